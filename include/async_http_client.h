@@ -0,0 +1,277 @@
+/**
+ * @file async_http_client.h
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef ASYNC_HTTP_CLIENT_H__
+#define ASYNC_HTTP_CLIENT_H__
+
+#include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "batch_queue.h"
+#include "httpconnection.h"
+#include "httpresolver.h"
+#include "mpsc_queue.h"
+#include "shared_string.h"
+#include "snmp_counter_table.h"
+
+// Splits the bytes received on a connection into HTTP/1.x responses.
+class HttpResponseParser
+{
+public:
+  enum Result
+  {
+    INCOMPLETE,
+    COMPLETE,
+    INVALID
+  };
+
+  HttpResponseParser() { reset(); }
+
+  // Parse some more of the response. Sets consumed to the number of bytes
+  // that were used - if the response is complete, any remaining bytes are the
+  // start of the next response.
+  Result parse(const char* data, size_t length, size_t& consumed);
+
+  // The connection has been closed. Returns COMPLETE if the response was
+  // ended by the close, and INVALID if it's been cut short.
+  Result close();
+
+  // Prepare to parse the next response.
+  void reset();
+
+  // The status code and body of a complete response.
+  HTTPCode status() const { return _status; }
+  const std::string& body() const { return _body; }
+
+  // Whether the connection can be reused once the response is complete.
+  bool keep_alive() const { return _keep_alive; }
+
+  // Whether any of the response has been received.
+  bool started() const { return ((_state != STATUS_LINE) || (!_line.empty())); }
+
+  // The longest status, header or chunk size line that's accepted.
+  static const size_t MAX_LINE_LENGTH = 8192;
+
+private:
+  enum State
+  {
+    STATUS_LINE,
+    HEADER_LINE,
+    BODY,
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    CHUNK_END,
+    TRAILER_LINE,
+    BODY_UNTIL_CLOSE,
+    DONE
+  };
+
+  // Process a complete line of the response.
+  Result process_line(const std::string& line);
+  Result process_status_line(const std::string& line);
+  Result process_header_line(const std::string& line);
+  Result process_chunk_size_line(const std::string& line);
+
+  State _state;
+  HTTPCode _status;
+  int _minor_version;
+  bool _keep_alive;
+  bool _chunked;
+  bool _has_content_length;
+  uint64_t _remaining;
+  std::string _line;
+  std::string _body;
+};
+
+// An HTTP POST to be sent by an AsyncHttpClient. Subclasses say what to do
+// when it completes.
+class AsyncHttpRequest
+{
+public:
+  virtual ~AsyncHttpRequest() {}
+
+  // Called on the client's thread just before the request is sent. This can
+  // fill in the fields below, and returns false if the request can't be sent
+  // (in which case it completes straight away as failed).
+  virtual bool prepare() { return true; }
+
+  // Called on the client's thread when the request has completed, with the
+  // response's status code and body. The status code is 0 if no response was
+  // received (e.g. because the server couldn't be reached, or timed out).
+  virtual void complete(HTTPCode rc, const std::string& body) = 0;
+
+  // The server (host name or IP address, and optional port) to send the
+  // request to, and the path to post to.
+  std::string server;
+  std::string path;
+
+  // Extra headers, in "Name: value" form.
+  std::vector<std::string> headers;
+
+  SharedString body;
+};
+
+// Sends HTTP requests from a single thread, using non-blocking sockets and
+// epoll, so that many requests can be in flight at once.
+//
+// Requests to each server share a pool of persistent connections. Requests
+// are sent on an idle connection if there is one, and otherwise on a new
+// connection, up to a maximum number per server. Once a server has shown it
+// keeps connections open, requests can also be pipelined on its busy
+// connections. Connections that have been idle for too long are closed, and
+// idle connections are checked for having been closed by the server before
+// they're reused. Requests are never sent twice - if a connection fails, only
+// the requests that hadn't been sent on it at all are sent again.
+//
+// Each new connection's server is resolved using the HTTP resolver on a
+// separate thread (as resolving can block), and the next target is tried if
+// one can't be connected to.
+class AsyncHttpClient
+{
+public:
+  AsyncHttpClient(HttpResolver* resolver,
+                  const std::string& bind_address,
+                  int timeout_ms,
+                  size_t max_in_flight,
+                  size_t max_connections_per_server,
+                  int idle_timeout_ms,
+                  size_t pipeline_depth,
+                  SNMP::CounterTable* new_connections_table = NULL,
+                  SNMP::CounterTable* reused_connections_table = NULL);
+  ~AsyncHttpClient();
+
+  void start();
+  void stop();
+
+  // Send a request, taking ownership of it. This can be called on any thread.
+  // Requests that are still waiting to be sent when the client stops are
+  // deleted without completing.
+  void send(AsyncHttpRequest* request);
+
+  // The most targets that are tried for each connection.
+  static const int MAX_TARGETS = 2;
+
+private:
+  struct Transaction;
+  struct Connection;
+  struct Pool;
+
+  // A server to resolve for a new connection, and what it resolved to.
+  struct ResolveJob
+  {
+    uint64_t conn_id;
+    std::string host;
+    int port;
+  };
+
+  struct ResolveResult
+  {
+    uint64_t conn_id;
+    std::vector<AddrInfo> targets;
+  };
+
+  static void* thread_entry_point(void* arg);
+  void run();
+
+  // Resolve servers for new connections until the client stops.
+  static void* resolver_entry_point(void* arg);
+  void run_resolver();
+
+  // Start connecting a new connection, now its server has been resolved.
+  void handle_resolved(const ResolveResult& result);
+
+  // Start sending requests that are waiting, up to the maximum in flight.
+  void start_waiting_requests();
+  void start_request(AsyncHttpRequest* request);
+
+  // Send as many of a pool's waiting transactions as its connections allow.
+  void dispatch(Pool* pool);
+  void assign(Transaction* transaction, Connection* conn);
+
+  // Check whether an idle connection can still be used, i.e. the server
+  // hasn't closed it (or sent anything on it) since it became idle.
+  bool is_alive(Connection* conn);
+
+  // Open a new connection in a pool. The connection can be given
+  // transactions straight away, which are sent once it's connected.
+  Connection* open_connection(Pool* pool);
+
+  // Connect to the connection's next target. Returns false if there are no
+  // targets left.
+  bool connect_to_next_target(Connection* conn);
+
+  void handle_event(Connection* conn, uint32_t events);
+  void handle_writable(Connection* conn);
+  void handle_readable(Connection* conn);
+
+  // Finish a transaction, completing its request.
+  void complete(Transaction* transaction, HTTPCode rc, const std::string& body);
+
+  // Close a connection. Transactions on it that haven't been sent at all are
+  // sent again on another connection if retry is set. The rest fail, as the
+  // server may have acted on them.
+  void close_connection(Connection* conn, bool retry);
+
+  void make_idle(Connection* conn);
+  void set_events(Connection* conn, uint32_t events);
+
+  // Fail any requests that have timed out, and close any connections that
+  // have been idle for too long.
+  void expire(uint64_t now_ms);
+
+  HttpResolver* _resolver;
+  std::string _bind_address;
+  int _timeout_ms;
+  size_t _max_in_flight;
+  size_t _max_connections_per_server;
+  int _idle_timeout_ms;
+  size_t _pipeline_depth;
+  SNMP::CounterTable* _new_connections_table;
+  SNMP::CounterTable* _reused_connections_table;
+
+  int _epoll_fd;
+  int _wake_fd;
+  pthread_t _thread;
+  pthread_t _resolver_thread;
+  bool _running;
+  std::atomic<bool> _terminated;
+
+  // The servers waiting to be resolved, the results waiting to be picked up
+  // by the client's thread, and the connections waiting for them (by ID).
+  BatchQueue<ResolveJob> _resolve_queue;
+  MPSCQueue<ResolveResult> _resolved;
+  std::map<uint64_t, Connection*> _resolving;
+  uint64_t _next_connection_id;
+
+  // Requests queued by other threads, and requests waiting for space to be
+  // sent (only accessed on the client's thread).
+  MPSCQueue<AsyncHttpRequest*> _queue;
+  std::deque<AsyncHttpRequest*> _waiting;
+
+  // The connection pools, by server.
+  std::map<std::string, Pool*> _pools;
+
+  // The transactions in flight, ordered by when they time out, and the idle
+  // connections, ordered by when they're closed.
+  std::multimap<uint64_t, Transaction*> _deadlines;
+  std::multimap<uint64_t, Connection*> _idle_deadlines;
+
+  // Connections that have been closed during the current batch of events.
+  // These are only freed after the batch, as later events may refer to them.
+  std::vector<Connection*> _closed;
+};
+
+#endif
@@ -0,0 +1,131 @@
+/**
+ * @file batch_queue.h
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef BATCH_QUEUE_H__
+#define BATCH_QUEUE_H__
+
+#include <pthread.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+// A work queue shared between a fixed pool of consumer threads, which moves
+// items on and off the queue in batches.
+//
+// Timers pop in bursts (all the timers in a bucket pop together), so rather
+// than taking the queue's lock for every item, producers push a whole batch
+// at once and consumers take several items at a time. A consumer never takes
+// more than its share of the items on the queue, so items aren't left
+// waiting behind a busy consumer while other consumers are idle.
+template <class T>
+class BatchQueue
+{
+public:
+  BatchQueue(int num_consumers) :
+    _num_consumers(std::max(num_consumers, 1)),
+    _terminated(false)
+  {
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+  }
+
+  ~BatchQueue()
+  {
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+  }
+
+  // Add a single item to the queue.
+  void push(const T& item)
+  {
+    pthread_mutex_lock(&_mutex);
+    _items.push_back(item);
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+  }
+
+  // Add a batch of items to the queue, leaving the passed in vector empty.
+  void push_batch(std::vector<T>& items)
+  {
+    if (items.empty())
+    {
+      return;
+    }
+
+    pthread_mutex_lock(&_mutex);
+    _items.insert(_items.end(), items.begin(), items.end());
+
+    if (items.size() == 1)
+    {
+      pthread_cond_signal(&_cond);
+    }
+    else
+    {
+      pthread_cond_broadcast(&_cond);
+    }
+
+    pthread_mutex_unlock(&_mutex);
+    items.clear();
+  }
+
+  // Take up to max_items items from the queue (appending them to the passed
+  // in vector), waiting for some to be added if the queue is empty. Returns
+  // false (without taking any items) if the queue has been terminated.
+  bool pop_batch(std::vector<T>& items, size_t max_items)
+  {
+    pthread_mutex_lock(&_mutex);
+
+    while ((_items.empty()) && (!_terminated))
+    {
+      pthread_cond_wait(&_cond, &_mutex);
+    }
+
+    if (_terminated)
+    {
+      pthread_mutex_unlock(&_mutex);
+      return false;
+    }
+
+    size_t fair_share = (_items.size() + _num_consumers - 1) / _num_consumers;
+    size_t num_items = std::max(std::min(max_items, fair_share), (size_t)1);
+    items.insert(items.end(), _items.begin(), _items.begin() + num_items);
+    _items.erase(_items.begin(), _items.begin() + num_items);
+
+    pthread_mutex_unlock(&_mutex);
+    return true;
+  }
+
+  // Wake up all the consumers and stop them taking any more items.
+  void terminate()
+  {
+    pthread_mutex_lock(&_mutex);
+    _terminated = true;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+  }
+
+  size_t size()
+  {
+    pthread_mutex_lock(&_mutex);
+    size_t size = _items.size();
+    pthread_mutex_unlock(&_mutex);
+    return size;
+  }
+
+private:
+  size_t _num_consumers;
+  bool _terminated;
+  std::deque<T> _items;
+  pthread_mutex_t _mutex;
+  pthread_cond_t _cond;
+};
+
+#endif
@@ -0,0 +1,154 @@
+/**
+ * @file binary_codec.h
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef BINARY_CODEC_H__
+#define BINARY_CODEC_H__
+
+#include <stdint.h>
+#include <string>
+
+// Encoding and decoding of the compact binary format that Chronos nodes can
+// use to send timers to each other (rather than JSON).
+//
+// Integers are written as variable length (LEB128) unsigned integers, so
+// small values take a single byte. Signed integers are zigzag encoded first,
+// so that small negative values are small too. Strings are written as their
+// length followed by their bytes.
+
+// Appends values to a string in the binary format.
+class BinaryWriter
+{
+public:
+  BinaryWriter(std::string& buffer) : _buffer(buffer) {}
+
+  void write_uint(uint64_t value)
+  {
+    while (value >= 0x80)
+    {
+      _buffer.push_back((char)((value & 0x7F) | 0x80));
+      value >>= 7;
+    }
+
+    _buffer.push_back((char)value);
+  }
+
+  void write_int(int64_t value)
+  {
+    write_uint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+  }
+
+  void write_string(const char* data, size_t length)
+  {
+    write_uint(length);
+    _buffer.append(data, length);
+  }
+
+  void write_string(const std::string& value)
+  {
+    write_string(value.data(), value.size());
+  }
+
+private:
+  std::string& _buffer;
+};
+
+// Reads values in the binary format from a buffer. Each read returns false
+// (and leaves the value unchanged) if the buffer doesn't hold a valid value
+// at the current position, e.g. because it's been truncated.
+class BinaryReader
+{
+public:
+  BinaryReader(const std::string& buffer) :
+    _next(buffer.data()),
+    _end(buffer.data() + buffer.size())
+  {}
+
+  // Whether the whole buffer has been read.
+  bool end() const { return (_next == _end); }
+
+  bool read_uint(uint64_t& value)
+  {
+    uint64_t result = 0;
+
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+      if (_next == _end)
+      {
+        return false;
+      }
+
+      uint8_t byte = (uint8_t)*(_next++);
+
+      if ((shift == 63) && (byte > 1))
+      {
+        // Only the lowest bit of the tenth byte fits in 64 bits.
+        return false;
+      }
+
+      result |= ((uint64_t)(byte & 0x7F) << shift);
+
+      if ((byte & 0x80) == 0)
+      {
+        value = result;
+        return true;
+      }
+    }
+
+    // The value is more than 64 bits long.
+    return false;
+  }
+
+  bool read_uint32(uint32_t& value)
+  {
+    uint64_t result;
+
+    if ((!read_uint(result)) || (result > UINT32_MAX))
+    {
+      return false;
+    }
+
+    value = (uint32_t)result;
+    return true;
+  }
+
+  bool read_int(int64_t& value)
+  {
+    uint64_t result;
+
+    if (!read_uint(result))
+    {
+      return false;
+    }
+
+    value = (int64_t)((result >> 1) ^ (~(result & 1) + 1));
+    return true;
+  }
+
+  bool read_string(std::string& value)
+  {
+    uint64_t length;
+
+    if ((!read_uint(length)) || (length > (uint64_t)(_end - _next)))
+    {
+      return false;
+    }
+
+    value.assign(_next, length);
+    _next += length;
+    return true;
+  }
+
+private:
+  const char* _next;
+  const char* _end;
+};
+
+#endif
@@ -15,6 +15,7 @@
 #include "timer.h"
 
 #include <string>
+#include <vector>
 
 // Virtual class for handling timer callbacks.
 class Callback
@@ -31,6 +32,19 @@ public:
   //
   // Returns true if the callback was successful, false otherwise.
   virtual void perform(Timer*) = 0;
+
+  // Perform the callbacks for a batch of Timers (e.g. all the timers that
+  // popped on one tick). Takes ownership of the Timer objects, and leaves the
+  // vector empty.
+  virtual void perform_batch(std::vector<Timer*>& timers)
+  {
+    for (Timer* timer : timers)
+    {
+      perform(timer);
+    }
+
+    timers.clear();
+  }
 };
 
 #endif
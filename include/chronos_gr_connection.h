@@ -26,9 +26,10 @@ public:
                       BaseCommunicationMonitor* comm_monitor = NULL);
   virtual ~ChronosGRConnection();
 
-  // Replicate the timer cross-site.
-  virtual void send_put(std::string url,
-                        std::string body);
+  // Replicate the timer cross-site, with a body of the given content type.
+  virtual void send_put(const std::string& url,
+                        const std::string& body,
+                        const std::string& content_type);
 
 private:
   std::string _site_name;
@@ -58,14 +58,14 @@ private:
   std::string create_delete_body(std::map<TimerID, int> delete_map);
 
   // Returns whether a node is present in a replica list
-  bool get_replica_presence(std::string current_node,
-                            std::vector<std::string> replicas);
+  bool get_replica_presence(const InternedString& current_node,
+                            const InternedStringList& replicas);
 
   // Returns whether a node is present in a replica list, and if it
   // is what index it is
   bool get_replica_level(int& index,
-                         std::string current_node,
-                         std::vector<std::string> replicas);
+                         const InternedString& current_node,
+                         const InternedStringList& replicas);
 
   // Sends a delete request
   virtual HTTPCode send_delete(const std::string& server,
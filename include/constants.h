@@ -32,6 +32,13 @@ static const char* const PARAM_CLUSTER_VIEW_ID = "cluster-view-id";
 // Header values
 static const char* const HEADER_RANGE = "Range";
 static const char* const HEADER_CONTENT_RANGE = "Content-Range";
+static const char* const HEADER_CONTENT_TYPE = "Content-Type";
+
+// Content types. Timers are sent to other Chronos nodes as JSON, or (if
+// binary replication is enabled) in the binary format built by
+// Timer::to_binary.
+static const char* const CONTENT_TYPE_JSON = "application/json";
+static const char* const CONTENT_TYPE_BINARY_TIMER = "application/vnd.chronos.timer";
 
 
 #endif
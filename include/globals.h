@@ -13,11 +13,51 @@
 #define GLOBALS_H__
 
 #include <pthread.h>
+#include <atomic>
+#include <functional>
 #include <string>
 #include <map>
+#include <memory>
 #include <vector>
 #include <boost/program_options.hpp>
 #include "updater.h"
+#include "interned_string.h"
+
+namespace SNMP
+{
+  class CounterTable;
+}
+
+// An immutable snapshot of the parts of the configuration that are read for
+// individual timers (e.g. to work out their replicas, or when they pop). A new
+// snapshot is published each time the configuration changes, so these can be
+// read without taking the configuration lock or copying them. Each snapshot is
+// freed once the last reader has finished with it.
+struct ClusterConfig
+{
+  // The configuration generation this snapshot was published at.
+  uint64_t generation;
+
+  InternedString cluster_local_ip;
+  InternedString cluster_view_id;
+
+  // The current cluster (the staying then the joining nodes) and the old
+  // cluster (the staying then the leaving nodes), as used to work out a
+  // timer's replicas, and their rendezvous hashes.
+  std::vector<std::string> new_cluster;
+  std::vector<uint32_t> new_cluster_hashes;
+  std::vector<std::string> old_cluster;
+  std::vector<uint32_t> old_cluster_hashes;
+
+  InternedString local_site_name;
+  std::vector<std::string> remote_site_names;
+
+  int bind_port;
+  uint32_t instance_id;
+  uint32_t deployment_id;
+};
+
+typedef std::shared_ptr<const ClusterConfig> ClusterConfigPtr;
 
 // Defines a global variable and it's associated get and set
 // functions.  Note that, although get functions are protected
@@ -28,6 +68,7 @@
   public:                                      \
     void get_##NAME(__VA_ARGS__& val) \
     { \
+      count_locked_read(); \
       pthread_rwlock_rdlock(&_lock); \
       val = _##NAME; \
       pthread_rwlock_unlock(&_lock); \
@@ -37,7 +78,7 @@
       _##NAME = val; \
     } \
   private: \
-    __VA_ARGS__ _##NAME
+    __VA_ARGS__ _##NAME = __VA_ARGS__()
 
 class Globals
 {
@@ -53,6 +94,12 @@ public:
   GLOBAL(bind_port, int);
   GLOBAL(threads, int);
   GLOBAL(gr_threads, int);
+  GLOBAL(binary_replication, bool);
+  GLOBAL(timer_shards, int);
+  GLOBAL(queue_timer_adds, bool);
+  GLOBAL(callback_connections_per_host, int);
+  GLOBAL(callback_idle_timeout, int);
+  GLOBAL(callback_pipeline_depth, int);
   GLOBAL(logging_folder, std::string);
 
   // Clustering configuration
@@ -93,16 +140,66 @@ public:
 public:
   void update_config();
   void lock() { pthread_rwlock_wrlock(&_lock); }
-  void unlock() { pthread_rwlock_unlock(&_lock); }
+  void unlock()
+  {
+    ++_config_generation;
+    publish_cluster_config();
+    pthread_rwlock_unlock(&_lock);
+  }
+
+  // Get the current snapshot of the cluster configuration, without taking
+  // the lock. The snapshot is never changed (though a newer one may be
+  // published at any time), and is kept alive for as long as the caller holds
+  // on to it.
+  ClusterConfigPtr get_cluster_config() const
+  {
+    return std::atomic_load(&_cluster_config);
+  }
+
+  // Set a table to count the reads of the configuration that take the lock
+  // (i.e. those that don't use the snapshot above), or NULL to stop counting.
+  void set_config_reads_table(SNMP::CounterTable* table)
+  {
+    _config_reads_table.store(table);
+  }
+
+  // Returns a number that changes whenever the configuration is updated (and
+  // is never 0), so that values derived from the configuration can be cached
+  // and recalculated only when needed.
+  uint64_t get_config_generation()
+  {
+    return _published_generation.load(std::memory_order_acquire);
+  }
+
+  // Set a function to be called each time the configuration has been
+  // reloaded (or clear it, by passing an empty function). This is called on
+  // the thread that reloads the configuration, so shouldn't block.
+  void set_config_change_handler(std::function<void()> handler);
 
 private:
   uint64_t generate_bloom_filter(std::string);
   std::vector<uint32_t> generate_hashes(std::vector<std::string>);
 
+  // Publish a new snapshot of the cluster configuration. This must be called
+  // with the lock held for writing.
+  void publish_cluster_config();
+
+  void count_locked_read();
+
   std::string _local_config_file;
   std::string _cluster_config_file;
   std::string _shared_config_file;
   pthread_rwlock_t _lock;
+  uint64_t _config_generation;
+  pthread_mutex_t _config_change_handler_lock;
+  std::function<void()> _config_change_handler;
+
+  // The current snapshot of the cluster configuration (only accessed with
+  // std::atomic_load and std::atomic_store), and its generation (so that the
+  // generation can be checked without taking a reference to the snapshot).
+  ClusterConfigPtr _cluster_config;
+  std::atomic<uint64_t> _published_generation;
+  std::atomic<SNMP::CounterTable*> _config_reads_table;
   Updater<void, Globals>* _updater;
   boost::program_options::options_description _desc;
 };
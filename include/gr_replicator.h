@@ -21,22 +21,28 @@ struct GRReplicationRequest
 {
   GRReplicationRequest(ChronosGRConnection* connection,
                        std::string url,
-                       std::string body) :
+                       std::shared_ptr<const std::string> body,
+                       const char* content_type) :
     _connection(connection),
     _url(url),
-    _body(body)
+    _body(body),
+    _content_type(content_type)
   {
   }
 
   ChronosGRConnection* _connection;
   std::string _url;
-  std::string _body;
+
+  // The body is shared with the requests to the other sites.
+  std::shared_ptr<const std::string> _body;
+  const char* _content_type;
 };
 
 /// @class GRReplicator
 ///
 /// Responsible for creating replication requests to send between sites, and
-/// queuing these requests.
+/// queuing these requests. Timers are sent as JSON, or in the binary format if
+/// binary replication is configured.
 class GRReplicator
 {
 public:
@@ -56,6 +62,7 @@ private:
   std::vector<ChronosGRConnection*> _connections;
   ExceptionHandler* _exception_handler;
   int _gr_threads;
+  bool _binary;
 };
 
 #endif
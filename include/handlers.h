@@ -61,6 +61,10 @@ public:
   void handle_get();
   bool node_is_in_cluster(std::string requesting_node);
 
+  // Whether the request's body is a timer in the binary format (rather than
+  // JSON), according to its Content-Type.
+  bool is_binary_timer();
+
 protected:
   const Config* _cfg;
 };
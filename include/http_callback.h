@@ -13,23 +13,42 @@
 #define HTTP_CALLBACK_H__
 
 #include "callback.h"
-#include "eventq.h"
+#include "async_http_client.h"
+#include "batch_queue.h"
 #include "timer_handler.h"
 #include "timer.h"
 #include "httpresolver.h"
 #include "httpconnection.h"
 #include "exception_handler.h"
 
+#include <atomic>
 #include <string>
 #include <curl/curl.h>
 
-#define HTTPCALLBACK_THREAD_COUNT 50
+// HTTP callbacks are sent by event loops, each of which can have many
+// callbacks in flight at once.
+#define HTTPCALLBACK_LOOP_COUNT 4
+#define HTTPCALLBACK_MAX_IN_FLIGHT 1000
+#define HTTPCALLBACK_TIMEOUT_MS 2000
+
+// The most callbacks that are batched into one request, for clients that
+// accept batches.
+#define HTTPCALLBACK_MAX_CALLBACKS_PER_REQUEST 100
+
+// Callbacks over TLS are sent by a pool of worker threads instead, each of
+// which waits for its callback to complete.
+#define HTTPCALLBACK_THREAD_COUNT 10
+
+// The most timers a worker thread takes off the queue at once.
+#define HTTPCALLBACK_MAX_BATCH_SIZE 16
 
 class HTTPCallback : public Callback
 {
 public:
   HTTPCallback(HttpResolver* resolver,
-               ExceptionHandler* exception_handler);
+               ExceptionHandler* exception_handler,
+               SNMP::CounterTable* new_connections_table = NULL,
+               SNMP::CounterTable* reused_connections_table = NULL);
   ~HTTPCallback();
 
   void start(TimerHandler*);
@@ -37,13 +56,30 @@ public:
 
   std::string protocol() { return "http"; };
   void perform(Timer*);
+  void perform_batch(std::vector<Timer*>& timers);
 
   static void* worker_thread_entry_point(void*);
   void worker_thread_entry_point();
 
 private:
+  class Request;
+  class BatchRequest;
+
+  // Whether a timer's callback is sent by the event loops (rather than by
+  // the worker threads).
+  static bool is_async(const Timer* timer);
+
+  // Send a request on one of the event loops.
+  void send_async(AsyncHttpRequest* request);
+
+  // Send the HTTP request for a popped timer, waiting for it to complete.
+  void send_callback(Timer* timer);
+
+  AsyncHttpClient* _clients[HTTPCALLBACK_LOOP_COUNT];
+  std::atomic<unsigned int> _next_client;
+
   pthread_t _worker_threads[HTTPCALLBACK_THREAD_COUNT];
-  eventq<Timer*> _q;
+  BatchQueue<Timer*> _q;
   ExceptionHandler* _exception_handler;
   // Resolver to use to resolve callback URL server FQDNs to IP addresses.
   HttpResolver* _resolver;
@@ -0,0 +1,196 @@
+/**
+ * @file interned_string.h
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef INTERNED_STRING_H__
+#define INTERNED_STRING_H__
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <algorithm>
+#include <atomic>
+#include <utility>
+
+// A handle to an immutable string held in a process-wide table.
+//
+// Every timer holds the addresses of its replicas, the names of its sites and
+// the cluster view ID it was created under. There are only a handful of
+// distinct values of these across the whole cluster, so rather than each
+// timer holding its own copies, each distinct string is stored once and
+// timers hold pointers to it. As equal strings always share the same
+// storage, two interned strings can be compared by comparing pointers.
+//
+// Each string in the table is reference counted, and removed from the table
+// once no interned strings refer to it. Some of these strings come from other
+// nodes, so the table would otherwise grow without limit.
+class InternedString
+{
+public:
+  // The empty string.
+  InternedString();
+
+  // Intern a string. This is deliberately implicit, so that interned strings
+  // can be used in place of std::strings.
+  InternedString(const std::string& str);
+  InternedString(const char* str);
+
+  InternedString(const InternedString& other) : _entry(other._entry)
+  {
+    acquire();
+  }
+
+  InternedString& operator=(const InternedString& other)
+  {
+    if (_entry != other._entry)
+    {
+      other.acquire();
+      release();
+      _entry = other._entry;
+    }
+
+    return *this;
+  }
+
+  ~InternedString() { release(); }
+
+  const std::string& str() const { return _entry->first; }
+  operator const std::string&() const { return _entry->first; }
+  const char* c_str() const { return _entry->first.c_str(); }
+  bool empty() const { return _entry->first.empty(); }
+  size_t size() const { return _entry->first.size(); }
+
+  // The number of distinct strings that have been interned.
+  static size_t table_size();
+
+  friend bool operator==(const InternedString& a, const InternedString& b)
+  {
+    return (a._entry == b._entry);
+  }
+
+  friend bool operator==(const InternedString& a, const std::string& b)
+  {
+    return (a._entry->first == b);
+  }
+
+  friend bool operator==(const std::string& a, const InternedString& b)
+  {
+    return (a == b._entry->first);
+  }
+
+  friend bool operator==(const InternedString& a, const char* b)
+  {
+    return (a._entry->first == b);
+  }
+
+  template <class T>
+  friend bool operator!=(const InternedString& a, const T& b)
+  {
+    return !(a == b);
+  }
+
+  friend bool operator!=(const std::string& a, const InternedString& b)
+  {
+    return !(a == b);
+  }
+
+  // Interned strings sort in the same order as the strings themselves.
+  friend bool operator<(const InternedString& a, const InternedString& b)
+  {
+    return ((a._entry != b._entry) && (a._entry->first < b._entry->first));
+  }
+
+  friend std::ostream& operator<<(std::ostream& os, const InternedString& s)
+  {
+    return os << s._entry->first;
+  }
+
+private:
+  // A string in the table, and the number of interned strings that refer to
+  // it.
+  typedef std::pair<const std::string, std::atomic<size_t>> Entry;
+
+  // Find or add a string in the table, taking a reference to it.
+  static Entry* intern(const std::string& str);
+
+  void acquire() const
+  {
+    _entry->second.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void release()
+  {
+    // Only the last reference needs the table's lock (to remove the string
+    // from it), so drop any other without taking it.
+    size_t refs = _entry->second.load(std::memory_order_relaxed);
+
+    while (refs > 1)
+    {
+      if (_entry->second.compare_exchange_weak(refs,
+                                               refs - 1,
+                                               std::memory_order_acq_rel))
+      {
+        return;
+      }
+    }
+
+    release_last(_entry);
+  }
+
+  static void release_last(Entry* entry);
+
+  Entry* _entry;
+};
+
+// A list of interned strings (e.g. a timer's replicas). This can be used
+// in place of (and converted to and from) a list of std::strings.
+class InternedStringList : public std::vector<InternedString>
+{
+public:
+  InternedStringList() {}
+
+  InternedStringList(const std::vector<std::string>& strings) :
+    std::vector<InternedString>(strings.begin(), strings.end())
+  {
+  }
+
+  InternedStringList& operator=(const std::vector<std::string>& strings)
+  {
+    assign(strings.begin(), strings.end());
+    return *this;
+  }
+
+  operator std::vector<std::string>() const
+  {
+    return std::vector<std::string>(begin(), end());
+  }
+
+  friend bool operator==(const InternedStringList& a,
+                         const InternedStringList& b)
+  {
+    return ((a.size() == b.size()) &&
+            (std::equal(a.begin(), a.end(), b.begin())));
+  }
+
+  friend bool operator==(const InternedStringList& a,
+                         const std::vector<std::string>& b)
+  {
+    return ((a.size() == b.size()) &&
+            (std::equal(a.begin(), a.end(), b.begin())));
+  }
+
+  friend bool operator==(const std::vector<std::string>& a,
+                         const InternedStringList& b)
+  {
+    return (b == a);
+  }
+};
+
+#endif
@@ -0,0 +1,99 @@
+/**
+ * @file mpsc_queue.h
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef MPSC_QUEUE_H__
+#define MPSC_QUEUE_H__
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "object_pool.h"
+
+// A lock-free queue that any number of threads can add items to, and that a
+// single consumer empties in one go.
+//
+// The queue is a linked list that producers push onto the front of with a
+// compare-and-swap. The consumer takes the whole list with a single atomic
+// exchange (so never races with another consumer over individual entries),
+// and reverses it to get the items back in the order they were added.
+template <class T>
+class MPSCQueue
+{
+public:
+  MPSCQueue() : _head(NULL) {}
+
+  ~MPSCQueue()
+  {
+    std::vector<T> items;
+    pop_all(items);
+  }
+
+  MPSCQueue(const MPSCQueue& copy) = delete;
+
+  // Add an item to the queue. Returns true if the queue was empty before.
+  bool push(const T& item)
+  {
+    Node* node = new Node(item);
+    node->next = _head.load(std::memory_order_relaxed);
+
+    while (!_head.compare_exchange_weak(node->next, node))
+    {
+    }
+
+    return (node->next == NULL);
+  }
+
+  // Remove all the items from the queue, appending them to the passed in
+  // vector in the order they were added.
+  void pop_all(std::vector<T>& items)
+  {
+    Node* node = _head.exchange(NULL);
+    size_t first = items.size();
+
+    while (node != NULL)
+    {
+      Node* next = node->next;
+      items.push_back(node->item);
+      delete node;
+      node = next;
+    }
+
+    std::reverse(items.begin() + first, items.end());
+  }
+
+  bool empty() const { return (_head.load() == NULL); }
+
+private:
+  struct Node
+  {
+    Node(const T& item) : item(item), next(NULL) {}
+
+    // Nodes are allocated on one thread and freed on another at a high rate,
+    // which the object pool is designed for.
+    static void* operator new(size_t size)
+    {
+      return ObjectPool<Node>::allocate();
+    }
+
+    static void operator delete(void* ptr)
+    {
+      ObjectPool<Node>::release(ptr);
+    }
+
+    T item;
+    Node* next;
+  };
+
+  std::atomic<Node*> _head;
+};
+
+#endif
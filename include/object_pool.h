@@ -0,0 +1,441 @@
+/**
+ * @file object_pool.h
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef OBJECT_POOL_H__
+#define OBJECT_POOL_H__
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <new>
+#include <type_traits>
+
+#include "log.h"
+
+// A slab allocator for objects of type T.
+//
+// Memory is allocated from the heap in slabs of many objects, and freed
+// objects are kept on free lists for reuse rather than being returned to the
+// heap. Each thread has its own small cache of free objects, so most
+// allocations and frees don't need to take a lock. Objects are often freed on
+// a different thread to the one that allocated them (e.g. timers are created
+// on HTTP threads and deleted on callback threads), so threads move objects
+// to and from a shared free list in batches to keep their caches balanced.
+//
+// Each slab keeps its own list of the free objects that have been handed back
+// to it, so that once all of a slab's objects are free, the slab can be
+// returned to the OS. One empty slab is kept spare, so that a pool that's
+// repeatedly growing and shrinking around a slab boundary doesn't keep
+// mapping and unmapping memory. In a steady state, allocating and freeing
+// objects doesn't need any new memory at all.
+//
+// To use the pool for a class, give it class specific operator new and
+// operator delete that call allocate() and release().
+template <class T>
+class ObjectPool
+{
+public:
+  // Allocate memory for a T. Throws std::bad_alloc if the pool needs to grow
+  // and can't.
+  static void* allocate()
+  {
+    ThreadCache& cache = thread_cache();
+
+    if (cache.head == NULL)
+    {
+      shared().refill(cache);
+    }
+
+    FreeObject* obj = cache.head;
+    cache.head = obj->next;
+    --cache.count;
+    return obj;
+  }
+
+  // Return the memory for a T (which must have been allocated from this pool)
+  // to the pool.
+  static void release(void* ptr)
+  {
+    if (ptr == NULL)
+    {
+      return;
+    }
+
+    ThreadCache& cache = thread_cache();
+    FreeObject* obj = static_cast<FreeObject*>(ptr);
+    obj->next = cache.head;
+    cache.head = obj;
+    ++cache.count;
+
+    if (cache.count >= MAX_CACHED_OBJECTS)
+    {
+      shared().drain(cache, TRANSFER_BATCH_SIZE);
+    }
+  }
+
+  // The number of times the pool has allocated a slab. This stops increasing
+  // once the pool is big enough for the peak number of objects in use.
+  static uint64_t heap_allocations()
+  {
+    return shared().heap_allocations.load();
+  }
+
+  // The number of slabs the pool currently has.
+  static uint64_t slabs()
+  {
+    return shared().num_slabs.load();
+  }
+
+  // The number of objects the pool has room for (whether in use or free).
+  static uint64_t capacity()
+  {
+    return slabs() * OBJECTS_PER_SLAB;
+  }
+
+  // The number of objects in a slab.
+  static const size_t OBJECTS_PER_SLAB = 1024;
+
+private:
+  // The number of objects moved between a thread's cache and the shared free
+  // list at a time, and the most objects a thread caches before giving some
+  // back.
+  static const size_t TRANSFER_BATCH_SIZE = 64;
+  static const size_t MAX_CACHED_OBJECTS = TRANSFER_BATCH_SIZE * 2;
+
+  // Free objects are chained together through their own memory.
+  struct FreeObject
+  {
+    FreeObject* next;
+  };
+
+  union Slot
+  {
+    FreeObject free;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type object;
+  };
+
+  // A slab of objects. Slabs are aligned to a power of two at least as big
+  // as themselves, so an object's slab can be found from its address.
+  struct Slab
+  {
+    // The neighbouring slabs on the shared pool's list of slabs with free
+    // objects (if this slab is on it).
+    Slab* prev;
+    Slab* next;
+
+    // The free objects that have been handed back to this slab (objects in
+    // threads' caches aren't counted, as the slab can't get them back).
+    FreeObject* free_head;
+    size_t num_free;
+
+    Slot slots[OBJECTS_PER_SLAB];
+  };
+
+  static constexpr size_t next_power_of_two(size_t size, size_t power = 4096)
+  {
+    return (power >= size) ? power : next_power_of_two(size, power * 2);
+  }
+
+  static const size_t SLAB_ALIGNMENT = next_power_of_two(sizeof(Slab));
+
+  static Slab* slab_of(FreeObject* obj)
+  {
+    return reinterpret_cast<Slab*>((uintptr_t)obj & ~(uintptr_t)(SLAB_ALIGNMENT - 1));
+  }
+
+  struct ThreadCache
+  {
+    FreeObject* head;
+    size_t count;
+
+    ThreadCache() : head(NULL), count(0) {}
+
+    // Hand any cached objects back to the shared pool when the thread exits,
+    // so they can be reused by other threads (or their slabs freed).
+    ~ThreadCache()
+    {
+      shared().drain(*this, count);
+    }
+  };
+
+  struct SharedPool
+  {
+    pthread_mutex_t lock;
+
+    // The slabs with free objects. Slabs that have just had an object freed
+    // go at the front, and empty slabs at the back, so that objects are
+    // allocated from slabs that are already in use, and empty slabs stay
+    // empty.
+    Slab* available;
+    Slab* available_tail;
+
+    // The number of slabs on the list that are completely free. There's only
+    // ever one of these for long - any more are freed.
+    size_t num_empty;
+
+    std::atomic<uint64_t> heap_allocations;
+    std::atomic<uint64_t> num_slabs;
+
+    SharedPool() :
+      available(NULL),
+      available_tail(NULL),
+      num_empty(0),
+      heap_allocations(0),
+      num_slabs(0)
+    {
+      pthread_mutex_init(&lock, NULL);
+    }
+
+    void push_front(Slab* slab)
+    {
+      slab->prev = NULL;
+      slab->next = available;
+
+      if (available != NULL)
+      {
+        available->prev = slab;
+      }
+      else
+      {
+        available_tail = slab;
+      }
+
+      available = slab;
+    }
+
+    void push_back(Slab* slab)
+    {
+      slab->prev = available_tail;
+      slab->next = NULL;
+
+      if (available_tail != NULL)
+      {
+        available_tail->next = slab;
+      }
+      else
+      {
+        available = slab;
+      }
+
+      available_tail = slab;
+    }
+
+    void unlink(Slab* slab)
+    {
+      if (slab->prev != NULL)
+      {
+        slab->prev->next = slab->next;
+      }
+      else
+      {
+        available = slab->next;
+      }
+
+      if (slab->next != NULL)
+      {
+        slab->next->prev = slab->prev;
+      }
+      else
+      {
+        available_tail = slab->prev;
+      }
+    }
+
+    // Map a new slab, with all its objects free. Returns NULL if there's no
+    // memory for it. This maps twice the alignment, and unmaps whatever's
+    // either side of the aligned slab.
+    static Slab* map_slab()
+    {
+      void* mem = mmap(NULL,
+                       SLAB_ALIGNMENT * 2,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1,
+                       0);
+
+      if (mem == MAP_FAILED)
+      {
+        return NULL; // LCOV_EXCL_LINE - Can't run out of memory in UT
+      }
+
+      uintptr_t start = (uintptr_t)mem;
+      uintptr_t aligned = (start + SLAB_ALIGNMENT - 1) & ~(uintptr_t)(SLAB_ALIGNMENT - 1);
+      uintptr_t end = start + (SLAB_ALIGNMENT * 2);
+
+      if (aligned > start)
+      {
+        munmap(mem, aligned - start);
+      }
+
+      if (end > aligned + SLAB_ALIGNMENT)
+      {
+        munmap((void*)(aligned + SLAB_ALIGNMENT), end - (aligned + SLAB_ALIGNMENT));
+      }
+
+      Slab* slab = reinterpret_cast<Slab*>(aligned);
+
+      for (size_t ii = 0; ii < OBJECTS_PER_SLAB; ++ii)
+      {
+        slab->slots[ii].free.next = (ii + 1 < OBJECTS_PER_SLAB) ?
+                                      &slab->slots[ii + 1].free : NULL;
+      }
+
+      slab->free_head = &slab->slots[0].free;
+      slab->num_free = OBJECTS_PER_SLAB;
+      return slab;
+    }
+
+    // Move a batch of free objects into a thread's (empty) cache, allocating
+    // a new slab if there aren't any.
+    void refill(ThreadCache& cache)
+    {
+      pthread_mutex_lock(&lock);
+
+      while (cache.count < TRANSFER_BATCH_SIZE)
+      {
+        if (available == NULL)
+        {
+          if (cache.count > 0)
+          {
+            break;
+          }
+
+          Slab* slab = map_slab();
+
+          if (slab == NULL)
+          {
+            // LCOV_EXCL_START - Can't run out of memory in UT
+            pthread_mutex_unlock(&lock);
+            throw std::bad_alloc();
+            // LCOV_EXCL_STOP
+          }
+
+          ++heap_allocations;
+          ++num_slabs;
+          ++num_empty;
+          push_front(slab);
+          TRC_DEBUG("Grown object pool to %lu slabs", num_slabs.load());
+        }
+
+        Slab* slab = available;
+
+        if (slab->num_free == OBJECTS_PER_SLAB)
+        {
+          --num_empty;
+        }
+
+        while ((cache.count < TRANSFER_BATCH_SIZE) && (slab->free_head != NULL))
+        {
+          FreeObject* obj = slab->free_head;
+          slab->free_head = obj->next;
+          --slab->num_free;
+          obj->next = cache.head;
+          cache.head = obj;
+          ++cache.count;
+        }
+
+        if (slab->num_free == 0)
+        {
+          unlink(slab);
+        }
+      }
+
+      pthread_mutex_unlock(&lock);
+    }
+
+    // Move some objects from a thread's cache back to their slabs, freeing
+    // any slabs that become empty (apart from one spare).
+    void drain(ThreadCache& cache, size_t count)
+    {
+      if (count == 0)
+      {
+        return;
+      }
+
+      FreeObject* first = cache.head;
+      FreeObject* last = first;
+
+      for (size_t ii = 1; ii < count; ++ii)
+      {
+        last = last->next;
+      }
+
+      cache.head = last->next;
+      cache.count -= count;
+      last->next = NULL;
+
+      // The slabs to free are chained together, and only unmapped once the
+      // lock has been released.
+      Slab* to_free = NULL;
+
+      pthread_mutex_lock(&lock);
+
+      for (FreeObject* obj = first; obj != NULL; )
+      {
+        FreeObject* next = obj->next;
+        Slab* slab = slab_of(obj);
+        obj->next = slab->free_head;
+        slab->free_head = obj;
+
+        if (slab->num_free++ == 0)
+        {
+          push_front(slab);
+        }
+
+        if (slab->num_free == OBJECTS_PER_SLAB)
+        {
+          unlink(slab);
+
+          if (num_empty == 0)
+          {
+            ++num_empty;
+            push_back(slab);
+          }
+          else
+          {
+            --num_slabs;
+            slab->next = to_free;
+            to_free = slab;
+          }
+        }
+
+        obj = next;
+      }
+
+      pthread_mutex_unlock(&lock);
+
+      while (to_free != NULL)
+      {
+        Slab* next = to_free->next;
+        munmap(to_free, SLAB_ALIGNMENT);
+        to_free = next;
+      }
+    }
+  };
+
+  // The shared pool lives for the life of the process (it is never destroyed,
+  // as objects may be freed by other static destructors or exiting threads).
+  static SharedPool& shared()
+  {
+    static SharedPool* pool = new SharedPool();
+    return *pool;
+  }
+
+  static ThreadCache& thread_cache()
+  {
+    static thread_local ThreadCache cache;
+    return cache;
+  }
+};
+
+#endif
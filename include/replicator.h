@@ -13,6 +13,7 @@
 #define REPLICATOR_H__
 
 #include <curl/curl.h>
+#include <memory>
 
 #include "timer.h"
 #include "exception_handler.h"
@@ -25,11 +26,16 @@
 struct ReplicationRequest
 {
   std::string url;
-  std::string body;
+
+  // The body is shared with the other requests replicating the same version
+  // of the timer (see ReplicationBodies).
+  std::shared_ptr<const std::string> body;
+  const char* content_type;
 };
 
 // This class is used to replicate timers to the specified replicas, using cURL
-// to handle the HTTP construction and sending.
+// to handle the HTTP construction and sending. Timers are sent as JSON, or in
+// the binary format if binary replication is configured.
 class Replicator
 {
 public:
@@ -45,13 +51,16 @@ public:
   static void* worker_thread_entry_point(void*);
 
 private:
-  void replicate_int(const std::string&, const std::string&);
+  void replicate_int(const std::shared_ptr<const std::string>&,
+                     const std::string&);
   eventq<ReplicationRequest *> _q;
   pthread_t _worker_threads[REPLICATOR_THREAD_COUNT];
   struct curl_slist* _headers;
   ExceptionHandler* _exception_handler;
   HttpResolver* _resolver;
   HttpClient* _http_client;
+  bool _binary;
+  const char* _content_type;
 };
 
 #endif
@@ -0,0 +1,112 @@
+/**
+ * @file shared_string.h
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SHARED_STRING_H__
+#define SHARED_STRING_H__
+
+#include <memory>
+#include <string>
+#include <ostream>
+
+// An immutable string that's shared (by reference count) between copies,
+// rather than being copied.
+//
+// A timer's callback URL and opaque data are set when it's created, and then
+// only ever read - but the timer is copied when it pops, when it's
+// replicated and when it's resynced. The opaque data can be several KB, so
+// copies of a timer share these instead. Unlike interned strings, these are
+// freed once the last copy is gone, so can hold any value.
+class SharedString
+{
+public:
+  // The empty string. All empty strings share the same storage, so this
+  // doesn't allocate.
+  SharedString() : _str(empty_string()) {}
+
+  // Take a copy of a string to share. This is deliberately implicit, so that
+  // shared strings can be used in place of std::strings. Strings that are
+  // moved in aren't copied at all.
+  SharedString(const std::string& str) :
+    _str(str.empty() ? empty_string() : std::make_shared<const std::string>(str))
+  {}
+  SharedString(std::string&& str) :
+    _str(str.empty() ? empty_string() : std::make_shared<const std::string>(std::move(str)))
+  {}
+  SharedString(const char* str) : SharedString(std::string(str)) {}
+
+  const std::string& str() const { return *_str; }
+  operator const std::string&() const { return *_str; }
+  const char* c_str() const { return _str->c_str(); }
+  const char* data() const { return _str->data(); }
+  bool empty() const { return _str->empty(); }
+  size_t size() const { return _str->size(); }
+
+  // The number of copies sharing this string's storage (for UT).
+  long use_count() const { return _str.use_count(); }
+
+  friend bool operator==(const SharedString& a, const SharedString& b)
+  {
+    return ((a._str == b._str) || (*a._str == *b._str));
+  }
+
+  friend bool operator==(const SharedString& a, const std::string& b)
+  {
+    return (*a._str == b);
+  }
+
+  friend bool operator==(const std::string& a, const SharedString& b)
+  {
+    return (a == *b._str);
+  }
+
+  friend bool operator==(const SharedString& a, const char* b)
+  {
+    return (*a._str == b);
+  }
+
+  friend bool operator==(const char* a, const SharedString& b)
+  {
+    return (a == *b._str);
+  }
+
+  template <class T>
+  friend bool operator!=(const SharedString& a, const T& b)
+  {
+    return !(a == b);
+  }
+
+  friend bool operator!=(const std::string& a, const SharedString& b)
+  {
+    return !(a == b);
+  }
+
+  friend bool operator!=(const char* a, const SharedString& b)
+  {
+    return !(a == b);
+  }
+
+  friend std::ostream& operator<<(std::ostream& os, const SharedString& s)
+  {
+    return os << *s._str;
+  }
+
+private:
+  static const std::shared_ptr<const std::string>& empty_string()
+  {
+    static const std::shared_ptr<const std::string> empty =
+                                      std::make_shared<const std::string>();
+    return empty;
+  }
+
+  std::shared_ptr<const std::string> _str;
+};
+
+#endif
@@ -14,19 +14,161 @@
 
 #include <vector>
 #include <map>
+#include <memory>
 #include <string>
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
 #include "timer_heap.h"
+#include "object_pool.h"
+#include "interned_string.h"
+#include "shared_string.h"
 
 typedef uint64_t TimerID;
 
+class Timer;
+
+struct TimerSchedule;
+
+struct ClusterConfig;
+
+// Records where a timer is held in the TimerStore. This is only used by the
+// TimerStore. A copy of a timer is never in the store, so copying a timer gives
+// an unlinked copy.
+struct TimerStoreLink
+{
+  TimerStoreLink() : schedule(NULL), in_heap(false) {}
+  TimerStoreLink(const TimerStoreLink&) : TimerStoreLink() {}
+  TimerStoreLink& operator=(const TimerStoreLink&) { return *this; }
+
+  // The timer's entry in the timer wheels (or NULL if it isn't in them).
+  TimerSchedule* schedule;
+
+  // Whether the timer is in the store's heap.
+  bool in_heap;
+};
+
+// The bodies for replicating one version of a timer to other Chronos nodes.
+// Each body is built the first time it's needed, and then shared (by
+// reference count) between all the requests that send it, rather than the
+// timer being serialized again for each replicator and node.
+//
+// The bodies are only shared while this is in scope, and the timer mustn't be
+// changed in that time. Bodies built for a timer without one of these in
+// scope aren't shared.
+class ReplicationBodies
+{
+public:
+  ReplicationBodies(Timer* timer);
+  ~ReplicationBodies();
+  ReplicationBodies(const ReplicationBodies&) = delete;
+  ReplicationBodies& operator=(const ReplicationBodies&) = delete;
+
+private:
+  friend class Timer;
+
+  Timer* _timer;
+
+  // The bodies built so far, by whether they're binary and whether they
+  // include the timer's replicas.
+  std::shared_ptr<const std::string> _bodies[2][2];
+};
+
+// Records the replication bodies being shared for a timer (if any). Like the
+// store link, copying a timer gives a copy without any shared bodies.
+struct ReplicationBodiesLink
+{
+  ReplicationBodiesLink() : bodies(NULL) {}
+  ReplicationBodiesLink(const ReplicationBodiesLink&) : ReplicationBodiesLink() {}
+  ReplicationBodiesLink& operator=(const ReplicationBodiesLink&) { return *this; }
+
+  ReplicationBodies* bodies;
+};
+
 // Separate class implementing the hash approach for rendezvous hashing -
 // allows the hashing to be changed in UT (e.g. to force collisions).
 class Hasher
 {
 public:
   virtual uint32_t do_hash(TimerID data, uint32_t seed);
+
+  // Hash each of the data items with each of the seeds, giving the same
+  // results as do_hash. hashes[(ii * num_data) + jj] is set to the hash of
+  // data[jj] with seeds[ii].
+  virtual void do_hash_batch(const TimerID* data,
+                             size_t num_data,
+                             const uint32_t* seeds,
+                             size_t num_seeds,
+                             uint32_t* hashes);
+};
+
+// A timer's cluster information (as set by Timer::update_cluster_information)
+// for a particular configuration, worked out in advance so that the timer
+// doesn't have to work it out itself when it pops.
+//
+// There are only a handful of distinct values of this for any configuration,
+// so they are shared between timers, and freed once no timer refers to them.
+struct PrecomputedReplicas
+{
+  // The configuration generation these were worked out for.
+  uint64_t config_generation;
+
+  InternedString cluster_view_id;
+  InternedStringList replicas;
+
+  // The timer's replicas in the old cluster that aren't replicas in the new
+  // one, which are added to the timer's extra replicas.
+  InternedStringList extra_replicas;
+};
+
+typedef std::shared_ptr<const PrecomputedReplicas> PrecomputedReplicasPtr;
+
+// The cluster's addresses and rendezvous hashes, taken from a snapshot of the
+// global configuration, so that the replicas for many timers can be worked
+// out consistently (and without needing a Timer for each one).
+class ClusterReplicaView
+{
+public:
+  ClusterReplicaView();
+
+  // Check whether the node is one of the replicas for the timer with the
+  // given ID and replication factor in the current cluster.
+  bool is_replica(TimerID id,
+                  uint32_t replication_factor,
+                  const std::string& node) const;
+
+  // As above, but for many timers at once, setting the corresponding entry
+  // in replicas for each of the timers. This hashes the timers in a batch, so
+  // is much faster than checking them one at a time.
+  void are_replicas(const std::vector<TimerID>& ids,
+                    const std::vector<uint32_t>& replication_factors,
+                    const std::string& node,
+                    std::vector<bool>& replicas) const;
+
+  // Work out the cluster information for each of the given timers, filling
+  // in the corresponding entry in replicas.
+  void precompute_replicas(const std::vector<TimerID>& ids,
+                           const std::vector<uint32_t>& replication_factors,
+                           std::vector<PrecomputedReplicasPtr>& replicas);
+
+  // The configuration generation this view was taken from.
+  uint64_t config_generation() const;
+
+private:
+  // Work out the indices of the replicas for each of the timers in the given
+  // cluster. The replicas for the jj'th timer start at
+  // replica_idxs[jj * cluster.size()], and there are num_replicas[jj] of them.
+  void calculate_replica_idxs(const std::vector<std::string>& cluster,
+                              const std::vector<uint32_t>& cluster_rendezvous_hashes,
+                              const std::vector<TimerID>& ids,
+                              const std::vector<uint32_t>& replication_factors,
+                              std::vector<size_t>& replica_idxs,
+                              std::vector<size_t>& num_replicas) const;
+
+  std::shared_ptr<const ClusterConfig> _config;
+
+  // The cluster information this view has worked out so far, by the indices
+  // of the timer's replicas in the new cluster and extra replicas in the old.
+  std::map<std::vector<size_t>, PrecomputedReplicasPtr> _precomputed;
 };
 
 class Timer : public HeapableTimer
@@ -35,24 +177,69 @@ public:
   Timer(TimerID, uint32_t interval_ms, uint32_t repeat_for);
   ~Timer();
 
+  // Timers are created and destroyed at a high rate, so are allocated from a
+  // slab allocator rather than directly from the heap.
+  static void* operator new(size_t size)
+  {
+    return (size == sizeof(Timer)) ? ObjectPool<Timer>::allocate() :
+                                     ::operator new(size);
+  }
+
+  static void operator delete(void* ptr, size_t size)
+  {
+    if (size == sizeof(Timer))
+    {
+      ObjectPool<Timer>::release(ptr);
+    }
+    else
+    {
+      ::operator delete(ptr);
+    }
+  }
+
   // For testing purposes.
   friend class TestTimer;
 
+  // The timer store maintains the timer's store link.
+  friend class TimerStore;
+
   // Returns the next time to pop in ms after epoch
   uint32_t next_pop_time() const;
 
+  // The part of the pop time that depends on this node's position in the
+  // replica and site lists is cached, as working it out involves taking the
+  // configuration lock and searching the lists. This must be called if the
+  // replicas, sites or replication factor are changed directly (the Timer's
+  // own methods that change them do this already). Changes to the
+  // configuration are picked up automatically.
+  void invalidate_pop_time() { _position_delay_generation = 0; }
+
   // Required method for use in a heap
   uint64_t get_pop_time() const;
 
   // Construct the URL for this timer given a hostname
   std::string url(std::string host = "");
 
-  // Convert this timer to JSON to be sent to replicas
-  std::string to_json();
-  void to_json_obj(rapidjson::Writer<rapidjson::StringBuffer>* writer);
+  // Convert this timer to JSON to be sent to replicas. The replicas are left
+  // out if include_replicas isn't set (e.g. when sending the timer to other
+  // sites, which work out their own replicas).
+  std::string to_json(bool include_replicas = true);
+  void to_json_obj(rapidjson::Writer<rapidjson::StringBuffer>* writer,
+                   bool include_replicas = true);
+
+  // Convert this timer to the compact binary format (see binary_codec.h) to
+  // be sent to replicas. This holds the same information as the JSON, but is
+  // much smaller and quicker to build and parse.
+  std::string to_binary(bool include_replicas = true);
+
+  // Get the body to replicate this timer with, in binary or as JSON. This is
+  // shared with any other replications of this version of the timer (see
+  // ReplicationBodies).
+  std::shared_ptr<const std::string> replication_body(bool binary,
+                                                      bool include_replicas);
 
   // Check if the timer is owned by the specified node.
-  bool is_local(std::string);
+  bool is_local(const InternedString& host);
 
   // Check if this node is the last replica for the timer
   bool is_last_replica();
@@ -64,17 +251,17 @@ public:
   void become_tombstone();
 
   // Check if the timer has a matching cluster view ID
-  bool is_matching_cluster_view_id(std::string cluster_view_id_to_match);
+  bool is_matching_cluster_view_id(const InternedString& cluster_view_id_to_match);
 
   // Calculate the replicas for this timer.
   void calculate_replicas(uint64_t replica_hash);
 
   // Class method for calculating replicas, for easy UT.
   static void calculate_replicas(TimerID id,
-                                 std::vector<std::string> new_cluster,
-                                 std::vector<uint32_t> new_cluster_rendezvous_hashes,
-                                 std::vector<std::string> old_cluster,
-                                 std::vector<uint32_t> old_cluster_rendezvous_hashes,
+                                 const std::vector<std::string>& new_cluster,
+                                 const std::vector<uint32_t>& new_cluster_rendezvous_hashes,
+                                 const std::vector<std::string>& old_cluster,
+                                 const std::vector<uint32_t>& old_cluster_rendezvous_hashes,
                                  uint32_t replication_factor,
                                  std::vector<std::string>& replicas,
                                  std::vector<std::string>& extra_replicas,
@@ -89,9 +276,18 @@ public:
   void update_sites_on_timer_pop();
 
   // Update the cluster information stored in the timer (replica list and
-  // cluster view ID)
+  // cluster view ID). This uses the precomputed cluster information if it's
+  // for the current configuration.
   void update_cluster_information();
 
+  // Set the cluster information worked out for this timer in advance. The
+  // timer uses this the next time it updates its cluster information, if
+  // the configuration hasn't changed since.
+  void set_precomputed_replicas(const PrecomputedReplicasPtr& precomputed)
+  {
+    _precomputed_replicas = precomputed;
+  }
+
   // Member variables (mostly public since this is pretty much a struct with
   // utility functions, rather than a full-blown object).
   TimerID id;
@@ -99,29 +295,64 @@ public:
   uint32_t interval_ms;
   uint32_t repeat_for;
   uint32_t sequence_number;
-  std::string cluster_view_id;
-  std::vector<std::string> replicas;
-  std::vector<std::string> extra_replicas;
-  std::vector<std::string> sites;
+
+private:
+  // The fields used to work out when the timer pops and to find it in the
+  // timer store are kept together at the start of the timer, away from the
+  // (much larger) payload below, so that scheduling the timer touches as
+  // little memory as possible.
+  uint32_t _replication_factor;
+
+  // Cached result of delay_from_position(), and the configuration generation
+  // it was calculated for (0 if it needs recalculating).
+  mutable uint32_t _position_delay_ms;
+  mutable uint64_t _position_delay_generation;
+
+  // Cluster information worked out for this timer in advance (if any).
+  PrecomputedReplicasPtr _precomputed_replicas;
+
+  // Where this timer is held in the timer store (if anywhere).
+  TimerStoreLink _store_link;
+
+public:
+  // The cluster view ID, replicas and sites are drawn from a small set of
+  // values, so are interned (and can be compared cheaply).
+  InternedString cluster_view_id;
+  InternedStringList replicas;
+  InternedStringList extra_replicas;
+  InternedStringList sites;
   std::map<std::string, uint32_t> tags;
-  std::string callback_url;
-  std::string callback_body;
+
+  // The callback URL and opaque data never change once the timer's created,
+  // so are shared between copies of the timer rather than copied.
+  SharedString callback_url;
+  SharedString callback_body;
+
+  // Whether the client accepts this timer's callback batched with other
+  // timers' callbacks to the same URL.
+  bool batch_callback;
 
 private:
+  // The replication bodies being shared for this timer (if any).
+  friend class ReplicationBodies;
+  ReplicationBodiesLink _replication_bodies_link;
+
+  // Work out how delayed the timer should be based on this node's position
+  // in the replica and site lists, using the cached value if it's still valid
+  uint32_t delay_from_position() const;
+
   // Work out how delayed the timer should be based on this node's position
   // in the replica list
-  uint32_t delay_from_replica_position() const;
+  uint32_t delay_from_replica_position(const ClusterConfig& config) const;
 
   // Work out how delayed the timer should be based on this node's position
   // in the site list
-  uint32_t delay_from_site_position() const;
+  uint32_t delay_from_site_position(const ClusterConfig& config) const;
 
   // Work out how delayed the timer should be based on the timer's sequence
   // number and interval period (i.e. if this is a repeating timer)
   uint32_t delay_from_sequence_position() const;
 
-  uint32_t _replication_factor;
-
   // Class functions
 public:
   static TimerID generate_timer_id();
@@ -140,6 +371,13 @@ public:
                               bool& replicated,
                               bool& gr_replicated,
                               rapidjson::Value& doc);
+  static Timer* from_binary(TimerID id,
+                            uint32_t replication_factor,
+                            uint64_t replica_hash,
+                            const std::string& body,
+                            std::string& error,
+                            bool& replicated,
+                            bool& gr_replicated);
 
   // Sort timers by their pop time
   static bool compare_timer_pop_times(Timer* t1, Timer* t2)
@@ -13,6 +13,8 @@
 #define TIMER_HANDLER_H__
 
 #include <pthread.h>
+#include <atomic>
+#include <vector>
 
 #ifdef UNIT_TEST
 #include "pthread_cond_var_helper.h"
@@ -29,10 +31,20 @@
 #include "snmp_infinite_timer_count_table.h"
 #include "snmp_infinite_scalar_table.h"
 #include "snmp_scalar.h"
+#include "snmp_event_accumulator_table.h"
+#include "mpsc_queue.h"
+#include "batch_queue.h"
 
+// The timer handler owns the timers on this node, popping them when they're
+// due and handling updates to them.
+//
+// Timers are partitioned by ID across one or more shards. Each shard has its
+// own timer store, lock and thread to pop its timers, so operations on
+// timers in different shards don't contend with each other.
 class TimerHandler
 {
 public:
+  // Create a timer handler with a single shard.
   TimerHandler(TimerStore*,
                Callback*,
                Replicator*,
@@ -40,9 +52,39 @@ public:
                SNMP::ContinuousIncrementTable*,
                SNMP::InfiniteTimerCountTable*,
                SNMP::InfiniteScalarTable*);
+
+  // Create a timer handler with a shard for each of the passed in stores. The
+  // caller retains ownership of the stores.
+  //
+  // If queue_timer_adds is set, timers passed to queue_timer are queued for
+  // their shard's thread to add (see queue_timer). The optional tables
+  // record how long the shards' locks are held for (in microseconds), and how
+  // many queued timers each shard's thread picks up at once. The optional
+  // scalar reports how many timers are left to precompute the replicas for
+  // (see precompute_replicas), and the optional timer pool scalar reports how
+  // many slabs of timers have been allocated from the heap (which stops going
+  // up once the pool is big enough for the peak number of timers).
+  TimerHandler(std::vector<TimerStore*>,
+               Callback*,
+               Replicator*,
+               GRReplicator*,
+               SNMP::ContinuousIncrementTable*,
+               SNMP::InfiniteTimerCountTable*,
+               SNMP::InfiniteScalarTable*,
+               bool queue_timer_adds = false,
+               SNMP::EventAccumulatorTable* lock_hold_time_table = NULL,
+               SNMP::EventAccumulatorTable* add_queue_depth_table = NULL,
+               SNMP::U32Scalar* precompute_remaining_scalar = NULL,
+               SNMP::U32Scalar* timer_pool_scalar = NULL);
   virtual ~TimerHandler();
   TimerHandler(const TimerHandler& copy) = delete;
   virtual void add_timer(Timer*, bool=true);
+
+  // Add a timer received in a request. If timer adds are queued, this hands
+  // the timer to its shard's thread without taking the shard's lock, and the
+  // thread adds it (along with any others queued since) before its next
+  // tick. Otherwise, this is the same as add_timer.
+  virtual void queue_timer(Timer*);
   virtual void return_timer(Timer*);
   virtual void handle_successful_callback(TimerID id);
   virtual void handle_failed_callback(TimerID id);
@@ -51,12 +93,31 @@ public:
                                        std::string cluster_view_id,
                                        uint32_t time_from,
                                        std::string& get_response);
-  void run();
+
+  // Work out the cluster information for all the timers in the background,
+  // so that they don't each have to when they pop or are resynced. This
+  // should be called whenever the configuration changes. Any earlier pass
+  // that's still running stops once it notices the configuration changed.
+  virtual void precompute_replicas();
+
+  // Move the timers whose pop times have changed because the configuration
+  // changed this node's position in their replica or site lists, and wake
+  // the shards' threads to wait for the new pop times. This should be called
+  // whenever the configuration changes.
+  virtual void update_pop_times();
 
   friend class TestTimerHandler;
 
 #ifdef UNIT_TEST
-  TimerHandler() {}
+  TimerHandler() :
+    _callback(NULL),
+    _queue_timer_adds(false),
+    _lock_hold_time_table(NULL),
+    _add_queue_depth_table(NULL),
+    _precompute_queue(NULL),
+    _precompute_remaining_scalar(NULL),
+    _timer_pool_scalar(NULL)
+  {}
 #endif
 
 private:
@@ -64,15 +125,152 @@ private:
   // same. It should be bigger than the expected network lag
   static const int NETWORK_DELAY = 200;
 
-  void pop(std::unordered_set<Timer*>&);
+  // The state for a single shard. Each shard's store is protected by its
+  // mutex, and its timers are popped by its thread.
+  struct Shard
+  {
+    TimerHandler* handler;
+    TimerStore* store;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    uint32_t timer_count;
+
+    // Whether the shard's thread is waiting for its next timers to pop, and
+    // (if there are any timers to wait for) the time it's waiting until.
+    // Adding a timer that needs to pop before then wakes the thread early.
+    bool sleeping;
+    bool wake_time_set;
+    uint32_t wake_time_ms;
+
+    // Timers queued by queue_timer for the shard's thread to add. The thread
+    // sets waiting_for_adds before it sleeps, and the first timer queued
+    // after that wakes it.
+    MPSCQueue<Timer*> queued_timers;
+    std::atomic<bool> waiting_for_adds;
+
+    // When the shard's mutex was last locked (in microseconds), if lock hold
+    // times are being recorded.
+    uint64_t lock_time_us;
+
+    // The number of timers in the shard that are still to have their cluster
+    // information precomputed.
+    std::atomic<uint32_t> precompute_remaining;
+
+#ifdef UNIT_TEST
+    MockPThreadCondVar* cond;
+#else
+    CondVar* cond;
+#endif
+  };
+
+  // Walks through the timers in a shard in pop time order for a resync. The
+  // shard's lock is only taken to get the IDs and pop times of the next few
+  // timers, and to copy each timer as it's reached, so resyncs don't hold up
+  // the shard's thread popping timers.
+  //
+  // If a cluster and node are passed in, whether the node is a replica for
+  // each timer is worked out for each set of timers at once, without needing
+  // to copy the timers. The cluster and node must outlive the cursor.
+  class ResyncCursor
+  {
+  public:
+    ResyncCursor(TimerHandler* handler,
+                 Shard* shard,
+                 uint32_t time_from,
+                 const ClusterReplicaView* cluster,
+                 const std::string* node);
+
+    bool end() const { return (_next >= _entries.size()); }
+    const TimerStore::ResyncEntry& operator*() const { return _entries[_next]; }
+    ResyncCursor& operator++();
+
+    // Whether the requesting node is one of the replicas for the timer the
+    // cursor is on.
+    bool on_node() const { return _on_node[_next]; }
+
+    // Get a copy of the timer the cursor is on. Returns NULL if the timer has
+    // been popped, updated or deleted since the cursor reached it.
+    Timer* copy_timer();
+
+  private:
+    // Get the next set of timers from the shard.
+    void refill();
+
+    // The number of timers to get from the shard at a time.
+    static const size_t BATCH_SIZE = 64;
+
+    TimerHandler* _handler;
+    Shard* _shard;
+    const ClusterReplicaView* _cluster;
+    const std::string* _node;
+    std::vector<TimerStore::ResyncEntry> _entries;
+    std::vector<bool> _on_node;
+    size_t _next;
+    bool _more;
+
+    // Where the next set of timers starts from - the last pop time returned,
+    // and the IDs of the timers returned so far that pop at that time.
+    uint32_t _time_from;
+    std::vector<TimerID> _ids_at_time_from;
+  };
+
+  // Return the shard that owns the timer with the given ID.
+  Shard* shard_for(TimerID id);
+
+  // Loop popping the timers in a shard until the handler is terminated.
+  void run(Shard* shard);
+
+  // Loop precomputing the cluster information for the shards queued by
+  // precompute_replicas until the handler is terminated.
+  void run_precompute();
+
+  // Precompute the cluster information for the timers in a shard, a batch at
+  // a time.
+  void precompute_shard(Shard* shard);
+
+  // Report how many timers are left to precompute the cluster information
+  // for, across all the shards.
+  void report_precompute_remaining();
+
+  // Report how many slabs of timers the timer pool has allocated.
+  void report_timer_pool();
+
+  // The number of timers to precompute the cluster information for at once.
+  static const size_t PRECOMPUTE_BATCH_SIZE = 256;
+
+  // Lock and unlock a shard's mutex, recording how long it was held for.
+  // locked and unlocked record the same for a mutex that was taken or
+  // released elsewhere (e.g. when waiting on the shard's condition variable).
+  void lock_shard(Shard* shard);
+  void unlock_shard(Shard* shard);
+  void locked(Shard* shard);
+  void unlocked(Shard* shard);
+
+  // Add a timer to a shard's store. Must be called with the shard's mutex
+  // held.
+  void add_timer_to_shard(Shard* shard, Timer* timer, bool update_stats);
+
+  // Add any timers queued for the shard. Must be called with the shard's
+  // mutex held.
+  void add_queued_timers(Shard* shard);
+
+  // Wake the shard's thread if it's sleeping past the time the given timer
+  // is due to pop. Must be called with the shard's mutex held.
+  void wake_for_timer(Shard* shard, Timer* timer);
+
+  void pop(std::vector<Timer*>&);
   void pop(Timer*);
 
+  // Get a popped timer ready to be passed to the callback. Returns false (and
+  // deletes the timer) if it's a tombstone, which needs no callback.
+  bool prepare_to_pop(Timer* timer);
+
   // Update a timer object with the current cluster configuration. Store off
   // the old set of replicas, and return whether the requesting node is
   // one of the new replicas
-  bool timer_is_on_node(std::string request_node,
+  bool timer_is_on_node(const InternedString& request_node,
                         Timer* timer,
-                        std::vector<std::string>& old_replicas);
+                        InternedStringList& old_replicas);
 
   // Ensure the update to the timer "sticks" by making it last at least as long
   // as the previous timer
@@ -89,7 +287,7 @@ private:
   // Check to see if these two timestamps are within NETWORK_DELAY of each other
   bool near_time(uint32_t a, uint32_t b);
 
-  TimerStore* _store;
+  std::vector<Shard*> _shards;
   Callback* _callback;
   Replicator* _replicator;
   GRReplicator* _gr_replicator;
@@ -97,21 +295,27 @@ private:
   SNMP::InfiniteTimerCountTable* _tagged_timers_table;
   SNMP::InfiniteScalarTable* _scalar_timers_table;
   SNMP::U32Scalar* _current_timers_scalar;
+  bool _queue_timer_adds;
+  SNMP::EventAccumulatorTable* _lock_hold_time_table;
+  SNMP::EventAccumulatorTable* _add_queue_depth_table;
+
+  // The shards waiting for their cluster information to be precomputed, and
+  // the pool of threads (one per shard) that do it.
+  BatchQueue<Shard*>* _precompute_queue;
+  std::vector<pthread_t> _precompute_threads;
+  SNMP::U32Scalar* _precompute_remaining_scalar;
+
+  // Serializes reporting the precomputing progress, so that shards
+  // finishing at the same time can't report stale totals.
+  pthread_mutex_t _precompute_report_lock;
+
+  SNMP::U32Scalar* _timer_pool_scalar;
 
-  pthread_t _handler_thread;
-  uint32_t _timer_count;
   std::map<std::string, int> _tag_count = {};
   volatile bool _terminate;
-  volatile unsigned int _nearest_new_timer;
-  pthread_mutex_t _mutex;
-
-#ifdef UNIT_TEST
-  MockPThreadCondVar* _cond;
-#else
-  CondVar* _cond;
-#endif
 
   static void* timer_handler_entry_func(void *);
+  static void* precompute_entry_func(void *);
 };
 
 #endif
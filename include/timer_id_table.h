@@ -0,0 +1,177 @@
+/**
+ * @file timer_id_table.h
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TIMER_ID_TABLE_H__
+#define TIMER_ID_TABLE_H__
+
+#include "timer.h"
+
+#include <stddef.h>
+
+// A table of timers indexed by ID.
+//
+// This is an open-addressing hash table using linear probing. Each slot holds
+// the timer's ID alongside the timer, so a lookup only touches the table
+// itself (and typically a single cache line). Timer IDs are well distributed
+// 64-bit integers, so a multiplicative (Fibonacci) hash is sufficient.
+//
+// The table grows incrementally. When it gets too full, a table of twice the
+// size is allocated and all new timers are added to it. The old table is then
+// drained a few slots at a time on each subsequent insert or erase, so no
+// single operation has to move every timer (which would stall the tick thread
+// for seconds with millions of timers). Lookups check both tables until the
+// old one is empty.
+//
+// This class is not thread-safe - the timer store is protected by the timer
+// handler's lock.
+class TimerIDTable
+{
+public:
+  TimerIDTable();
+  ~TimerIDTable();
+  TimerIDTable(const TimerIDTable& copy) = delete;
+
+  // Return the timer with the given ID, or NULL if there isn't one.
+  Timer* find(TimerID id) const;
+
+  // Add a timer to the table. There must not already be a timer with this ID
+  // in the table.
+  void insert(TimerID id, Timer* timer);
+
+  // Remove the timer with the given ID from the table. Returns whether there
+  // was a timer to remove.
+  bool erase(TimerID id);
+
+  // Remove all timers from the table (without deleting them).
+  void clear();
+
+  // Start loading the part of the table where the given ID would be, so that
+  // a later lookup or erase of it doesn't have to wait for memory.
+  void prefetch(TimerID id) const
+  {
+    __builtin_prefetch(&_table.slots[home_slot(_table, id)], 1);
+  }
+
+  // The number of timers in the table.
+  size_t size() const { return _size; }
+  bool empty() const { return (_size == 0); }
+
+private:
+  struct Slot
+  {
+    TimerID id;
+    Timer* timer;
+  };
+
+  // A single open-addressing table, whose capacity is a power of 2.
+  struct Table
+  {
+    Slot* slots;
+    size_t capacity;
+    unsigned int shift;
+  };
+
+public:
+  // Iterates over all the timers in the table. The table must not be modified
+  // while iterating.
+  class iterator
+  {
+  public:
+    iterator(const TimerIDTable* table, bool end);
+    iterator& operator++();
+    Timer* operator*() const { return _slot->timer; }
+    bool operator!=(const iterator& other) const
+    {
+      return (_slot != other._slot);
+    }
+
+  private:
+    void skip_unused_slots();
+
+    const TimerIDTable* _table;
+    const Table* _current;
+    const Slot* _slot;
+  };
+
+  iterator begin() const { return iterator(this, false); }
+  iterator end() const { return iterator(this, true); }
+
+private:
+  // The capacity of a new (or cleared) table.
+  static const size_t INITIAL_CAPACITY = 64;
+
+  // The table grows once more than MAX_LOAD_NUMERATOR/MAX_LOAD_DENOMINATOR of
+  // its slots are in use.
+  static const size_t MAX_LOAD_NUMERATOR = 3;
+  static const size_t MAX_LOAD_DENOMINATOR = 4;
+
+  // The number of old table slots migrated on each insert or erase while
+  // resizing.
+  // The old table has at most 3/4 as many slots as the new one can take
+  // before it grows again, so this is plenty to finish draining in time.
+  static const size_t MIGRATE_SLOTS_PER_OP = 8;
+
+  // Marks a slot in the old table whose timer has been moved or removed.
+  // Empty slots in the old table can't be reused (as that would break probe
+  // sequences that pass through them) so these are never cleaned up - the old
+  // table is freed once it's fully drained instead.
+  static Timer* const MOVED;
+
+  static void allocate(Table& table, size_t capacity);
+  static void release(Table& table);
+
+  // Hash an ID to its home slot in a table.
+  static size_t home_slot(const Table& table, TimerID id)
+  {
+    return (size_t)((id * 0x9E3779B97F4A7C15ULL) >> table.shift);
+  }
+
+  // Find the slot holding the given ID in a table, or NULL if it isn't there.
+  static Slot* find_slot(const Table& table, TimerID id);
+
+  // Add a timer to the (current) table, which must have space.
+  static void insert_slot(Table& table, TimerID id, Timer* timer);
+
+  // Empty a slot in the current table, shifting any following entries in the
+  // probe sequence back so that lookups never need tombstones.
+  static void erase_slot(Table& table, Slot* slot);
+
+  // Start an incremental resize into a table of twice the size.
+  void grow();
+
+  // Migrate some slots from the old table, freeing it once it's empty.
+  void migrate(size_t num_slots);
+
+  // Return the memory for the drained part of the old table to the OS. This
+  // spreads the cost of unmapping the old table over the resize, rather than
+  // paying it all (tens of ms for a large table) when the old table is freed.
+  void release_drained_pages();
+
+  // Only release drained memory in chunks of at least this size, to limit the
+  // number of system calls.
+  static const size_t RELEASE_CHUNK_BYTES = 1024 * 1024;
+
+  Table _table;
+  Table _old_table;
+  size_t _migrate_pos;
+
+  // The last slot in the old table found to be empty while draining it. No
+  // probe sequence for a timer still in the old table can cross this slot, so
+  // the memory before it is no longer needed.
+  size_t _last_empty_pos;
+
+  // The slot up to which the old table's memory has been released.
+  size_t _released_pos;
+
+  size_t _size;
+};
+
+#endif
@@ -14,12 +14,14 @@
 
 #include "timer.h"
 #include "timer_heap.h"
+#include "timer_id_table.h"
 #include "health_checker.h"
 #include "httpconnection.h"
 
 #include <unordered_set>
 #include <map>
 #include <string>
+#include <vector>
 
 // This defines a hashing mechanism, based on the uniqueness of the timer ids,
 // that will be used when a Timer is added to a set
@@ -42,8 +44,52 @@ namespace std
   };
 }
 
+// The scheduling state of a timer held in the timer wheels.
+//
+// The wheels only need to know when each timer is due to pop, so rather than
+// walking the (large) timers themselves, each bucket is a list of these small
+// records, allocated separately from the timers. Moving timers between the
+// wheels only touches these records - the timer itself is only looked at when
+// it is added to the store or when it pops.
+struct TimerSchedule
+{
+  enum Location
+  {
+    OVERDUE,
+    SHORT_WHEEL,
+    LONG_WHEEL,
+    DAY_WHEEL,
+    WEEK_WHEEL
+  };
+
+  // Records are added to and removed from the store at a high rate, so are
+  // allocated from a slab allocator (which also keeps them packed together).
+  static void* operator new(size_t size)
+  {
+    return ObjectPool<TimerSchedule>::allocate();
+  }
+
+  static void operator delete(void* ptr)
+  {
+    ObjectPool<TimerSchedule>::release(ptr);
+  }
+
+  TimerSchedule* prev;
+  TimerSchedule* next;
+  Timer* timer;
+
+  // The time the timer pops, calculated when it was added to the store.
+  uint32_t pop_time;
+
+  Location location;
+};
+
 class TimerStore
 {
+private:
+  class Bucket;
+  class OccupancyBitmap;
+
 public:
 
   TimerStore(HealthChecker* hc);
@@ -55,19 +101,32 @@ public:
   // Fetch a timer by ID and populate the Timer
   virtual void fetch(TimerID id, Timer** timer);
 
-  // Fetch the next buckets of timers to pop and remove from store
-  virtual void fetch_next_timers(std::unordered_set<Timer*>& set);
+  // Fetch the next buckets of timers to pop and remove from store. The timers
+  // are added to the end of the passed in vector.
+  virtual void fetch_next_timers(std::vector<Timer*>& timers);
+
+  // Get the time (in ms, on the monotonic clock) at which fetch_next_timers
+  // next has any work to do - either timers to pop, or timers to move between
+  // the timer wheels. Returns false if the store is empty.
+  virtual bool next_tick_time(uint32_t& time);
+
+  // Work out the timers' pop times again, and move any whose pop time has
+  // changed. A timer's pop time is worked out when it's added to the store,
+  // and depends on this node's position in the timer's replica and site lists
+  // - so this should be called whenever the configuration changes. It does
+  // nothing unless this node's address or site has changed since the pop times
+  // were last worked out.
+  virtual void update_pop_times();
 
   // Removes all timers from the wheels and heap, without deleting them. Useful
   // for cleanup in UT.
   void clear();
 
   // A table of all known timers indexed by ID.
-  std::map<TimerID, Timer*> _timer_lookup_id_table;
+  TimerIDTable _timer_lookup_id_table;
 
-  // Constants controlling the size of the short wheel buckets (this needs to
-  // be public so that the timer handler can work out how long it should
-  // wait for a tick)
+  // Constants controlling the size of the short wheel buckets. Timers may pop
+  // up to this long after they are due.
 #ifndef UNIT_TEST
   static const int SHORT_WHEEL_RESOLUTION_MS = 8;
 #else
@@ -81,7 +140,7 @@ public:
   class TSOrderedTimerIterator
   {
   protected:
-    TSOrderedTimerIterator(TimerStore* ts, uint32_t time_from);
+    TSOrderedTimerIterator(TimerStore* ts, uint32_t time_from, bool sorted);
 
     void iterate_through_ordered_timers();
 
@@ -89,37 +148,43 @@ public:
     std::vector<Timer*>::iterator _iterator;
     TimerStore* _ts;
     uint32_t _time_from;
+    bool _sorted;
   };
 
-  class TSShortWheelIterator : public TSOrderedTimerIterator
+  // Iterates through the timers in one of the timer wheels, in pop time
+  // order. Each bucket's timers are sorted when the iterator reaches it, so
+  // nothing is sorted until the iterator is first used. If sorted is false,
+  // the iterator goes through the buckets in order, but the timers in each
+  // bucket in no particular order.
+  class TSWheelIterator : public TSOrderedTimerIterator
   {
   public:
-    TSShortWheelIterator(TimerStore* ts, uint32_t time_from);
-    TSShortWheelIterator& operator++();
+    TSWheelIterator(TimerStore* ts,
+                    uint32_t time_from,
+                    Bucket* wheel,
+                    const OccupancyBitmap* occupancy,
+                    int num_buckets,
+                    uint32_t resolution_ms,
+                    bool sorted);
+    TSWheelIterator& operator++();
     Timer* operator*();
-    bool end() const;
+    bool end();
 
-  private:
-    int _end_bucket;
-    int _bucket;
-    void next_bucket();
-  };
-
-  class TSLongWheelIterator : public TSOrderedTimerIterator
-   {
-   public:
-    TSLongWheelIterator(TimerStore* ts, uint32_t time_from);
-    TSLongWheelIterator& operator++();
-    Timer* operator*();
-    bool end() const;
+    // Whether the iterator is part way through a bucket it has sorted.
+    bool mid_bucket() const;
 
   private:
+    Bucket* _wheel;
+    const OccupancyBitmap* _occupancy;
+    int _num_buckets;
     int _end_bucket;
     int _bucket;
+    bool _loaded;
+    void load();
     void next_bucket();
   };
 
-class TSHeapIterator
+  class TSHeapIterator
   {
   public:
     TSHeapIterator(TimerStore* ts, uint32_t time_from);
@@ -136,34 +201,77 @@ class TSHeapIterator
   class TSIterator
   {
   public:
-    TSIterator(TimerStore* ts, uint32_t time_from);
+    TSIterator(TimerStore* ts, uint32_t time_from, bool sorted);
     TSIterator& operator++();
     Timer* operator*();
-    bool end() const;
+    bool end();
+
+    // Whether the iterator is part way through a bucket of one of the timer
+    // wheels, which has been sorted.
+    bool mid_bucket() const;
 
   private:
     TimerStore* _ts;
     uint32_t _time_from;
-    TSShortWheelIterator _short_wheel_it;
-    TSLongWheelIterator _long_wheel_it;
+    TSWheelIterator _short_wheel_it;
+    TSWheelIterator _long_wheel_it;
+    TSWheelIterator _day_wheel_it;
+    TSWheelIterator _week_wheel_it;
     TSHeapIterator _heap_it;
 
     void next_iterator();
   };
 
-  TSIterator begin(uint32_t time_from);
+  // Get an iterator over the timers that pop at or after time_from. Unless
+  // sorted is false, this returns the timers in pop time order. Otherwise the
+  // timers within each timer wheel bucket come out in no particular order.
+  TSIterator begin(uint32_t time_from, bool sorted = true);
+
+  // The ID, pop time and replication factor of a timer, as returned by
+  // get_resync_entries. This is enough to work out whether the timer belongs
+  // on a node without looking at the timer itself.
+  struct ResyncEntry
+  {
+    TimerID id;
+    uint32_t pop_time;
+    uint32_t replication_factor;
+  };
+
+  // Get the resync entries for the timers (ignoring tombstones) that pop at or
+  // after time_from. Timers that pop at time_from are left out if their IDs
+  // are in skip_ids (which must be sorted), so that the caller can carry on
+  // from where an earlier call left off.
+  //
+  // This gets at least max_entries timers (if there are that many), then
+  // finishes off any timer wheel bucket it's part way through. The entries
+  // aren't sorted, so that the caller can sort them without holding up the
+  // store, but all the timers returned pop before any that are left for the
+  // next call. Returns whether there may be more timers after these.
+  bool get_resync_entries(uint32_t time_from,
+                          const std::vector<TimerID>& skip_ids,
+                          size_t max_entries,
+                          std::vector<ResyncEntry>& entries);
 
 private:
-  // The timer store uses 4 data structures to ensure timers pop on time:
+  // The timer store uses 6 data structures to ensure timers pop on time:
   // - A short timer wheel consisting of 128 8ms buckets (1024ms in total).
-  // - A long timer wheel consisting of 4096 1024ms buckets (4194304ms in total).
+  // - A long timer wheel consisting of 4096 1024ms buckets (4194304ms, or
+  //   ~70 minutes, in total).
+  // - A day timer wheel consisting of 64 4194304ms buckets (268435456ms, or
+  //   ~3 days, in total).
+  // - A week timer wheel consisting of 4 268435456ms buckets (1073741824ms,
+  //   or ~12 days, in total).
   // - A heap,
   // - A set of overdue timers.
   //
   // New timers are placed into on of these structures:
   // - The short wheel if due to pop in 1024ms.
   // - The long wheel if due to pop in 4194304ms (but not the next 1024ms).
-  // - The heap if due to pop >= 4194304 (~>1hr) in the future.
+  // - The day wheel if due to pop in 268435456ms (but not the next
+  //   4194304ms).
+  // - The week wheel if due to pop in 1073741824ms (but not the next
+  //   268435456ms).
+  // - The heap if due to pop >= 1073741824ms (~>12 days) in the future.
   // - The overdue set if they should have already popped.
   //
   // Timers in the overdue set are popped whenever `get_next_timers` is called.
@@ -172,28 +280,39 @@ private:
   // tick the timers in the current bucket are popped. Every time the short
   // wheel does a full rotation, the long wheel ticks forward, and every timer
   // in the next bucket is placed into the correct place in the short wheel.
-  // Every time the long wheel does a full rotation, all timers on the heap due
-  // to pop in the next hour are placed into the appropriate place in the
-  // short/long wheels.
+  // Every time the long wheel does a full rotation, the day wheel ticks
+  // forward, and every timer in its next bucket is placed into the correct
+  // place in the short/long wheels. The week wheel feeds the day wheel in the
+  // same way. Every time the week wheel does a full rotation, all timers on
+  // the heap due to pop in the next 12 days are placed into the appropriate
+  // place in the wheels. This means that adding a timer to the store and
+  // removing it again is constant time (unless it's in the heap, which is
+  // only needed for timers set unusually far into the future).
   //
   // To achieve this the store tracks the time of the next tick to process
   // _tick_timestamp, which is a multiple of 8ms. The wheels are arrays
-  // of sets that store pointers to timer objects. Any timestamp can be mapped
-  // to an index into these arrays (using division and modulo arithmetic).
+  // of buckets of timers. Any timestamp can be mapped to an index into these
+  // arrays (using division and modulo arithmetic).
   //
   // When a tick is processed:
   // - All timers in the current short bucket are popped.
   // - The tick time is increased by 8ms.
+  // - If the new tick time is on a ~12 day boundary, all timers in the heap
+  //   that are due to pop in the next 12 days are moved into the correct
+  //   positions in the wheels.
+  // - If the new tick time is on a ~3 day boundary, all timers in the current
+  //   week bucket are distributed to the appropriate place in the wheels.
+  // - If the new tick time is on a ~70 minute boundary, all timers in the
+  //   current day bucket are distributed to the appropriate place in the
+  //   short/long wheels.
   // - If the new tick time is on a 1s boundary, all timers in the current
   //   long bucket are distributed to the appropriate short bucket.
-  // - If the new tick time is on a 1hr boundary, all timers in the heap that
-  //   are due to pop in the next hour are moved into the correct positions in
-  //   the short/long wheels.
   //
   // A result of this algorithm is that it is not possible to tell where a timer
   // is stored based solely on it's pop time. For example:
   // - At time 0ms, a new timer was set to pop at time 4,194,305ms. It would
-  //   go straight into the heap as it's due to pop in >= long timer wheel total.
+  //   go straight into the day wheel as it's due to pop in >= long timer wheel
+  //   total.
   // - At time 4,194,300ms, another new timer is set to pop, also at
   //   4,194,305ms.  It would go in the short wheel as it's due to pop in <
   //   short wheel timer total.
@@ -203,9 +322,12 @@ private:
   //   rotation, and both timers get moved into the short wheel, to be popped
   //   at the right time.
   //
-  // This does mean that when removing a timer, the overdue set, both wheels and
-  // the heap may need to be searched, although the timer is guaranteed to be in
-  // only one of them (and the heap is searched last for efficiency).
+  // This means that a timer's location can't be derived from its pop time, so
+  // each timer records where it is held. The buckets are lists of small
+  // TimerSchedule records (one per timer), which hold the timer's pop time as
+  // calculated when it was added to the store. Moving timers between the
+  // wheels works entirely on these records, without touching the timers, and
+  // removing a timer from the store is a direct unlink of its record.
 
   // Health checker, which is notified when a timer is successfully added.
   HealthChecker* _health_checker;
@@ -214,6 +336,8 @@ private:
 #ifndef UNIT_TEST
   static const int SHORT_WHEEL_NUM_BUCKETS = 128;
   static const int LONG_WHEEL_NUM_BUCKETS = 4096;
+  static const int DAY_WHEEL_NUM_BUCKETS = 64;
+  static const int WEEK_WHEEL_NUM_BUCKETS = 4;
 #else
   // Use fewer, larger buckets in UT, so we do less work when iterating over
   // timers, and run at an acceptable speed under Valgrind. The timer wheel
@@ -221,6 +345,8 @@ private:
   // reduce the quality of our testing.
   static const int SHORT_WHEEL_NUM_BUCKETS = 4;
   static const int LONG_WHEEL_NUM_BUCKETS = 2048;
+  static const int DAY_WHEEL_NUM_BUCKETS = 16;
+  static const int WEEK_WHEEL_NUM_BUCKETS = 8;
 #endif
   static const int SHORT_WHEEL_PERIOD_MS =
                                  (SHORT_WHEEL_RESOLUTION_MS * SHORT_WHEEL_NUM_BUCKETS);
@@ -229,21 +355,122 @@ private:
   static const int LONG_WHEEL_PERIOD_MS =
                             (LONG_WHEEL_RESOLUTION_MS * LONG_WHEEL_NUM_BUCKETS);
 
-  // Type of a single timer bucket.
-  typedef std::unordered_set<Timer*> Bucket;
+  static const int DAY_WHEEL_RESOLUTION_MS = LONG_WHEEL_PERIOD_MS;
+  static const int DAY_WHEEL_PERIOD_MS =
+                              (DAY_WHEEL_RESOLUTION_MS * DAY_WHEEL_NUM_BUCKETS);
+
+  // The week wheel's period must stay well below 2^31ms, so that pop times
+  // within it can be compared despite timestamps wrapping.
+  static const int WEEK_WHEEL_RESOLUTION_MS = DAY_WHEEL_PERIOD_MS;
+  static const int WEEK_WHEEL_PERIOD_MS =
+                            (WEEK_WHEEL_RESOLUTION_MS * WEEK_WHEEL_NUM_BUCKETS);
+
+  // Records which buckets of a timer wheel hold any timers, so that runs of
+  // empty buckets can be skipped over without looking at each one.
+  class OccupancyBitmap
+  {
+  public:
+    OccupancyBitmap(int num_buckets);
+
+    void set(int bucket) { _words[bucket / 64] |= (1ULL << (bucket % 64)); }
+    void clear(int bucket) { _words[bucket / 64] &= ~(1ULL << (bucket % 64)); }
+
+    // Returns how many buckets on from the given bucket (wrapping round the
+    // wheel) the first occupied bucket is, or -1 if all the buckets are
+    // empty.
+    int next_occupied(int bucket) const;
+
+  private:
+    int _num_buckets;
+    std::vector<uint64_t> _words;
+  };
+
+  // A single timer bucket. This is a doubly-linked list of timer schedules.
+  class Bucket
+  {
+  public:
+    Bucket() :
+      _head(NULL),
+      _location(TimerSchedule::OVERDUE),
+      _occupancy(NULL),
+      _index(0)
+    {}
+
+    // Set which structure this bucket is in (and, for the timer wheels, its
+    // position in the wheel's occupancy bitmap). The location is recorded on
+    // each schedule added to the bucket.
+    void init(TimerSchedule::Location location,
+              OccupancyBitmap* occupancy = NULL,
+              int index = 0);
+
+    // Add a schedule to the bucket. The schedule must not already be in a
+    // bucket.
+    void insert(TimerSchedule* schedule);
+
+    // Remove a schedule from the bucket. The schedule must be in this bucket.
+    void erase(TimerSchedule* schedule);
+
+    // Remove and return a schedule from the bucket (or NULL if it's empty).
+    TimerSchedule* pop_front();
+
+    bool empty() const { return (_head == NULL); }
+
+    // Free all the schedules in the bucket. This doesn't touch the timers
+    // themselves (as they may already have been deleted).
+    void clear();
+
+    class iterator
+    {
+    public:
+      iterator(TimerSchedule* schedule) : _schedule(schedule) {}
+      TimerSchedule* operator*() const { return _schedule; }
+      iterator& operator++() { _schedule = _schedule->next; return *this; }
+      bool operator!=(const iterator& other) const
+      {
+        return (_schedule != other._schedule);
+      }
+
+    private:
+      TimerSchedule* _schedule;
+    };
+
+    iterator begin() const { return iterator(_head); }
+    iterator end() const { return iterator(NULL); }
+
+  private:
+    TimerSchedule* _head;
+    TimerSchedule::Location _location;
+    OccupancyBitmap* _occupancy;
+    int _index;
+  };
 
   // Bucket for timers that are added after they were supposed to pop.
   Bucket _overdue_timers;
 
   // The short timer wheel.
   Bucket _short_wheel[SHORT_WHEEL_NUM_BUCKETS];
+  OccupancyBitmap _short_wheel_occupancy;
 
   // The long timer wheel.
   Bucket _long_wheel[LONG_WHEEL_NUM_BUCKETS];
+  OccupancyBitmap _long_wheel_occupancy;
+
+  // The day timer wheel.
+  Bucket _day_wheel[DAY_WHEEL_NUM_BUCKETS];
+  OccupancyBitmap _day_wheel_occupancy;
 
-  // Heap of longer-lived timers (> 1hr)
+  // The week timer wheel.
+  Bucket _week_wheel[WEEK_WHEEL_NUM_BUCKETS];
+  OccupancyBitmap _week_wheel_occupancy;
+
+  // Heap of very long-lived timers (> ~12 days)
   TimerHeap _extra_heap;
 
+  // This node's address and site when the timers' pop times were last worked
+  // out (see update_pop_times).
+  InternedString _local_ip;
+  InternedString _local_site_name;
+
   // Timestamp of the next tick to process. This is stored in ms, and is always
   // a multiple of SHORT_WHEEL_RESOLUTION_MS.
   uint32_t _tick_timestamp;
@@ -251,21 +478,30 @@ private:
   // Return the current timestamp in ms.
   static uint32_t timestamp_ms();
 
-  // Utility functions to locate a Timer's correct home in the store's timer
-  // wheels.
-  Bucket* short_wheel_bucket(Timer* timer);
-  Bucket* long_wheel_bucket(Timer* timer);
+  // Return how long after the current tick the next occupied bucket of one of
+  // the longer timer wheels is reached, or UINT32_MAX if the wheel is empty.
+  uint32_t next_occupied_bucket_offset(const OccupancyBitmap& occupancy,
+                                       int num_buckets,
+                                       uint32_t resolution_ms);
 
   // Utility functions to locate a bucket in the timer wheels based on a
   // timestamp.
   Bucket* short_wheel_bucket(uint32_t t);
   Bucket* long_wheel_bucket(uint32_t t);
+  Bucket* day_wheel_bucket(uint32_t t);
+  Bucket* week_wheel_bucket(uint32_t t);
+
+  // Utility function to locate the bucket a timer should be in based on its
+  // pop time. This returns NULL if the timer belongs in the heap.
+  Bucket* wheel_bucket(uint32_t pop_time);
 
   // Utility methods to convert a timestamp to the resolution used by the
   // wheels.  These round down (so to 8ms accuracy, 1644 -> 1640, but 1640
   // -> 1640).
   static uint32_t to_short_wheel_resolution(uint32_t t);
   static uint32_t to_long_wheel_resolution(uint32_t t);
+  static uint32_t to_day_wheel_resolution(uint32_t t);
+  static uint32_t to_week_wheel_resolution(uint32_t t);
 
   // Refill timer wheels from the longer duration stores.
   //
@@ -273,24 +509,44 @@ private:
   // case it is a no-op.
   void maybe_refill_wheels();
 
-  // Refill the long timer wheel from the heap.
+  // Refill the week timer wheel from the heap.
+  void refill_week_wheel();
+
+  // Refill the day timer wheel from the week wheel.
+  void refill_day_wheel();
+
+  // Refill the long timer wheel from the day wheel.
   void refill_long_wheel();
 
   // Refill the short timer wheel from the long wheel.
   void refill_short_wheel();
 
-  // Refill the short timer wheel using appropriate timers from the next bucket
-  // of the long wheel.
-  void refill_short_wheel_from_next_long_bucket();
+  // Refill each timer wheel using appropriate timers from the next bucket of
+  // the wheel above it (and the week wheel from the heap), so that every
+  // timer is in the smallest structure covering its pop time. Iterating
+  // through the structures in turn then gives the timers in order.
+  void refill_wheels_for_iteration();
+
+  // Move the timers in a bucket that are due to pop before the given time to
+  // the bucket they should now be in.
+  void redistribute_bucket(Bucket* bucket, uint32_t pop_before);
+
+  // Utility function to locate the bucket holding a schedule.
+  Bucket* bucket_for(TimerSchedule* schedule);
+
+  // Add a timer to a timer wheel bucket (creating its schedule), and remove a
+  // timer from whichever bucket it's in (freeing its schedule).
+  void insert_into_bucket(Bucket* bucket, Timer* timer, uint32_t pop_time);
+  void remove_from_bucket(Timer* timer);
 
-  // Ensure a timer is no longer stored in the timer wheels.  This is an
-  // expensive operation and should only be called when unsure of the timer
-  // store's consistency.
-  void purge_timer_from_wheels(Timer* timer);
+  // Add a timer to / remove a timer from the extra heap, keeping the timer's
+  // store link up to date.
+  void insert_into_heap(Timer* timer);
+  void remove_from_heap(Timer* timer);
 
-  // Pop a single timer bucket into the set.
+  // Pop a single timer bucket, adding its timers to the vector.
   void pop_bucket(TimerStore::Bucket* bucket,
-                  std::unordered_set<Timer*>& set);
+                  std::vector<Timer*>& timers);
 
   // Delete a timer from the timer wheel
   void remove_timer_from_timer_wheel(Timer* timer);
@@ -0,0 +1,1384 @@
+/**
+ * @file async_http_client.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "async_http_client.h"
+#include "log.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// The most events handled each time the client's thread wakes up.
+static const int MAX_EVENTS = 256;
+
+// How much is read from a connection at once.
+static const size_t READ_BUFFER_SIZE = 16384;
+
+/*****************************************************************************/
+/* HttpResponseParser                                                        */
+/*****************************************************************************/
+
+void HttpResponseParser::reset()
+{
+  _state = STATUS_LINE;
+  _status = 0;
+  _minor_version = 1;
+  _keep_alive = true;
+  _chunked = false;
+  _has_content_length = false;
+  _remaining = 0;
+  _line.clear();
+  _body.clear();
+}
+
+HttpResponseParser::Result HttpResponseParser::parse(const char* data,
+                                                     size_t length,
+                                                     size_t& consumed)
+{
+  consumed = 0;
+
+  while ((consumed < length) && (_state != DONE))
+  {
+    const char* next = data + consumed;
+    size_t available = length - consumed;
+
+    if ((_state == BODY) || (_state == CHUNK_DATA))
+    {
+      size_t num_bytes = (size_t)std::min((uint64_t)available, _remaining);
+      _body.append(next, num_bytes);
+      consumed += num_bytes;
+      _remaining -= num_bytes;
+
+      if (_remaining == 0)
+      {
+        _state = (_state == CHUNK_DATA) ? CHUNK_END : DONE;
+      }
+    }
+    else if (_state == BODY_UNTIL_CLOSE)
+    {
+      _body.append(next, available);
+      consumed = length;
+    }
+    else
+    {
+      // The rest of the response is made up of lines. Add to the current line
+      // until we've got all of it.
+      const char* eol = (const char*)memchr(next, '\n', available);
+      size_t num_bytes = (eol != NULL) ? (eol - next) + 1 : available;
+
+      if (_line.size() + num_bytes > MAX_LINE_LENGTH)
+      {
+        return INVALID;
+      }
+
+      _line.append(next, num_bytes);
+      consumed += num_bytes;
+
+      if (eol != NULL)
+      {
+        // Strip the line ending (which should be CRLF, but may just be LF).
+        _line.pop_back();
+
+        if ((!_line.empty()) && (_line.back() == '\r'))
+        {
+          _line.pop_back();
+        }
+
+        Result result = process_line(_line);
+        _line.clear();
+
+        if (result == INVALID)
+        {
+          return INVALID;
+        }
+      }
+    }
+  }
+
+  return (_state == DONE) ? COMPLETE : INCOMPLETE;
+}
+
+HttpResponseParser::Result HttpResponseParser::close()
+{
+  if (_state == BODY_UNTIL_CLOSE)
+  {
+    _state = DONE;
+  }
+
+  return (_state == DONE) ? COMPLETE : INVALID;
+}
+
+HttpResponseParser::Result HttpResponseParser::process_line(const std::string& line)
+{
+  switch (_state)
+  {
+  case STATUS_LINE:
+    return process_status_line(line);
+
+  case HEADER_LINE:
+    return process_header_line(line);
+
+  case CHUNK_SIZE:
+    return process_chunk_size_line(line);
+
+  case CHUNK_END:
+    // There's an empty line after each chunk's data.
+    if (!line.empty())
+    {
+      return INVALID;
+    }
+
+    _state = CHUNK_SIZE;
+    return INCOMPLETE;
+
+  case TRAILER_LINE:
+    // Trailers aren't used, so are skipped until the empty line that ends
+    // the response.
+    if (line.empty())
+    {
+      _state = DONE;
+    }
+
+    return INCOMPLETE;
+
+  // LCOV_EXCL_START - lines are only processed in the states above
+  default:
+    return INVALID;
+  // LCOV_EXCL_STOP
+  }
+}
+
+HttpResponseParser::Result HttpResponseParser::process_status_line(const std::string& line)
+{
+  // The status line looks like "HTTP/1.1 200 OK" (the reason is optional).
+  if ((line.size() < 12) ||
+      (line.compare(0, 7, "HTTP/1.") != 0) ||
+      (!isdigit(line[7])) ||
+      (line[8] != ' ') ||
+      (!isdigit(line[9])) ||
+      (!isdigit(line[10])) ||
+      (!isdigit(line[11])) ||
+      ((line.size() > 12) && (line[12] != ' ')))
+  {
+    return INVALID;
+  }
+
+  _minor_version = line[7] - '0';
+  _status = ((line[9] - '0') * 100) + ((line[10] - '0') * 10) + (line[11] - '0');
+
+  // Connections are persistent by default from HTTP/1.1.
+  _keep_alive = (_minor_version >= 1);
+  _state = HEADER_LINE;
+  return INCOMPLETE;
+}
+
+HttpResponseParser::Result HttpResponseParser::process_header_line(const std::string& line)
+{
+  if (line.empty())
+  {
+    // This is the end of the headers, which tell us how the body is sent.
+    if ((_status >= 100) && (_status < 200))
+    {
+      // This is an interim response (e.g. 100 Continue), and the real
+      // response follows.
+      _state = STATUS_LINE;
+      _chunked = false;
+      _has_content_length = false;
+      _remaining = 0;
+    }
+    else if ((_status == 204) || (_status == 304))
+    {
+      _state = DONE;
+    }
+    else if (_chunked)
+    {
+      _state = CHUNK_SIZE;
+    }
+    else if (_has_content_length)
+    {
+      _state = (_remaining > 0) ? BODY : DONE;
+    }
+    else
+    {
+      // The body runs until the server closes the connection.
+      _keep_alive = false;
+      _state = BODY_UNTIL_CLOSE;
+    }
+
+    return INCOMPLETE;
+  }
+
+  if ((line[0] == ' ') || (line[0] == '\t'))
+  {
+    // This continues the previous header, and none of the headers we're
+    // interested in are long enough to need this.
+    return INCOMPLETE;
+  }
+
+  size_t colon = line.find(':');
+
+  if (colon == std::string::npos)
+  {
+    return INVALID;
+  }
+
+  std::string name = line.substr(0, colon);
+  size_t value_start = line.find_first_not_of(" \t", colon + 1);
+  size_t value_end = line.find_last_not_of(" \t");
+  std::string value = (value_start != std::string::npos) ?
+                      line.substr(value_start, value_end - value_start + 1) :
+                      "";
+
+  if (strcasecmp(name.c_str(), "Content-Length") == 0)
+  {
+    if ((value.empty()) ||
+        (value.size() > 18) ||
+        (value.find_first_not_of("0123456789") != std::string::npos))
+    {
+      return INVALID;
+    }
+
+    _has_content_length = true;
+    _remaining = strtoull(value.c_str(), NULL, 10);
+  }
+  else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0)
+  {
+    if (strcasestr(value.c_str(), "chunked") != NULL)
+    {
+      _chunked = true;
+    }
+  }
+  else if (strcasecmp(name.c_str(), "Connection") == 0)
+  {
+    if (strcasecmp(value.c_str(), "close") == 0)
+    {
+      _keep_alive = false;
+    }
+    else if (strcasecmp(value.c_str(), "keep-alive") == 0)
+    {
+      _keep_alive = true;
+    }
+  }
+
+  return INCOMPLETE;
+}
+
+HttpResponseParser::Result HttpResponseParser::process_chunk_size_line(const std::string& line)
+{
+  // The chunk size is in hex, and may be followed by extensions (which we
+  // ignore).
+  size_t size_start = line.find_first_not_of(" \t");
+  size_t size_end = line.find_first_not_of("0123456789abcdefABCDEF", size_start);
+
+  if (size_end == std::string::npos)
+  {
+    size_end = line.size();
+  }
+
+  if ((size_start == std::string::npos) ||
+      (size_end == size_start) ||
+      (size_end - size_start > 15))
+  {
+    return INVALID;
+  }
+
+  _remaining = strtoull(line.substr(size_start, size_end - size_start).c_str(),
+                        NULL,
+                        16);
+  _state = (_remaining > 0) ? CHUNK_DATA : TRAILER_LINE;
+  return INCOMPLETE;
+}
+
+/*****************************************************************************/
+/* AsyncHttpClient                                                           */
+/*****************************************************************************/
+
+// A request that's being sent.
+struct AsyncHttpClient::Transaction
+{
+  Transaction(AsyncHttpRequest* request, Pool* pool) :
+    request(request),
+    pool(pool),
+    conn(NULL)
+  {}
+
+  AsyncHttpRequest* request;
+  Pool* pool;
+
+  // The connection the request has been given to, or NULL if it's waiting
+  // for one (in which case it's on the pool's waiting list).
+  Connection* conn;
+  std::list<Transaction*>::iterator waiting;
+
+  // The request line and headers. The body is sent straight from the request,
+  // rather than being copied in after them.
+  std::string head;
+
+  std::multimap<uint64_t, Transaction*>::iterator deadline;
+
+  size_t length() const { return head.size() + request->body.size(); }
+};
+
+// A connection to a server.
+struct AsyncHttpClient::Connection
+{
+  Connection(Pool* pool, uint64_t id) :
+    pool(pool),
+    id(id),
+    resolving(false),
+    fd(-1),
+    events(0),
+    connected(false),
+    closed(false),
+    next_target(0),
+    num_written(0),
+    sent(0),
+    num_responses(0),
+    idle(false)
+  {}
+
+  Pool* pool;
+  std::list<Connection*>::iterator pool_entry;
+
+  // The connection's ID, and whether it's waiting for its server to be
+  // resolved (in which case it's not connecting yet).
+  uint64_t id;
+  bool resolving;
+
+  int fd;
+  uint32_t events;
+  bool connected;
+  bool closed;
+
+  // The targets the server resolved to, and the index of the next one to try
+  // if we can't connect to the current one.
+  std::vector<AddrInfo> targets;
+  size_t next_target;
+
+  // The transactions on the connection, in the order they were sent. The
+  // first num_written have been sent in full, and sent bytes of the next one
+  // have been sent.
+  std::deque<Transaction*> transactions;
+  size_t num_written;
+  size_t sent;
+
+  HttpResponseParser parser;
+  uint64_t num_responses;
+
+  // Whether the connection is idle, and if so when it's closed.
+  bool idle;
+  std::list<Connection*>::iterator idle_entry;
+  std::multimap<uint64_t, Connection*>::iterator idle_deadline;
+
+  const AddrInfo& target() const { return targets[next_target - 1]; }
+};
+
+// The connections to a server, and the transactions waiting for one of them.
+struct AsyncHttpClient::Pool
+{
+  std::string server;
+  std::string host;
+  int port;
+
+  std::list<Connection*> connections;
+
+  // The idle connections, with the most recently used last.
+  std::list<Connection*> idle;
+
+  std::list<Transaction*> waiting;
+};
+
+// Split a server into its host and port. The host may be an IPv6 address in
+// square brackets.
+static bool split_server(const std::string& server, std::string& host, int& port)
+{
+  size_t colon;
+  port = 80;
+
+  if ((!server.empty()) && (server[0] == '['))
+  {
+    size_t close = server.find(']');
+
+    if (close == std::string::npos)
+    {
+      return false;
+    }
+
+    host = server.substr(1, close - 1);
+    colon = (close + 1 < server.size()) ? close + 1 : std::string::npos;
+
+    if ((colon != std::string::npos) && (server[colon] != ':'))
+    {
+      return false;
+    }
+  }
+  else
+  {
+    colon = server.find(':');
+    host = server.substr(0, colon);
+  }
+
+  if (colon != std::string::npos)
+  {
+    std::string port_str = server.substr(colon + 1);
+
+    if ((port_str.empty()) ||
+        (port_str.size() > 5) ||
+        (port_str.find_first_not_of("0123456789") != std::string::npos))
+    {
+      return false;
+    }
+
+    port = atoi(port_str.c_str());
+  }
+
+  return (!host.empty()) && (port > 0) && (port <= 65535);
+}
+
+static socklen_t to_sockaddr(const AddrInfo& target, struct sockaddr_storage& addr)
+{
+  memset(&addr, 0, sizeof(addr));
+
+  if (target.address.af == AF_INET6)
+  {
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&addr;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(target.port);
+    sin6->sin6_addr = target.address.addr.ipv6;
+    return sizeof(*sin6);
+  }
+  else
+  {
+    struct sockaddr_in* sin = (struct sockaddr_in*)&addr;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(target.port);
+    sin->sin_addr = target.address.addr.ipv4;
+    return sizeof(*sin);
+  }
+}
+
+AsyncHttpClient::AsyncHttpClient(HttpResolver* resolver,
+                                 const std::string& bind_address,
+                                 int timeout_ms,
+                                 size_t max_in_flight,
+                                 size_t max_connections_per_server,
+                                 int idle_timeout_ms,
+                                 size_t pipeline_depth,
+                                 SNMP::CounterTable* new_connections_table,
+                                 SNMP::CounterTable* reused_connections_table) :
+  _resolver(resolver),
+  _bind_address(bind_address),
+  _timeout_ms(timeout_ms),
+  _max_in_flight(max_in_flight),
+  _max_connections_per_server(std::max(max_connections_per_server, (size_t)1)),
+  _idle_timeout_ms(idle_timeout_ms),
+  _pipeline_depth(std::max(pipeline_depth, (size_t)1)),
+  _new_connections_table(new_connections_table),
+  _reused_connections_table(reused_connections_table),
+  _running(false),
+  _terminated(false),
+  _resolve_queue(1),
+  _next_connection_id(1)
+{
+  _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  _wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if ((_epoll_fd < 0) || (_wake_fd < 0))
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to create HTTP client's event fds: %s", strerror(errno));
+    // LCOV_EXCL_STOP
+  }
+
+  // The wake fd is the only one without a connection.
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _wake_fd, &event);
+}
+
+AsyncHttpClient::~AsyncHttpClient()
+{
+  if (_running)
+  {
+    stop();
+  }
+
+  // Drop anything that's still in flight.
+  for (std::pair<const std::string, Pool*>& entry : _pools)
+  {
+    Pool* pool = entry.second;
+
+    for (Connection* conn : pool->connections)
+    {
+      if (conn->fd >= 0)
+      {
+        ::close(conn->fd);
+      }
+
+      for (Transaction* transaction : conn->transactions)
+      {
+        delete transaction->request;
+        delete transaction;
+      }
+
+      delete conn;
+    }
+
+    for (Transaction* transaction : pool->waiting)
+    {
+      delete transaction->request;
+      delete transaction;
+    }
+
+    delete pool;
+  }
+
+  for (Connection* conn : _closed)
+  {
+    delete conn;
+  }
+
+  std::vector<AsyncHttpRequest*> requests(_waiting.begin(), _waiting.end());
+  _queue.pop_all(requests);
+
+  for (AsyncHttpRequest* request : requests)
+  {
+    delete request;
+  }
+
+  ::close(_wake_fd);
+  ::close(_epoll_fd);
+}
+
+void AsyncHttpClient::start()
+{
+  int rc = pthread_create(&_resolver_thread, NULL, &resolver_entry_point, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start HTTP client resolver thread: %s", strerror(rc));
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  rc = pthread_create(&_thread, NULL, &thread_entry_point, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start HTTP client thread: %s", strerror(rc));
+    _resolve_queue.terminate();
+    pthread_join(_resolver_thread, NULL);
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  _running = true;
+}
+
+void AsyncHttpClient::stop()
+{
+  _terminated.store(true);
+
+  uint64_t value = 1;
+  ssize_t rc = write(_wake_fd, &value, sizeof(value));
+  (void)rc;
+
+  pthread_join(_thread, NULL);
+
+  // This waits for any resolve that's in progress to finish.
+  _resolve_queue.terminate();
+  pthread_join(_resolver_thread, NULL);
+  _running = false;
+}
+
+void AsyncHttpClient::send(AsyncHttpRequest* request)
+{
+  // Only wake the client's thread if it's not already been woken for earlier
+  // requests that it hasn't picked up yet.
+  if (_queue.push(request))
+  {
+    uint64_t value = 1;
+    ssize_t rc = write(_wake_fd, &value, sizeof(value));
+    (void)rc;
+  }
+}
+
+void* AsyncHttpClient::thread_entry_point(void* arg)
+{
+  static_cast<AsyncHttpClient*>(arg)->run();
+  return NULL;
+}
+
+void* AsyncHttpClient::resolver_entry_point(void* arg)
+{
+  static_cast<AsyncHttpClient*>(arg)->run_resolver();
+  return NULL;
+}
+
+void AsyncHttpClient::run_resolver()
+{
+  std::vector<ResolveJob> jobs;
+
+  while (_resolve_queue.pop_batch(jobs, 1))
+  {
+    for (const ResolveJob& job : jobs)
+    {
+      ResolveResult result;
+      result.conn_id = job.conn_id;
+
+      BaseAddrIterator* targets = _resolver->resolve_iter(job.host, job.port, 0);
+      result.targets = targets->take(MAX_TARGETS);
+      delete targets; targets = NULL;
+
+      if (_resolved.push(result))
+      {
+        uint64_t value = 1;
+        ssize_t rc = write(_wake_fd, &value, sizeof(value));
+        (void)rc;
+      }
+    }
+
+    jobs.clear();
+  }
+}
+
+void AsyncHttpClient::run()
+{
+  struct epoll_event events[MAX_EVENTS];
+  std::vector<AsyncHttpRequest*> requests;
+  std::vector<ResolveResult> results;
+
+  while (!_terminated.load())
+  {
+    _resolved.pop_all(results);
+
+    for (const ResolveResult& result : results)
+    {
+      handle_resolved(result);
+    }
+
+    results.clear();
+
+    _queue.pop_all(requests);
+    _waiting.insert(_waiting.end(), requests.begin(), requests.end());
+    requests.clear();
+
+    uint64_t now_ms = Utils::get_time(CLOCK_MONOTONIC);
+    expire(now_ms);
+    start_waiting_requests();
+
+    // Send whatever the pools' connections now have room for. Callbacks go
+    // to a small number of servers, so there are few pools to check.
+    for (std::pair<const std::string, Pool*>& entry : _pools)
+    {
+      if (!entry.second->waiting.empty())
+      {
+        dispatch(entry.second);
+      }
+    }
+
+    // Wait until the next request times out or idle connection is closed,
+    // if nothing happens before then.
+    uint64_t next_deadline_ms = UINT64_MAX;
+
+    if (!_deadlines.empty())
+    {
+      next_deadline_ms = _deadlines.begin()->first;
+    }
+
+    if (!_idle_deadlines.empty())
+    {
+      next_deadline_ms = std::min(next_deadline_ms, _idle_deadlines.begin()->first);
+    }
+
+    int timeout_ms = -1;
+
+    if (next_deadline_ms != UINT64_MAX)
+    {
+      timeout_ms = (next_deadline_ms > now_ms) ? (int)(next_deadline_ms - now_ms) : 0;
+    }
+
+    int num_events = epoll_wait(_epoll_fd, events, MAX_EVENTS, timeout_ms);
+
+    for (int ii = 0; ii < num_events; ++ii)
+    {
+      Connection* conn = static_cast<Connection*>(events[ii].data.ptr);
+
+      if (conn == NULL)
+      {
+        uint64_t value;
+        ssize_t rc = read(_wake_fd, &value, sizeof(value));
+        (void)rc;
+      }
+      else if (!conn->closed)
+      {
+        handle_event(conn, events[ii].events);
+      }
+    }
+
+    for (Connection* conn : _closed)
+    {
+      delete conn;
+    }
+
+    _closed.clear();
+  }
+}
+
+void AsyncHttpClient::start_waiting_requests()
+{
+  while ((!_waiting.empty()) && (_deadlines.size() < _max_in_flight))
+  {
+    AsyncHttpRequest* request = _waiting.front();
+    _waiting.pop_front();
+    start_request(request);
+  }
+}
+
+void AsyncHttpClient::start_request(AsyncHttpRequest* request)
+{
+  if (!request->prepare())
+  {
+    TRC_DEBUG("Unable to send request to %s", request->server.c_str());
+    request->complete(0, "");
+    delete request;
+    return;
+  }
+
+  std::map<std::string, Pool*>::iterator it = _pools.find(request->server);
+  Pool* pool;
+
+  if (it != _pools.end())
+  {
+    pool = it->second;
+  }
+  else
+  {
+    std::string host;
+    int port;
+
+    if (!split_server(request->server, host, port))
+    {
+      TRC_DEBUG("Unable to send request to %s", request->server.c_str());
+      request->complete(0, "");
+      delete request;
+      return;
+    }
+
+    pool = new Pool();
+    pool->server = request->server;
+    pool->host = host;
+    pool->port = port;
+    _pools[request->server] = pool;
+  }
+
+  Transaction* transaction = new Transaction(request, pool);
+  transaction->deadline =
+    _deadlines.emplace(Utils::get_time(CLOCK_MONOTONIC) + _timeout_ms, transaction);
+
+  // Build the request line and headers.
+  std::string& head = transaction->head;
+  head.reserve(256);
+  head.append("POST ").append(request->path).append(" HTTP/1.1\r\n");
+  head.append("Host: ").append(request->server).append("\r\n");
+  head.append("Content-Length: ").append(std::to_string(request->body.size())).append("\r\n");
+
+  for (const std::string& header : request->headers)
+  {
+    head.append(header).append("\r\n");
+  }
+
+  head.append("\r\n");
+
+  transaction->waiting = pool->waiting.insert(pool->waiting.end(), transaction);
+}
+
+void AsyncHttpClient::dispatch(Pool* pool)
+{
+  while (!pool->waiting.empty())
+  {
+    Connection* conn = NULL;
+
+    if (!pool->idle.empty())
+    {
+      // Use the most recently used idle connection, so that if there are more
+      // connections than are needed, the others are left to time out.
+      conn = pool->idle.back();
+
+      if (!is_alive(conn))
+      {
+        // The server has closed the connection, but we've not heard about
+        // it from epoll yet. Requests sent on it would be lost (and may or
+        // may not have been acted on), so use another connection.
+        TRC_DEBUG("Idle connection to %s has been closed", pool->server.c_str());
+        close_connection(conn, false);
+        continue;
+      }
+
+      pool->idle.pop_back();
+      _idle_deadlines.erase(conn->idle_deadline);
+      conn->idle = false;
+    }
+    else if (_pipeline_depth > 1)
+    {
+      // Pipeline the request on the least busy connection that's already
+      // shown it's persistent (by keeping the connection open after a
+      // response).
+      for (Connection* candidate : pool->connections)
+      {
+        if ((candidate->num_responses > 0) &&
+            (candidate->transactions.size() < _pipeline_depth) &&
+            ((conn == NULL) ||
+             (candidate->transactions.size() < conn->transactions.size())))
+        {
+          conn = candidate;
+        }
+      }
+    }
+
+    if (conn != NULL)
+    {
+      if (_reused_connections_table != NULL)
+      {
+        _reused_connections_table->increment();
+      }
+    }
+    else if (pool->connections.size() < _max_connections_per_server)
+    {
+      conn = open_connection(pool);
+    }
+    else
+    {
+      // The pool's connections are all busy, so the rest of the requests have
+      // to wait.
+      return;
+    }
+
+    Transaction* transaction = pool->waiting.front();
+    pool->waiting.pop_front();
+    assign(transaction, conn);
+  }
+}
+
+bool AsyncHttpClient::is_alive(Connection* conn)
+{
+  // The server shouldn't send anything on an idle connection, so if there's
+  // anything to read it's either the connection closing or junk, and either
+  // way the connection can't be used.
+  char c;
+  ssize_t rc = recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return ((rc < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)));
+}
+
+void AsyncHttpClient::assign(Transaction* transaction, Connection* conn)
+{
+  transaction->conn = conn;
+  conn->transactions.push_back(transaction);
+
+  if (conn->connected)
+  {
+    handle_writable(conn);
+  }
+}
+
+AsyncHttpClient::Connection* AsyncHttpClient::open_connection(Pool* pool)
+{
+  Connection* conn = new Connection(pool, _next_connection_id++);
+  conn->pool_entry = pool->connections.insert(pool->connections.end(), conn);
+
+  // Resolve the server on the resolver thread, and only start connecting
+  // once that's done.
+  conn->resolving = true;
+  _resolving[conn->id] = conn;
+
+  ResolveJob job;
+  job.conn_id = conn->id;
+  job.host = pool->host;
+  job.port = pool->port;
+  _resolve_queue.push(job);
+
+  if (_new_connections_table != NULL)
+  {
+    _new_connections_table->increment();
+  }
+
+  return conn;
+}
+
+void AsyncHttpClient::handle_resolved(const ResolveResult& result)
+{
+  std::map<uint64_t, Connection*>::iterator it = _resolving.find(result.conn_id);
+
+  if (it == _resolving.end())
+  {
+    // The connection was closed while its server was being resolved.
+    return;
+  }
+
+  Connection* conn = it->second;
+  _resolving.erase(it);
+  conn->resolving = false;
+  conn->targets = result.targets;
+
+  if (!connect_to_next_target(conn))
+  {
+    // The server can't be reached, so fail everything that's waiting for
+    // it, as well as what's on the connection.
+    TRC_DEBUG("Unable to connect to %s", conn->pool->server.c_str());
+    Pool* pool = conn->pool;
+    close_connection(conn, false);
+
+    while (!pool->waiting.empty())
+    {
+      complete(pool->waiting.front(), 0, "");
+    }
+  }
+}
+
+bool AsyncHttpClient::connect_to_next_target(Connection* conn)
+{
+  while (conn->next_target < conn->targets.size())
+  {
+    const AddrInfo& target = conn->targets[conn->next_target++];
+    int fd = socket(target.address.af,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    0);
+
+    if (fd < 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to create HTTP client socket: %s", strerror(errno));
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Send from the bind address, if it's of the right address family.
+    struct sockaddr_storage local;
+    memset(&local, 0, sizeof(local));
+
+    if (target.address.af == AF_INET6)
+    {
+      struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&local;
+
+      if (inet_pton(AF_INET6, _bind_address.c_str(), &sin6->sin6_addr) == 1)
+      {
+        sin6->sin6_family = AF_INET6;
+        bind(fd, (struct sockaddr*)sin6, sizeof(*sin6));
+      }
+    }
+    else
+    {
+      struct sockaddr_in* sin = (struct sockaddr_in*)&local;
+
+      if ((inet_pton(AF_INET, _bind_address.c_str(), &sin->sin_addr) == 1) &&
+          (sin->sin_addr.s_addr != INADDR_ANY))
+      {
+        sin->sin_family = AF_INET;
+        bind(fd, (struct sockaddr*)sin, sizeof(*sin));
+      }
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = to_sockaddr(target, addr);
+
+    if ((::connect(fd, (struct sockaddr*)&addr, addr_len) == 0) ||
+        (errno == EINPROGRESS))
+    {
+      // Wait until the connection's writable to find out whether it worked.
+      struct epoll_event event;
+      event.events = EPOLLOUT;
+      event.data.ptr = conn;
+      epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+      conn->fd = fd;
+      conn->events = EPOLLOUT;
+      conn->connected = false;
+      return true;
+    }
+
+    TRC_DEBUG("Failed to connect to %s: %s",
+              conn->pool->server.c_str(),
+              strerror(errno));
+    ::close(fd);
+    _resolver->blacklist(target);
+  }
+
+  return false;
+}
+
+void AsyncHttpClient::handle_event(Connection* conn, uint32_t events)
+{
+  if (!conn->connected)
+  {
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+
+    if ((error != 0) || (events & (EPOLLERR | EPOLLHUP)))
+    {
+      TRC_DEBUG("Failed to connect to %s: %s",
+                conn->pool->server.c_str(),
+                strerror(error));
+      _resolver->blacklist(conn->target());
+      ::close(conn->fd);
+      conn->fd = -1;
+
+      if (!connect_to_next_target(conn))
+      {
+        close_connection(conn, false);
+      }
+
+      return;
+    }
+
+    conn->connected = true;
+  }
+
+  if (events & EPOLLOUT)
+  {
+    handle_writable(conn);
+  }
+
+  if ((!conn->closed) && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+  {
+    handle_readable(conn);
+  }
+}
+
+void AsyncHttpClient::handle_writable(Connection* conn)
+{
+  // Write as many of the unsent transactions as we can at once.
+  static const size_t MAX_IOVECS = 32;
+
+  while (conn->num_written < conn->transactions.size())
+  {
+    struct iovec iov[MAX_IOVECS];
+    size_t iov_count = 0;
+    size_t offset = conn->sent;
+
+    for (size_t ii = conn->num_written;
+         (ii < conn->transactions.size()) && (iov_count + 2 <= MAX_IOVECS);
+         ++ii)
+    {
+      const std::string& head = conn->transactions[ii]->head;
+      const SharedString& body = conn->transactions[ii]->request->body;
+
+      if (offset < head.size())
+      {
+        iov[iov_count].iov_base = (void*)(head.data() + offset);
+        iov[iov_count++].iov_len = head.size() - offset;
+        offset = 0;
+      }
+      else
+      {
+        offset -= head.size();
+      }
+
+      if (offset < body.size())
+      {
+        iov[iov_count].iov_base = (void*)(body.data() + offset);
+        iov[iov_count++].iov_len = body.size() - offset;
+      }
+
+      offset = 0;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov_count;
+
+    ssize_t rc = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+
+    if (rc >= 0)
+    {
+      // Work out how far through the transactions this got.
+      size_t sent = conn->sent + rc;
+
+      while ((conn->num_written < conn->transactions.size()) &&
+             (sent >= conn->transactions[conn->num_written]->length()))
+      {
+        sent -= conn->transactions[conn->num_written]->length();
+        conn->num_written++;
+      }
+
+      conn->sent = sent;
+    }
+    else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+    {
+      // Wait until there's space to send the rest.
+      set_events(conn, EPOLLOUT | EPOLLIN);
+      return;
+    }
+    else if (errno != EINTR)
+    {
+      TRC_DEBUG("Failed to send request to %s: %s",
+                conn->pool->server.c_str(),
+                strerror(errno));
+      close_connection(conn, true);
+      return;
+    }
+  }
+
+  set_events(conn, EPOLLIN);
+}
+
+void AsyncHttpClient::handle_readable(Connection* conn)
+{
+  char buffer[READ_BUFFER_SIZE];
+
+  while (true)
+  {
+    ssize_t rc = recv(conn->fd, buffer, sizeof(buffer), 0);
+
+    if ((rc < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+    {
+      return;
+    }
+    else if ((rc < 0) && (errno == EINTR))
+    {
+      continue;
+    }
+    else if (rc <= 0)
+    {
+      // The server's closed the connection (or it's failed). This may be
+      // how the server's ended the response.
+      if ((rc == 0) &&
+          (!conn->transactions.empty()) &&
+          (conn->parser.close() == HttpResponseParser::COMPLETE))
+      {
+        Transaction* transaction = conn->transactions.front();
+        conn->transactions.pop_front();
+
+        if (conn->num_written > 0)
+        {
+          conn->num_written--;
+        }
+        else
+        {
+          conn->sent = 0;
+        }
+
+        _resolver->success(conn->target());
+        complete(transaction, conn->parser.status(), conn->parser.body());
+        conn->parser.reset();
+      }
+
+      close_connection(conn, true);
+      return;
+    }
+
+    // There may be any number of responses in what's been read.
+    size_t offset = 0;
+
+    while (offset < (size_t)rc)
+    {
+      if (conn->transactions.empty())
+      {
+        TRC_DEBUG("Unexpected data from %s", conn->pool->server.c_str());
+        close_connection(conn, false);
+        return;
+      }
+
+      size_t consumed;
+      HttpResponseParser::Result result =
+        conn->parser.parse(buffer + offset, rc - offset, consumed);
+      offset += consumed;
+
+      if (result == HttpResponseParser::INVALID)
+      {
+        TRC_DEBUG("Invalid response from %s", conn->pool->server.c_str());
+        close_connection(conn, false);
+        return;
+      }
+      else if (result == HttpResponseParser::COMPLETE)
+      {
+        // The response is for the oldest transaction. If the server has
+        // responded before all of the request was sent, the connection can't
+        // be used any more.
+        Transaction* transaction = conn->transactions.front();
+        conn->transactions.pop_front();
+
+        bool keep_alive = (conn->parser.keep_alive() && (conn->num_written > 0));
+
+        if (conn->num_written > 0)
+        {
+          conn->num_written--;
+        }
+        else
+        {
+          conn->sent = 0;
+        }
+
+        conn->num_responses++;
+        _resolver->success(conn->target());
+        complete(transaction, conn->parser.status(), conn->parser.body());
+        conn->parser.reset();
+
+        if (!keep_alive)
+        {
+          close_connection(conn, true);
+          return;
+        }
+      }
+    }
+
+    if (conn->transactions.empty())
+    {
+      // Anything else the server sends before the connection's reused is
+      // unexpected, and is picked up when epoll reports it.
+      make_idle(conn);
+      return;
+    }
+  }
+}
+
+void AsyncHttpClient::complete(Transaction* transaction,
+                               HTTPCode rc,
+                               const std::string& body)
+{
+  _deadlines.erase(transaction->deadline);
+
+  if (transaction->conn == NULL)
+  {
+    transaction->pool->waiting.erase(transaction->waiting);
+  }
+
+  transaction->request->complete(rc, body);
+  delete transaction->request;
+  delete transaction;
+}
+
+void AsyncHttpClient::close_connection(Connection* conn, bool retry)
+{
+  Pool* pool = conn->pool;
+
+  if (conn->fd >= 0)
+  {
+    // Closing the socket also removes it from epoll.
+    ::close(conn->fd);
+    conn->fd = -1;
+  }
+
+  if (conn->idle)
+  {
+    pool->idle.erase(conn->idle_entry);
+    _idle_deadlines.erase(conn->idle_deadline);
+    conn->idle = false;
+  }
+
+  if (conn->resolving)
+  {
+    _resolving.erase(conn->id);
+    conn->resolving = false;
+  }
+
+  pool->connections.erase(conn->pool_entry);
+  conn->closed = true;
+  _closed.push_back(conn);
+
+  // Work out what to do with the transactions that were on the connection.
+  // Any that the server has been sent some of may have been acted on, so
+  // sending them again could repeat them, and they fail. The rest never left
+  // this client, so they're sent again on another connection (unless the
+  // server's failed, in which case they'd just fail there too).
+  std::deque<Transaction*> transactions;
+  transactions.swap(conn->transactions);
+  std::list<Transaction*>::iterator insert_at = pool->waiting.begin();
+
+  for (size_t ii = 0; ii < transactions.size(); ++ii)
+  {
+    Transaction* transaction = transactions[ii];
+    bool unsent = ((ii > conn->num_written) ||
+                   ((ii == conn->num_written) && (conn->sent == 0)));
+
+    if ((retry) && (unsent))
+    {
+      transaction->conn = NULL;
+      transaction->waiting = pool->waiting.insert(insert_at, transaction);
+    }
+    else
+    {
+      complete(transaction, 0, "");
+    }
+  }
+}
+
+void AsyncHttpClient::make_idle(Connection* conn)
+{
+  if (_idle_timeout_ms <= 0)
+  {
+    close_connection(conn, false);
+    return;
+  }
+
+  conn->idle = true;
+  conn->idle_entry = conn->pool->idle.insert(conn->pool->idle.end(), conn);
+  conn->idle_deadline =
+    _idle_deadlines.emplace(Utils::get_time(CLOCK_MONOTONIC) + _idle_timeout_ms, conn);
+}
+
+void AsyncHttpClient::set_events(Connection* conn, uint32_t events)
+{
+  if (conn->events != events)
+  {
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = conn;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    conn->events = events;
+  }
+}
+
+void AsyncHttpClient::expire(uint64_t now_ms)
+{
+  while ((!_deadlines.empty()) && (_deadlines.begin()->first <= now_ms))
+  {
+    Transaction* transaction = _deadlines.begin()->second;
+
+    if (transaction->conn != NULL)
+    {
+      // The response will never be matched up with the request now, so the
+      // connection can't be used any more.
+      close_connection(transaction->conn, true);
+    }
+
+    // The transaction may have been sent again when the connection closed,
+    // in which case it's now waiting for another connection.
+    if ((!_deadlines.empty()) && (_deadlines.begin()->second == transaction))
+    {
+      TRC_DEBUG("Request to %s timed out", transaction->pool->server.c_str());
+      complete(transaction, 0, "");
+    }
+  }
+
+  while ((!_idle_deadlines.empty()) && (_idle_deadlines.begin()->first <= now_ms))
+  {
+    close_connection(_idle_deadlines.begin()->second, false);
+  }
+}
@@ -0,0 +1,276 @@
+/**
+ * @file batch_hash.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "batch_hash.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BATCH_HASH_X86
+#endif
+
+// MurmurHash3_x86_32 on an 8 byte key is two rounds of mixing a 4 byte block
+// of the key into the hash, then the finalization. The blocks are mixed with
+// constants before going into the hash, and this doesn't depend on the seed,
+// so each key's blocks are only mixed once however many seeds it's hashed
+// with.
+static const uint32_t C1 = 0xcc9e2d51;
+static const uint32_t C2 = 0x1b873593;
+static const uint32_t C3 = 0xe6546b64;
+static const uint32_t F1 = 0x85ebca6b;
+static const uint32_t F2 = 0xc2b2ae35;
+static const uint32_t KEY_LEN = sizeof(uint64_t);
+
+static inline uint32_t rotl32(uint32_t x, int r)
+{
+  return (x << r) | (x >> (32 - r));
+}
+
+static inline uint32_t mix_block(uint32_t k)
+{
+  return rotl32(k * C1, 15) * C2;
+}
+
+static inline uint32_t mix_hash(uint32_t h, uint32_t k)
+{
+  return rotl32(h ^ k, 13) * 5 + C3;
+}
+
+static inline uint32_t fmix32(uint32_t h)
+{
+  h ^= h >> 16;
+  h *= F1;
+  h ^= h >> 13;
+  h *= F2;
+  h ^= h >> 16;
+  return h;
+}
+
+// Each implementation hashes the keys from first onwards (leaving the hashes
+// for earlier keys alone), and returns the index of the first key it didn't
+// hash. This one hashes the keys one at a time, so does them all.
+static size_t murmur3_32_scalar(const uint64_t* keys,
+                                size_t first,
+                                size_t num_keys,
+                                const uint32_t* seeds,
+                                size_t num_seeds,
+                                uint32_t* hashes)
+{
+  for (size_t jj = first; jj < num_keys; ++jj)
+  {
+    // Murmur reads the key as blocks in the machine's byte order.
+    uint32_t blocks[2];
+    memcpy(blocks, &keys[jj], sizeof(blocks));
+    uint32_t k1 = mix_block(blocks[0]);
+    uint32_t k2 = mix_block(blocks[1]);
+
+    for (size_t ii = 0; ii < num_seeds; ++ii)
+    {
+      uint32_t h = mix_hash(mix_hash(seeds[ii], k1), k2);
+      hashes[(ii * num_keys) + jj] = fmix32(h ^ KEY_LEN);
+    }
+  }
+
+  return num_keys;
+}
+
+#ifdef BATCH_HASH_X86
+
+// The SIMD implementations below hash a group of keys at a time (one per
+// lane) with each seed in turn. They're compiled for their instruction sets
+// regardless of the flags the rest of the code is built with, and only used
+// if the CPU supports them.
+
+#define ROTL_128(X, R) _mm_or_si128(_mm_slli_epi32((X), (R)), \
+                                    _mm_srli_epi32((X), 32 - (R)))
+
+__attribute__((target("sse4.1")))
+static size_t murmur3_32_sse41(const uint64_t* keys,
+                               size_t first,
+                               size_t num_keys,
+                               const uint32_t* seeds,
+                               size_t num_seeds,
+                               uint32_t* hashes)
+{
+  const size_t LANES = 4;
+  const __m128i c1 = _mm_set1_epi32(C1);
+  const __m128i c2 = _mm_set1_epi32(C2);
+  const __m128i c3 = _mm_set1_epi32(C3);
+  const __m128i f1 = _mm_set1_epi32(F1);
+  const __m128i f2 = _mm_set1_epi32(F2);
+  const __m128i len = _mm_set1_epi32(KEY_LEN);
+  size_t jj = first;
+
+  for (; jj + LANES <= num_keys; jj += LANES)
+  {
+    // Split the keys into their low and high blocks.
+    __m128i a = _mm_loadu_si128((const __m128i*)&keys[jj]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&keys[jj + 2]);
+    __m128i lo = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a),
+                                                 _mm_castsi128_ps(b),
+                                                 _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i hi = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a),
+                                                 _mm_castsi128_ps(b),
+                                                 _MM_SHUFFLE(3, 1, 3, 1)));
+
+    __m128i k1 = _mm_mullo_epi32(lo, c1);
+    k1 = _mm_mullo_epi32(ROTL_128(k1, 15), c2);
+    __m128i k2 = _mm_mullo_epi32(hi, c1);
+    k2 = _mm_mullo_epi32(ROTL_128(k2, 15), c2);
+
+    for (size_t ii = 0; ii < num_seeds; ++ii)
+    {
+      __m128i h = _mm_set1_epi32(seeds[ii]);
+
+      // h = rotl(h ^ k, 13) * 5 + C3, for each block.
+      h = ROTL_128(_mm_xor_si128(h, k1), 13);
+      h = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(h, 2), h), c3);
+      h = ROTL_128(_mm_xor_si128(h, k2), 13);
+      h = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(h, 2), h), c3);
+
+      h = _mm_xor_si128(h, len);
+      h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+      h = _mm_mullo_epi32(h, f1);
+      h = _mm_xor_si128(h, _mm_srli_epi32(h, 13));
+      h = _mm_mullo_epi32(h, f2);
+      h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+
+      _mm_storeu_si128((__m128i*)&hashes[(ii * num_keys) + jj], h);
+    }
+  }
+
+  return jj;
+}
+
+#define ROTL_256(X, R) _mm256_or_si256(_mm256_slli_epi32((X), (R)), \
+                                       _mm256_srli_epi32((X), 32 - (R)))
+
+__attribute__((target("avx2")))
+static size_t murmur3_32_avx2(const uint64_t* keys,
+                              size_t first,
+                              size_t num_keys,
+                              const uint32_t* seeds,
+                              size_t num_seeds,
+                              uint32_t* hashes)
+{
+  const size_t LANES = 8;
+  const __m256i c1 = _mm256_set1_epi32(C1);
+  const __m256i c2 = _mm256_set1_epi32(C2);
+  const __m256i c3 = _mm256_set1_epi32(C3);
+  const __m256i f1 = _mm256_set1_epi32(F1);
+  const __m256i f2 = _mm256_set1_epi32(F2);
+  const __m256i len = _mm256_set1_epi32(KEY_LEN);
+
+  // Shuffling within each 128-bit half leaves the blocks of keys 0, 1, 4, 5,
+  // 2, 3, 6, 7 in that order, so this puts them back in key order.
+  const __m256i unshuffle = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+  size_t jj = first;
+
+  for (; jj + LANES <= num_keys; jj += LANES)
+  {
+    __m256 a = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)&keys[jj]));
+    __m256 b = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)&keys[jj + 4]));
+    __m256i lo = _mm256_permutevar8x32_epi32(
+                   _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))),
+                   unshuffle);
+    __m256i hi = _mm256_permutevar8x32_epi32(
+                   _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))),
+                   unshuffle);
+
+    __m256i k1 = _mm256_mullo_epi32(lo, c1);
+    k1 = _mm256_mullo_epi32(ROTL_256(k1, 15), c2);
+    __m256i k2 = _mm256_mullo_epi32(hi, c1);
+    k2 = _mm256_mullo_epi32(ROTL_256(k2, 15), c2);
+
+    for (size_t ii = 0; ii < num_seeds; ++ii)
+    {
+      __m256i h = _mm256_set1_epi32(seeds[ii]);
+
+      h = ROTL_256(_mm256_xor_si256(h, k1), 13);
+      h = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(h, 2), h), c3);
+      h = ROTL_256(_mm256_xor_si256(h, k2), 13);
+      h = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(h, 2), h), c3);
+
+      h = _mm256_xor_si256(h, len);
+      h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+      h = _mm256_mullo_epi32(h, f1);
+      h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+      h = _mm256_mullo_epi32(h, f2);
+      h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+
+      _mm256_storeu_si256((__m256i*)&hashes[(ii * num_keys) + jj], h);
+    }
+  }
+
+  return jj;
+}
+
+#endif
+
+BatchHash::Implementation BatchHash::best_implementation()
+{
+#ifdef BATCH_HASH_X86
+  static const Implementation best = []()
+  {
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+      return AVX2;
+    }
+    else if (__builtin_cpu_supports("sse4.1"))
+    {
+      return SSE41;
+    }
+
+    return SCALAR;
+  }();
+
+  return best;
+#else
+  return SCALAR;
+#endif
+}
+
+void BatchHash::murmur3_32(const uint64_t* keys,
+                           size_t num_keys,
+                           const uint32_t* seeds,
+                           size_t num_seeds,
+                           uint32_t* hashes)
+{
+  murmur3_32(keys, num_keys, seeds, num_seeds, hashes, best_implementation());
+}
+
+void BatchHash::murmur3_32(const uint64_t* keys,
+                           size_t num_keys,
+                           const uint32_t* seeds,
+                           size_t num_seeds,
+                           uint32_t* hashes,
+                           Implementation implementation)
+{
+  size_t done = 0;
+
+#ifdef BATCH_HASH_X86
+  if (implementation == AVX2)
+  {
+    done = murmur3_32_avx2(keys, done, num_keys, seeds, num_seeds, hashes);
+  }
+
+  // Use SSE for any keys left over from AVX, as it has half as many lanes.
+  if (implementation >= SSE41)
+  {
+    done = murmur3_32_sse41(keys, done, num_keys, seeds, num_seeds, hashes);
+  }
+#endif
+
+  murmur3_32_scalar(keys, done, num_keys, seeds, num_seeds, hashes);
+}
@@ -13,6 +13,7 @@
 #include "sasevent.h"
 #include "globals.h"
 #include "chronos_gr_connection.h"
+#include "constants.h"
 
 ChronosGRConnection::ChronosGRConnection(const std::string& remote_site,
                                          HttpResolver* resolver,
@@ -46,11 +47,13 @@ ChronosGRConnection::~ChronosGRConnection()
   delete _http_client; _http_client = nullptr;
 }
 
-void ChronosGRConnection::send_put(std::string url,
-                                   std::string body)
+void ChronosGRConnection::send_put(const std::string& url,
+                                   const std::string& body,
+                                   const std::string& content_type)
 {
   HttpResponse resp = _http_conn->create_request(HttpClient::RequestType::PUT, url)
     .set_body(body)
+    .add_header(std::string(HEADER_CONTENT_TYPE) + ": " + content_type)
     .send();
   HTTPCode rc = resp.get_rc();
 
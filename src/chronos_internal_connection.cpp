@@ -11,6 +11,7 @@
 
 #include <string>
 #include <map>
+#include <memory>
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/document.h"
@@ -155,6 +156,10 @@ HTTPCode ChronosInternalConnection::resynchronise_with_single_node(
   std::string cluster_view_id;
   __globals->get_cluster_view_id(cluster_view_id);
 
+  // The local address is compared against each timer's replicas, so intern it
+  // up front.
+  InternedString interned_localhost(localhost);
+
   uint32_t current_time = Utils::get_time();
   uint32_t time_from = 0;
   bool use_time_from_param = false;
@@ -179,9 +184,10 @@ HTTPCode ChronosInternalConnection::resynchronise_with_single_node(
     if ((rc == HTTP_PARTIAL_CONTENT) ||
         (rc == HTTP_OK))
     {
-      // Parse the GET response
+      // Parse the GET response. This is parsed in place, as the response
+      // isn't needed afterwards and can hold the opaque data for many timers.
       rapidjson::Document doc;
-      doc.Parse<0>(response.c_str());
+      doc.ParseInsitu<0>(&response[0]);
 
       if (doc.HasParseError())
       {
@@ -215,7 +221,7 @@ HTTPCode ChronosInternalConnection::resynchronise_with_single_node(
             JSON_GET_INT_64_MEMBER(id_arr, JSON_TIMER_ID, timer_id);
 
             // Get the old replicas
-            std::vector<std::string> old_replicas;
+            InternedStringList old_replicas;
             JSON_ASSERT_CONTAINS(id_arr, JSON_OLD_REPLICAS);
             JSON_ASSERT_ARRAY(id_arr[JSON_OLD_REPLICAS]);
             const rapidjson::Value& old_repl_arr = id_arr[JSON_OLD_REPLICAS];
@@ -265,11 +271,11 @@ HTTPCode ChronosInternalConnection::resynchronise_with_single_node(
             // Decide what we're going to do with this timer.
             int old_level = 0;
             bool in_old_replica_list = get_replica_level(old_level,
-                                                         localhost,
+                                                         interned_localhost,
                                                          old_replicas);
             int new_level = 0;
             bool in_new_replica_list = get_replica_level(new_level,
-                                                         localhost,
+                                                         interned_localhost,
                                                          timer->replicas);
 
             // Add the timer to the delete map we're building up
@@ -294,9 +300,12 @@ HTTPCode ChronosInternalConnection::resynchronise_with_single_node(
                 store_timer = true;
               }
 
-              // Now loop through the new replicas.
+              // Now loop through the new replicas. The timer is sent to each
+              // of them with the same body (until the end of this block,
+              // before the timer is added to the store).
+              ReplicationBodies bodies(timer);
               int index = 0;
-              for (std::vector<std::string>::iterator it = timer->replicas.begin();
+              for (InternedStringList::iterator it = timer->replicas.begin();
                                                       it != timer->replicas.end();
                                                       ++it, ++index)
               {
@@ -328,9 +337,13 @@ HTTPCode ChronosInternalConnection::resynchronise_with_single_node(
 
               // Now loop through the old replicas. We can send a tombstone
               // replication to any node that used to be a replica and was
-              // higher in the replica list than the new replica.
+              // higher in the replica list than the new replica. The same
+              // tombstone (and body) is sent to each of them, so it's only
+              // built the first time it's needed.
+              std::unique_ptr<Timer> tombstone;
+              std::unique_ptr<ReplicationBodies> tombstone_bodies;
               index = 0;
-              for (std::vector<std::string>::iterator it = old_replicas.begin();
+              for (InternedStringList::iterator it = old_replicas.begin();
                                                       it != old_replicas.end();
                                                       ++it, ++index)
               {
@@ -342,10 +355,14 @@ HTTPCode ChronosInternalConnection::resynchronise_with_single_node(
 
                   if (!old_rep_in_new_rep)
                   {
-                    Timer* timer_copy = new Timer(*timer);
-                    timer_copy->become_tombstone();
-                    _replicator->replicate_timer_to_node(timer_copy, *it);
-                    delete timer_copy; timer_copy = NULL;
+                    if (tombstone == nullptr)
+                    {
+                      tombstone.reset(new Timer(*timer));
+                      tombstone->become_tombstone();
+                      tombstone_bodies.reset(new ReplicationBodies(tombstone.get()));
+                    }
+
+                    _replicator->replicate_timer_to_node(tombstone.get(), *it);
                   }
                 }
               }
@@ -523,18 +540,18 @@ std::string ChronosInternalConnection::create_delete_body(std::map<TimerID, int>
   return sb.GetString();
 }
 
-bool ChronosInternalConnection::get_replica_presence(std::string current_node,
-                                                     std::vector<std::string> replicas)
+bool ChronosInternalConnection::get_replica_presence(const InternedString& current_node,
+                                                     const InternedStringList& replicas)
 {
   int unused_index;
   return get_replica_level(unused_index, current_node, replicas);
 }
 
 bool ChronosInternalConnection::get_replica_level(int& index,
-                                                  std::string current_node,
-                                                  std::vector<std::string> replicas)
+                                                  const InternedString& current_node,
+                                                  const InternedStringList& replicas)
 {
-  for (std::vector<std::string>::iterator it = replicas.begin();
+  for (InternedStringList::const_iterator it = replicas.begin();
                                           it != replicas.end();
                                           ++it, ++index)
   {
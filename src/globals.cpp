@@ -14,6 +14,7 @@
 #include "log.h"
 #include "chronos_pd_definitions.h"
 #include "utils.h"
+#include "snmp_counter_table.h"
 
 #include <fstream>
 #include <syslog.h>
@@ -31,9 +32,18 @@ Globals::Globals(std::string local_config_file,
                  std::string shared_config_file) :
   _local_config_file(local_config_file),
   _cluster_config_file(cluster_config_file),
-  _shared_config_file(shared_config_file)
+  _shared_config_file(shared_config_file),
+  _config_generation(1),
+  _cluster_config(),
+  _published_generation(0),
+  _config_reads_table(NULL)
 {
   pthread_rwlock_init(&_lock, NULL);
+  pthread_mutex_init(&_config_change_handler_lock, NULL);
+
+  // Publish a snapshot of the (empty) configuration, so there's always one
+  // to read.
+  publish_cluster_config();
 
   // Describe the configuration file format.
   _desc.add_options()
@@ -49,6 +59,12 @@ Globals::Globals(std::string local_config_file,
     ("logging.level", po::value<int>()->default_value(2), "Logging level: 1(lowest) - 5(highest)")
     ("http.threads", po::value<int>()->default_value(50), "Number of HTTP threads (for incoming requests) to create")
     ("http.gr_threads", po::value<int>()->default_value(50), "Number of HTTP threads (for GR replication) to create")
+    ("http.binary_replication", po::value<bool>()->default_value(false), "Whether timers are replicated to other Chronos nodes in the compact binary format, rather than as JSON")
+    ("timers.shards", po::value<int>()->default_value(1), "Number of shards to split timers across. Each shard has its own lock and thread for popping timers")
+    ("timers.queue_adds", po::value<bool>()->default_value(false), "Whether HTTP threads queue new and updated timers for the shards' threads to add, rather than taking the shards' locks themselves")
+    ("callbacks.connections_per_host", po::value<int>()->default_value(400), "Maximum number of connections to each host that timer callbacks are sent to")
+    ("callbacks.idle_timeout", po::value<int>()->default_value(30000), "Time (in milliseconds) before an idle callback connection is closed. 0 closes connections after each callback")
+    ("callbacks.pipeline_depth", po::value<int>()->default_value(1), "Maximum number of callbacks in flight on each connection. 1 disables pipelining")
     ("exceptions.max_ttl", po::value<int>()->default_value(600), "Maximum time before the process exits after hitting an exception")
     ("sites.local_site", po::value<std::string>()->default_value("site1"), "The name of the local site")
     ("sites.remote_site", po::value<std::vector<std::string>>()->multitoken()->default_value(std::vector<std::string>(), "SITE"), "The name and address of the remote sites in the cluster")
@@ -75,6 +91,7 @@ Globals::~Globals()
 #ifndef UNIT_TEST
   delete _updater;
 #endif
+  pthread_mutex_destroy(&_config_change_handler_lock);
   pthread_rwlock_destroy(&_lock);
 }
 
@@ -152,6 +169,49 @@ void Globals::update_config()
   set_gr_threads(gr_threads);
   TRC_STATUS("HTTP GR Threads: %d", gr_threads);
 
+  bool binary_replication = conf_map["http.binary_replication"].as<bool>();
+  set_binary_replication(binary_replication);
+  TRC_STATUS("Timers will be replicated %s",
+             (binary_replication ? "in binary" : "as JSON"));
+
+  int timer_shards = conf_map["timers.shards"].as<int>();
+  if (timer_shards < 1)
+  {
+    TRC_WARNING("Invalid number of timer shards (%d), using 1", timer_shards);
+    timer_shards = 1;
+  }
+  set_timer_shards(timer_shards);
+  TRC_STATUS("Timer shards: %d", timer_shards);
+
+  bool queue_timer_adds = conf_map["timers.queue_adds"].as<bool>();
+  set_queue_timer_adds(queue_timer_adds);
+  TRC_STATUS("New timers are %squeued for the timer shards' threads",
+             (queue_timer_adds ? "" : "not "));
+
+  int callback_connections_per_host = conf_map["callbacks.connections_per_host"].as<int>();
+  if (callback_connections_per_host < 1)
+  {
+    TRC_WARNING("Invalid number of callback connections per host (%d), using 1",
+                callback_connections_per_host);
+    callback_connections_per_host = 1;
+  }
+  set_callback_connections_per_host(callback_connections_per_host);
+  TRC_STATUS("Callback connections per host: %d", callback_connections_per_host);
+
+  int callback_idle_timeout = conf_map["callbacks.idle_timeout"].as<int>();
+  set_callback_idle_timeout(callback_idle_timeout);
+  TRC_STATUS("Callback connection idle timeout: %dms", callback_idle_timeout);
+
+  int callback_pipeline_depth = conf_map["callbacks.pipeline_depth"].as<int>();
+  if (callback_pipeline_depth < 1)
+  {
+    TRC_WARNING("Invalid callback pipeline depth (%d), using 1",
+                callback_pipeline_depth);
+    callback_pipeline_depth = 1;
+  }
+  set_callback_pipeline_depth(callback_pipeline_depth);
+  TRC_STATUS("Callback pipeline depth: %d", callback_pipeline_depth);
+
   int ttl = conf_map["exceptions.max_ttl"].as<int>();
   set_max_ttl(ttl);
   TRC_STATUS("Maximum post-exception TTL: %d", ttl);
@@ -316,6 +376,64 @@ void Globals::update_config()
   set_remote_site_dns_records(remote_site_dns_records);
 
   unlock();
+
+  pthread_mutex_lock(&_config_change_handler_lock);
+
+  if (_config_change_handler)
+  {
+    _config_change_handler();
+  }
+
+  pthread_mutex_unlock(&_config_change_handler_lock);
+}
+
+void Globals::set_config_change_handler(std::function<void()> handler)
+{
+  pthread_mutex_lock(&_config_change_handler_lock);
+  _config_change_handler = handler;
+  pthread_mutex_unlock(&_config_change_handler_lock);
+}
+
+void Globals::publish_cluster_config()
+{
+  std::shared_ptr<ClusterConfig> config(new ClusterConfig());
+
+  config->generation = _config_generation;
+  config->cluster_local_ip = _cluster_local_ip;
+  config->cluster_view_id = _cluster_view_id;
+
+  config->new_cluster = _cluster_staying_addresses;
+  config->new_cluster.insert(config->new_cluster.end(),
+                             _cluster_joining_addresses.begin(),
+                             _cluster_joining_addresses.end());
+  config->new_cluster_hashes = _new_cluster_hashes;
+  config->old_cluster = _cluster_staying_addresses;
+  config->old_cluster.insert(config->old_cluster.end(),
+                             _cluster_leaving_addresses.begin(),
+                             _cluster_leaving_addresses.end());
+  config->old_cluster_hashes = _old_cluster_hashes;
+
+  config->local_site_name = _local_site_name;
+  config->remote_site_names = _remote_site_names;
+
+  config->bind_port = _bind_port;
+  config->instance_id = _instance_id;
+  config->deployment_id = _deployment_id;
+
+  // Readers that still hold the previous snapshot keep it alive until
+  // they're done with it.
+  std::atomic_store(&_cluster_config, ClusterConfigPtr(config));
+  _published_generation.store(config->generation, std::memory_order_release);
+}
+
+void Globals::count_locked_read()
+{
+  SNMP::CounterTable* table = _config_reads_table.load(std::memory_order_relaxed);
+
+  if (table != NULL)
+  {
+    table->increment();
+  }
 }
 
 // Generates the pre-calculated bloom filter for the given string.
@@ -11,6 +11,7 @@
 
 #include "gr_replicator.h"
 #include "globals.h"
+#include "constants.h"
 #include <pthread.h>
 
 GRReplicator::GRReplicator(HttpResolver* http_resolver,
@@ -21,6 +22,8 @@ GRReplicator::GRReplicator(HttpResolver* http_resolver,
   _exception_handler(exception_handler),
   _gr_threads(gr_threads)
 {
+  __globals->get_binary_replication(_binary);
+
   std::vector<std::string> remote_site_dns_records;
   __globals->get_remote_site_dns_records(remote_site_dns_records);
 
@@ -77,16 +80,17 @@ void* GRReplicator::worker_thread_entry_point(void* arg)
 // Handle the replication of the timer to other sites
 void GRReplicator::replicate(Timer* timer)
 {
-  // Create the JSON body - strip out any replica information
-  Timer timer_copy(*timer);
-  std::string url = timer_copy.url();
-  timer_copy.replicas.clear();
-  std::string body = timer_copy.to_json();
+  // Create the body once for all the sites - without any replica
+  // information, as each site works out its own replicas
+  std::string url = timer->url();
+  std::shared_ptr<const std::string> body = timer->replication_body(_binary, false);
+  const char* content_type = _binary ? CONTENT_TYPE_BINARY_TIMER :
+                                       CONTENT_TYPE_JSON;
 
   for (ChronosGRConnection* conn : _connections)
   {
     GRReplicationRequest* replication_request =
-                                      new GRReplicationRequest(conn, url, body);
+                    new GRReplicationRequest(conn, url, body, content_type);
     _q.push(replication_request);
   }
 }
@@ -100,7 +104,8 @@ void GRReplicator::worker_thread_entry_point()
     CW_TRY
     {
       replication_request->_connection->send_put(replication_request->_url,
-                                                 replication_request->_body);
+                                                 *replication_request->_body,
+                                                 replication_request->_content_type);
     }
     // LCOV_EXCL_START - No exception testing in UT
     CW_EXCEPT(_exception_handler)
@@ -82,17 +82,32 @@ void ControllerTask::add_or_update_timer(TimerID timer_id,
   }
   else
   {
-    // Create a timer from the JSON body. This also works out whether the
-    // timer has already been replicated within/cross-site.
+    // Create a timer from the body. This also works out whether the timer
+    // has already been replicated within/cross-site. Other Chronos nodes may
+    // send the timer in the binary format rather than as JSON.
     std::string body = _req.get_rx_body();
     std::string error_str;
-    timer = Timer::from_json(timer_id,
-                             replication_factor,
-                             replica_hash,
-                             body,
-                             error_str,
-                             replicated_timer,
-                             gr_replicated_timer);
+
+    if (is_binary_timer())
+    {
+      timer = Timer::from_binary(timer_id,
+                                 replication_factor,
+                                 replica_hash,
+                                 body,
+                                 error_str,
+                                 replicated_timer,
+                                 gr_replicated_timer);
+    }
+    else
+    {
+      timer = Timer::from_json(timer_id,
+                               replication_factor,
+                               replica_hash,
+                               std::move(body),
+                               error_str,
+                               replicated_timer,
+                               gr_replicated_timer);
+    }
 
     if (!timer)
     {
@@ -115,6 +130,8 @@ void ControllerTask::add_or_update_timer(TimerID timer_id,
   // first Chronos in this site to handle the request
   if (!replicated_timer)
   {
+    // The replicators share the bodies they send.
+    ReplicationBodies bodies(timer);
     _cfg->_replicator->replicate(timer);
 
     // Replicate the timer cross site if this is the first Chronos in this
@@ -128,15 +145,12 @@ void ControllerTask::add_or_update_timer(TimerID timer_id,
 
   // If the timer belongs to the local node, store it. Otherwise, turn it into
   // a tombstone.
-  std::string localhost;
-  __globals->get_cluster_local_ip(localhost);
-
-  if (!timer->is_local(localhost))
+  if (!timer->is_local(__globals->get_cluster_config()->cluster_local_ip))
   {
     timer->become_tombstone();
   }
 
-  _cfg->_handler->add_timer(timer);
+  _cfg->_handler->queue_timer(timer);
 
   // The store takes ownership of the timer.
   timer = NULL;
@@ -210,6 +224,14 @@ void ControllerTask::handle_get()
   send_http_reply(rc);
 }
 
+bool ControllerTask::is_binary_timer()
+{
+  // Ignore any parameters on the content type.
+  std::string content_type = _req.header(HEADER_CONTENT_TYPE);
+  return (content_type.substr(0, content_type.find(';')) ==
+          CONTENT_TYPE_BINARY_TIMER);
+}
+
 bool ControllerTask::node_is_in_cluster(std::string node_for_replicas)
 {
   // Check the requesting node is a Chronos node
@@ -13,12 +13,311 @@
 #include "log.h"
 #include "globals.h"
 
+#include "rapidjson/document.h"
+#include "rapidjson/writer.h"
+
+#include <algorithm>
 #include <cstring>
+#include <strings.h>
+#include <unordered_map>
+
+// Whether the data is valid UTF-8 (as defined by RFC 3629). Overlong
+// encodings, UTF-16 surrogates and code points above U+10FFFF are all invalid.
+static bool is_valid_utf8(const char* data, size_t size)
+{
+  size_t ii = 0;
+
+  while (ii < size)
+  {
+    unsigned char byte = data[ii];
+
+    if (byte < 0x80)
+    {
+      ++ii;
+      continue;
+    }
+
+    // Work out the length of the sequence from its first byte, and the range
+    // its second byte must be in. The narrower ranges rule out overlong
+    // encodings, surrogates and code points that are too large.
+    size_t length;
+    unsigned char min = 0x80;
+    unsigned char max = 0xBF;
+
+    if ((byte >= 0xC2) && (byte <= 0xDF))
+    {
+      length = 2;
+    }
+    else if ((byte >= 0xE0) && (byte <= 0xEF))
+    {
+      length = 3;
+      min = (byte == 0xE0) ? 0xA0 : 0x80;
+      max = (byte == 0xED) ? 0x9F : 0xBF;
+    }
+    else if ((byte >= 0xF0) && (byte <= 0xF4))
+    {
+      length = 4;
+      min = (byte == 0xF0) ? 0x90 : 0x80;
+      max = (byte == 0xF4) ? 0x8F : 0xBF;
+    }
+    else
+    {
+      return false;
+    }
+
+    if ((size - ii < length) ||
+        ((unsigned char)data[ii + 1] < min) ||
+        ((unsigned char)data[ii + 1] > max))
+    {
+      return false;
+    }
+
+    // The remaining bytes are all continuation bytes.
+    for (size_t jj = 2; jj < length; ++jj)
+    {
+      if (((unsigned char)data[ii + jj] & 0xC0) != 0x80)
+      {
+        return false;
+      }
+    }
+
+    ii += length;
+  }
+
+  return true;
+}
+
+// Whether a popped timer's callback should be sent in a batch. Batches are
+// JSON, so can only hold opaque data that's valid UTF-8 - any other callbacks
+// are sent on their own, just as if the client didn't accept batches.
+static bool send_in_batch(const Timer* timer)
+{
+  if (!timer->batch_callback)
+  {
+    return false;
+  }
+
+  if (!is_valid_utf8(timer->callback_body.data(), timer->callback_body.size()))
+  {
+    TRC_DEBUG("Opaque data for timer %lu isn't valid UTF-8, so not batching it",
+              timer->id);
+    return false;
+  }
+
+  return true;
+}
+
+// The callback for a popped timer, sent by one of the event loops.
+class HTTPCallback::Request : public AsyncHttpRequest
+{
+public:
+  Request(HTTPCallback* callback, Timer* timer) :
+    _callback(callback),
+    _timer(timer),
+    _timer_id(timer->id)
+  {}
+
+  ~Request()
+  {
+    // The timer is only still here if the request was never sent.
+    delete _timer; _timer = NULL;
+  }
+
+  bool prepare()
+  {
+    // Pull out the timer details for use in the request. The URL and opaque
+    // data are shared with the timer, so this doesn't copy them.
+    _callback_url = _timer->callback_url;
+    body = _timer->callback_body;
+    headers.push_back("X-Sequence-Number: " + std::to_string(_timer->sequence_number));
+    headers.push_back("Content-Type: application/octet-stream");
+
+    // Return the timer to the store before sending the request, for the same
+    // reasons as in send_callback.
+    _callback->_handler->return_timer(_timer);
+    _timer = NULL;
+
+    std::string scheme;
+
+    if (!Utils::parse_http_url(_callback_url.str(), scheme, server, path))
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Invalid callback url: %s", _callback_url.c_str());
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    return true;
+  }
+
+  void complete(HTTPCode rc, const std::string& rsp_body)
+  {
+    if (rc == HTTP_OK)
+    {
+      // The callback succeeded, so we need to re-find the timer, and replicate it.
+      TRC_DEBUG("Callback for timer \"%lu\" was successful", _timer_id);
+      _callback->_handler->handle_successful_callback(_timer_id);
+    }
+    else
+    {
+      TRC_DEBUG("Failed to process callback for %lu: URL %s, HTTP rc %ld", _timer_id,
+                _callback_url.c_str(), rc);
+
+      // The callback failed, and so we need to remove the timer from the store.
+      _callback->_handler->handle_failed_callback(_timer_id);
+    }
+  }
+
+private:
+  HTTPCallback* _callback;
+  Timer* _timer;
+  TimerID _timer_id;
+  SharedString _callback_url;
+};
+
+// The callbacks for popped timers that are batched together, because they're
+// all to the same URL and their client accepts batches. The body is a JSON
+// object holding a callback for each timer, and the response holds a result
+// for each of them (see api.md).
+class HTTPCallback::BatchRequest : public AsyncHttpRequest
+{
+public:
+  BatchRequest(HTTPCallback* callback,
+               std::vector<Timer*>::iterator begin,
+               std::vector<Timer*>::iterator end) :
+    _callback(callback),
+    _timers(begin, end)
+  {}
+
+  ~BatchRequest()
+  {
+    // The timers are only still here if the request was never sent.
+    for (Timer* timer : _timers)
+    {
+      delete timer;
+    }
+  }
+
+  bool prepare()
+  {
+    _callback_url = _timers.front()->callback_url;
+
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+    writer.StartObject();
+    {
+      writer.String("callbacks");
+      writer.StartArray();
+      {
+        for (Timer* timer : _timers)
+        {
+          // The timer ID is rendered as it is in the timer's URL.
+          std::string id = timer->url().substr(strlen("/timers/"));
+
+          writer.StartObject();
+          {
+            writer.String("id");
+            writer.String(id.c_str(), id.size());
+            writer.String("sequence-number");
+            writer.Uint(timer->sequence_number);
+            writer.String("opaque");
+            writer.String(timer->callback_body.data(), timer->callback_body.size());
+          }
+          writer.EndObject();
+
+          // Return the timer to the store once we've got what we need from
+          // it, as for a single callback.
+          _timer_ids.push_back(timer->id);
+          _callback->_handler->return_timer(timer);
+        }
+      }
+      writer.EndArray();
+    }
+    writer.EndObject();
+
+    _timers.clear();
+    body = std::string(sb.GetString(), sb.GetSize());
+    headers.push_back("Content-Type: application/json");
+
+    std::string scheme;
+
+    if (!Utils::parse_http_url(_callback_url.str(), scheme, server, path))
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Invalid callback url: %s", _callback_url.c_str());
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    return true;
+  }
+
+  void complete(HTTPCode rc, const std::string& rsp_body)
+  {
+    // Pull out the result for each callback. If there isn't one for every
+    // callback, they all fail.
+    std::vector<HTTPCode> results;
+
+    if (rc == HTTP_OK)
+    {
+      rapidjson::Document doc;
+      doc.Parse<0>(rsp_body.c_str());
+
+      if ((!doc.HasParseError()) &&
+          (doc.IsObject()) &&
+          (doc.HasMember("results")) &&
+          (doc["results"].IsArray()) &&
+          (doc["results"].Size() == _timer_ids.size()))
+      {
+        for (rapidjson::Value::ConstValueIterator it = doc["results"].Begin();
+             it != doc["results"].End();
+             ++it)
+        {
+          results.push_back(it->IsInt() ? it->GetInt() : 0);
+        }
+      }
+      else
+      {
+        TRC_WARNING("Invalid response to batch of %lu callbacks to %s",
+                    _timer_ids.size(),
+                    _callback_url.c_str());
+        rc = 0;
+      }
+    }
+
+    for (size_t ii = 0; ii < _timer_ids.size(); ++ii)
+    {
+      HTTPCode timer_rc = (ii < results.size()) ? results[ii] : rc;
+
+      if (timer_rc == HTTP_OK)
+      {
+        TRC_DEBUG("Callback for timer \"%lu\" was successful", _timer_ids[ii]);
+        _callback->_handler->handle_successful_callback(_timer_ids[ii]);
+      }
+      else
+      {
+        TRC_DEBUG("Failed to process callback for %lu: URL %s, HTTP rc %ld",
+                  _timer_ids[ii], _callback_url.c_str(), timer_rc);
+        _callback->_handler->handle_failed_callback(_timer_ids[ii]);
+      }
+    }
+  }
+
+private:
+  HTTPCallback* _callback;
+  std::vector<Timer*> _timers;
+  std::vector<TimerID> _timer_ids;
+  SharedString _callback_url;
+};
 
 HTTPCallback::HTTPCallback(HttpResolver* resolver,
-                           ExceptionHandler* exception_handler) :
+                           ExceptionHandler* exception_handler,
+                           SNMP::CounterTable* new_connections_table,
+                           SNMP::CounterTable* reused_connections_table) :
 
-  _q(),
+  _next_client(0),
+  _q(HTTPCALLBACK_THREAD_COUNT),
   _exception_handler(exception_handler),
   _resolver(resolver),
   _running(false),
@@ -26,6 +325,32 @@ HTTPCallback::HTTPCallback(HttpResolver* resolver,
 {
   std::string bind_address;
   __globals->get_bind_address(bind_address);
+
+  int connections_per_host;
+  int idle_timeout;
+  int pipeline_depth;
+  __globals->get_callback_connections_per_host(connections_per_host);
+  __globals->get_callback_idle_timeout(idle_timeout);
+  __globals->get_callback_pipeline_depth(pipeline_depth);
+
+  // Each event loop has its own connections, so they share the connections
+  // allowed to each host.
+  size_t loop_connections_per_host =
+    std::max(connections_per_host / HTTPCALLBACK_LOOP_COUNT, 1);
+
+  for (int ii = 0; ii < HTTPCALLBACK_LOOP_COUNT; ++ii)
+  {
+    _clients[ii] = new AsyncHttpClient(_resolver,
+                                       bind_address,
+                                       HTTPCALLBACK_TIMEOUT_MS,
+                                       HTTPCALLBACK_MAX_IN_FLIGHT,
+                                       loop_connections_per_host,
+                                       idle_timeout,
+                                       pipeline_depth,
+                                       new_connections_table,
+                                       reused_connections_table);
+  }
+
   _http_client = new HttpClient(false,
                                 _resolver,
                                 nullptr,
@@ -47,6 +372,11 @@ HTTPCallback::~HTTPCallback()
     stop();
   }
 
+  for (int ii = 0; ii < HTTPCALLBACK_LOOP_COUNT; ++ii)
+  {
+    delete _clients[ii]; _clients[ii] = NULL;
+  }
+
   delete _http_client; _http_client = nullptr;
 }
 
@@ -55,6 +385,11 @@ void HTTPCallback::start(TimerHandler* handler)
   _handler = handler;
   _running = true;
 
+  for (int ii = 0; ii < HTTPCALLBACK_LOOP_COUNT; ++ii)
+  {
+    _clients[ii]->start();
+  }
+
   // Create a pool of worker threads
   for (int ii = 0; ii < HTTPCALLBACK_THREAD_COUNT; ++ii)
   {
@@ -81,12 +416,87 @@ void HTTPCallback::stop()
   {
     pthread_join(_worker_threads[ii], NULL);
   }
+
+  for (int ii = 0; ii < HTTPCALLBACK_LOOP_COUNT; ++ii)
+  {
+    _clients[ii]->stop();
+  }
+
   _running = false;
 }
 
+bool HTTPCallback::is_async(const Timer* timer)
+{
+  return (strncasecmp(timer->callback_url.c_str(), "http://", 7) == 0);
+}
+
+void HTTPCallback::send_async(AsyncHttpRequest* request)
+{
+  // Share the callbacks out between the event loops.
+  unsigned int client = _next_client++ % HTTPCALLBACK_LOOP_COUNT;
+  _clients[client]->send(request);
+}
+
 void HTTPCallback::perform(Timer* timer)
 {
-  _q.push(timer);
+  if (!is_async(timer))
+  {
+    _q.push(timer);
+  }
+  else if (send_in_batch(timer))
+  {
+    // The client expects its callbacks in batches, even if there's only one.
+    std::vector<Timer*> timers(1, timer);
+    send_async(new BatchRequest(this, timers.begin(), timers.end()));
+  }
+  else
+  {
+    send_async(new Request(this, timer));
+  }
+}
+
+void HTTPCallback::perform_batch(std::vector<Timer*>& timers)
+{
+  std::vector<Timer*> sync_timers;
+
+  // The timers whose clients accept batched callbacks, by callback URL.
+  std::unordered_map<std::string, std::vector<Timer*>> batches;
+
+  for (Timer* timer : timers)
+  {
+    if (!is_async(timer))
+    {
+      sync_timers.push_back(timer);
+    }
+    else if (send_in_batch(timer))
+    {
+      batches[timer->callback_url].push_back(timer);
+    }
+    else
+    {
+      send_async(new Request(this, timer));
+    }
+  }
+
+  timers.clear();
+
+  for (std::pair<const std::string, std::vector<Timer*>>& batch : batches)
+  {
+    std::vector<Timer*>& batch_timers = batch.second;
+
+    for (size_t ii = 0;
+         ii < batch_timers.size();
+         ii += HTTPCALLBACK_MAX_CALLBACKS_PER_REQUEST)
+    {
+      size_t end = std::min(ii + HTTPCALLBACK_MAX_CALLBACKS_PER_REQUEST,
+                            batch_timers.size());
+      send_async(new BatchRequest(this,
+                                  batch_timers.begin() + ii,
+                                  batch_timers.begin() + end));
+    }
+  }
+
+  _q.push_batch(sync_timers);
 }
 
 void* HTTPCallback::worker_thread_entry_point(void* arg)
@@ -98,77 +508,89 @@ void* HTTPCallback::worker_thread_entry_point(void* arg)
 
 void HTTPCallback::worker_thread_entry_point()
 {
-  Timer* timer = NULL;
-  while (_q.pop(timer))
-  {
-    CW_TRY
-    {
-      // Pull out the timer details for use in the CURL request.
-      TimerID timer_id = timer->id;
-      std::string callback_url = timer->callback_url;
-      std::string callback_body = timer->callback_body;
-
-      // Set up the headers.
-      std::string seq_no_hdr = "X-Sequence-Number: " + std::to_string(timer->sequence_number);
-      std::string content_type_hdr = "Content-Type: application/octet-stream";
-
-      // Return the timer to the store. This avoids the error case where the client
-      // attempts to update the timer based on the pop, finds nothing in the store,
-      // inserts a new timer rather than updating the timer that popped, and the popped
-      // timer then tombstoning and overwriting the newer timer, leading to leaked statistics.
-      _handler->return_timer(timer);
-      timer = NULL; // We relinquish control of the timer when we give it back to the store.
-
-      // Send the request.
-      std::string server;
-      std::string scheme;
-      std::string path;
-      bool valid_url = Utils::parse_http_url(callback_url, scheme, server, path);
-
-      if (valid_url)
-      {
-        HttpResponse resp = HttpRequest(server,
-                                        scheme,
-                                        _http_client,
-                                        HttpClient::RequestType::POST,
-                                        path)
-                            .set_body(callback_body)
-                            .add_header(seq_no_hdr)
-                            .add_header(content_type_hdr)
-                            .send();
-        HTTPCode http_rc = resp.get_rc();
-
-        if (http_rc == HTTP_OK)
-        {
-          // The callback succeeded, so we need to re-find the timer, and replicate it.
-          TRC_DEBUG("Callback for timer \"%lu\" was successful", timer_id);
-          _handler->handle_successful_callback(timer_id);
-        }
-        else
-        {
-          TRC_DEBUG("Failed to process callback for %lu: URL %s, HTTP rc %ld", timer_id,
-                    callback_url.c_str(), http_rc);
+  std::vector<Timer*> timers;
 
-          // The callback failed, and so we need to remove the timer from the store.
-          _handler->handle_failed_callback(timer_id);
-        }
+  while (_q.pop_batch(timers, HTTPCALLBACK_MAX_BATCH_SIZE))
+  {
+    for (Timer* timer : timers)
+    {
+      send_callback(timer);
+    }
+
+    timers.clear();
+  }
+
+  return;
+}
+
+void HTTPCallback::send_callback(Timer* timer)
+{
+  CW_TRY
+  {
+    // Pull out the timer details for use in the CURL request. The URL and
+    // opaque data are shared with the timer, so this doesn't copy them.
+    TimerID timer_id = timer->id;
+    SharedString callback_url = timer->callback_url;
+    SharedString callback_body = timer->callback_body;
+
+    // Set up the headers.
+    std::string seq_no_hdr = "X-Sequence-Number: " + std::to_string(timer->sequence_number);
+    std::string content_type_hdr = "Content-Type: application/octet-stream";
+
+    // Return the timer to the store. This avoids the error case where the client
+    // attempts to update the timer based on the pop, finds nothing in the store,
+    // inserts a new timer rather than updating the timer that popped, and the popped
+    // timer then tombstoning and overwriting the newer timer, leading to leaked statistics.
+    _handler->return_timer(timer);
+    timer = NULL; // We relinquish control of the timer when we give it back to the store.
+
+    // Send the request.
+    std::string server;
+    std::string scheme;
+    std::string path;
+    bool valid_url = Utils::parse_http_url(callback_url.str(), scheme, server, path);
+
+    if (valid_url)
+    {
+      HttpResponse resp = HttpRequest(server,
+                                      scheme,
+                                      _http_client,
+                                      HttpClient::RequestType::POST,
+                                      path)
+                          .set_body(callback_body.str())
+                          .add_header(seq_no_hdr)
+                          .add_header(content_type_hdr)
+                          .send();
+      HTTPCode http_rc = resp.get_rc();
+
+      if (http_rc == HTTP_OK)
+      {
+        // The callback succeeded, so we need to re-find the timer, and replicate it.
+        TRC_DEBUG("Callback for timer \"%lu\" was successful", timer_id);
+        _handler->handle_successful_callback(timer_id);
       }
-      //LCOV_EXCL_START
       else
       {
-        TRC_ERROR("Invalid callback url: %s", callback_url.c_str());
+        TRC_DEBUG("Failed to process callback for %lu: URL %s, HTTP rc %ld", timer_id,
+                  callback_url.c_str(), http_rc);
+
+        // The callback failed, and so we need to remove the timer from the store.
         _handler->handle_failed_callback(timer_id);
       }
-      // LCOV_EXCL_STOP
     }
-    //LCOV_EXCL_START - No exception testing in UT
-    CW_EXCEPT(_exception_handler)
+    //LCOV_EXCL_START
+    else
     {
-      // No recovery behaviour needed
+      TRC_ERROR("Invalid callback url: %s", callback_url.c_str());
+      _handler->handle_failed_callback(timer_id);
     }
-    CW_END
     // LCOV_EXCL_STOP
   }
-
-  return;
+  //LCOV_EXCL_START - No exception testing in UT
+  CW_EXCEPT(_exception_handler)
+  {
+    // No recovery behaviour needed
+  }
+  CW_END
+  // LCOV_EXCL_STOP
 }
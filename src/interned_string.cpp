@@ -0,0 +1,116 @@
+/**
+ * @file interned_string.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "interned_string.h"
+
+#include <pthread.h>
+#include <tuple>
+#include <unordered_map>
+
+// The table of interned strings, with their reference counts. This is an
+// unordered_map so that the entries never move once they've been added. It's
+// never destroyed, as interned strings may still be in use by other static
+// destructors.
+//
+// Reference counts are only increased from zero (when a string is added), and
+// only drop to zero (when the string is removed), with the write lock held, so
+// a string can't be found in the table as it's being removed.
+struct InternTable
+{
+  pthread_rwlock_t lock;
+  std::unordered_map<std::string, std::atomic<size_t>> strings;
+
+  InternTable()
+  {
+    pthread_rwlock_init(&lock, NULL);
+  }
+};
+
+static InternTable& intern_table()
+{
+  static InternTable* table = new InternTable();
+  return *table;
+}
+
+InternedString::InternedString()
+{
+  // The empty string is used a lot, so it keeps a reference of its own and
+  // is never removed.
+  static Entry* empty = intern("");
+  _entry = empty;
+  acquire();
+}
+
+InternedString::InternedString(const std::string& str) : _entry(intern(str))
+{
+}
+
+InternedString::InternedString(const char* str) : _entry(intern(str))
+{
+}
+
+size_t InternedString::table_size()
+{
+  InternTable& table = intern_table();
+  pthread_rwlock_rdlock(&table.lock);
+  size_t size = table.strings.size();
+  pthread_rwlock_unlock(&table.lock);
+  return size;
+}
+
+InternedString::Entry* InternedString::intern(const std::string& str)
+{
+  InternTable& table = intern_table();
+  Entry* entry = NULL;
+
+  // The string is usually in the table already, in which case it only needs
+  // the read lock (as the reference count is never zero).
+  pthread_rwlock_rdlock(&table.lock);
+  std::unordered_map<std::string, std::atomic<size_t>>::iterator it =
+                                                         table.strings.find(str);
+
+  if (it != table.strings.end())
+  {
+    entry = &(*it);
+    entry->second.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  pthread_rwlock_unlock(&table.lock);
+
+  if (entry == NULL)
+  {
+    // Add the string, unless another thread has added it in the meantime.
+    pthread_rwlock_wrlock(&table.lock);
+    entry = &(*table.strings.emplace(std::piecewise_construct,
+                                     std::forward_as_tuple(str),
+                                     std::forward_as_tuple(0)).first);
+    entry->second.fetch_add(1, std::memory_order_relaxed);
+    pthread_rwlock_unlock(&table.lock);
+  }
+
+  return entry;
+}
+
+void InternedString::release_last(Entry* entry)
+{
+  // This may not be the last reference any more, if the string has been
+  // interned again since. If it is, nothing else can take a reference to the
+  // string while we hold the write lock.
+  InternTable& table = intern_table();
+  pthread_rwlock_wrlock(&table.lock);
+
+  if (entry->second.fetch_sub(1, std::memory_order_acq_rel) == 1)
+  {
+    table.strings.erase(table.strings.find(entry->first));
+  }
+
+  pthread_rwlock_unlock(&table.lock);
+}
@@ -35,6 +35,7 @@
 #include "snmp_continuous_increment_table.h"
 #include "snmp_counter_table.h"
 #include "snmp_scalar.h"
+#include "snmp_event_accumulator_table.h"
 #include "snmp_agent.h"
 #include "updater.h"
 
@@ -265,8 +266,15 @@ int main(int argc, char** argv)
   Alarm* resync_operation_alarm = nullptr;
   CommunicationMonitor* remote_chronos_comm_monitor = nullptr;
   SNMP::U32Scalar* remaining_nodes_scalar = nullptr;
+  SNMP::U32Scalar* precompute_remaining_scalar = nullptr;
+  SNMP::U32Scalar* timer_pool_scalar = nullptr;
   SNMP::CounterTable* timers_processed_table = nullptr;
   SNMP::CounterTable* invalid_timers_processed_table = nullptr;
+  SNMP::CounterTable* config_reads_table = nullptr;
+  SNMP::CounterTable* callback_new_connections_table = nullptr;
+  SNMP::CounterTable* callback_reused_connections_table = nullptr;
+  SNMP::EventAccumulatorTable* lock_hold_time_table = nullptr;
+  SNMP::EventAccumulatorTable* add_queue_depth_table = nullptr;
   SNMP::ContinuousIncrementTable* all_timers_table = nullptr;
   SNMP::InfiniteTimerCountTable* total_timers_table = nullptr;
   SNMP::InfiniteScalarTable* scalar_timers_table = nullptr;
@@ -287,6 +295,21 @@ int main(int argc, char** argv)
                                                       ".1.2.826.0.1.1578918.9.10.2");
   invalid_timers_processed_table = SNMP::CounterTable::create("chronos_invalid_timers_processed_table",
                                                               ".1.2.826.0.1.1578918.9.10.3");
+  lock_hold_time_table = SNMP::EventAccumulatorTable::create("chronos_lock_hold_time_table",
+                                                             ".1.2.826.0.1.1578918.9.10.5");
+  add_queue_depth_table = SNMP::EventAccumulatorTable::create("chronos_add_queue_depth_table",
+                                                              ".1.2.826.0.1.1578918.9.10.6");
+  precompute_remaining_scalar = new SNMP::U32Scalar("chronos_precompute_remaining_scalar",
+                                                    ".1.2.826.0.1.1578918.9.10.7");
+  config_reads_table = SNMP::CounterTable::create("chronos_config_reads_table",
+                                                  ".1.2.826.0.1.1578918.9.10.8");
+  __globals->set_config_reads_table(config_reads_table);
+  callback_new_connections_table = SNMP::CounterTable::create("chronos_callback_new_connections_table",
+                                                              ".1.2.826.0.1.1578918.9.10.9");
+  callback_reused_connections_table = SNMP::CounterTable::create("chronos_callback_reused_connections_table",
+                                                                 ".1.2.826.0.1.1578918.9.10.10");
+  timer_pool_scalar = new SNMP::U32Scalar("chronos_timer_pool_scalar",
+                                          ".1.2.826.0.1.1578918.9.10.11");
 
   // Must be called after all SNMP tables have been registered
   init_snmp_handler_threads("chronos");
@@ -360,11 +383,20 @@ int main(int argc, char** argv)
 
   // Create the timer store, handlers, replicators...
   int gr_threads;
+  int timer_shards;
+  bool queue_timer_adds;
   bool replicate_timers_across_sites;
   __globals->get_gr_threads(gr_threads);
+  __globals->get_timer_shards(timer_shards);
+  __globals->get_queue_timer_adds(queue_timer_adds);
   __globals->get_replicate_timers_across_sites(replicate_timers_across_sites);
 
-  TimerStore* store = new TimerStore(hc);
+  std::vector<TimerStore*> stores;
+  for (int ii = 0; ii < timer_shards; ++ii)
+  {
+    stores.push_back(new TimerStore(hc));
+  }
+
   Replicator* local_rep = new Replicator(http_resolver,
                                          exception_handler);
 
@@ -380,16 +412,32 @@ int main(int argc, char** argv)
   }
 
   HTTPCallback* callback = new HTTPCallback(http_resolver,
-                                            exception_handler);
-  TimerHandler* handler = new TimerHandler(store,
+                                            exception_handler,
+                                            callback_new_connections_table,
+                                            callback_reused_connections_table);
+  TimerHandler* handler = new TimerHandler(stores,
                                            callback,
                                            local_rep,
                                            gr_rep,
                                            all_timers_table,
                                            total_timers_table,
-                                           scalar_timers_table);
+                                           scalar_timers_table,
+                                           queue_timer_adds,
+                                           lock_hold_time_table,
+                                           add_queue_depth_table,
+                                           precompute_remaining_scalar,
+                                           timer_pool_scalar);
   callback->start(handler);
 
+  // Whenever the configuration changes, move any timers whose pop times have
+  // changed, and work out the timers' cluster information in the background
+  // (rather than as each timer pops).
+  __globals->set_config_change_handler([handler]()
+  {
+    handler->update_pop_times();
+    handler->precompute_replicas();
+  });
+
   int target_latency;
   int max_tokens;
   int initial_token_rate;
@@ -483,20 +531,33 @@ int main(int argc, char** argv)
   delete load_monitor; load_monitor = nullptr;
   delete chronos_internal_connection; chronos_internal_connection = nullptr;
   delete client; client = nullptr;
+  __globals->set_config_change_handler(std::function<void()>());
   delete handler; handler = nullptr;
   // Callback is deleted by the handler
   delete gr_rep; gr_rep = nullptr;
   delete local_rep; local_rep = nullptr;
-  delete store; store = nullptr;
+  for (TimerStore* store : stores)
+  {
+    delete store;
+  }
+  stores.clear();
   delete http_resolver; http_resolver = nullptr;
   delete dns_updater; dns_updater = nullptr;
   delete dns_resolver; dns_resolver = nullptr;
 
+  __globals->set_config_reads_table(nullptr);
+  delete callback_reused_connections_table; callback_reused_connections_table = nullptr;
+  delete callback_new_connections_table; callback_new_connections_table = nullptr;
+  delete config_reads_table; config_reads_table = nullptr;
+  delete add_queue_depth_table; add_queue_depth_table = nullptr;
+  delete lock_hold_time_table; lock_hold_time_table = nullptr;
   delete scalar_timers_table; scalar_timers_table = nullptr;
   delete total_timers_table; total_timers_table = nullptr;
   delete all_timers_table; all_timers_table = nullptr;
   delete invalid_timers_processed_table; invalid_timers_processed_table = nullptr;
   delete timers_processed_table; timers_processed_table = nullptr;
+  delete timer_pool_scalar; timer_pool_scalar = nullptr;
+  delete precompute_remaining_scalar; precompute_remaining_scalar = nullptr;
   delete remaining_nodes_scalar; remaining_nodes_scalar = nullptr;
 
   delete exception_handler; exception_handler = nullptr;
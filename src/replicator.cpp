@@ -11,6 +11,7 @@
 
 #include "replicator.h"
 #include "globals.h"
+#include "constants.h"
 
 #include <cstring>
 #include <pthread.h>
@@ -36,6 +37,9 @@ Replicator::Replicator(HttpResolver* resolver,
                                 "",
                                 bind_address);
 
+  __globals->get_binary_replication(_binary);
+  _content_type = _binary ? CONTENT_TYPE_BINARY_TIMER : CONTENT_TYPE_JSON;
+
   // Create a pool of replicator threads
   for (int ii = 0; ii < REPLICATOR_THREAD_COUNT; ++ii)
   {
@@ -84,13 +88,12 @@ void* Replicator::worker_thread_entry_point(void* arg)
 // Handle the replication of the given timer to its replicas.
 void Replicator::replicate(Timer* timer)
 {
-  std::string localhost;
-  __globals->get_cluster_local_ip(localhost);
+  InternedString localhost = __globals->get_cluster_config()->cluster_local_ip;
 
   // Only create the body once (as it's the same for each replica).
-  std::string body = timer->to_json();
+  std::shared_ptr<const std::string> body = timer->replication_body(_binary, true);
 
-  for (std::vector<std::string>::iterator it = timer->replicas.begin();
+  for (InternedStringList::iterator it = timer->replicas.begin();
                                           it != timer->replicas.end();
                                           ++it)
   {
@@ -100,7 +103,7 @@ void Replicator::replicate(Timer* timer)
     }
   }
 
-  for (std::vector<std::string>::iterator it = timer->extra_replicas.begin();
+  for (InternedStringList::iterator it = timer->extra_replicas.begin();
                                           it != timer->extra_replicas.end();
                                           ++it)
   {
@@ -115,7 +118,7 @@ void Replicator::replicate(Timer* timer)
 void Replicator::replicate_timer_to_node(Timer* timer,
                                          std::string node)
 {
-  std::string body = timer->to_json();
+  std::shared_ptr<const std::string> body = timer->replication_body(_binary, true);
   replicate_int(body, timer->url(node));
 }
 
@@ -129,8 +132,9 @@ void Replicator::worker_thread_entry_point()
   {
     CW_TRY
     {
-      std::string replication_url = replication_request->url.c_str();
-      std::string replication_body = replication_request->body.data();
+      // The body may be binary, so mustn't be treated as a C string.
+      std::string replication_url = replication_request->url;
+      const std::string& replication_body = *replication_request->body;
 
       std::string server;
       std::string scheme;
@@ -145,6 +149,9 @@ void Replicator::worker_thread_entry_point()
                                         HttpClient::RequestType::PUT,
                                         path)
                             .set_body(replication_body)
+                            .add_header(std::string(HEADER_CONTENT_TYPE) +
+                                        ": " +
+                                        replication_request->content_type)
                             .send();
         HTTPCode http_rc = resp.get_rc();
 
@@ -178,10 +185,12 @@ void Replicator::worker_thread_entry_point()
 /* Private functions.                                                        */
 /*****************************************************************************/
 
-void Replicator::replicate_int(const std::string& body, const std::string& url)
+void Replicator::replicate_int(const std::shared_ptr<const std::string>& body,
+                               const std::string& url)
 {
   ReplicationRequest* replication_request = new ReplicationRequest();
   replication_request->url = url;
   replication_request->body = body;
+  replication_request->content_type = _content_type;
   _q.push(replication_request);
 }
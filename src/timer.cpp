@@ -12,10 +12,12 @@
 #include "timer.h"
 #include "globals.h"
 #include "murmur/MurmurHash3.h"
+#include "batch_hash.h"
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/error/en.h"
 #include "json_parse_utils.h"
+#include "binary_codec.h"
 #include "utils.h"
 #include "log.h"
 
@@ -24,8 +26,11 @@
 #include <iomanip>
 #include <boost/format.hpp>
 #include <map>
+#include <algorithm>
+#include <tuple>
 #include <atomic>
 #include <time.h>
+#include <pthread.h>
 
 uint32_t DELAY_BETWEEN_CHRONOS_INSTANCES_MS = 2000;
 
@@ -36,6 +41,15 @@ uint32_t Hasher::do_hash(TimerID data, uint32_t seed)
   return hash;
 }
 
+void Hasher::do_hash_batch(const TimerID* data,
+                           size_t num_data,
+                           const uint32_t* seeds,
+                           size_t num_seeds,
+                           uint32_t* hashes)
+{
+  BatchHash::murmur3_32(data, num_data, seeds, num_seeds, hashes);
+}
+
 static Hasher hasher;
 
 inline uint32_t clock_gettime_ms(int clock_id)
@@ -53,49 +67,60 @@ Timer::Timer(TimerID id, uint32_t interval_ms, uint32_t repeat_for) :
   interval_ms(interval_ms),
   repeat_for(repeat_for),
   sequence_number(0),
-  replicas(std::vector<std::string>()),
-  sites(std::vector<std::string>()),
+  _replication_factor(0),
+  _position_delay_ms(0),
+  _position_delay_generation(0),
+  _precomputed_replicas(),
+  replicas(),
+  sites(),
   tags(std::map<std::string, uint32_t>()),
-  callback_url(""),
-  callback_body(""),
-  _replication_factor(0)
+  callback_url(),
+  callback_body(),
+  batch_callback(false)
 {
   // Set the start time to now
   start_time_mono_ms = clock_gettime_ms(CLOCK_MONOTONIC);
 
   // Get the cluster view ID from global configuration
-  std::string global_cluster_view_id;
-  __globals->get_cluster_view_id(global_cluster_view_id);
-  cluster_view_id = global_cluster_view_id;
+  cluster_view_id = __globals->get_cluster_config()->cluster_view_id;
 }
 
 Timer::~Timer()
 {
 }
 
-uint32_t Timer::delay_from_replica_position() const
+uint32_t Timer::delay_from_position() const
 {
-  // Get the replica position
-  std::string localhost;
-  int replica_index = 0;
-  __globals->get_cluster_local_ip(localhost);
+  // Only take a reference to the configuration when the cached delay is out
+  // of date, as this is called every time the timer is scheduled.
+  if (_position_delay_generation != __globals->get_config_generation())
+  {
+    ClusterConfigPtr config = __globals->get_cluster_config();
+    _position_delay_ms = delay_from_replica_position(*config) +
+                         delay_from_site_position(*config);
+    _position_delay_generation = config->generation;
+  }
+
+  return _position_delay_ms;
+}
 
-  replica_index = std::find(replicas.begin(), replicas.end(), localhost) -
-                                                                  replicas.begin();
+uint32_t Timer::delay_from_replica_position(const ClusterConfig& config) const
+{
+  // Get the replica position
+  int replica_index = std::find(replicas.begin(),
+                                replicas.end(),
+                                config.cluster_local_ip) - replicas.begin();
 
   // Delay by 2 seconds for each place down in the replica list
   return replica_index * DELAY_BETWEEN_CHRONOS_INSTANCES_MS;
 }
 
-uint32_t Timer::delay_from_site_position() const
+uint32_t Timer::delay_from_site_position(const ClusterConfig& config) const
 {
   // Get the site position
-  std::string local_site_name;
-  int site_index = 0;
-  __globals->get_local_site_name(local_site_name);
-
-  site_index = std::find(sites.begin(), sites.end(), local_site_name) -
-                                                                  sites.begin();
+  int site_index = std::find(sites.begin(),
+                             sites.end(),
+                             config.local_site_name) - sites.begin();
 
   // Delay for each site ahead of us in the site list. The delay for each site
   // is 2 seconds * number of replicas
@@ -115,8 +140,7 @@ uint32_t Timer::next_pop_time() const
 {
   return start_time_mono_ms +
          delay_from_sequence_position() +
-         delay_from_replica_position() +
-         delay_from_site_position();
+         delay_from_position();
 }
 
 uint64_t Timer::get_pop_time() const
@@ -140,8 +164,7 @@ std::string Timer::url(std::string host)
 
   if (host != "")
   {
-    int default_port;
-    __globals->get_bind_port(default_port);
+    int default_port = __globals->get_cluster_config()->bind_port;
 
     ss << "http://" << Utils::uri_address(host, default_port);
   }
@@ -168,7 +191,8 @@ std::string Timer::url(std::string host)
 //     "callback": {
 //         "http": {
 //             "uri": "string",
-//             "opaque": "string"
+//             "opaque": "string",
+//             "batch": Bool // Optional, defaults to false
 //         }
 //     },
 //     "reliability": {
@@ -184,11 +208,11 @@ std::string Timer::url(std::string host)
 //         ]
 //     }
 // }
-std::string Timer::to_json()
+std::string Timer::to_json(bool include_replicas)
 {
   rapidjson::StringBuffer sb;
   rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
-  to_json_obj(&writer);
+  to_json_obj(&writer, include_replicas);
 
   std::string body = sb.GetString();
   TRC_DEBUG("Built replication body: %s", body.c_str());
@@ -196,7 +220,8 @@ std::string Timer::to_json()
   return body;
 }
 
-void Timer::to_json_obj(rapidjson::Writer<rapidjson::StringBuffer>* writer)
+void Timer::to_json_obj(rapidjson::Writer<rapidjson::StringBuffer>* writer,
+                        bool include_replicas)
 {
   writer->StartObject();
   {
@@ -229,6 +254,12 @@ void Timer::to_json_obj(rapidjson::Writer<rapidjson::StringBuffer>* writer)
         writer->String(callback_url.c_str());
         writer->String("opaque");
         writer->String(callback_body.c_str());
+
+        if (batch_callback)
+        {
+          writer->String("batch");
+          writer->Bool(true);
+        }
       }
       writer->EndObject();
     }
@@ -240,12 +271,12 @@ void Timer::to_json_obj(rapidjson::Writer<rapidjson::StringBuffer>* writer)
       writer->String("cluster-view-id");
       writer->String(cluster_view_id.c_str());
 
-      if (!replicas.empty())
+      if ((include_replicas) && (!replicas.empty()))
       {
         writer->String("replicas");
         writer->StartArray();
         {
-          for (std::string replica : replicas)
+          for (const InternedString& replica : replicas)
           {
             writer->String(replica.c_str());
           }
@@ -259,7 +290,7 @@ void Timer::to_json_obj(rapidjson::Writer<rapidjson::StringBuffer>* writer)
         writer->String("sites");
         writer->StartArray();
         {
-          for (std::string site: sites)
+          for (const InternedString& site : sites)
           {
             writer->String(site.c_str());
           }
@@ -296,131 +327,313 @@ void Timer::to_json_obj(rapidjson::Writer<rapidjson::StringBuffer>* writer)
   writer->EndObject();
 }
 
-bool Timer::is_local(std::string host)
+// The versions of the binary format. Version 2 adds the callback flags, and
+// is only written for timers that have some (so that nodes that only
+// understand version 1 can still read all other timers). from_binary rejects
+// any other version.
+static const uint64_t BINARY_FORMAT_VERSION = 1;
+static const uint64_t BINARY_FORMAT_VERSION_WITH_FLAGS = 2;
+
+// The callback flags.
+static const uint64_t BINARY_FLAG_BATCH_CALLBACK = 0x1;
+
+// Render the timer in the binary format (see binary_codec.h) to be used in an
+// HTTP request body. This is, in order:
+//
+//  - the format version
+//  - the start time, as a signed millisecond offset from the current time
+//  - the sequence number
+//  - the interval and repeat-for, in milliseconds
+//  - the callback URI and opaque data
+//  - the callback flags (in version 2 only)
+//  - the cluster view ID
+//  - the number of replicas, followed by the replicas
+//  - the number of sites, followed by the sites
+//  - the number of tags, followed by the type and count of each tag
+std::string Timer::to_binary(bool include_replicas)
+{
+  std::string body;
+  body.reserve(64 + callback_url.size() + callback_body.size());
+  BinaryWriter writer(body);
+
+  uint32_t monotime = clock_gettime_ms(CLOCK_MONOTONIC);
+  int32_t delta = start_time_mono_ms - monotime;
+
+  uint64_t flags = (batch_callback ? BINARY_FLAG_BATCH_CALLBACK : 0);
+
+  writer.write_uint((flags != 0) ? BINARY_FORMAT_VERSION_WITH_FLAGS :
+                                   BINARY_FORMAT_VERSION);
+  writer.write_int(delta);
+  writer.write_uint(sequence_number);
+  writer.write_uint(interval_ms);
+  writer.write_uint(repeat_for);
+  writer.write_string(callback_url);
+  writer.write_string(callback_body);
+
+  if (flags != 0)
+  {
+    writer.write_uint(flags);
+  }
+  writer.write_string(cluster_view_id.str());
+
+  if (include_replicas)
+  {
+    writer.write_uint(replicas.size());
+    for (const InternedString& replica : replicas)
+    {
+      writer.write_string(replica.str());
+    }
+  }
+  else
+  {
+    writer.write_uint(0);
+  }
+
+  writer.write_uint(sites.size());
+  for (const InternedString& site : sites)
+  {
+    writer.write_string(site.str());
+  }
+
+  writer.write_uint(tags.size());
+  for (std::map<std::string, uint32_t>::iterator it = tags.begin();
+                                                 it != tags.end();
+                                                 ++it)
+  {
+    writer.write_string(it->first);
+    writer.write_uint(it->second);
+  }
+
+  TRC_DEBUG("Built binary replication body (%lu bytes)", body.size());
+
+  return body;
+}
+
+std::shared_ptr<const std::string> Timer::replication_body(bool binary,
+                                                           bool include_replicas)
+{
+  ReplicationBodies* bodies = _replication_bodies_link.bodies;
+
+  if ((bodies != NULL) &&
+      (bodies->_bodies[binary][include_replicas] != nullptr))
+  {
+    return bodies->_bodies[binary][include_replicas];
+  }
+
+  std::shared_ptr<const std::string> body =
+    std::make_shared<const std::string>(binary ?
+                                          to_binary(include_replicas) :
+                                          to_json(include_replicas));
+
+  if (bodies != NULL)
+  {
+    bodies->_bodies[binary][include_replicas] = body;
+  }
+
+  return body;
+}
+
+ReplicationBodies::ReplicationBodies(Timer* timer) :
+  _timer(timer)
+{
+  _timer->_replication_bodies_link.bodies = this;
+}
+
+ReplicationBodies::~ReplicationBodies()
+{
+  _timer->_replication_bodies_link.bodies = NULL;
+}
+
+bool Timer::is_local(const InternedString& host)
 {
   return (std::find(replicas.begin(), replicas.end(), host) != replicas.end());
 }
 
 bool Timer::is_last_replica()
 {
-  std::string localhost;
-  __globals->get_cluster_local_ip(localhost);
-  return ((!replicas.empty()) ? replicas.back() == localhost : true);
+  ClusterConfigPtr config = __globals->get_cluster_config();
+  return ((!replicas.empty()) ? replicas.back() == config->cluster_local_ip : true);
 }
 
 bool Timer::is_tombstone()
 {
-  return ((callback_url == "") && (callback_body == ""));
+  return ((callback_url.empty()) && (callback_body.empty()));
 }
 
 void Timer::become_tombstone()
 {
-  callback_url = "";
-  callback_body = "";
+  callback_url = SharedString();
+  callback_body = SharedString();
 
   // Since we're not bringing the start-time forward we have to extend the
   // repeat-for to ensure the tombstone gets added to the replica's store.
   repeat_for = interval_ms * (sequence_number + 1);
 }
 
-bool Timer::is_matching_cluster_view_id(std::string cluster_view_id_to_match)
+bool Timer::is_matching_cluster_view_id(const InternedString& cluster_view_id_to_match)
 {
   return (cluster_view_id_to_match == cluster_view_id);
 }
 
-static void calculate_rendezvous_hash(std::vector<std::string> cluster,
-                                      std::vector<uint32_t> cluster_rendezvous_hashes,
-                                      TimerID id,
-                                      uint32_t replication_factor,
-                                      std::vector<std::string>& replicas,
-                                      Hasher* hasher)
+// The largest cluster that the rendezvous hash works out the replicas for
+// using buffers on the stack. Larger clusters use buffers on the heap.
+static const size_t MAX_STACK_CLUSTER_SIZE = 32;
+
+// A buffer with an entry per node in the cluster, which is on the stack
+// unless the cluster is unusually large.
+template <class T>
+class ClusterBuffer
 {
-  if (replication_factor == 0u)
+public:
+  ClusterBuffer(size_t size) : _data(_stack)
   {
-    return;
+    if (size > MAX_STACK_CLUSTER_SIZE)
+    {
+      // LCOV_EXCL_START
+      _heap.resize(size);
+      _data = _heap.data();
+      // LCOV_EXCL_STOP
+    }
   }
 
-  std::map<uint32_t, size_t> hash_to_idx;
-  std::vector<std::string> ordered_cluster;
+  ClusterBuffer(const ClusterBuffer& copy) = delete;
+
+  T& operator[](size_t ii) { return _data[ii]; }
+
+private:
+  T _stack[MAX_STACK_CLUSTER_SIZE];
+  std::vector<T> _heap;
+  T* _data;
+};
+
+// Work out the replicas for a timer in a cluster of the given size from the
+// timer's hash with each server's seed (timer_hashes[ii * stride] being the
+// hash for the ii'th server), and fill in their indices in the cluster
+// (primary first). Returns the number of replicas, which is the replication
+// factor capped at the cluster size.
+static size_t calculate_rendezvous_hash(const uint32_t* timer_hashes,
+                                        size_t stride,
+                                        size_t cluster_size,
+                                        uint32_t replication_factor,
+                                        ClusterBuffer<size_t>& replica_idxs)
+{
+  if ((replication_factor == 0u) || (cluster_size == 0))
+  {
+    return 0;
+  }
 
-  // Do a rendezvous hash, by hashing this timer repeatedly, seeded by a
-  // different per-server value each time. Rank the servers for this timer
-  // based on this hash output.
-
-  for (unsigned int ii = 0;
-       ii < cluster.size();
-       ++ii)
-  {
-    uint32_t server_hash = cluster_rendezvous_hashes[ii];
-    uint32_t hash = hasher->do_hash(id, server_hash);
-
-    // Deal with hash collisions by incrementing the hash. For
-    // example, if I have server hashes A, B, C, D which cause
-    // this timer to hash to 10, 40, 10, 30:
-    // hash_to_idx[10] = 0 (A's index)
-    // hash_to_idx[40] = 1 (B's index)
-    // hash_to_idx[10] exists, increment C's hash
-    // hash_to_idx[11] = 2 (C's index)
-    // hash_to_idx[30] = 3 (D's index)
-    //
-    // Iterating over hash_to_idx then gives (10, 0), (11, 2), (40, 1)
-    // and (30, 3), so the ordered list is A, C, B, D. Effectively, the
+  size_t num_replicas = std::min((size_t)replication_factor, cluster_size);
+  size_t num_backups = num_replicas - 1;
+  size_t num_backups_found = 0;
+  ClusterBuffer<uint32_t> hashes(cluster_size);
+
+  // Rank the servers for this timer based on its hashes.
+  for (size_t ii = 0; ii < cluster_size; ++ii)
+  {
+    uint32_t hash = timer_hashes[ii * stride];
+
+    // Deal with hash collisions by incrementing the hash until it doesn't
+    // match any earlier server's. For example, if I have server hashes
+    // A, B, C, D which cause this timer to hash to 10, 40, 10, 30, C's hash
+    // is incremented to 11, so the servers rank A, C, D, B. Effectively, the
     // first entry in the original list consistently wins.
     //
-    // This doesn't work perfectly in the edge case
-    // If I have servers A, B, C, D which cause this
-    // timer to hash to 10, 11, 10, 11:
-    // hash_to_idx[10] = 0 (A's index)
-    // hash_to_idx[11] = 1 (B's index)
-    // hash_to_idx[10] exists, increment C's hash
-    // hash_to_idx[11] exists, increment C's hash
-    // hash_to_idx[12] = 2 (C's index)
-    // hash_to_idx[11] exists, increment D's hash
-    // hash_to_idx[12] exists, increment D's hash
-    // hash_to_idx[13] = 3 (D's index)
-    //
-    // Iterating over hash_to_idx then gives (10, 0), (11, 1), (12, 2)
-    // and (13, 3), so the ordered list is A, B, C, D. This is wrong,
-    // but deterministic - the only problem in this very rare case is that
-    // more timers will be moved around when scaling.
-    while (hash_to_idx.find(hash) != hash_to_idx.end())
+    // This doesn't work perfectly in the edge case where A, B, C, D cause
+    // this timer to hash to 10, 11, 10, 11. C's hash is incremented to 11,
+    // then 12, and D's to 12, then 13, so the servers rank A, B, C, D. This
+    // is wrong, but deterministic - the only problem in this very rare case
+    // is that more timers will be moved around when scaling.
+    size_t jj = 0;
+
+    while (jj < ii)
     {
-      // LCOV_EXCL_START
-      hash++;
-      // LCOV_EXCL_STOP
+      if (hashes[jj] == hash)
+      {
+        hash++;
+        jj = 0;
+      }
+      else
+      {
+        jj++;
+      }
+    }
+
+    hashes[ii] = hash;
+
+    // Pick the lowest hash value as the primary replica.
+    if ((ii == 0) || (hash < hashes[replica_idxs[0]]))
+    {
+      replica_idxs[0] = ii;
+    }
+
+    // Pick the (N-1) highest hash values as the backup replicas, which are
+    // kept in descending order of hash after the primary. As the hashes are
+    // all different, the lowest can't be one of these once every server has
+    // been seen.
+    size_t pos;
+
+    if (num_backups_found < num_backups)
+    {
+      num_backups_found++;
+      pos = num_backups_found;
+    }
+    else if ((num_backups > 0) && (hash > hashes[replica_idxs[num_backups]]))
+    {
+      pos = num_backups;
+    }
+    else
+    {
+      continue;
+    }
+
+    while ((pos > 1) && (hash > hashes[replica_idxs[pos - 1]]))
+    {
+      replica_idxs[pos] = replica_idxs[pos - 1];
+      pos--;
     }
 
-    hash_to_idx[hash] = ii;
+    replica_idxs[pos] = ii;
   }
 
-  // Pick the lowest hash value as the primary replica.
-  for (std::map<uint32_t, size_t>::iterator ii = hash_to_idx.begin();
-       ii != hash_to_idx.end();
-       ++ii)
+  return num_replicas;
+}
+
+// Work out the replicas for a timer in the given cluster, adding their
+// addresses to the list of replicas.
+static void calculate_rendezvous_hash(const std::vector<std::string>& cluster,
+                                      const std::vector<uint32_t>& cluster_rendezvous_hashes,
+                                      TimerID id,
+                                      uint32_t replication_factor,
+                                      std::vector<std::string>& replicas,
+                                      Hasher* hasher)
+{
+  // Do a rendezvous hash, by hashing this timer repeatedly, seeded by a
+  // different per-server value each time.
+  ClusterBuffer<uint32_t> timer_hashes(cluster.size());
+
+  for (size_t ii = 0; ii < cluster.size(); ++ii)
   {
-    ordered_cluster.push_back(cluster[ii->second]);
+    timer_hashes[ii] = hasher->do_hash(id, cluster_rendezvous_hashes[ii]);
   }
 
-  replicas.push_back(ordered_cluster.front());
-
-  // Pick the (N-1) highest hash values as the backup replicas.
-  replication_factor = replication_factor > ordered_cluster.size() ?
-                       ordered_cluster.size() : replication_factor;
+  ClusterBuffer<size_t> replica_idxs(cluster.size());
+  size_t num_replicas = calculate_rendezvous_hash(&timer_hashes[0],
+                                                  1,
+                                                  cluster.size(),
+                                                  replication_factor,
+                                                  replica_idxs);
 
-  for (size_t jj = 1;
-       jj < replication_factor;
-       jj++)
+  for (size_t ii = 0; ii < num_replicas; ++ii)
   {
-    replicas.push_back(ordered_cluster.back());
-    ordered_cluster.pop_back();
+    replicas.push_back(cluster[replica_idxs[ii]]);
   }
 }
 
 void Timer::calculate_replicas(TimerID id,
-                               std::vector<std::string> new_cluster,
-                               std::vector<uint32_t> new_cluster_rendezvous_hashes,
-                               std::vector<std::string> old_cluster,
-                               std::vector<uint32_t> old_cluster_rendezvous_hashes,
+                               const std::vector<std::string>& new_cluster,
+                               const std::vector<uint32_t>& new_cluster_rendezvous_hashes,
+                               const std::vector<std::string>& old_cluster,
+                               const std::vector<uint32_t>& old_cluster_rendezvous_hashes,
                                uint32_t replication_factor,
                                std::vector<std::string>& replicas,
                                std::vector<std::string>& extra_replicas,
@@ -457,76 +670,347 @@ void Timer::calculate_replicas(TimerID id,
   }
 }
 
-void Timer::calculate_replicas(uint64_t replica_hash)
+ClusterReplicaView::ClusterReplicaView() :
+  _config(__globals->get_cluster_config())
 {
-  std::vector<std::string> new_cluster;
-  std::vector<std::string> joining_cluster_addresses;
-  __globals->get_cluster_staying_addresses(new_cluster);
-  __globals->get_cluster_joining_addresses(joining_cluster_addresses);
-  new_cluster.insert(new_cluster.end(),
-                     joining_cluster_addresses.begin(),
-                     joining_cluster_addresses.end());
+}
 
-  std::vector<std::string> old_cluster;
-  std::vector<std::string> leaving_cluster_addresses;
-  __globals->get_cluster_staying_addresses(old_cluster);
-  __globals->get_cluster_leaving_addresses(leaving_cluster_addresses);
-  old_cluster.insert(old_cluster.end(),
-                     leaving_cluster_addresses.begin(),
-                     leaving_cluster_addresses.end());
+uint64_t ClusterReplicaView::config_generation() const
+{
+  return _config->generation;
+}
+
+bool ClusterReplicaView::is_replica(TimerID id,
+                                    uint32_t replication_factor,
+                                    const std::string& node) const
+{
+  size_t cluster_size = _config->new_cluster.size();
+  ClusterBuffer<uint32_t> timer_hashes(cluster_size);
+
+  for (size_t ii = 0; ii < cluster_size; ++ii)
+  {
+    timer_hashes[ii] = hasher.do_hash(id, _config->new_cluster_hashes[ii]);
+  }
 
-  std::vector<uint32_t> new_cluster_rendezvous_hashes;
-  __globals->get_new_cluster_hashes(new_cluster_rendezvous_hashes);
+  ClusterBuffer<size_t> replica_idxs(cluster_size);
+  size_t num_replicas = calculate_rendezvous_hash(&timer_hashes[0],
+                                                  1,
+                                                  cluster_size,
+                                                  replication_factor,
+                                                  replica_idxs);
 
-  std::vector<uint32_t> old_cluster_rendezvous_hashes;
-  __globals->get_old_cluster_hashes(old_cluster_rendezvous_hashes);
+  for (size_t ii = 0; ii < num_replicas; ++ii)
+  {
+    if (_config->new_cluster[replica_idxs[ii]] == node)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ClusterReplicaView::are_replicas(const std::vector<TimerID>& ids,
+                                      const std::vector<uint32_t>& replication_factors,
+                                      const std::string& node,
+                                      std::vector<bool>& replicas) const
+{
+  size_t cluster_size = _config->new_cluster.size();
+  replicas.assign(ids.size(), false);
+
+  // Hash all the timers with every server's seed in one go. The hashes for
+  // each server are together, so the hashes for a timer are ids.size()
+  // apart.
+  std::vector<uint32_t> timer_hashes(cluster_size * ids.size());
+  hasher.do_hash_batch(ids.data(),
+                       ids.size(),
+                       _config->new_cluster_hashes.data(),
+                       cluster_size,
+                       timer_hashes.data());
+
+  ClusterBuffer<size_t> replica_idxs(cluster_size);
+
+  for (size_t jj = 0; jj < ids.size(); ++jj)
+  {
+    size_t num_replicas = calculate_rendezvous_hash(&timer_hashes[jj],
+                                                    ids.size(),
+                                                    cluster_size,
+                                                    replication_factors[jj],
+                                                    replica_idxs);
+
+    for (size_t ii = 0; ii < num_replicas; ++ii)
+    {
+      if (_config->new_cluster[replica_idxs[ii]] == node)
+      {
+        replicas[jj] = true;
+        break;
+      }
+    }
+  }
+}
+
+void ClusterReplicaView::calculate_replica_idxs(const std::vector<std::string>& cluster,
+                                                const std::vector<uint32_t>& cluster_rendezvous_hashes,
+                                                const std::vector<TimerID>& ids,
+                                                const std::vector<uint32_t>& replication_factors,
+                                                std::vector<size_t>& replica_idxs,
+                                                std::vector<size_t>& num_replicas) const
+{
+  size_t cluster_size = cluster.size();
+  std::vector<uint32_t> timer_hashes(cluster_size * ids.size());
+  hasher.do_hash_batch(ids.data(),
+                       ids.size(),
+                       cluster_rendezvous_hashes.data(),
+                       cluster_size,
+                       timer_hashes.data());
+
+  ClusterBuffer<size_t> timer_replica_idxs(cluster_size);
+  replica_idxs.resize(cluster_size * ids.size());
+  num_replicas.resize(ids.size());
+
+  for (size_t jj = 0; jj < ids.size(); ++jj)
+  {
+    num_replicas[jj] = calculate_rendezvous_hash(&timer_hashes[jj],
+                                                 ids.size(),
+                                                 cluster_size,
+                                                 replication_factors[jj],
+                                                 timer_replica_idxs);
+
+    for (size_t ii = 0; ii < num_replicas[jj]; ++ii)
+    {
+      replica_idxs[(jj * cluster_size) + ii] = timer_replica_idxs[ii];
+    }
+  }
+}
+
+// The cluster information that's been worked out for the latest
+// configuration, keyed on its contents. This is shared between views (so that
+// they share the cluster information they work out). Entries for earlier
+// configurations are dropped once the next configuration's are worked out -
+// timers that still refer to them keep them alive until they're done with
+// them.
+typedef std::tuple<uint64_t,
+                   std::string,
+                   std::vector<std::string>,
+                   std::vector<std::string>> PrecomputedReplicasKey;
+static std::map<PrecomputedReplicasKey, PrecomputedReplicasPtr> precomputed_replicas;
+static uint64_t precomputed_replicas_generation = 0;
+static pthread_mutex_t precomputed_replicas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static PrecomputedReplicasPtr create_precomputed_replicas(const ClusterConfigPtr& config,
+                                                          const PrecomputedReplicasKey& key)
+{
+  PrecomputedReplicas* precomputed = new PrecomputedReplicas();
+  precomputed->config_generation = config->generation;
+  precomputed->cluster_view_id = config->cluster_view_id;
+  precomputed->replicas = std::get<2>(key);
+  precomputed->extra_replicas = std::get<3>(key);
+  return PrecomputedReplicasPtr(precomputed);
+}
+
+void ClusterReplicaView::precompute_replicas(const std::vector<TimerID>& ids,
+                                             const std::vector<uint32_t>& replication_factors,
+                                             std::vector<PrecomputedReplicasPtr>& replicas)
+{
+  std::vector<size_t> new_replica_idxs;
+  std::vector<size_t> num_new_replicas;
+  calculate_replica_idxs(_config->new_cluster,
+                         _config->new_cluster_hashes,
+                         ids,
+                         replication_factors,
+                         new_replica_idxs,
+                         num_new_replicas);
+
+  std::vector<size_t> old_replica_idxs;
+  std::vector<size_t> num_old_replicas;
+  calculate_replica_idxs(_config->old_cluster,
+                         _config->old_cluster_hashes,
+                         ids,
+                         replication_factors,
+                         old_replica_idxs,
+                         num_old_replicas);
+
+  replicas.resize(ids.size());
+  std::vector<size_t> key;
+
+  for (size_t jj = 0; jj < ids.size(); ++jj)
+  {
+    const size_t* new_idxs = &new_replica_idxs[jj * _config->new_cluster.size()];
+    const size_t* old_idxs = &old_replica_idxs[jj * _config->old_cluster.size()];
 
-  std::map<std::string, uint64_t> cluster_bloom_filters;
-  __globals->get_cluster_bloom_filters(cluster_bloom_filters);
+    // The key is the indices of the new replicas, then a separator, then the
+    // indices of the old replicas that aren't new replicas (which become
+    // extra replicas).
+    key.assign(new_idxs, new_idxs + num_new_replicas[jj]);
+    key.push_back((size_t)-1);
 
+    for (size_t ii = 0; ii < num_old_replicas[jj]; ++ii)
+    {
+      bool is_new_replica = false;
+
+      for (size_t kk = 0; kk < num_new_replicas[jj]; ++kk)
+      {
+        if (_config->old_cluster[old_idxs[ii]] == _config->new_cluster[new_idxs[kk]])
+        {
+          is_new_replica = true;
+          break;
+        }
+      }
+
+      if (!is_new_replica)
+      {
+        key.push_back(old_idxs[ii]);
+      }
+    }
+
+    std::map<std::vector<size_t>, PrecomputedReplicasPtr>::iterator it =
+                                                         _precomputed.find(key);
+
+    if (it != _precomputed.end())
+    {
+      replicas[jj] = it->second;
+      continue;
+    }
+
+    // This view hasn't seen these replicas before, so look for them in the
+    // shared cluster information, and add them if they're not there.
+    PrecomputedReplicasKey shared_key(_config->generation,
+                                      _config->cluster_view_id.str(),
+                                      std::vector<std::string>(),
+                                      std::vector<std::string>());
+    size_t ii = 0;
+
+    for (; key[ii] != (size_t)-1; ++ii)
+    {
+      std::get<2>(shared_key).push_back(_config->new_cluster[key[ii]]);
+    }
+
+    for (++ii; ii < key.size(); ++ii)
+    {
+      std::get<3>(shared_key).push_back(_config->old_cluster[key[ii]]);
+    }
+
+    pthread_mutex_lock(&precomputed_replicas_lock);
+
+    // Drop the cluster information for the previous configuration when the
+    // first view for the current one gets here.
+    if ((precomputed_replicas_generation != _config->generation) &&
+        (_config->generation == __globals->get_config_generation()))
+    {
+      precomputed_replicas.clear();
+      precomputed_replicas_generation = _config->generation;
+    }
+
+    PrecomputedReplicasPtr shared;
+
+    if (precomputed_replicas_generation == _config->generation)
+    {
+      PrecomputedReplicasPtr& entry = precomputed_replicas[shared_key];
+
+      if (entry == NULL)
+      {
+        entry = create_precomputed_replicas(_config, shared_key);
+      }
+
+      shared = entry;
+    }
+    else
+    {
+      // This view is for a configuration that's already been superseded, so
+      // don't share what it works out (it won't be used for long anyway).
+      shared = create_precomputed_replicas(_config, shared_key);
+    }
+
+    pthread_mutex_unlock(&precomputed_replicas_lock);
+
+    _precomputed[key] = shared;
+    replicas[jj] = shared;
+  }
+}
+
+void Timer::calculate_replicas(uint64_t replica_hash)
+{
+  ClusterConfigPtr config = __globals->get_cluster_config();
+
+  std::vector<std::string> new_replicas;
+  std::vector<std::string> new_extra_replicas = extra_replicas;
   calculate_replicas(id,
-                     new_cluster,
-                     new_cluster_rendezvous_hashes,
-                     old_cluster,
-                     old_cluster_rendezvous_hashes,
+                     config->new_cluster,
+                     config->new_cluster_hashes,
+                     config->old_cluster,
+                     config->old_cluster_hashes,
                      _replication_factor,
-                     replicas,
-                     extra_replicas,
+                     new_replicas,
+                     new_extra_replicas,
                      &hasher);
+  replicas = new_replicas;
+  extra_replicas = new_extra_replicas;
+  invalidate_pop_time();
 }
 
 void Timer::populate_sites()
 {
-  std::string local_site_name;
-  __globals->get_local_site_name(local_site_name);
-
-  std::vector<std::string> remote_site_names;
-  __globals->get_remote_site_names(remote_site_names);
+  ClusterConfigPtr config = __globals->get_cluster_config();
+  std::vector<std::string> remote_site_names = config->remote_site_names;
 
-  sites.push_back(local_site_name);
+  sites.push_back(config->local_site_name);
 
   std::random_shuffle(remote_site_names.begin(), remote_site_names.end());
   for (std::string remote_site_name: remote_site_names)
   {
     sites.push_back(remote_site_name);
   }
+
+  invalidate_pop_time();
 }
 
 
+// Whether a timer's sites are exactly the current sites (in any order).
+static bool sites_are_current(const InternedStringList& sites,
+                              const ClusterConfig& config)
+{
+  if (sites.size() != config.remote_site_names.size() + 1)
+  {
+    return false;
+  }
+
+  for (InternedStringList::const_iterator it = sites.begin();
+                                          it != sites.end();
+                                          ++it)
+  {
+    if (((*it != config.local_site_name) &&
+         (std::find(config.remote_site_names.begin(),
+                    config.remote_site_names.end(),
+                    *it) == config.remote_site_names.end())) ||
+        (std::find(sites.begin(), it, *it) != it))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
 void Timer::update_sites_on_timer_pop()
 {
-  std::string local_site_name;
-  __globals->get_local_site_name(local_site_name);
+  ClusterConfigPtr config = __globals->get_cluster_config();
 
-  std::vector<std::string> remote_site_names;
-  __globals->get_remote_site_names(remote_site_names);
+  // The sites rarely change, and there's nothing to do if they haven't (so
+  // don't copy anything).
+  if (sites_are_current(sites, *config))
+  {
+    return;
+  }
 
-  std::vector<std::string> site_names;
+  const InternedString& local_site_name = config->local_site_name;
+  std::vector<std::string> remote_site_names = config->remote_site_names;
+
+  InternedStringList site_names;
 
   // Build up a new list of sites
   // - Firstly, remove any sites that no longer exist
   // - Secondly, add any new sites to the end of the list (local site first)
-  for (std::string site: sites)
+  for (const InternedString& site : sites)
   {
     std::vector<std::string>::iterator pos =
             std::find(remote_site_names.begin(), remote_site_names.end(), site);
@@ -546,8 +1030,9 @@ void Timer::update_sites_on_timer_pop()
     }
   }
 
-  if (std::find(site_names.begin(), site_names.end(), local_site_name)
-        == site_names.end())
+  if (std::find(site_names.begin(),
+                site_names.end(),
+                local_site_name) == site_names.end())
   {
     site_names.push_back(local_site_name);
   }
@@ -561,6 +1046,7 @@ void Timer::update_sites_on_timer_pop()
   }
 
   sites = site_names;
+  invalidate_pop_time();
 }
 
 // Generate a timer that should be unique across the (possibly geo-redundant)
@@ -568,14 +1054,10 @@ void Timer::update_sites_on_timer_pop()
 // timestamp and an incrementing sequence number.
 TimerID Timer::generate_timer_id()
 {
-  uint32_t instance_id = 0;
-  uint32_t deployment_id = 0;
-
-  __globals->get_instance_id(instance_id);
-  __globals->get_deployment_id(deployment_id);
+  ClusterConfigPtr config = __globals->get_cluster_config();
 
-  return (TimerID)Utils::generate_unique_integer(deployment_id,
-                                                 instance_id);
+  return (TimerID)Utils::generate_unique_integer(config->deployment_id,
+                                                 config->instance_id);
 }
 
 // Created tombstones from delete operations are given
@@ -594,13 +1076,25 @@ Timer* Timer::create_tombstone(TimerID id,
   return tombstone;
 }
 
+// The size of the buffer that Timer::from_json parses the JSON into. This is
+// plenty for the timers that clients and other Chronos nodes send (the DOM
+// doesn't hold the strings, which are left in the JSON). Larger timers are
+// still parsed, using memory from the heap once the buffer is full.
+static const size_t JSON_PARSE_BUFFER_SIZE = 4096;
+
 // Create a Timer object from the JSON representation.
 //
+// The JSON is parsed in place (so the strings in it aren't copied until
+// they're copied into the timer), with the parsed document held in a buffer
+// on the stack (so parsing a typical timer doesn't allocate).
+//
 // @param id - The unique identity for the timer (see generate_timer_id()
 //             above
 // @param replication_factor - The replication_factor extracted from the timer
 //                             URL (or 0 for new timer)
-// @param json - The JSON representation of the timer
+// @param json - The JSON representation of the timer. This is overwritten
+//               while it's parsed, so callers that don't need it afterwards
+//               should move it in
 // @param error - This will be populated with a descriptive error string if
 //                 required
 // @param replicated - This will be set to true if this is a replica of a timer
@@ -614,8 +1108,10 @@ Timer* Timer::from_json(TimerID id,
                         bool& replicated,
                         bool& gr_replicated)
 {
-  rapidjson::Document doc;
-  doc.Parse<0>(json.c_str());
+  char parse_buffer[JSON_PARSE_BUFFER_SIZE];
+  rapidjson::MemoryPoolAllocator<> allocator(parse_buffer, sizeof(parse_buffer));
+  rapidjson::Document doc(&allocator);
+  doc.ParseInsitu<0>(&json[0]);
 
   if (doc.HasParseError())
   {
@@ -715,6 +1211,11 @@ Timer* Timer::from_json_obj(TimerID id,
     JSON_GET_STRING_MEMBER(http, "uri", timer->callback_url);
     JSON_GET_STRING_MEMBER(http, "opaque", timer->callback_body);
 
+    if (http.HasMember("batch"))
+    {
+      JSON_GET_BOOL_MEMBER(http, "batch", timer->batch_callback);
+    }
+
     if (doc.HasMember("reliability"))
     {
       // Parse out the 'reliability' block
@@ -906,14 +1407,204 @@ Timer* Timer::from_json_obj(TimerID id,
   return timer;
 }
 
+// Create a Timer object from the binary representation (see to_binary()).
+// This takes the same parameters as from_json(), and treats the timer in the
+// same way - in particular, a timer with no replicas or sites is treated as a
+// timer that hasn't been replicated yet.
+Timer* Timer::from_binary(TimerID id,
+                          uint32_t replication_factor,
+                          uint64_t replica_hash,
+                          const std::string& body,
+                          std::string& error,
+                          bool& replicated,
+                          bool& gr_replicated)
+{
+  BinaryReader reader(body);
+
+  uint64_t version;
+  if (!reader.read_uint(version))
+  {
+    error = "Badly formed binary timer - no version";
+    return NULL;
+  }
+
+  if ((version != BINARY_FORMAT_VERSION) &&
+      (version != BINARY_FORMAT_VERSION_WITH_FLAGS))
+  {
+    error = "Unsupported binary timer version (";
+    error.append(std::to_string(version));
+    error.append(")");
+    return NULL;
+  }
+
+  int64_t start_time_delta;
+  uint32_t sequence_number;
+  uint32_t interval_ms;
+  uint32_t repeat_for;
+  std::string callback_url;
+  std::string callback_body;
+  uint64_t flags = 0;
+  std::string cluster_view_id;
+  uint64_t num_replicas;
+
+  if ((!reader.read_int(start_time_delta)) ||
+      (!reader.read_uint32(sequence_number)) ||
+      (!reader.read_uint32(interval_ms)) ||
+      (!reader.read_uint32(repeat_for)) ||
+      (!reader.read_string(callback_url)) ||
+      (!reader.read_string(callback_body)) ||
+      ((version == BINARY_FORMAT_VERSION_WITH_FLAGS) && (!reader.read_uint(flags))))
+  {
+    error = "Badly formed binary timer - truncated timing or callback";
+    return NULL;
+  }
+
+  if (!reader.read_string(cluster_view_id))
+  {
+    error = "Badly formed binary timer - truncated cluster view ID";
+    return NULL;
+  }
+
+  if (!reader.read_uint(num_replicas))
+  {
+    error = "Badly formed binary timer - truncated replicas";
+    return NULL;
+  }
+
+  if ((interval_ms == 0) && (repeat_for != 0))
+  {
+    // If the interval time is 0 and the repeat_for isn't then reject the timer.
+    error = "Can't have a zero interval time with a non-zero (";
+    error.append(std::to_string(repeat_for / 1000));
+    error.append(") repeat-for time");
+    return NULL;
+  }
+
+  Timer* timer = new Timer(id, interval_ms, repeat_for);
+  timer->start_time_mono_ms = clock_gettime_ms(CLOCK_MONOTONIC) + start_time_delta;
+  timer->sequence_number = sequence_number;
+  timer->callback_url = std::move(callback_url);
+  timer->callback_body = std::move(callback_body);
+  timer->batch_callback = ((flags & BINARY_FLAG_BATCH_CALLBACK) != 0);
+  timer->cluster_view_id = cluster_view_id;
+
+  std::string value;
+
+  for (uint64_t ii = 0; ii < num_replicas; ++ii)
+  {
+    if (!reader.read_string(value))
+    {
+      error = "Badly formed binary timer - truncated replicas";
+      delete timer; timer = NULL;
+      return NULL;
+    }
+
+    timer->replicas.push_back(value);
+  }
+
+  uint64_t num_sites;
+  if (!reader.read_uint(num_sites))
+  {
+    error = "Badly formed binary timer - truncated sites";
+    delete timer; timer = NULL;
+    return NULL;
+  }
+
+  for (uint64_t ii = 0; ii < num_sites; ++ii)
+  {
+    if (!reader.read_string(value))
+    {
+      error = "Badly formed binary timer - truncated sites";
+      delete timer; timer = NULL;
+      return NULL;
+    }
+
+    timer->sites.push_back(value);
+  }
+
+  uint64_t num_tags;
+  if (!reader.read_uint(num_tags))
+  {
+    error = "Badly formed binary timer - truncated tags";
+    delete timer; timer = NULL;
+    return NULL;
+  }
+
+  for (uint64_t ii = 0; ii < num_tags; ++ii)
+  {
+    uint32_t count;
+    if ((!reader.read_string(value)) || (!reader.read_uint32(count)))
+    {
+      error = "Badly formed binary timer - truncated tags";
+      delete timer; timer = NULL;
+      return NULL;
+    }
+
+    timer->tags[value] += count;
+  }
+
+  if (!reader.end())
+  {
+    error = "Badly formed binary timer - unexpected data after the tags";
+    delete timer; timer = NULL;
+    return NULL;
+  }
+
+  if (timer->replicas.empty())
+  {
+    // Replicas not specified, so this is from a client (or a Chronos in a
+    // different site), not another replica. Determine them now.
+    replicated = false;
+    timer->_replication_factor = replication_factor ? replication_factor : 2;
+    timer->calculate_replicas(replica_hash);
+  }
+  else
+  {
+    // Replicas were specified in the request, must be a replication message
+    // from another cluster node.
+    replicated = true;
+    timer->_replication_factor = (replication_factor > 0) ?
+                                  replication_factor :
+                                  timer->replicas.size();
+  }
+
+  if (timer->sites.empty())
+  {
+    gr_replicated = false;
+    timer->populate_sites();
+  }
+  else
+  {
+    gr_replicated = true;
+  }
+
+  return timer;
+}
+
 void Timer::update_cluster_information()
 {
-  // Update the replica list
-  replicas.clear();
+  PrecomputedReplicasPtr precomputed;
+  precomputed.swap(_precomputed_replicas);
+
+  if ((precomputed != NULL) &&
+      (precomputed->config_generation == __globals->get_config_generation()))
+  {
+    // The cluster information has already been worked out for the current
+    // configuration, so just copy it in.
+    replicas = precomputed->replicas;
+    extra_replicas.insert(extra_replicas.end(),
+                          precomputed->extra_replicas.begin(),
+                          precomputed->extra_replicas.end());
+    cluster_view_id = precomputed->cluster_view_id;
+    invalidate_pop_time();
+    return;
+  }
+
+  // Update the replica list. The replicas aren't cleared first, so that the
+  // interned addresses are kept (rather than released and interned again)
+  // if they haven't changed.
   calculate_replicas(0);
 
   // Update the cluster view ID
-  std::string global_cluster_view_id;
-  __globals->get_cluster_view_id(global_cluster_view_id);
- cluster_view_id = global_cluster_view_id;
+  cluster_view_id = __globals->get_cluster_config()->cluster_view_id;
 }
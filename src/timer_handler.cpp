@@ -10,6 +10,7 @@
  */
 
 #include <time.h>
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 
@@ -21,7 +22,14 @@
 
 void* TimerHandler::timer_handler_entry_func(void* arg)
 {
-  static_cast<TimerHandler*>(arg)->run();
+  Shard* shard = static_cast<Shard*>(arg);
+  shard->handler->run(shard);
+  return NULL;
+}
+
+void* TimerHandler::precompute_entry_func(void* arg)
+{
+  static_cast<TimerHandler*>(arg)->run_precompute();
   return NULL;
 }
 
@@ -32,68 +40,183 @@ TimerHandler::TimerHandler(TimerStore* store,
                            SNMP::ContinuousIncrementTable* all_timers_table,
                            SNMP::InfiniteTimerCountTable* tagged_timers_table,
                            SNMP::InfiniteScalarTable* scalar_timers_table) :
-  _store(store),
+  TimerHandler(std::vector<TimerStore*>(1, store),
+               callback,
+               replicator,
+               gr_replicator,
+               all_timers_table,
+               tagged_timers_table,
+               scalar_timers_table)
+{
+}
+
+TimerHandler::TimerHandler(std::vector<TimerStore*> stores,
+                           Callback* callback,
+                           Replicator* replicator,
+                           GRReplicator* gr_replicator,
+                           SNMP::ContinuousIncrementTable* all_timers_table,
+                           SNMP::InfiniteTimerCountTable* tagged_timers_table,
+                           SNMP::InfiniteScalarTable* scalar_timers_table,
+                           bool queue_timer_adds,
+                           SNMP::EventAccumulatorTable* lock_hold_time_table,
+                           SNMP::EventAccumulatorTable* add_queue_depth_table,
+                           SNMP::U32Scalar* precompute_remaining_scalar,
+                           SNMP::U32Scalar* timer_pool_scalar) :
   _callback(callback),
   _replicator(replicator),
   _gr_replicator(gr_replicator),
   _all_timers_table(all_timers_table),
   _tagged_timers_table(tagged_timers_table),
   _scalar_timers_table(scalar_timers_table),
-  _terminate(false),
-  _nearest_new_timer(-1)
+  _queue_timer_adds(queue_timer_adds),
+  _lock_hold_time_table(lock_hold_time_table),
+  _add_queue_depth_table(add_queue_depth_table),
+  _precompute_queue(new BatchQueue<Shard*>(stores.size())),
+  _precompute_remaining_scalar(precompute_remaining_scalar),
+  _timer_pool_scalar(timer_pool_scalar),
+  _terminate(false)
 {
-  pthread_mutex_init(&_mutex, NULL);
+  pthread_mutex_init(&_precompute_report_lock, NULL);
+
+  // Set up all the shards before starting any threads, as the threads can
+  // call back into the handler straight away.
+  for (TimerStore* store : stores)
+  {
+    Shard* shard = new Shard();
+    shard->handler = this;
+    shard->store = store;
+    shard->timer_count = 0;
+    shard->sleeping = false;
+    shard->wake_time_set = false;
+    shard->wake_time_ms = 0;
+    shard->waiting_for_adds = false;
+    shard->lock_time_us = 0;
+    shard->precompute_remaining = 0;
+    pthread_mutex_init(&shard->mutex, NULL);
 
 #ifdef UNIT_TEST
-  _cond = new MockPThreadCondVar(&_mutex);
+    shard->cond = new MockPThreadCondVar(&shard->mutex);
 #else
-  _cond = new CondVar(&_mutex);
+    shard->cond = new CondVar(&shard->mutex);
 #endif
 
-  int rc = pthread_create(&_handler_thread,
-                          NULL,
-                          &timer_handler_entry_func,
-                          (void*)this);
-  if (rc < 0)
+    _shards.push_back(shard);
+  }
+
+  TRC_STATUS("Starting timer handler with %lu shards", _shards.size());
+
+  for (Shard* shard : _shards)
   {
-    // LCOV_EXCL_START
-    printf("Failed to start timer handling thread: %s", strerror(errno));
-    exit(2);
-    // LCOV_EXCL_STOP
+    int rc = pthread_create(&shard->thread,
+                            NULL,
+                            &timer_handler_entry_func,
+                            (void*)shard);
+    if (rc < 0)
+    {
+      // LCOV_EXCL_START
+      printf("Failed to start timer handling thread: %s", strerror(errno));
+      exit(2);
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  _precompute_threads.resize(_shards.size());
+
+  for (pthread_t& thread : _precompute_threads)
+  {
+    int rc = pthread_create(&thread, NULL, &precompute_entry_func, (void*)this);
+    if (rc < 0)
+    {
+      // LCOV_EXCL_START
+      printf("Failed to start replica precomputing thread: %s", strerror(errno));
+      exit(2);
+      // LCOV_EXCL_STOP
+    }
   }
 }
 
 TimerHandler::~TimerHandler()
 {
-  if (_handler_thread)
+  // Tell all the shards to stop, then wait for them to do so.
+  for (Shard* shard : _shards)
   {
-    pthread_mutex_lock(&_mutex);
+    pthread_mutex_lock(&shard->mutex);
     _terminate = true;
-    _cond->signal();
-    pthread_mutex_unlock(&_mutex);
-    pthread_join(_handler_thread, NULL);
+    shard->cond->signal();
+    pthread_mutex_unlock(&shard->mutex);
+  }
+
+  // The precomputing threads use the shards, so stop them first.
+  if (_precompute_queue != NULL)
+  {
+    _precompute_queue->terminate();
+
+    for (pthread_t& thread : _precompute_threads)
+    {
+      pthread_join(thread, NULL);
+    }
+
+    _precompute_threads.clear();
+    delete _precompute_queue; _precompute_queue = NULL;
+    pthread_mutex_destroy(&_precompute_report_lock);
+  }
+
+  for (Shard* shard : _shards)
+  {
+    pthread_join(shard->thread, NULL);
+    delete shard->cond;
+    pthread_mutex_destroy(&shard->mutex);
+    delete shard;
   }
-  delete _cond;
-  _cond = NULL;
 
-  pthread_mutex_destroy(&_mutex);
+  _shards.clear();
   delete _callback;
 }
 
 void TimerHandler::add_timer(Timer* timer, bool update_stats)
 {
-  pthread_mutex_lock(&_mutex);
+  Shard* shard = shard_for(timer->id);
+  lock_shard(shard);
+  add_timer_to_shard(shard, timer, update_stats);
+  unlock_shard(shard);
+}
+
+void TimerHandler::queue_timer(Timer* timer)
+{
+  if (!_queue_timer_adds)
+  {
+    add_timer(timer);
+    return;
+  }
+
+  Shard* shard = shard_for(timer->id);
+  shard->queued_timers.push(timer);
+
+  // If the shard's thread is sleeping (or about to), wake it to add the
+  // timer. Only the first timer queued after it starts sleeping needs to.
+  if (shard->waiting_for_adds.exchange(false))
+  {
+    TRC_DEBUG("Waking shard thread to add timer %lu", timer->id);
+    lock_shard(shard);
+    shard->cond->signal();
+    unlock_shard(shard);
+  }
+}
 
+void TimerHandler::add_timer_to_shard(Shard* shard,
+                                      Timer* timer,
+                                      bool update_stats)
+{
   // Pull out any existing timer from the timer store
   Timer* existing_timer = NULL;
-  _store->fetch(timer->id, &existing_timer);
+  shard->store->fetch(timer->id, &existing_timer);
 
   // We've found a timer.
   if (existing_timer)
   {
     bool will_add_timer = true;
-    std::string cluster_view_id;
-    __globals->get_cluster_view_id(cluster_view_id);
+    InternedString cluster_view_id =
+                             __globals->get_cluster_config()->cluster_view_id;
 
     if ((timer->is_matching_cluster_view_id(cluster_view_id)) &&
         !(existing_timer->is_matching_cluster_view_id(cluster_view_id)))
@@ -215,9 +338,8 @@ void TimerHandler::add_timer(Timer* timer, bool update_stats)
   delete existing_timer;
 
   TRC_DEBUG("Inserting the new timer with ID %llu", timer->id);
-  _store->insert(timer);
-
-  pthread_mutex_unlock(&_mutex);
+  wake_for_timer(shard, timer);
+  shard->store->insert(timer);
 }
 
 void TimerHandler::return_timer(Timer* timer)
@@ -250,10 +372,11 @@ void TimerHandler::return_timer(Timer* timer)
 void TimerHandler::handle_successful_callback(TimerID timer_id)
 {
   // Fetch the timer from the store and replicate it (within and cross-site)
-  pthread_mutex_lock(&_mutex);
+  Shard* shard = shard_for(timer_id);
+  lock_shard(shard);
 
   Timer* timer = NULL;
-  _store->fetch(timer_id, &timer);
+  shard->store->fetch(timer_id, &timer);
 
   if (timer)
   {
@@ -261,27 +384,34 @@ void TimerHandler::handle_successful_callback(TimerID timer_id)
     // the remote sites (it will only exist if the system has been configured to
     // replicate across sites).
     timer->update_sites_on_timer_pop();
-    _replicator->replicate(timer);
 
-    if (_gr_replicator != NULL)
     {
-      _gr_replicator->replicate(timer);
+      // The replicators share the bodies they send.
+      ReplicationBodies bodies(timer);
+      _replicator->replicate(timer);
+
+      if (_gr_replicator != NULL)
+      {
+        _gr_replicator->replicate(timer);
+      }
     }
 
     // Pass the timer pair back to the store, relinquishing responsibility for it.
-    _store->insert(timer);
+    wake_for_timer(shard, timer);
+    shard->store->insert(timer);
   }
 
-  pthread_mutex_unlock(&_mutex);
+  unlock_shard(shard);
 }
 
 void TimerHandler::handle_failed_callback(TimerID timer_id)
 {
   // Fetch the timer from the store and delete it.
-  pthread_mutex_lock(&_mutex);
+  Shard* shard = shard_for(timer_id);
+  lock_shard(shard);
   Timer* timer = NULL;
-  _store->fetch(timer_id, &timer);
-  pthread_mutex_unlock(&_mutex);
+  shard->store->fetch(timer_id, &timer);
+  unlock_shard(shard);
 
   if (timer)
   {
@@ -309,7 +439,19 @@ HTTPCode TimerHandler::get_timers_for_node(std::string request_node,
   // parameter in the future to help with resynchronisation operations. We
   // pass it into the timer handler now to help with UTing the handler code
 
-  pthread_mutex_lock(&_mutex);
+  // Walk the shards' stores together, always taking the timer that pops
+  // soonest. This returns the timers in the same order as if they were all in
+  // a single store. The shards are only locked briefly as we go, so timers
+  // can be added, updated and popped in the meantime - any timers that change
+  // after we reach them are left out (as their new replicas are sent the
+  // changes anyway).
+  ClusterReplicaView cluster;
+  std::vector<ResyncCursor> cursors;
+
+  for (Shard* shard : _shards)
+  {
+    cursors.push_back(ResyncCursor(this, shard, time_from, &cluster, &request_node));
+  }
 
   // Create the JSON doc for the Timer information
   rapidjson::StringBuffer sb;
@@ -321,32 +463,60 @@ HTTPCode TimerHandler::get_timers_for_node(std::string request_node,
 
   TRC_DEBUG("Get timers for %s", request_node.c_str());
 
+  InternedString interned_request_node(request_node);
   int retrieved_timers = 0;
   uint32_t last_time_from = 0;
   uint32_t current_time_from = 0;
 
-  for (TimerStore::TSIterator it = _store->begin(time_from);
-       !(it.end());
-       ++it)
+  while (true)
   {
-    Timer* timer_copy = new Timer(**it);
-    current_time_from = timer_copy->next_pop_time();
+    ResyncCursor* next_cursor = NULL;
+
+    for (ResyncCursor& cursor : cursors)
+    {
+      if ((!cursor.end()) &&
+          ((next_cursor == NULL) ||
+           (Utils::overflow_less_than((*cursor).pop_time,
+                                      (**next_cursor).pop_time))))
+      {
+        next_cursor = &cursor;
+      }
+    }
+
+    if (next_cursor == NULL)
+    {
+      break;
+    }
+
+    current_time_from = (**next_cursor).pop_time;
 
-    // Break out of the for loop once we hit the maximum number of
+    // Break out of the loop once we hit the maximum number of
     // timers to collect, and we know that the next timer doesn't
     // have the same pop time as our last timer
     if ((retrieved_timers >= max_rsps_with_unique_pop_time) &&
         (last_time_from != current_time_from))
     {
       TRC_DEBUG("Reached the max number of timers to collect");
-      delete timer_copy;
       break;
     }
 
-    if (!timer_copy->is_tombstone())
+    // Most timers don't belong on the requesting node, so check whether this
+    // one does from its ID before copying it. Otherwise we'd copy every
+    // timer just to work out its replicas.
+    if (!next_cursor->on_node())
+    {
+      ++(*next_cursor);
+      last_time_from = current_time_from;
+      continue;
+    }
+
+    Timer* timer_copy = next_cursor->copy_timer();
+    ++(*next_cursor);
+
+    if (timer_copy != NULL)
     {
-      std::vector<std::string> old_replicas;
-      if (timer_is_on_node(request_node,
+      InternedStringList old_replicas;
+      if (timer_is_on_node(interned_request_node,
                            timer_copy,
                            old_replicas))
       {
@@ -362,7 +532,7 @@ HTTPCode TimerHandler::get_timers_for_node(std::string request_node,
           // Add the old replicas
           writer.String(JSON_OLD_REPLICAS);
           writer.StartArray();
-          for (std::vector<std::string>::const_iterator i = old_replicas.begin();
+          for (InternedStringList::const_iterator i = old_replicas.begin();
                i != old_replicas.end();
                ++i)
           {
@@ -388,7 +558,6 @@ HTTPCode TimerHandler::get_timers_for_node(std::string request_node,
   writer.EndArray();
   writer.EndObject();
   get_response = sb.GetString();
-  pthread_mutex_unlock(&_mutex);
 
   TRC_DEBUG("Retrieved %d timers", retrieved_timers);
   return (retrieved_timers >= max_rsps_with_unique_pop_time) ?
@@ -396,34 +565,283 @@ HTTPCode TimerHandler::get_timers_for_node(std::string request_node,
                                         HTTP_OK;
 }
 
-bool TimerHandler::timer_is_on_node(std::string request_node,
-                                    Timer* timer,
-                                    std::vector<std::string>& old_replicas)
+TimerHandler::ResyncCursor::ResyncCursor(TimerHandler* handler,
+                                         Shard* shard,
+                                         uint32_t time_from,
+                                         const ClusterReplicaView* cluster,
+                                         const std::string* node) :
+  _handler(handler),
+  _shard(shard),
+  _cluster(cluster),
+  _node(node),
+  _next(0),
+  _more(true),
+  _time_from(time_from)
 {
-  bool timer_is_on_requesting_node = false;
+  refill();
+}
 
-  // Store the old replica list
-  std::string localhost;
-  __globals->get_cluster_local_ip(localhost);
-  old_replicas = timer->replicas;
+TimerHandler::ResyncCursor& TimerHandler::ResyncCursor::operator++()
+{
+  ++_next;
 
-  // Calculate whether the new request node is interested in the timer. This
-  // updates the replica list in the timer object to be the new replica list
-  timer->update_cluster_information();
+  if ((_next == _entries.size()) && (_more))
+  {
+    refill();
+  }
+
+  return *this;
+}
+
+Timer* TimerHandler::ResyncCursor::copy_timer()
+{
+  const TimerStore::ResyncEntry& entry = _entries[_next];
+  Timer* timer_copy = NULL;
+
+  _handler->lock_shard(_shard);
+  Timer* timer = _shard->store->_timer_lookup_id_table.find(entry.id);
+
+  if ((timer != NULL) &&
+      (timer->next_pop_time() == entry.pop_time) &&
+      (!timer->is_tombstone()))
+  {
+    timer_copy = new Timer(*timer);
+  }
+
+  _handler->unlock_shard(_shard);
+
+  if (timer_copy == NULL)
+  {
+    TRC_DEBUG("Timer %lu changed during resync", entry.id);
+  }
+
+  return timer_copy;
+}
 
-  int index = 0;
-  for (std::vector<std::string>::iterator it = timer->replicas.begin();
-                                          it != timer->replicas.end();
-                                          ++it, ++index)
+void TimerHandler::ResyncCursor::refill()
+{
+  // Carry on from the last timer we got.
+  for (const TimerStore::ResyncEntry& entry : _entries)
   {
-    if (*it == request_node)
+    if (entry.pop_time != _time_from)
     {
-      timer_is_on_requesting_node = true;
-      break;
+      _time_from = entry.pop_time;
+      _ids_at_time_from.clear();
+    }
+
+    _ids_at_time_from.push_back(entry.id);
+  }
+
+  std::sort(_ids_at_time_from.begin(), _ids_at_time_from.end());
+  _entries.clear();
+  _next = 0;
+
+  _handler->lock_shard(_shard);
+  _more = _shard->store->get_resync_entries(_time_from,
+                                            _ids_at_time_from,
+                                            BATCH_SIZE,
+                                            _entries);
+  _handler->unlock_shard(_shard);
+
+  // The store doesn't sort the timers, so that we can do it here without
+  // holding the shard's lock.
+  std::sort(_entries.begin(),
+            _entries.end(),
+            [](const TimerStore::ResyncEntry& a, const TimerStore::ResyncEntry& b)
+            {
+              return ((Utils::overflow_less_than(a.pop_time, b.pop_time)) ||
+                      ((a.pop_time == b.pop_time) && (a.id < b.id)));
+            });
+
+  if (_cluster != NULL)
+  {
+    std::vector<TimerID> ids;
+    std::vector<uint32_t> replication_factors;
+    ids.reserve(_entries.size());
+    replication_factors.reserve(_entries.size());
+
+    for (const TimerStore::ResyncEntry& entry : _entries)
+    {
+      ids.push_back(entry.id);
+      replication_factors.push_back(entry.replication_factor);
+    }
+
+    _cluster->are_replicas(ids, replication_factors, *_node, _on_node);
+  }
+  else
+  {
+    _on_node.assign(_entries.size(), false);
+  }
+}
+
+void TimerHandler::update_pop_times()
+{
+  for (Shard* shard : _shards)
+  {
+    lock_shard(shard);
+    shard->store->update_pop_times();
+
+    // The thread may be sleeping until a time worked out from the old pop
+    // times, so wake it to work out when to wake again.
+    if (shard->sleeping)
+    {
+      shard->sleeping = false;
+      shard->cond->signal();
+    }
+
+    unlock_shard(shard);
+  }
+}
+
+void TimerHandler::precompute_replicas()
+{
+  if (_precompute_queue != NULL)
+  {
+    TRC_STATUS("Precomputing the replicas for all timers");
+
+    // Count all the timers before any shard starts, so the progress reported
+    // doesn't drop to zero while some shards are still waiting to start.
+    for (Shard* shard : _shards)
+    {
+      lock_shard(shard);
+      shard->precompute_remaining = shard->store->_timer_lookup_id_table.size();
+      unlock_shard(shard);
+    }
+
+    report_precompute_remaining();
+
+    std::vector<Shard*> shards = _shards;
+    _precompute_queue->push_batch(shards);
+  }
+}
+
+void TimerHandler::run_precompute()
+{
+  std::vector<Shard*> shards;
+
+  while (_precompute_queue->pop_batch(shards, 1))
+  {
+    for (Shard* shard : shards)
+    {
+      precompute_shard(shard);
+    }
+
+    shards.clear();
+  }
+}
+
+void TimerHandler::precompute_shard(Shard* shard)
+{
+  ClusterReplicaView cluster;
+
+  lock_shard(shard);
+  shard->precompute_remaining = shard->store->_timer_lookup_id_table.size();
+  unlock_shard(shard);
+  report_precompute_remaining();
+
+  // Walk through the timers in pop time order, so that the timers that pop
+  // soonest are done first. The cluster information is worked out without
+  // holding the shard's lock, and only set on the timers that haven't
+  // changed in the meantime.
+  ResyncCursor cursor(this, shard, Utils::get_time(), NULL, NULL);
+  std::vector<TimerStore::ResyncEntry> entries;
+  std::vector<TimerID> ids;
+  std::vector<uint32_t> replication_factors;
+  std::vector<PrecomputedReplicasPtr> precomputed;
+
+  // Stop if the configuration changes, as there'll be another pass for the
+  // new configuration.
+  while ((!cursor.end()) &&
+         (!_terminate) &&
+         (cluster.config_generation() == __globals->get_config_generation()))
+  {
+    entries.clear();
+    ids.clear();
+    replication_factors.clear();
+
+    for (; (!cursor.end()) && (entries.size() < PRECOMPUTE_BATCH_SIZE); ++cursor)
+    {
+      entries.push_back(*cursor);
+      ids.push_back((*cursor).id);
+      replication_factors.push_back((*cursor).replication_factor);
+    }
+
+    cluster.precompute_replicas(ids, replication_factors, precomputed);
+
+    lock_shard(shard);
+
+    for (size_t ii = 0; ii < entries.size(); ++ii)
+    {
+      Timer* timer = shard->store->_timer_lookup_id_table.find(entries[ii].id);
+
+      if ((timer != NULL) && (timer->next_pop_time() == entries[ii].pop_time))
+      {
+        timer->set_precomputed_replicas(precomputed[ii]);
+      }
+    }
+
+    unlock_shard(shard);
+
+    uint32_t remaining = shard->precompute_remaining;
+    shard->precompute_remaining = (remaining > entries.size()) ?
+                                  (remaining - entries.size()) : 0;
+    report_precompute_remaining();
+  }
+
+  // If this pass stopped early because the configuration changed, leave the
+  // count for the pass that replaces it.
+  if (cursor.end())
+  {
+    shard->precompute_remaining = 0;
+    report_precompute_remaining();
+  }
+}
+
+void TimerHandler::report_precompute_remaining()
+{
+  if (_precompute_remaining_scalar != NULL)
+  {
+    pthread_mutex_lock(&_precompute_report_lock);
+    uint32_t remaining = 0;
+
+    for (Shard* shard : _shards)
+    {
+      remaining += shard->precompute_remaining;
     }
+
+    _precompute_remaining_scalar->value = remaining;
+    pthread_mutex_unlock(&_precompute_report_lock);
+  }
+}
+
+void TimerHandler::report_timer_pool()
+{
+  if (_timer_pool_scalar != NULL)
+  {
+    _timer_pool_scalar->value = ObjectPool<Timer>::heap_allocations();
   }
+}
 
-  return timer_is_on_requesting_node;
+TimerHandler::Shard* TimerHandler::shard_for(TimerID id)
+{
+  // Timer IDs aren't uniformly distributed in their low bits (they embed the
+  // instance and deployment IDs), so mix them before choosing a shard.
+  uint64_t hash = (id * 0x9E3779B97F4A7C15ULL) >> 32;
+  return _shards[hash % _shards.size()];
+}
+
+bool TimerHandler::timer_is_on_node(const InternedString& request_node,
+                                    Timer* timer,
+                                    InternedStringList& old_replicas)
+{
+  // Store the old replica list
+  old_replicas = timer->replicas;
+
+  // Calculate whether the new request node is interested in the timer. This
+  // updates the replica list in the timer object to be the new replica list
+  timer->update_cluster_information();
+
+  return timer->is_local(request_node);
 }
 
 // The core function in the timer handler, basic principle is to loop around repeatedly
@@ -432,49 +850,90 @@ bool TimerHandler::timer_is_on_node(std::string request_node,
 // If there are no timers in the store at all, we wait forever for one to be added (or
 // until we're terminated).  If we are woken while waiting for one set of timers to
 // pop, check the timer store to make sure we're holding the nearest timers.
-void TimerHandler::run()
+//
+// Each shard runs this loop on its own thread, over the timers in its store.
+// Timers queued for the shard are added each time round the loop, in a batch.
+void TimerHandler::run(Shard* shard)
 {
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
-  pthread_mutex_lock(&_mutex);
+  lock_shard(shard);
 
-  _store->fetch_next_timers(next_timers);
+  shard->store->fetch_next_timers(next_timers);
 
   while (!_terminate)
   {
     if (!next_timers.empty())
     {
       TRC_DEBUG("Have a timer to pop");
-      _timer_count -= next_timers.size();
-      pthread_mutex_unlock(&_mutex);
+      shard->timer_count -= next_timers.size();
+      unlock_shard(shard);
       pop(next_timers);
-      pthread_mutex_lock(&_mutex);
+      lock_shard(shard);
     }
     else
     {
-      struct timespec next_pop;
-      clock_gettime(CLOCK_MONOTONIC, &next_pop);
-
-      // Work out how long we should wait for (this should be the length of the
-      // short wheel bucket - if this crosses a second boundary then set the
-      // secs/nsecs appropriately).
-      if (next_pop.tv_nsec < (1000 - _store->SHORT_WHEEL_RESOLUTION_MS) * 1000 * 1000)
+      // Timers are allocated as they're added, so report how big the timer
+      // pool has got before going to sleep.
+      report_timer_pool();
+
+      // Sleep until the store next has any work to do (rather than waking up
+      // on every tick). Timers added in the meantime that need to pop sooner
+      // wake us early.
+      int rc = 0;
+      uint32_t wake_time_ms = 0;
+      shard->wake_time_set = shard->store->next_tick_time(wake_time_ms);
+      shard->wake_time_ms = wake_time_ms;
+
+      // Let queue_timer know it needs to wake us, then check nothing was
+      // queued before it could see that.
+      shard->waiting_for_adds = true;
+
+      if (!shard->queued_timers.empty())
       {
-        // LCOV_EXCL_START - We can't guarantee which of these two paths we go
-        // through in UT
-        next_pop.tv_nsec += _store->SHORT_WHEEL_RESOLUTION_MS * 1000 * 1000;
-        // LCOV_EXCL_STOP
+        TRC_DEBUG("Timers queued to add");
+      }
+      else if (!shard->wake_time_set)
+      {
+        TRC_DEBUG("No timers to wait for");
+        shard->sleeping = true;
+        unlocked(shard);
+        rc = shard->cond->wait();
+        locked(shard);
       }
       else
       {
-        // LCOV_EXCL_START - We can't guarantee which of these two paths we go
-        // through in UT
-        next_pop.tv_nsec -= (1000 - _store->SHORT_WHEEL_RESOLUTION_MS) * 1000 * 1000;
-        next_pop.tv_sec += 1;
-        // LCOV_EXCL_STOP
+        struct timespec wake_time;
+        clock_gettime(CLOCK_MONOTONIC, &wake_time);
+        uint64_t now_ms = ((uint64_t)wake_time.tv_sec * 1000) +
+                          (wake_time.tv_nsec / (1000 * 1000));
+
+        if (Utils::overflow_less_than((uint32_t)now_ms, wake_time_ms))
+        {
+          // Work out the absolute time to wake up at, carrying any whole
+          // seconds over from the nanoseconds.
+          uint32_t delay_ms = wake_time_ms - (uint32_t)now_ms;
+          wake_time.tv_sec += delay_ms / 1000;
+          wake_time.tv_nsec += (delay_ms % 1000) * 1000 * 1000;
+
+          if (wake_time.tv_nsec >= 1000 * 1000 * 1000)
+          {
+            // LCOV_EXCL_START - We can't guarantee which of these two paths we
+            // go through in UT
+            wake_time.tv_nsec -= 1000 * 1000 * 1000;
+            wake_time.tv_sec += 1;
+            // LCOV_EXCL_STOP
+          }
+
+          shard->sleeping = true;
+          unlocked(shard);
+          rc = shard->cond->timedwait(&wake_time);
+          locked(shard);
+        }
       }
 
-      int rc = _cond->timedwait(&next_pop);
+      shard->sleeping = false;
+      shard->waiting_for_adds = false;
 
       if (rc < 0 && rc != ETIMEDOUT)
       {
@@ -485,36 +944,120 @@ void TimerHandler::run()
       }
     }
 
-
-    _store->fetch_next_timers(next_timers);
+    add_queued_timers(shard);
+    shard->store->fetch_next_timers(next_timers);
   }
 
+  // Throw away any timers still waiting to be popped or added.
+  shard->queued_timers.pop_all(next_timers);
 
-  for (std::unordered_set<Timer*>::iterator it = next_timers.begin();
-                                            it != next_timers.end();
-                                            ++it)
+  for (Timer* timer : next_timers)
   {
-    delete *it;
+    delete timer;
   }
 
   next_timers.clear();
 
-  pthread_mutex_unlock(&_mutex);
+  unlock_shard(shard);
 }
 
 /*****************************************************************************/
 /* PRIVATE FUNCTIONS                                                         */
 /*****************************************************************************/
 
-// Pop a set of timers, this function takes ownership of the timers and
-// thus empties the passed in set.
-void TimerHandler::pop(std::unordered_set<Timer*>& timers)
+void TimerHandler::lock_shard(Shard* shard)
+{
+  pthread_mutex_lock(&shard->mutex);
+  locked(shard);
+}
+
+void TimerHandler::unlock_shard(Shard* shard)
+{
+  unlocked(shard);
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+static uint64_t monotonic_time_us()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+void TimerHandler::locked(Shard* shard)
+{
+  if (_lock_hold_time_table)
+  {
+    shard->lock_time_us = monotonic_time_us();
+  }
+}
+
+void TimerHandler::unlocked(Shard* shard)
+{
+  if (_lock_hold_time_table)
+  {
+    _lock_hold_time_table->accumulate(monotonic_time_us() - shard->lock_time_us);
+  }
+}
+
+void TimerHandler::add_queued_timers(Shard* shard)
+{
+  if (shard->queued_timers.empty())
+  {
+    return;
+  }
+
+  std::vector<Timer*> timers;
+  shard->queued_timers.pop_all(timers);
+  TRC_DEBUG("Adding %lu queued timers", timers.size());
+
+  if (_add_queue_depth_table)
+  {
+    _add_queue_depth_table->accumulate(timers.size());
+  }
+
+  for (Timer* timer : timers)
+  {
+    add_timer_to_shard(shard, timer, true);
+  }
+}
+
+void TimerHandler::wake_for_timer(Shard* shard, Timer* timer)
 {
-  for (std::unordered_set<Timer*>::iterator it = timers.begin();
-                                            it != timers.end();
-                                            ++it)
+  // If the thread has no wake time, it's waiting for the first timer to be
+  // added. Once signalled, the thread works out its new wake time itself, so
+  // there's no need to signal it again.
+  if ((shard->sleeping) &&
+      ((!shard->wake_time_set) ||
+       (Utils::overflow_less_than(timer->next_pop_time(),
+                                  shard->wake_time_ms))))
   {
-    pop(*it);
+    TRC_DEBUG("Waking shard thread for timer %lu", timer->id);
+    shard->sleeping = false;
+    shard->cond->signal();
+  }
+}
+
+// Pop a batch of timers, passing them on to the callback together.
+void TimerHandler::pop(std::vector<Timer*>& timers)
+{
+  // Drop any tombstones from the batch, keeping the rest in order.
+  size_t num_to_pop = 0;
+
+  for (Timer* timer : timers)
+  {
+    if (prepare_to_pop(timer))
+    {
+      timers[num_to_pop++] = timer;
+    }
+  }
+
+  timers.resize(num_to_pop);
+
+  // The callback takes ownership of the timers at this point.
+  if (!timers.empty())
+  {
+    _callback->perform_batch(timers);
   }
 
   timers.clear();
@@ -523,14 +1066,23 @@ void TimerHandler::pop(std::unordered_set<Timer*>& timers)
 // Pop a specific timer, if required pass the timer on to the replication layer to
 // reset the timer for another pop, otherwise destroy the timer record.
 void TimerHandler::pop(Timer* timer)
+{
+  if (prepare_to_pop(timer))
+  {
+    // The callback borrows of the timer at this point.
+    // cppcheck-suppress uselessAssignmentPtrArg
+    _callback->perform(timer); timer = NULL;
+  }
+}
+
+bool TimerHandler::prepare_to_pop(Timer* timer)
 {
   // Tombstones are reaped when they pop.
   if (timer->is_tombstone())
   {
     TRC_DEBUG("Discarding expired tombstone");
     delete timer;
-    timer = NULL;
-    return;
+    return false;
   }
 
   // Increment the timer's sequence before sending the callback.
@@ -538,10 +1090,7 @@ void TimerHandler::pop(Timer* timer)
 
   // Update the timer in case it has out of date configuration
   timer->update_cluster_information();
-
-  // The callback borrows of the timer at this point.
-  // cppcheck-suppress uselessAssignmentPtrArg
-  _callback->perform(timer); timer = NULL;
+  return true;
 }
 
 void TimerHandler::save_tombstone_information(Timer* t, Timer* existing)
@@ -560,24 +1109,25 @@ void TimerHandler::save_site_information(Timer* new_timer, Timer* old_timer)
   // Firstly, check if the sites are the same (potentially in a different
   // order). We expect this to be the mainline case, so we always do this
   // cheaper check
-  std::vector<std::string> old_timer_sites = old_timer->sites;
-  std::vector<std::string> new_timer_sites = new_timer->sites;
+  InternedStringList old_timer_sites = old_timer->sites;
+  InternedStringList new_timer_sites = new_timer->sites;
   std::sort(old_timer_sites.begin(), old_timer_sites.end());
   std::sort(new_timer_sites.begin(), new_timer_sites.end());
 
   if (old_timer_sites == new_timer_sites)
   {
     new_timer->sites = old_timer->sites;
+    new_timer->invalidate_pop_time();
     return;
   }
 
   // The sites aren't the same. We have to check the sites to make sure that
   // the site ordering is retained (which is O(n^2) cost - but this only
   // happens when the sites are added/removed which we expect to be rare).
-  std::vector<std::string> site_names;
+  InternedStringList site_names;
 
   // Remove any sites that aren't in the new timer
-  for (std::string site: old_timer->sites)
+  for (const InternedString& site : old_timer->sites)
   {
     if (std::find(new_timer->sites.begin(), new_timer->sites.end(), site) !=
         new_timer->sites.end())
@@ -591,7 +1141,7 @@ void TimerHandler::save_site_information(Timer* new_timer, Timer* old_timer)
   }
 
   // Add any new sites that are only in the new timer
-  for (std::string site: new_timer->sites)
+  for (const InternedString& site : new_timer->sites)
   {
     if (std::find(site_names.begin(), site_names.end(), site) ==
         site_names.end())
@@ -602,6 +1152,7 @@ void TimerHandler::save_site_information(Timer* new_timer, Timer* old_timer)
   }
 
   new_timer->sites = site_names;
+  new_timer->invalidate_pop_time();
 }
 
 // Report an update to the number of timers to statistics
@@ -0,0 +1,328 @@
+/**
+ * @file timer_id_table.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "timer_id_table.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+Timer* const TimerIDTable::MOVED = reinterpret_cast<Timer*>(1);
+
+TimerIDTable::TimerIDTable() :
+  _migrate_pos(0),
+  _last_empty_pos(0),
+  _released_pos(0),
+  _size(0)
+{
+  allocate(_table, INITIAL_CAPACITY);
+  _old_table.slots = NULL;
+  _old_table.capacity = 0;
+  _old_table.shift = 0;
+}
+
+TimerIDTable::~TimerIDTable()
+{
+  release(_old_table);
+  release(_table);
+}
+
+Timer* TimerIDTable::find(TimerID id) const
+{
+  Slot* slot = find_slot(_table, id);
+
+  if ((slot == NULL) && (_old_table.slots != NULL))
+  {
+    slot = find_slot(_old_table, id);
+  }
+
+  return (slot != NULL) ? slot->timer : NULL;
+}
+
+void TimerIDTable::insert(TimerID id, Timer* timer)
+{
+  migrate(MIGRATE_SLOTS_PER_OP);
+
+  if ((_size + 1) * MAX_LOAD_DENOMINATOR >
+      _table.capacity * MAX_LOAD_NUMERATOR)
+  {
+    grow();
+  }
+
+  insert_slot(_table, id, timer);
+  ++_size;
+}
+
+bool TimerIDTable::erase(TimerID id)
+{
+  migrate(MIGRATE_SLOTS_PER_OP);
+
+  Slot* slot = find_slot(_table, id);
+
+  if (slot != NULL)
+  {
+    erase_slot(_table, slot);
+    --_size;
+    return true;
+  }
+
+  if (_old_table.slots != NULL)
+  {
+    slot = find_slot(_old_table, id);
+
+    if (slot != NULL)
+    {
+      slot->timer = MOVED;
+      --_size;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void TimerIDTable::clear()
+{
+  release(_old_table);
+  release(_table);
+  allocate(_table, INITIAL_CAPACITY);
+  _migrate_pos = 0;
+  _last_empty_pos = 0;
+  _released_pos = 0;
+  _size = 0;
+}
+
+/*****************************************************************************/
+/* Private functions.                                                        */
+/*****************************************************************************/
+
+void TimerIDTable::allocate(Table& table, size_t capacity)
+{
+  // Use calloc rather than new[] so that large tables are mapped in lazily
+  // as zero pages, rather than being zeroed up front (which takes hundreds of
+  // ms with tens of millions of slots, and would stall the tick thread).
+  table.slots = static_cast<Slot*>(calloc(capacity, sizeof(Slot)));
+  table.capacity = capacity;
+  table.shift = 64;
+
+  while (capacity > 1)
+  {
+    capacity >>= 1;
+    --table.shift;
+  }
+}
+
+void TimerIDTable::release(Table& table)
+{
+  free(table.slots);
+  table.slots = NULL;
+  table.capacity = 0;
+  table.shift = 0;
+}
+
+TimerIDTable::Slot* TimerIDTable::find_slot(const Table& table, TimerID id)
+{
+  size_t mask = table.capacity - 1;
+  size_t ii = home_slot(table, id);
+
+  // The table is never full, so this always finds an empty slot eventually.
+  while (table.slots[ii].timer != NULL)
+  {
+    if ((table.slots[ii].id == id) && (table.slots[ii].timer != MOVED))
+    {
+      return &table.slots[ii];
+    }
+
+    ii = (ii + 1) & mask;
+  }
+
+  return NULL;
+}
+
+void TimerIDTable::insert_slot(Table& table, TimerID id, Timer* timer)
+{
+  size_t mask = table.capacity - 1;
+  size_t ii = home_slot(table, id);
+
+  while (table.slots[ii].timer != NULL)
+  {
+    ii = (ii + 1) & mask;
+  }
+
+  table.slots[ii].id = id;
+  table.slots[ii].timer = timer;
+}
+
+void TimerIDTable::erase_slot(Table& table, Slot* slot)
+{
+  size_t mask = table.capacity - 1;
+  size_t hole = slot - table.slots;
+  size_t ii = hole;
+
+  while (true)
+  {
+    ii = (ii + 1) & mask;
+
+    if (table.slots[ii].timer == NULL)
+    {
+      break;
+    }
+
+    // The entry in this slot can fill the hole unless its home slot lies
+    // (cyclically) after the hole, as it then wouldn't be found from there.
+    size_t home = home_slot(table, table.slots[ii].id);
+    bool stays = (hole <= ii) ? ((hole < home) && (home <= ii)) :
+                                ((hole < home) || (home <= ii));
+
+    if (!stays)
+    {
+      table.slots[hole] = table.slots[ii];
+      hole = ii;
+    }
+  }
+
+  table.slots[hole].timer = NULL;
+}
+
+void TimerIDTable::grow()
+{
+  if (_old_table.slots != NULL)
+  {
+    // LCOV_EXCL_START - The old table is always drained before this happens
+    TRC_WARNING("Timer ID table resized again before migration completed");
+    migrate(_old_table.capacity);
+    // LCOV_EXCL_STOP
+  }
+
+  TRC_DEBUG("Resizing timer ID table from %lu to %lu slots",
+            _table.capacity,
+            _table.capacity * 2);
+
+  _old_table = _table;
+  allocate(_table, _old_table.capacity * 2);
+  _migrate_pos = 0;
+  _last_empty_pos = 0;
+  _released_pos = 0;
+}
+
+void TimerIDTable::migrate(size_t num_slots)
+{
+  if (_old_table.slots == NULL)
+  {
+    return;
+  }
+
+  size_t end = _migrate_pos + num_slots;
+
+  if (end > _old_table.capacity)
+  {
+    end = _old_table.capacity;
+  }
+
+  for (; _migrate_pos < end; ++_migrate_pos)
+  {
+    Slot& slot = _old_table.slots[_migrate_pos];
+
+    if (slot.timer == NULL)
+    {
+      _last_empty_pos = _migrate_pos;
+    }
+    else if (slot.timer != MOVED)
+    {
+      insert_slot(_table, slot.id, slot.timer);
+      slot.timer = MOVED;
+    }
+  }
+
+  if (_migrate_pos == _old_table.capacity)
+  {
+    TRC_DEBUG("Finished resizing timer ID table");
+    release(_old_table);
+    _migrate_pos = 0;
+  }
+  else
+  {
+    release_drained_pages();
+  }
+}
+
+void TimerIDTable::release_drained_pages()
+{
+  // Only whole pages can be released. Everything before the last empty slot
+  // is no longer needed - lookups that start there stop at the empty slot
+  // anyway, and released pages read back as zeros (i.e. empty slots).
+  uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)(_old_table.slots + _released_pos);
+  uintptr_t end = (uintptr_t)(_old_table.slots + _last_empty_pos);
+  start = (start + page_size - 1) & ~(page_size - 1);
+  end = end & ~(page_size - 1);
+
+  if ((end > start) && (end - start >= RELEASE_CHUNK_BYTES))
+  {
+    madvise((void*)start, end - start, MADV_DONTNEED);
+    _released_pos = (end - (uintptr_t)_old_table.slots) / sizeof(Slot);
+  }
+}
+
+/*****************************************************************************/
+/* Iterator.                                                                 */
+/*****************************************************************************/
+
+TimerIDTable::iterator::iterator(const TimerIDTable* table, bool end) :
+  _table(table),
+  _current(NULL),
+  _slot(NULL)
+{
+  if (!end)
+  {
+    // Walk the old table (if any) before the current one.
+    _current = (_table->_old_table.slots != NULL) ? &_table->_old_table :
+                                                    &_table->_table;
+    _slot = _current->slots;
+    skip_unused_slots();
+  }
+}
+
+TimerIDTable::iterator& TimerIDTable::iterator::operator++()
+{
+  ++_slot;
+  skip_unused_slots();
+  return *this;
+}
+
+void TimerIDTable::iterator::skip_unused_slots()
+{
+  while (_slot != NULL)
+  {
+    if (_slot == _current->slots + _current->capacity)
+    {
+      if (_current == &_table->_old_table)
+      {
+        _current = &_table->_table;
+        _slot = _current->slots;
+      }
+      else
+      {
+        _slot = NULL;
+      }
+    }
+    else if ((_slot->timer == NULL) || (_slot->timer == MOVED))
+    {
+      ++_slot;
+    }
+    else
+    {
+      break;
+    }
+  }
+}
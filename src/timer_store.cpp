@@ -40,14 +40,45 @@
                             (T)->callback_body.c_str()
 
 TimerStore::TimerStore(HealthChecker* hc) :
-  _health_checker(hc)
+  _health_checker(hc),
+  _short_wheel_occupancy(SHORT_WHEEL_NUM_BUCKETS),
+  _long_wheel_occupancy(LONG_WHEEL_NUM_BUCKETS),
+  _day_wheel_occupancy(DAY_WHEEL_NUM_BUCKETS),
+  _week_wheel_occupancy(WEEK_WHEEL_NUM_BUCKETS)
 {
   _tick_timestamp = to_short_wheel_resolution(timestamp_ms());
+
+  _overdue_timers.init(TimerSchedule::OVERDUE);
+
+  for (int ii = 0; ii < SHORT_WHEEL_NUM_BUCKETS; ++ii)
+  {
+    _short_wheel[ii].init(TimerSchedule::SHORT_WHEEL, &_short_wheel_occupancy, ii);
+  }
+
+  for (int ii = 0; ii < LONG_WHEEL_NUM_BUCKETS; ++ii)
+  {
+    _long_wheel[ii].init(TimerSchedule::LONG_WHEEL, &_long_wheel_occupancy, ii);
+  }
+
+  for (int ii = 0; ii < DAY_WHEEL_NUM_BUCKETS; ++ii)
+  {
+    _day_wheel[ii].init(TimerSchedule::DAY_WHEEL, &_day_wheel_occupancy, ii);
+  }
+
+  for (int ii = 0; ii < WEEK_WHEEL_NUM_BUCKETS; ++ii)
+  {
+    _week_wheel[ii].init(TimerSchedule::WEEK_WHEEL, &_week_wheel_occupancy, ii);
+  }
+
+  ClusterConfigPtr config = __globals->get_cluster_config();
+  _local_ip = config->cluster_local_ip;
+  _local_site_name = config->local_site_name;
 }
 
 void TimerStore::clear()
 {
   _timer_lookup_id_table.clear();
+  _overdue_timers.clear();
 
   for (int ii = 0; ii < SHORT_WHEEL_NUM_BUCKETS; ++ii)
   {
@@ -59,17 +90,27 @@ void TimerStore::clear()
     _long_wheel[ii].clear();
   }
 
+  for (int ii = 0; ii < DAY_WHEEL_NUM_BUCKETS; ++ii)
+  {
+    _day_wheel[ii].clear();
+  }
+
+  for (int ii = 0; ii < WEEK_WHEEL_NUM_BUCKETS; ++ii)
+  {
+    _week_wheel[ii].clear();
+  }
+
   _extra_heap.clear();
 }
 
 TimerStore::~TimerStore()
 {
   // Delete the timers in the lookup table as they will never pop now.
-  for (std::map<TimerID, Timer*>::iterator it = _timer_lookup_id_table.begin();
-                                           it != _timer_lookup_id_table.end();
-                                           ++it)
+  for (TimerIDTable::iterator it = _timer_lookup_id_table.begin();
+                              it != _timer_lookup_id_table.end();
+                              ++it)
   {
-    delete it->second;
+    delete *it;
   }
 
   clear();
@@ -77,52 +118,40 @@ TimerStore::~TimerStore()
 
 void TimerStore::insert(Timer* timer)
 {
-  if (_timer_lookup_id_table.find(timer->id) != _timer_lookup_id_table.end())
+  if (_timer_lookup_id_table.find(timer->id) != NULL)
   {
     // LCOV_EXCL_START - Not in UTs as this is a logic error
     throw std::logic_error("There is already a timer with this ID in the store!");
     // LCOV_EXCL_STOP
   }
 
-  Bucket* bucket;
+  uint32_t pop_time = timer->next_pop_time();
+  Bucket* bucket = wheel_bucket(pop_time);
 
-  if (Utils::overflow_less_than(timer->next_pop_time(), _tick_timestamp))
+  if (bucket == &_overdue_timers)
   {
     // The timer should have already popped so put it in the overdue timers,
     // and warn the user.
-    //
-    // We can't just put the timer in the next bucket to pop.  We need to know
-    // what bucket to look in when deleting timers, and this is derived from
-    // the pop time. So if we put the timer in the wrong bucket we can't find
-    // it to delete it.
     TRC_WARNING("Modifying timer after pop time (current time is %lu). "
                 "Window condition detected.\n" TIMER_LOG_FMT,
                 _tick_timestamp,
                 TIMER_LOG_PARAMS(timer));
-    _overdue_timers.insert(timer);
-  }
-  else if (Utils::overflow_less_than(to_short_wheel_resolution(timer->next_pop_time()),
-           to_short_wheel_resolution(_tick_timestamp + SHORT_WHEEL_PERIOD_MS)))
-  {
-    bucket = short_wheel_bucket(timer->next_pop_time());
-    bucket->insert(timer);
   }
-  else if (Utils::overflow_less_than(to_long_wheel_resolution(timer->next_pop_time()),
-           to_long_wheel_resolution(_tick_timestamp + LONG_WHEEL_PERIOD_MS)))
+
+  if (bucket != NULL)
   {
-    bucket = long_wheel_bucket(timer->next_pop_time());
-    bucket->insert(timer);
+    insert_into_bucket(bucket, timer, pop_time);
   }
   else
   {
     // Timer is too far in the future to be handled by the wheels, put it in
     // the extra heap.
     TRC_DEBUG("Adding timer to extra heap");
-    _extra_heap.insert(timer);
+    insert_into_heap(timer);
   }
 
   // Finally, add the timer to the lookup table.
-  _timer_lookup_id_table[timer->id] = timer;
+  _timer_lookup_id_table.insert(timer->id, timer);
 
   // We've successfully added a timer, so confirm to the
   // health-checker that we're still healthy.
@@ -131,14 +160,13 @@ void TimerStore::insert(Timer* timer)
 
 void TimerStore::fetch(TimerID id, Timer** timer)
 {
-  std::map<TimerID, Timer*>::iterator it;
-  it = _timer_lookup_id_table.find(id);
+  Timer* found = _timer_lookup_id_table.find(id);
 
-  if (it != _timer_lookup_id_table.end())
+  if (found != NULL)
   {
     // The Timer is still present in the store. Remove the timer from the
     // wheel, and pass ownership back by populating the timer parameter.
-    *timer = it->second;
+    *timer = found;
 
     TRC_DEBUG("Removing timer from wheel");
     remove_timer_from_timer_wheel(*timer);
@@ -148,10 +176,10 @@ void TimerStore::fetch(TimerID id, Timer** timer)
   }
 }
 
-void TimerStore::fetch_next_timers(std::unordered_set<Timer*>& set)
+void TimerStore::fetch_next_timers(std::vector<Timer*>& timers)
 {
   // Always pop the overdue timers, even if we're not processing any ticks.
-  pop_bucket(&_overdue_timers, set);
+  pop_bucket(&_overdue_timers, timers);
 
   // Now process the required number of ticks. Integer division does the
   // necessary rounding for us.
@@ -159,19 +187,150 @@ void TimerStore::fetch_next_timers(std::unordered_set<Timer*>& set)
   uint32_t num_ticks = ((current_timestamp - _tick_timestamp) /
                         SHORT_WHEEL_RESOLUTION_MS);
 
-  for (int ii = 0; ii < (int)(num_ticks); ++ii)
+  while (num_ticks > 0)
   {
     // Pop all timers in the current bucket.
     Bucket* bucket = short_wheel_bucket(_tick_timestamp);
-    pop_bucket(bucket, set);
+    pop_bucket(bucket, timers);
 
     // Get ready for the next tick - advance the tick time, and refill the
-    // timer wheels.
-    _tick_timestamp += SHORT_WHEEL_RESOLUTION_MS;
+    // timer wheels. Rather than stepping through empty buckets one at a time,
+    // jump straight to the next bucket with any timers in, or to the next
+    // rotation of the short wheel (when the wheels need refilling), whichever
+    // comes first.
+    uint32_t current_bucket = (_tick_timestamp / SHORT_WHEEL_RESOLUTION_MS) %
+                              SHORT_WHEEL_NUM_BUCKETS;
+    uint32_t ticks = SHORT_WHEEL_NUM_BUCKETS - current_bucket;
+    int next_occupied = _short_wheel_occupancy.next_occupied(
+                             (current_bucket + 1) % SHORT_WHEEL_NUM_BUCKETS);
+
+    if ((next_occupied >= 0) && ((uint32_t)next_occupied + 1 < ticks))
+    {
+      ticks = next_occupied + 1;
+    }
+
+    if (ticks > num_ticks)
+    {
+      ticks = num_ticks;
+    }
+
+    _tick_timestamp += ticks * SHORT_WHEEL_RESOLUTION_MS;
+    num_ticks -= ticks;
     maybe_refill_wheels();
   }
 }
 
+void TimerStore::update_pop_times()
+{
+  // The configuration only affects a timer's pop time through this node's
+  // position in the timer's replica and site lists (see
+  // Timer::delay_from_position), so there's nothing to do unless this node's
+  // address or site has changed.
+  ClusterConfigPtr config = __globals->get_cluster_config();
+
+  if ((config->cluster_local_ip == _local_ip) &&
+      (config->local_site_name == _local_site_name))
+  {
+    return;
+  }
+
+  TRC_STATUS("Local address or site changed, updating the pop times of %lu timers",
+             _timer_lookup_id_table.size());
+  _local_ip = config->cluster_local_ip;
+  _local_site_name = config->local_site_name;
+
+  // The heap is ordered by the timers' current pop times, which may all have
+  // changed, so it can't be updated in place. Take all the timers out of it
+  // and add them back below.
+  _extra_heap.clear();
+
+  for (TimerIDTable::iterator it = _timer_lookup_id_table.begin();
+                              it != _timer_lookup_id_table.end();
+                              ++it)
+  {
+    Timer* timer = *it;
+    uint32_t pop_time = timer->next_pop_time();
+
+    if (timer->_store_link.schedule != NULL)
+    {
+      if (timer->_store_link.schedule->pop_time == pop_time)
+      {
+        continue;
+      }
+
+      remove_from_bucket(timer);
+    }
+
+    timer->_store_link.in_heap = false;
+
+    // Timers that should now have popped go in the overdue timers, to pop on
+    // the next tick.
+    Bucket* bucket = wheel_bucket(pop_time);
+
+    if (bucket != NULL)
+    {
+      insert_into_bucket(bucket, timer, pop_time);
+    }
+    else
+    {
+      insert_into_heap(timer);
+    }
+  }
+}
+
+bool TimerStore::next_tick_time(uint32_t& time)
+{
+  // Overdue timers are popped as soon as fetch_next_timers is next called.
+  if (!_overdue_timers.empty())
+  {
+    time = _tick_timestamp;
+    return true;
+  }
+
+  // Otherwise find the first tick with anything to do, as an offset from the
+  // current tick. The timers in a short wheel bucket pop on the tick after
+  // that bucket's tick. The timers in a bucket of one of the longer wheels
+  // are moved down on the tick where the wheel below completes a rotation
+  // onto that bucket, and the heap is checked whenever the week wheel
+  // completes a rotation.
+  uint32_t offset = UINT32_MAX;
+  int next_bucket = _short_wheel_occupancy.next_occupied(
+     (_tick_timestamp / SHORT_WHEEL_RESOLUTION_MS) % SHORT_WHEEL_NUM_BUCKETS);
+
+  if (next_bucket >= 0)
+  {
+    offset = (next_bucket + 1) * SHORT_WHEEL_RESOLUTION_MS;
+  }
+
+  offset = std::min(offset,
+                    next_occupied_bucket_offset(_long_wheel_occupancy,
+                                                LONG_WHEEL_NUM_BUCKETS,
+                                                LONG_WHEEL_RESOLUTION_MS));
+  offset = std::min(offset,
+                    next_occupied_bucket_offset(_day_wheel_occupancy,
+                                                DAY_WHEEL_NUM_BUCKETS,
+                                                DAY_WHEEL_RESOLUTION_MS));
+  offset = std::min(offset,
+                    next_occupied_bucket_offset(_week_wheel_occupancy,
+                                                WEEK_WHEEL_NUM_BUCKETS,
+                                                WEEK_WHEEL_RESOLUTION_MS));
+
+  if (!_extra_heap.empty())
+  {
+    offset = std::min(offset,
+                      (uint32_t)(WEEK_WHEEL_PERIOD_MS -
+                                 (_tick_timestamp % WEEK_WHEEL_PERIOD_MS)));
+  }
+
+  if (offset == UINT32_MAX)
+  {
+    return false;
+  }
+
+  time = _tick_timestamp + offset;
+  return true;
+}
+
 /*****************************************************************************/
 /* Private functions.                                                        */
 /*****************************************************************************/
@@ -199,6 +358,26 @@ uint32_t TimerStore::timestamp_ms()
   return time;
 }
 
+uint32_t TimerStore::next_occupied_bucket_offset(const OccupancyBitmap& occupancy,
+                                                 int num_buckets,
+                                                 uint32_t resolution_ms)
+{
+  // The wheel's current bucket has already been emptied into the wheels
+  // below, so start looking from the next one.
+  uint32_t next_bucket_time = (_tick_timestamp -
+                               (_tick_timestamp % resolution_ms) +
+                               resolution_ms);
+  int distance = occupancy.next_occupied((next_bucket_time / resolution_ms) %
+                                         num_buckets);
+
+  if (distance < 0)
+  {
+    return UINT32_MAX;
+  }
+
+  return (next_bucket_time - _tick_timestamp) + (distance * resolution_ms);
+}
+
 uint32_t TimerStore::to_short_wheel_resolution(uint32_t t)
 {
   return (t - (t % SHORT_WHEEL_RESOLUTION_MS));
@@ -209,14 +388,14 @@ uint32_t TimerStore::to_long_wheel_resolution(uint32_t t)
   return (t - (t % LONG_WHEEL_RESOLUTION_MS));
 }
 
-TimerStore::Bucket* TimerStore::short_wheel_bucket(Timer* timer)
+uint32_t TimerStore::to_day_wheel_resolution(uint32_t t)
 {
-  return short_wheel_bucket(timer->next_pop_time());
+  return (t - (t % DAY_WHEEL_RESOLUTION_MS));
 }
 
-TimerStore::Bucket* TimerStore::long_wheel_bucket(Timer* timer)
+uint32_t TimerStore::to_week_wheel_resolution(uint32_t t)
 {
-  return long_wheel_bucket(timer->next_pop_time());
+  return (t - (t % WEEK_WHEEL_RESOLUTION_MS));
 }
 
 TimerStore::Bucket* TimerStore::short_wheel_bucket(uint32_t t)
@@ -231,41 +410,141 @@ TimerStore::Bucket* TimerStore::long_wheel_bucket(uint32_t t)
   return &_long_wheel[bucket_index];
 }
 
+TimerStore::Bucket* TimerStore::day_wheel_bucket(uint32_t t)
+{
+  size_t bucket_index = (t / DAY_WHEEL_RESOLUTION_MS) % DAY_WHEEL_NUM_BUCKETS;
+  return &_day_wheel[bucket_index];
+}
+
+TimerStore::Bucket* TimerStore::week_wheel_bucket(uint32_t t)
+{
+  size_t bucket_index = (t / WEEK_WHEEL_RESOLUTION_MS) % WEEK_WHEEL_NUM_BUCKETS;
+  return &_week_wheel[bucket_index];
+}
+
+TimerStore::Bucket* TimerStore::wheel_bucket(uint32_t pop_time)
+{
+  if (Utils::overflow_less_than(pop_time, _tick_timestamp))
+  {
+    return &_overdue_timers;
+  }
+  else if (Utils::overflow_less_than(to_short_wheel_resolution(pop_time),
+           to_short_wheel_resolution(_tick_timestamp + SHORT_WHEEL_PERIOD_MS)))
+  {
+    return short_wheel_bucket(pop_time);
+  }
+  else if (Utils::overflow_less_than(to_long_wheel_resolution(pop_time),
+           to_long_wheel_resolution(_tick_timestamp + LONG_WHEEL_PERIOD_MS)))
+  {
+    return long_wheel_bucket(pop_time);
+  }
+  else if (Utils::overflow_less_than(to_day_wheel_resolution(pop_time),
+           to_day_wheel_resolution(_tick_timestamp + DAY_WHEEL_PERIOD_MS)))
+  {
+    return day_wheel_bucket(pop_time);
+  }
+  else if (Utils::overflow_less_than(to_week_wheel_resolution(pop_time),
+           to_week_wheel_resolution(_tick_timestamp + WEEK_WHEEL_PERIOD_MS)))
+  {
+    return week_wheel_bucket(pop_time);
+  }
+  else
+  {
+    return NULL;
+  }
+}
+
+TimerStore::Bucket* TimerStore::bucket_for(TimerSchedule* schedule)
+{
+  // A schedule is always in the bucket for the pop time it holds.
+  switch (schedule->location)
+  {
+  case TimerSchedule::SHORT_WHEEL:
+    return short_wheel_bucket(schedule->pop_time);
+
+  case TimerSchedule::LONG_WHEEL:
+    return long_wheel_bucket(schedule->pop_time);
+
+  case TimerSchedule::DAY_WHEEL:
+    return day_wheel_bucket(schedule->pop_time);
+
+  case TimerSchedule::WEEK_WHEEL:
+    return week_wheel_bucket(schedule->pop_time);
+
+  default:
+    return &_overdue_timers;
+  }
+}
+
 void TimerStore::pop_bucket(TimerStore::Bucket* bucket,
-                            std::unordered_set<Timer*>& set)
+                            std::vector<Timer*>& timers)
 {
-  for(TimerStore::Bucket::iterator it = bucket->begin();
-                                   it != bucket->end();
-                                   ++it)
+  // The timers aren't stored near their schedules, so start fetching them all
+  // before popping any, rather than waiting for each one in turn. Then do the
+  // same for their entries in the ID table (which needs the timers' IDs).
+  for (TimerSchedule* schedule : *bucket)
   {
-    _timer_lookup_id_table.erase((*it)->id);
-    set.insert(*it);
+    __builtin_prefetch(schedule->timer, 1);
+  }
+
+  for (TimerSchedule* schedule : *bucket)
+  {
+    _timer_lookup_id_table.prefetch(schedule->timer->id);
+  }
+
+  TimerSchedule* schedule;
+
+  while ((schedule = bucket->pop_front()) != NULL)
+  {
+    Timer* timer = schedule->timer;
+    timer->_store_link.schedule = NULL;
+    delete schedule;
+
+    _timer_lookup_id_table.erase(timer->id);
+    timers.push_back(timer);
   }
-  bucket->clear();
 }
 
-// Refill the timer buckets from the longer lived store. This function is safe
+// Refill the timer buckets from the longer lived stores. This function is safe
 // to call at any time - if no changes are needed no work is done.
 void TimerStore::maybe_refill_wheels()
 {
-  // Every hour on the hour refill the long timer wheel.
+  // Refill the wheels from the largest down, as timers may need to propogate
+  // from the heap all the way down to the short wheel in one tick.
+  //
+  // Every ~12 days refill the week timer wheel.
+  if ((_tick_timestamp % WEEK_WHEEL_PERIOD_MS) == 0)
+  {
+    refill_week_wheel();
+  }
+
+  // Every ~3 days move all timers from the first bucket of the week wheel
+  // into the smaller wheels.
+  if ((_tick_timestamp % DAY_WHEEL_PERIOD_MS) == 0)
+  {
+    refill_day_wheel();
+  }
+
+  // Every ~70 minutes move all timers from the first bucket of the day wheel
+  // into the short and long wheels.
   if ((_tick_timestamp % LONG_WHEEL_PERIOD_MS) == 0)
   {
     refill_long_wheel();
   }
 
-  // Every second on the second refill the short timer wheel. Do this 2nd as
-  // timers may need to propogate from the heap -> long wheel -> short wheel.
-  // Move all timers from the first bucket of the long wheel into the short.
+  // Every second on the second refill the short timer wheel. Move all timers
+  // from the first bucket of the long wheel into the short.
   if ((_tick_timestamp % SHORT_WHEEL_PERIOD_MS) == 0)
   {
     refill_short_wheel();
   }
 }
 
-// Refill the long timer wheel by taking all timers from the heap that are due
-// to pop in < long wheel timer total.
-void TimerStore::refill_long_wheel()
+// Refill the week timer wheel by taking all timers from the heap that are due
+// to pop in < week wheel timer total. This can be called at any tick, so the
+// bound is rounded down to the week wheel's resolution - timers after that
+// don't have a bucket in the week wheel yet.
+void TimerStore::refill_week_wheel()
 {
   if (!_extra_heap.empty())
   {
@@ -276,14 +555,16 @@ void TimerStore::refill_long_wheel()
       TRC_DEBUG("Timer at top of heap has ID %lu", timer->id);
     }
 
+    uint32_t pop_before = to_week_wheel_resolution(_tick_timestamp +
+                                                   WEEK_WHEEL_PERIOD_MS);
+
     while ((timer != NULL) &&
-           (Utils::overflow_less_than(timer->next_pop_time(),
-                                      _tick_timestamp + LONG_WHEEL_PERIOD_MS)))
+           (Utils::overflow_less_than(timer->next_pop_time(), pop_before)))
     {
       // Remove timer from heap
-      _extra_heap.remove(timer);
-      Bucket* bucket = long_wheel_bucket(timer);
-      bucket->insert(timer);
+      remove_from_heap(timer);
+      uint32_t pop_time = timer->next_pop_time();
+      insert_into_bucket(wheel_bucket(pop_time), timer, pop_time);
 
       if (!_extra_heap.empty())
       {
@@ -297,274 +578,357 @@ void TimerStore::refill_long_wheel()
   }
 }
 
+// Refill the day timer wheel by distributing timers from the current bucket
+// in the week timer wheel.
+void TimerStore::refill_day_wheel()
+{
+  redistribute_bucket(week_wheel_bucket(_tick_timestamp),
+                      _tick_timestamp + DAY_WHEEL_PERIOD_MS);
+}
+
+// Refill the long timer wheel by distributing timers from the current bucket
+// in the day timer wheel.
+void TimerStore::refill_long_wheel()
+{
+  redistribute_bucket(day_wheel_bucket(_tick_timestamp),
+                      _tick_timestamp + LONG_WHEEL_PERIOD_MS);
+}
+
 // Refill the short timer wheel by distributing timers from the current bucket
 // in the long timer wheel.
 // All timers in the long wheel bucket are moved into the short wheel.
 void TimerStore::refill_short_wheel()
 {
   Bucket* long_bucket = long_wheel_bucket(_tick_timestamp);
+  TimerSchedule* schedule;
 
-  for (Bucket::iterator it = long_bucket->begin();
-                        it != long_bucket->end();
-                        ++it)
+  while ((schedule = long_bucket->pop_front()) != NULL)
   {
-    Bucket* short_bucket = short_wheel_bucket(*it);
-    short_bucket->insert(*it);
+    short_wheel_bucket(schedule->pop_time)->insert(schedule);
   }
+}
 
-  long_bucket->clear();
+// Each wheel is only refilled from the wheel above when it completes a
+// rotation, so the next bucket of each wheel can hold timers that are due to
+// pop within the range of the wheel below (and the heap can hold timers due
+// to pop within the range of the week wheel). Move these timers down now.
+//
+// This isn't only called when the wheels complete a rotation, so each range is
+// rounded down to the resolution of the wheel the timers are moving into.
+// Timers after that are already in the right bucket, and moving them would
+// put them back in the bucket they came from.
+void TimerStore::refill_wheels_for_iteration()
+{
+  refill_week_wheel();
+  redistribute_bucket(week_wheel_bucket(_tick_timestamp + WEEK_WHEEL_RESOLUTION_MS),
+                      to_day_wheel_resolution(_tick_timestamp + DAY_WHEEL_PERIOD_MS));
+  redistribute_bucket(day_wheel_bucket(_tick_timestamp + DAY_WHEEL_RESOLUTION_MS),
+                      to_long_wheel_resolution(_tick_timestamp + LONG_WHEEL_PERIOD_MS));
+  redistribute_bucket(long_wheel_bucket(_tick_timestamp + LONG_WHEEL_RESOLUTION_MS),
+                      to_short_wheel_resolution(_tick_timestamp + SHORT_WHEEL_PERIOD_MS));
 }
 
-// Refill the short timer wheel by distributing timers from the next bucket in
-// the long timer wheel.
-// Only timers due to pop within SHORT_WHEEL_PERIOD_MS should be moved from the
-// long bucket, so we check the time of each timer.
-void TimerStore::refill_short_wheel_from_next_long_bucket()
+void TimerStore::redistribute_bucket(Bucket* bucket, uint32_t pop_before)
 {
-  Bucket* long_bucket = long_wheel_bucket(_tick_timestamp + LONG_WHEEL_RESOLUTION_MS);
-  Bucket::iterator it = long_bucket->begin();
+  Bucket::iterator it = bucket->begin();
 
-  while (it != long_bucket->end())
+  while (it != bucket->end())
   {
-    if (Utils::overflow_less_than((*it)->next_pop_time(),
-                                  _tick_timestamp + SHORT_WHEEL_PERIOD_MS))
-    {
-      Bucket* short_bucket = short_wheel_bucket(*it);
-      short_bucket->insert(*it);
-      it = long_bucket->erase(it);
-    }
-    else
+    // Step past the schedule before moving it, as moving it relinks it into
+    // another bucket.
+    TimerSchedule* schedule = *it;
+    ++it;
+
+    if (Utils::overflow_less_than(schedule->pop_time, pop_before))
     {
-      ++it;
+      bucket->erase(schedule);
+      wheel_bucket(schedule->pop_time)->insert(schedule);
     }
   }
 }
 
 void TimerStore::remove_timer_from_timer_wheel(Timer* timer)
 {
-  Bucket* bucket;
-  size_t num_erased;
-
-  // Delete the timer from the overdue buckets / timer wheels / heap. Try the
-  // overdue bucket first, then the short wheel then the long wheel, then
-  // finally the heap.
-  num_erased = _overdue_timers.erase(timer);
-
-  if (num_erased == 0)
+  // The timer records where it's stored, so remove it directly from there.
+  if (timer->_store_link.schedule != NULL)
+  {
+    remove_from_bucket(timer);
+  }
+  else if (timer->_store_link.in_heap)
   {
-    bucket = short_wheel_bucket(timer);
-    num_erased = bucket->erase(timer);
+    remove_from_heap(timer);
+  }
+  else
+  {
+    TRC_WARNING("Attempted to remove timer %lu, which isn't in the store",
+                timer->id);
+  }
+}
 
-    if (num_erased == 0)
-    {
-      bucket = long_wheel_bucket(timer);
-      num_erased = bucket->erase(timer);
+void TimerStore::insert_into_bucket(Bucket* bucket,
+                                    Timer* timer,
+                                    uint32_t pop_time)
+{
+  TimerSchedule* schedule = new TimerSchedule();
+  schedule->timer = timer;
+  schedule->pop_time = pop_time;
+  bucket->insert(schedule);
+  timer->_store_link.schedule = schedule;
+}
 
-      if (num_erased == 0)
-      {
-        bool success = _extra_heap.remove(timer);
-
-        if (!success)
-        {
-          // We failed to remove the timer from any data structure.  Try and
-          // purge the timer from all the timer wheels (we're already sure
-          // that it's not in the heap).
-          // LCOV_EXCL_START
-          TRC_ERROR("Failed to remove timer consistently");
-          purge_timer_from_wheels(timer);
-          // LCOV_EXCL_STOP
-        }
-      }
-    }
-  }
+void TimerStore::remove_from_bucket(Timer* timer)
+{
+  TimerSchedule* schedule = timer->_store_link.schedule;
+  bucket_for(schedule)->erase(schedule);
+  delete schedule;
+  timer->_store_link.schedule = NULL;
 }
 
-// Remove the timer from all the timer buckets.  This is a fallback that is only
-// used when we're deleting a timer that should be in the store, but that we
-// couldn't find in the buckets and the heap.  It's an expensive operation but
-// is a last ditch effort to restore consistency.
-// LCOV_EXCL_START
-void TimerStore::purge_timer_from_wheels(Timer* t)
+void TimerStore::insert_into_heap(Timer* timer)
 {
-  TRC_WARNING("Purging timer from store.\n", TIMER_LOG_FMT, TIMER_LOG_PARAMS(t));
+  _extra_heap.insert(timer);
+  timer->_store_link.in_heap = true;
+}
 
-  for (int ii = 0; ii < SHORT_WHEEL_NUM_BUCKETS; ++ii)
+void TimerStore::remove_from_heap(Timer* timer)
+{
+  if (!_extra_heap.remove(timer))
   {
-    if (_short_wheel[ii].erase(t) != 0)
-    {
-      TRC_WARNING("  Deleting timer %lu from short wheel bucket %d", t->id, ii);
-    }
+    // LCOV_EXCL_START - Not in UTs as this is a logic error
+    TRC_ERROR("Failed to remove timer %lu from the heap", timer->id);
+    // LCOV_EXCL_STOP
   }
 
-  for (int ii = 0; ii < LONG_WHEEL_NUM_BUCKETS; ++ii)
+  timer->_store_link.in_heap = false;
+}
+
+TimerStore::OccupancyBitmap::OccupancyBitmap(int num_buckets) :
+  _num_buckets(num_buckets),
+  _words((num_buckets + 63) / 64, 0)
+{
+}
+
+int TimerStore::OccupancyBitmap::next_occupied(int bucket) const
+{
+  // Check the rest of the bucket's word, then each following word (wrapping
+  // round the wheel), and finally the whole of the bucket's word again.
+  int num_words = _words.size();
+  int word = bucket / 64;
+  uint64_t bits = _words[word] & (~0ULL << (bucket % 64));
+
+  for (int ii = 0; ii <= num_words; ++ii)
   {
-    if (_long_wheel[ii].erase(t) != 0)
+    if (bits != 0)
     {
-      TRC_WARNING("  Deleting timer %lu from long wheel bucket %d", t->id, ii);
+      int found = (word * 64) + __builtin_ctzll(bits);
+      return (found - bucket + _num_buckets) % _num_buckets;
     }
+
+    word = (word + 1) % num_words;
+    bits = _words[word];
   }
+
+  return -1;
 }
-// LCOV_EXCL_STOP
 
-TimerStore::TSOrderedTimerIterator::TSOrderedTimerIterator(TimerStore* ts,
-                                                           uint32_t time_from) :
-  _ts(ts),
-  _time_from(time_from)
-{}
+void TimerStore::Bucket::init(TimerSchedule::Location location,
+                              OccupancyBitmap* occupancy,
+                              int index)
+{
+  _location = location;
+  _occupancy = occupancy;
+  _index = index;
+}
 
-void TimerStore::TSOrderedTimerIterator::iterate_through_ordered_timers()
+void TimerStore::Bucket::insert(TimerSchedule* schedule)
 {
-  std::sort(_ordered_timers.begin(),
-            _ordered_timers.end(),
-            Timer::compare_timer_pop_times);
+  if ((_head == NULL) && (_occupancy != NULL))
+  {
+    _occupancy->set(_index);
+  }
 
-  _iterator = _ordered_timers.begin();
+  schedule->location = _location;
+  schedule->prev = NULL;
+  schedule->next = _head;
 
-  while (_iterator != _ordered_timers.end())
+  if (_head != NULL)
   {
-    if ((Utils::overflow_less_than(_time_from, (*_iterator)->next_pop_time())) ||
-        (_time_from == (*_iterator)->next_pop_time()))
-    {
-      break;
-    }
-    else
-    {
-      ++_iterator;
-    }
+    _head->prev = schedule;
   }
+
+  _head = schedule;
 }
 
-TimerStore::TSShortWheelIterator::TSShortWheelIterator(TimerStore* ts,
-                                                       uint32_t time_from) :
-  TSOrderedTimerIterator(ts, time_from)
+void TimerStore::Bucket::erase(TimerSchedule* schedule)
 {
-  // We have to check the next bucket of the long wheel for any timers which
-  // need moving into the short wheel (to ensure they'll get picked up by one of
-  // the iterators).
-  _ts->refill_short_wheel_from_next_long_bucket();
-  _bucket = 0;
-  _iterator = _ordered_timers.end();
-
-  if (Utils::overflow_less_than(to_short_wheel_resolution(time_from),
-                                to_short_wheel_resolution(
-                                   _ts->_tick_timestamp + SHORT_WHEEL_PERIOD_MS)))
+  if (schedule->prev != NULL)
   {
-    _bucket = (time_from / SHORT_WHEEL_RESOLUTION_MS) % SHORT_WHEEL_NUM_BUCKETS;
-    uint32_t current_bucket = (_ts->_tick_timestamp / SHORT_WHEEL_RESOLUTION_MS) % SHORT_WHEEL_NUM_BUCKETS;
-    _end_bucket = current_bucket + SHORT_WHEEL_NUM_BUCKETS;
-    next_bucket();
+    schedule->prev->next = schedule->next;
   }
   else
   {
-    _bucket = SHORT_WHEEL_NUM_BUCKETS;
-    _end_bucket = SHORT_WHEEL_NUM_BUCKETS;
+    _head = schedule->next;
   }
-}
 
-TimerStore::TSShortWheelIterator& TimerStore::TSShortWheelIterator::operator++()
-{
-  ++_iterator;
-  if (_iterator == _ordered_timers.end())
+  if (schedule->next != NULL)
   {
-    ++_bucket;
-    next_bucket();
+    schedule->next->prev = schedule->prev;
   }
-  return *this;
-}
 
-Timer* TimerStore::TSShortWheelIterator::operator*()
-{
-  return *_iterator;
+  schedule->prev = NULL;
+  schedule->next = NULL;
+
+  if ((_head == NULL) && (_occupancy != NULL))
+  {
+    _occupancy->clear(_index);
+  }
 }
 
-bool TimerStore::TSShortWheelIterator::end() const
+TimerSchedule* TimerStore::Bucket::pop_front()
 {
-  return ((_iterator == _ordered_timers.end()) &&
-          (_bucket == _end_bucket));
+  TimerSchedule* schedule = _head;
+
+  if (schedule != NULL)
+  {
+    erase(schedule);
+  }
+
+  return schedule;
 }
 
-void TimerStore::TSShortWheelIterator::next_bucket()
+void TimerStore::Bucket::clear()
 {
-  _ordered_timers.clear();
-  _iterator = _ordered_timers.end();
+  while (_head != NULL)
+  {
+    TimerSchedule* schedule = _head;
+    _head = schedule->next;
+    delete schedule;
+  }
 
-  while ((_bucket < _end_bucket) &&
-         (_ordered_timers.size() == 0))
+  if (_occupancy != NULL)
   {
-    for (Timer* timer : _ts->_short_wheel[_bucket % SHORT_WHEEL_NUM_BUCKETS])
-    {
-      _ordered_timers.push_back(timer);
-    }
+    _occupancy->clear(_index);
+  }
+}
 
-    if (_ordered_timers.size() != 0)
-    {
-      iterate_through_ordered_timers();
+TimerStore::TSOrderedTimerIterator::TSOrderedTimerIterator(TimerStore* ts,
+                                                           uint32_t time_from,
+                                                           bool sorted) :
+  _ts(ts),
+  _time_from(time_from),
+  _sorted(sorted)
+{}
 
-      // LCOV_EXCL_START
-      if (_iterator == _ordered_timers.end())
-      {
-        _ordered_timers.clear();
-        _iterator = _ordered_timers.end();
-        ++_bucket;
-      }
-      // LCOV_EXCL_STOP
-    }
-    else
-    {
-      ++_bucket;
-    }
+void TimerStore::TSOrderedTimerIterator::iterate_through_ordered_timers()
+{
+  // Drop any timers that pop before the time we're iterating from before
+  // sorting, so we don't spend time sorting them.
+  uint32_t time_from = _time_from;
+  _ordered_timers.erase(std::remove_if(_ordered_timers.begin(),
+                                       _ordered_timers.end(),
+                                       [time_from](Timer* timer)
+                                       {
+                                         return Utils::overflow_less_than(
+                                                       timer->next_pop_time(),
+                                                       time_from);
+                                       }),
+                        _ordered_timers.end());
+
+  if (_sorted)
+  {
+    std::sort(_ordered_timers.begin(),
+              _ordered_timers.end(),
+              Timer::compare_timer_pop_times);
   }
+
+  _iterator = _ordered_timers.begin();
 }
 
-TimerStore::TSLongWheelIterator::TSLongWheelIterator(TimerStore* ts,
-                                                     uint32_t time_from) :
-  TSOrderedTimerIterator(ts, time_from)
+TimerStore::TSWheelIterator::TSWheelIterator(TimerStore* ts,
+                                             uint32_t time_from,
+                                             Bucket* wheel,
+                                             const OccupancyBitmap* occupancy,
+                                             int num_buckets,
+                                             uint32_t resolution_ms,
+                                             bool sorted) :
+  TSOrderedTimerIterator(ts, time_from, sorted),
+  _wheel(wheel),
+  _occupancy(occupancy),
+  _num_buckets(num_buckets)
 {
-  // We have to top up the long wheel with times from the heap to ensure the
-  // iterators will pick them up in the correct order.
-  _ts->refill_long_wheel();
   _bucket = 0;
   _iterator = _ordered_timers.end();
 
-  if (Utils::overflow_less_than(to_long_wheel_resolution(time_from),
-                                to_long_wheel_resolution(
-                                   _ts->_tick_timestamp + LONG_WHEEL_PERIOD_MS)))
+  uint32_t wheel_end = _ts->_tick_timestamp + (resolution_ms * num_buckets);
+
+  if (Utils::overflow_less_than(time_from - (time_from % resolution_ms),
+                                wheel_end - (wheel_end % resolution_ms)))
   {
-    _bucket = (time_from / LONG_WHEEL_RESOLUTION_MS) % LONG_WHEEL_NUM_BUCKETS;
-    uint32_t current_bucket = (_ts->_tick_timestamp / LONG_WHEEL_RESOLUTION_MS) % LONG_WHEEL_NUM_BUCKETS;
-    _end_bucket = current_bucket + LONG_WHEEL_NUM_BUCKETS;
-    next_bucket();
+    // Start from the bucket holding time_from, counting on from the current
+    // bucket so that each bucket is only visited once, even if time_from is
+    // in a bucket before the current one in the wheel.
+    uint32_t tick = _ts->_tick_timestamp;
+    int current_bucket = (tick / resolution_ms) % num_buckets;
+    int offset = 0;
+
+    if (Utils::overflow_less_than(tick, time_from))
+    {
+      offset = ((time_from - tick) + (tick % resolution_ms)) / resolution_ms;
+    }
+
+    _bucket = current_bucket + offset;
+    _end_bucket = current_bucket + num_buckets;
   }
   else
   {
-    _bucket = LONG_WHEEL_NUM_BUCKETS;
-    _end_bucket = LONG_WHEEL_NUM_BUCKETS;
+    _bucket = num_buckets;
+    _end_bucket = num_buckets;
   }
+
+  _loaded = false;
 }
 
-TimerStore::TSLongWheelIterator& TimerStore::TSLongWheelIterator::operator++()
+TimerStore::TSWheelIterator& TimerStore::TSWheelIterator::operator++()
 {
+  load();
   ++_iterator;
   if (_iterator == _ordered_timers.end())
   {
+    // Move on to the next bucket, but don't sort it until it's needed.
     ++_bucket;
-    next_bucket();
+    _loaded = false;
   }
   return *this;
 }
 
-Timer* TimerStore::TSLongWheelIterator::operator*()
+Timer* TimerStore::TSWheelIterator::operator*()
 {
+  load();
   return *_iterator;
 }
 
-bool TimerStore::TSLongWheelIterator::end() const
+bool TimerStore::TSWheelIterator::end()
 {
+  load();
   return ((_iterator == _ordered_timers.end()) &&
           (_bucket == _end_bucket));
 }
 
-void TimerStore::TSLongWheelIterator::next_bucket()
+bool TimerStore::TSWheelIterator::mid_bucket() const
+{
+  return ((_loaded) && (_iterator != _ordered_timers.end()));
+}
+
+void TimerStore::TSWheelIterator::load()
+{
+  if (!_loaded)
+  {
+    next_bucket();
+    _loaded = true;
+  }
+}
+
+void TimerStore::TSWheelIterator::next_bucket()
 {
   _ordered_timers.clear();
   _iterator = _ordered_timers.end();
@@ -572,9 +936,20 @@ void TimerStore::TSLongWheelIterator::next_bucket()
   while ((_bucket < _end_bucket) &&
          (_ordered_timers.size() == 0))
   {
-    for (Timer* timer : _ts->_long_wheel[_bucket % LONG_WHEEL_NUM_BUCKETS])
+    // Skip straight to the next bucket with any timers in.
+    int skip = _occupancy->next_occupied(_bucket % _num_buckets);
+
+    if ((skip < 0) || (skip >= _end_bucket - _bucket))
+    {
+      _bucket = _end_bucket;
+      break;
+    }
+
+    _bucket += skip;
+
+    for (TimerSchedule* schedule : _wheel[_bucket % _num_buckets])
     {
-      _ordered_timers.push_back(timer);
+      _ordered_timers.push_back(schedule->timer);
     }
 
     if (_ordered_timers.size() != 0)
@@ -605,7 +980,11 @@ TimerStore::TSHeapIterator::TSHeapIterator(TimerStore* ts,
 {
   while (!this->end())
   {
-    if (Utils::overflow_less_than(time_from, static_cast<Timer*>(*_iterator)->next_pop_time()))
+    uint32_t pop_time = static_cast<Timer*>(*_iterator)->next_pop_time();
+
+    // Include timers that pop at time_from, as the wheel iterators do.
+    if ((Utils::overflow_less_than(time_from, pop_time)) ||
+        (time_from == pop_time))
     {
       break;
     }
@@ -633,11 +1012,38 @@ bool TimerStore::TSHeapIterator::end() const
 }
 
 TimerStore::TSIterator::TSIterator(TimerStore* ts,
-                                   uint32_t time_from) :
+                                   uint32_t time_from,
+                                   bool sorted) :
   _ts(ts),
   _time_from(time_from),
-  _short_wheel_it(ts, time_from),
-  _long_wheel_it(ts, time_from),
+  _short_wheel_it(ts,
+                  time_from,
+                  ts->_short_wheel,
+                  &ts->_short_wheel_occupancy,
+                  SHORT_WHEEL_NUM_BUCKETS,
+                  SHORT_WHEEL_RESOLUTION_MS,
+                  sorted),
+  _long_wheel_it(ts,
+                 time_from,
+                 ts->_long_wheel,
+                 &ts->_long_wheel_occupancy,
+                 LONG_WHEEL_NUM_BUCKETS,
+                 LONG_WHEEL_RESOLUTION_MS,
+                 sorted),
+  _day_wheel_it(ts,
+                time_from,
+                ts->_day_wheel,
+                &ts->_day_wheel_occupancy,
+                DAY_WHEEL_NUM_BUCKETS,
+                DAY_WHEEL_RESOLUTION_MS,
+                sorted),
+  _week_wheel_it(ts,
+                 time_from,
+                 ts->_week_wheel,
+                 &ts->_week_wheel_occupancy,
+                 WEEK_WHEEL_NUM_BUCKETS,
+                 WEEK_WHEEL_RESOLUTION_MS,
+                 sorted),
   _heap_it(ts, time_from)
 {
 }
@@ -658,16 +1064,36 @@ Timer* TimerStore::TSIterator::operator*()
   {
     return (Timer*)(*_long_wheel_it);
   }
+  else if (!_day_wheel_it.end())
+  {
+    return (Timer*)(*_day_wheel_it);
+  }
+  else if (!_week_wheel_it.end())
+  {
+    return (Timer*)(*_week_wheel_it);
+  }
   else
   {
     return (Timer*)(*_heap_it);
   }
 }
 
-bool TimerStore::TSIterator::end() const
+bool TimerStore::TSIterator::mid_bucket() const
+{
+  // Only one of the wheel iterators can be part way through a bucket, as
+  // each only starts once the one before has finished.
+  return ((_short_wheel_it.mid_bucket()) ||
+          (_long_wheel_it.mid_bucket()) ||
+          (_day_wheel_it.mid_bucket()) ||
+          (_week_wheel_it.mid_bucket()));
+}
+
+bool TimerStore::TSIterator::end()
 {
   return ((_short_wheel_it.end()) &&
           (_long_wheel_it.end()) &&
+          (_day_wheel_it.end()) &&
+          (_week_wheel_it.end()) &&
           (_heap_it.end()));
 }
 
@@ -681,13 +1107,60 @@ void TimerStore::TSIterator::next_iterator()
   {
     ++_long_wheel_it;
   }
+  else if (!_day_wheel_it.end())
+  {
+    ++_day_wheel_it;
+  }
+  else if (!_week_wheel_it.end())
+  {
+    ++_week_wheel_it;
+  }
   else if (!_heap_it.end())
   {
     ++_heap_it;
   }
 }
 
-TimerStore::TSIterator TimerStore::begin(uint32_t time_from)
+TimerStore::TSIterator TimerStore::begin(uint32_t time_from, bool sorted)
+{
+  // Make sure the timers are in the right structures to be iterated over in
+  // order before creating the iterators.
+  refill_wheels_for_iteration();
+  return TimerStore::TSIterator(this, time_from, sorted);
+}
+
+bool TimerStore::get_resync_entries(uint32_t time_from,
+                                    const std::vector<TimerID>& skip_ids,
+                                    size_t max_entries,
+                                    std::vector<ResyncEntry>& entries)
 {
-  return TimerStore::TSIterator(this, time_from);
+  TimerStore::TSIterator it = begin(time_from, false);
+
+  while (true)
+  {
+    // Check whether we've got enough timers before checking for the end, as
+    // that moves on to the next bucket.
+    if ((entries.size() >= max_entries) && (!it.mid_bucket()))
+    {
+      return true;
+    }
+
+    if (it.end())
+    {
+      return false;
+    }
+
+    Timer* timer = *it;
+    ++it;
+    uint32_t pop_time = timer->next_pop_time();
+
+    if ((timer->is_tombstone()) ||
+        ((pop_time == time_from) &&
+         (std::binary_search(skip_ids.begin(), skip_ids.end(), timer->id))))
+    {
+      continue;
+    }
+
+    entries.push_back({timer->id, pop_time, timer->_replication_factor});
+  }
 }
@@ -23,7 +23,7 @@ public:
   ~MockTimerStore() {};
   MOCK_METHOD1(insert, void(Timer*));
   MOCK_METHOD2(fetch, void(TimerID, Timer**));
-  MOCK_METHOD1(fetch_next_timers, void(std::unordered_set<Timer*>&));
+  MOCK_METHOD1(fetch_next_timers, void(std::vector<Timer*>&));
   MOCK_METHOD3(get_by_not_view_id, bool(std::string, int, std::unordered_set<Timer*>&));
 };
 
@@ -0,0 +1,431 @@
+/**
+ * @file stub_http_server.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "stub_http_server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+struct StubHttpServer::Connection
+{
+  uint64_t id;
+  int fd;
+  std::string in;
+  std::string out;
+
+  // The number of requests that haven't been responded to yet, and whether
+  // the connection should be closed once they have been.
+  int num_pending;
+  bool close_when_done;
+};
+
+static uint64_t now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+StubHttpServer::StubHttpServer() :
+  _terminated(false),
+  _status(200),
+  _latency_ms(0),
+  _requests_until_drop(0),
+  _close_when_idle(false),
+  _num_connections(0),
+  _next_connection_id(1)
+{
+  _listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  bind(_listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+  listen(_listen_fd, SOMAXCONN);
+
+  socklen_t addr_len = sizeof(addr);
+  getsockname(_listen_fd, (struct sockaddr*)&addr, &addr_len);
+  _port = ntohs(addr.sin_port);
+
+  _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  _wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  // Connections are identified by their (non-zero) IDs, the listening socket
+  // by 0, and the wake fd by -1.
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = 0;
+  epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _listen_fd, &event);
+  event.data.u64 = (uint64_t)-1;
+  epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _wake_fd, &event);
+
+  pthread_create(&_thread, NULL, &thread_entry_point, this);
+}
+
+StubHttpServer::~StubHttpServer()
+{
+  _terminated.store(true);
+  uint64_t value = 1;
+  ssize_t rc = write(_wake_fd, &value, sizeof(value));
+  (void)rc;
+  pthread_join(_thread, NULL);
+
+  while (!_connections.empty())
+  {
+    close_connection(_connections.begin()->second);
+  }
+
+  close(_listen_fd);
+  close(_wake_fd);
+  close(_epoll_fd);
+}
+
+std::string StubHttpServer::url(const std::string& path) const
+{
+  return "http://127.0.0.1:" + std::to_string(_port) + path;
+}
+
+bool StubHttpServer::wait_for_requests(size_t count, int timeout_ms)
+{
+  uint64_t give_up_ms = now_ms() + timeout_ms;
+
+  while (num_requests() < count)
+  {
+    if (now_ms() > give_up_ms)
+    {
+      return false;
+    }
+
+    usleep(1000);
+  }
+
+  return true;
+}
+
+void StubHttpServer::set_response_body(const std::string& body)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  _response_body = body;
+}
+
+std::vector<StubHttpServer::Request> StubHttpServer::requests()
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  return _requests;
+}
+
+size_t StubHttpServer::num_requests()
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  return _requests.size();
+}
+
+void* StubHttpServer::thread_entry_point(void* arg)
+{
+  static_cast<StubHttpServer*>(arg)->run();
+  return NULL;
+}
+
+void StubHttpServer::run()
+{
+  struct epoll_event events[256];
+
+  while (!_terminated.load())
+  {
+    uint64_t now = now_ms();
+    send_due_responses(now);
+
+    int timeout_ms = -1;
+
+    if (!_due_responses.empty())
+    {
+      uint64_t due_ms = _due_responses.begin()->first;
+      timeout_ms = (due_ms > now) ? (int)(due_ms - now) : 0;
+    }
+
+    int num_events = epoll_wait(_epoll_fd, events, 256, timeout_ms);
+
+    for (int ii = 0; ii < num_events; ++ii)
+    {
+      uint64_t id = events[ii].data.u64;
+
+      if (id == 0)
+      {
+        accept_connections();
+      }
+      else if (id == (uint64_t)-1)
+      {
+        uint64_t value;
+        ssize_t rc = read(_wake_fd, &value, sizeof(value));
+        (void)rc;
+      }
+      else
+      {
+        std::map<uint64_t, Connection*>::iterator it = _connections.find(id);
+
+        if ((it != _connections.end()) && (events[ii].events & EPOLLOUT))
+        {
+          handle_writable(it->second);
+        }
+
+        it = _connections.find(id);
+
+        if ((it != _connections.end()) &&
+            (events[ii].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        {
+          handle_readable(it->second);
+        }
+      }
+    }
+  }
+}
+
+void StubHttpServer::accept_connections()
+{
+  while (true)
+  {
+    int fd = accept4(_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0)
+    {
+      return;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    Connection* conn = new Connection();
+    conn->id = _next_connection_id++;
+    conn->fd = fd;
+    conn->num_pending = 0;
+    conn->close_when_done = false;
+    _connections[conn->id] = conn;
+    ++_num_connections;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = conn->id;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+void StubHttpServer::handle_readable(Connection* conn)
+{
+  char buffer[16384];
+  bool closed = false;
+
+  while (!closed)
+  {
+    ssize_t rc = recv(conn->fd, buffer, sizeof(buffer), 0);
+
+    if (rc > 0)
+    {
+      conn->in.append(buffer, rc);
+    }
+    else if ((rc < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+    {
+      break;
+    }
+    else
+    {
+      // The client has closed the connection (or it's failed).
+      closed = true;
+    }
+  }
+
+  // Schedule a response to each complete request. Responses on a connection
+  // are all delayed by the same amount, so are sent in order.
+  Request request;
+  size_t length;
+
+  while ((!closed) && ((length = parse_request(conn->in, request)) > 0))
+  {
+    conn->in.erase(0, length);
+
+    int until_drop = _requests_until_drop.load();
+
+    if ((until_drop > 0) &&
+        (_requests_until_drop.compare_exchange_strong(until_drop, until_drop - 1)) &&
+        (until_drop == 1))
+    {
+      closed = true;
+      break;
+    }
+
+    std::map<std::string, std::string>::iterator it = request.headers.find("connection");
+
+    if ((it != request.headers.end()) &&
+        (strcasecmp(it->second.c_str(), "close") == 0))
+    {
+      conn->close_when_done = true;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _requests.push_back(request);
+    }
+
+    conn->num_pending++;
+    _due_responses.emplace(now_ms() + _latency_ms.load(), conn->id);
+  }
+
+  if (closed)
+  {
+    close_connection(conn);
+  }
+}
+
+void StubHttpServer::handle_writable(Connection* conn)
+{
+  while (!conn->out.empty())
+  {
+    ssize_t rc = send(conn->fd, conn->out.data(), conn->out.size(), MSG_NOSIGNAL);
+
+    if (rc > 0)
+    {
+      conn->out.erase(0, rc);
+    }
+    else if ((rc < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+    {
+      struct epoll_event event;
+      event.events = EPOLLIN | EPOLLOUT;
+      event.data.u64 = conn->id;
+      epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+      return;
+    }
+    else
+    {
+      close_connection(conn);
+      return;
+    }
+  }
+
+  if ((conn->num_pending == 0) &&
+      ((conn->close_when_done) || (_close_when_idle.load())))
+  {
+    close_connection(conn);
+    return;
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = conn->id;
+  epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+void StubHttpServer::send_due_responses(uint64_t now)
+{
+  while ((!_due_responses.empty()) && (_due_responses.begin()->first <= now))
+  {
+    uint64_t id = _due_responses.begin()->second;
+    _due_responses.erase(_due_responses.begin());
+
+    std::map<uint64_t, Connection*>::iterator it = _connections.find(id);
+
+    if (it == _connections.end())
+    {
+      // The connection's been closed.
+      continue;
+    }
+
+    Connection* conn = it->second;
+    conn->num_pending--;
+    conn->out.append("HTTP/1.1 " + std::to_string(_status.load()) + " Stub\r\n");
+
+    if ((conn->num_pending == 0) && (conn->close_when_done))
+    {
+      conn->out.append("Connection: close\r\n");
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      conn->out.append("Content-Length: " + std::to_string(_response_body.size()) + "\r\n\r\n");
+      conn->out.append(_response_body);
+    }
+
+    handle_writable(conn);
+  }
+}
+
+void StubHttpServer::close_connection(Connection* conn)
+{
+  close(conn->fd);
+  _connections.erase(conn->id);
+  delete conn;
+}
+
+size_t StubHttpServer::parse_request(const std::string& buffer, Request& request)
+{
+  size_t headers_end = buffer.find("\r\n\r\n");
+
+  if (headers_end == std::string::npos)
+  {
+    return 0;
+  }
+
+  request = Request();
+  size_t line_end = buffer.find("\r\n");
+  std::string request_line = buffer.substr(0, line_end);
+  size_t space1 = request_line.find(' ');
+  size_t space2 = request_line.find(' ', space1 + 1);
+  request.method = request_line.substr(0, space1);
+  request.path = request_line.substr(space1 + 1, space2 - space1 - 1);
+
+  // Header names are stored in lower case.
+  size_t pos = line_end + 2;
+
+  while (pos < headers_end)
+  {
+    line_end = buffer.find("\r\n", pos);
+    std::string line = buffer.substr(pos, line_end - pos);
+    size_t colon = line.find(':');
+    std::string name = line.substr(0, colon);
+
+    for (char& c : name)
+    {
+      c = tolower(c);
+    }
+
+    size_t value_start = line.find_first_not_of(' ', colon + 1);
+    request.headers[name] = (value_start != std::string::npos) ?
+                            line.substr(value_start) : "";
+    pos = line_end + 2;
+  }
+
+  size_t content_length = 0;
+  std::map<std::string, std::string>::iterator it = request.headers.find("content-length");
+
+  if (it != request.headers.end())
+  {
+    content_length = strtoul(it->second.c_str(), NULL, 10);
+  }
+
+  size_t body_start = headers_end + 4;
+
+  if (buffer.size() < body_start + content_length)
+  {
+    return 0;
+  }
+
+  request.body = buffer.substr(body_start, content_length);
+  return body_start + content_length;
+}
@@ -0,0 +1,116 @@
+/**
+ * @file stub_http_server.h
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef STUB_HTTP_SERVER_H__
+#define STUB_HTTP_SERVER_H__
+
+#include <pthread.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// An HTTP server on the loopback interface for testing HTTP clients against.
+// It runs on its own thread, answers each request after a configurable delay
+// (to simulate a slow client application), and records the requests it's
+// received.
+class StubHttpServer
+{
+public:
+  struct Request
+  {
+    std::string method;
+    std::string path;
+    std::map<std::string, std::string> headers;
+    std::string body;
+  };
+
+  StubHttpServer();
+  ~StubHttpServer();
+
+  int port() const { return _port; }
+
+  // The URL of a path on the server.
+  std::string url(const std::string& path) const;
+
+  // The status code to respond with, and how long to wait before responding.
+  void set_status(int status) { _status.store(status); }
+  void set_latency_ms(int latency_ms) { _latency_ms.store(latency_ms); }
+
+  // The body to respond with (empty by default).
+  void set_response_body(const std::string& body);
+
+  // Close the connection that the next request arrives on, without
+  // responding to (or recording) the request.
+  void drop_next_request() { drop_request(1); }
+
+  // As above, but for the num_requests'th request from now. Earlier requests
+  // on the same connection that haven't been responded to yet never are.
+  void drop_request(int num_requests) { _requests_until_drop.store(num_requests); }
+
+  // Close each connection once it's been sent all its responses, without
+  // telling the client first (as a server that times out idle connections
+  // would).
+  void close_when_idle() { _close_when_idle.store(true); }
+
+  // Wait until at least the given number of requests have been received.
+  // Returns false if they don't arrive within the timeout.
+  bool wait_for_requests(size_t count, int timeout_ms = 10000);
+
+  // The requests received so far.
+  std::vector<Request> requests();
+  size_t num_requests();
+
+  // The number of connections that have been made to the server.
+  size_t num_connections() const { return _num_connections.load(); }
+
+private:
+  struct Connection;
+
+  static void* thread_entry_point(void* arg);
+  void run();
+
+  void accept_connections();
+  void handle_readable(Connection* conn);
+  void handle_writable(Connection* conn);
+  void send_due_responses(uint64_t now_ms);
+  void close_connection(Connection* conn);
+
+  // Parse a complete request from the start of the buffer. Returns the number
+  // of bytes used, or 0 if the request isn't complete yet.
+  static size_t parse_request(const std::string& buffer, Request& request);
+
+  int _listen_fd;
+  int _epoll_fd;
+  int _wake_fd;
+  int _port;
+  pthread_t _thread;
+  std::atomic<bool> _terminated;
+
+  std::atomic<int> _status;
+  std::atomic<int> _latency_ms;
+  std::atomic<int> _requests_until_drop;
+  std::atomic<bool> _close_when_idle;
+  std::atomic<size_t> _num_connections;
+
+  // The open connections, by ID, and the responses waiting to be sent (by
+  // the time they're due and the ID of their connection).
+  std::map<uint64_t, Connection*> _connections;
+  std::multimap<uint64_t, uint64_t> _due_responses;
+  uint64_t _next_connection_id;
+
+  std::mutex _lock;
+  std::vector<Request> _requests;
+  std::string _response_body;
+};
+
+#endif
@@ -0,0 +1,739 @@
+/**
+ * @file test_async_http_client.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "async_http_client.h"
+#include "base.h"
+#include "fakehttpresolver.hpp"
+#include "stub_http_server.h"
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <unistd.h>
+
+/*****************************************************************************/
+/* HttpResponseParser tests                                                  */
+/*****************************************************************************/
+
+// Parse a whole response in one go, checking all of it was used.
+static HttpResponseParser::Result parse_all(HttpResponseParser& parser,
+                                            const std::string& data)
+{
+  size_t consumed;
+  HttpResponseParser::Result result = parser.parse(data.data(), data.size(), consumed);
+  EXPECT_EQ(data.size(), consumed);
+  return result;
+}
+
+TEST(TestHttpResponseParser, ContentLength)
+{
+  HttpResponseParser parser;
+  EXPECT_EQ(HttpResponseParser::COMPLETE,
+            parse_all(parser, "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello"));
+  EXPECT_EQ(200, parser.status());
+  EXPECT_EQ("hello", parser.body());
+  EXPECT_TRUE(parser.keep_alive());
+}
+
+TEST(TestHttpResponseParser, NoBody)
+{
+  HttpResponseParser parser;
+  EXPECT_EQ(HttpResponseParser::COMPLETE,
+            parse_all(parser, "HTTP/1.1 404 Not Found\r\ncontent-length:0\r\n\r\n"));
+  EXPECT_EQ(404, parser.status());
+  EXPECT_EQ("", parser.body());
+
+  // 204 responses never have a body.
+  parser.reset();
+  EXPECT_EQ(HttpResponseParser::COMPLETE,
+            parse_all(parser, "HTTP/1.1 204\r\n\r\n"));
+  EXPECT_EQ(204, parser.status());
+}
+
+// Test that a response that arrives a byte at a time is parsed correctly.
+TEST(TestHttpResponseParser, SplitResponse)
+{
+  std::string response = "HTTP/1.1 200 OK\r\n"
+                         "Content-Length: 10\r\n"
+                         "Connection: close\r\n"
+                         "\r\n"
+                         "0123456789";
+  HttpResponseParser parser;
+
+  for (size_t ii = 0; ii < response.size() - 1; ++ii)
+  {
+    size_t consumed;
+    EXPECT_EQ(HttpResponseParser::INCOMPLETE,
+              parser.parse(&response[ii], 1, consumed));
+    EXPECT_EQ(1u, consumed);
+  }
+
+  size_t consumed;
+  EXPECT_EQ(HttpResponseParser::COMPLETE,
+            parser.parse(&response[response.size() - 1], 1, consumed));
+  EXPECT_EQ("0123456789", parser.body());
+  EXPECT_FALSE(parser.keep_alive());
+}
+
+TEST(TestHttpResponseParser, Chunked)
+{
+  HttpResponseParser parser;
+  EXPECT_EQ(HttpResponseParser::COMPLETE,
+            parse_all(parser, "HTTP/1.1 200 OK\r\n"
+                              "Transfer-Encoding: chunked\r\n"
+                              "\r\n"
+                              "5\r\nhello\r\n"
+                              "7;ext=1\r\n, world\r\n"
+                              "0\r\n"
+                              "Trailer: value\r\n"
+                              "\r\n"));
+  EXPECT_EQ("hello, world", parser.body());
+  EXPECT_TRUE(parser.keep_alive());
+}
+
+// Test that interim responses are skipped.
+TEST(TestHttpResponseParser, Continue)
+{
+  HttpResponseParser parser;
+  EXPECT_EQ(HttpResponseParser::COMPLETE,
+            parse_all(parser, "HTTP/1.1 100 Continue\r\n\r\n"
+                              "HTTP/1.1 500 Error\r\nContent-Length: 2\r\n\r\nno"));
+  EXPECT_EQ(500, parser.status());
+  EXPECT_EQ("no", parser.body());
+}
+
+// Test a response whose body is ended by the connection closing.
+TEST(TestHttpResponseParser, BodyUntilClose)
+{
+  HttpResponseParser parser;
+  EXPECT_EQ(HttpResponseParser::INCOMPLETE,
+            parse_all(parser, "HTTP/1.0 200 OK\r\n\r\nsome body"));
+  EXPECT_EQ(HttpResponseParser::COMPLETE, parser.close());
+  EXPECT_EQ("some body", parser.body());
+  EXPECT_FALSE(parser.keep_alive());
+
+  // A response with a length that's cut short is invalid.
+  parser.reset();
+  EXPECT_EQ(HttpResponseParser::INCOMPLETE,
+            parse_all(parser, "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nshort"));
+  EXPECT_EQ(HttpResponseParser::INVALID, parser.close());
+}
+
+// Test that when several responses arrive together, each is parsed in turn.
+TEST(TestHttpResponseParser, PipelinedResponses)
+{
+  std::string responses = "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\none"
+                          "HTTP/1.1 503 Unavailable\r\nContent-Length: 3\r\n\r\ntwo";
+  HttpResponseParser parser;
+  size_t consumed;
+
+  EXPECT_EQ(HttpResponseParser::COMPLETE,
+            parser.parse(responses.data(), responses.size(), consumed));
+  EXPECT_EQ(200, parser.status());
+  EXPECT_EQ("one", parser.body());
+
+  size_t offset = consumed;
+  parser.reset();
+  EXPECT_EQ(HttpResponseParser::COMPLETE,
+            parser.parse(responses.data() + offset, responses.size() - offset, consumed));
+  EXPECT_EQ(offset + consumed, responses.size());
+  EXPECT_EQ(503, parser.status());
+  EXPECT_EQ("two", parser.body());
+}
+
+TEST(TestHttpResponseParser, Invalid)
+{
+  std::vector<std::string> invalid_responses =
+  {
+    "HTTP/2.0 200 OK\r\n",
+    "HTTP/1.1 2000 OK\r\n",
+    "SIP/2.0 200 OK\r\n",
+    "HTTP/1.1 200 OK\r\nNo colon\r\n",
+    "HTTP/1.1 200 OK\r\nContent-Length: lots\r\n",
+    "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n",
+    "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n1\r\nab\r\n",
+    "HTTP/1.1 200 OK\r\nX-Long: " + std::string(HttpResponseParser::MAX_LINE_LENGTH, 'x'),
+  };
+
+  for (const std::string& response : invalid_responses)
+  {
+    HttpResponseParser parser;
+    size_t consumed;
+    EXPECT_EQ(HttpResponseParser::INVALID,
+              parser.parse(response.data(), response.size(), consumed)) << response;
+  }
+}
+
+// Parse a stream of responses, split into pieces at the given offsets,
+// returning a description of each response and how the stream ended. Checks
+// the parser never uses more than it's given, and always makes progress.
+static std::vector<std::string> parse_stream(const std::string& data,
+                                             const std::vector<size_t>& splits)
+{
+  std::vector<std::string> results;
+  HttpResponseParser parser;
+  size_t start = 0;
+  size_t split = 0;
+
+  while (start < data.size())
+  {
+    while ((split < splits.size()) && (splits[split] <= start))
+    {
+      ++split;
+    }
+
+    size_t end = (split < splits.size()) ? splits[split] : data.size();
+    size_t consumed;
+    HttpResponseParser::Result result =
+      parser.parse(data.data() + start, end - start, consumed);
+    EXPECT_LE(consumed, end - start);
+
+    if (result == HttpResponseParser::INVALID)
+    {
+      results.push_back("invalid");
+      return results;
+    }
+    else if (result == HttpResponseParser::COMPLETE)
+    {
+      EXPECT_GT(consumed, 0u);
+      results.push_back(std::to_string(parser.status()) + " " +
+                        (parser.keep_alive() ? "keep-alive " : "close ") +
+                        parser.body());
+      parser.reset();
+    }
+    else
+    {
+      // The parser waits for more only once it's used everything.
+      EXPECT_EQ(end - start, consumed);
+    }
+
+    if ((consumed == 0) && (result != HttpResponseParser::INCOMPLETE))
+    {
+      // Don't loop forever if the parser isn't making progress.
+      return results;
+    }
+
+    start += consumed;
+  }
+
+  results.push_back((parser.close() == HttpResponseParser::COMPLETE) ?
+                    "closed " + std::to_string(parser.status()) + " " + parser.body() :
+                    (parser.started() ? "cut short" : "ended"));
+  return results;
+}
+
+// Fuzz the parser with mutated responses, checking it gives the same results
+// however the responses are split up (and doesn't crash). The random numbers
+// are seeded, so that any failure can be reproduced.
+TEST(TestHttpResponseParser, Fuzz)
+{
+  const std::vector<std::string> seeds =
+  {
+    "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello",
+    "HTTP/1.1 204\r\n\r\n",
+    "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+    "5\r\nhello\r\n7;ext=1\r\n, world\r\n0\r\nTrailer: value\r\n\r\n",
+    "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 500 Error\r\nContent-Length: 2\r\n\r\nno",
+    "HTTP/1.0 200 OK\r\n\r\nsome body",
+    "HTTP/1.1 200 OK\r\nConnection: close\r\ncontent-length:3\r\n\r\none"
+    "HTTP/1.1 503 Unavailable\r\nContent-Length: 3\r\n\r\ntwo",
+  };
+  const std::vector<std::string> tokens =
+  {
+    "\r\n", "\n", "\r", ":", " ", "\t", "0", "ffffffffffffffff", "99999999999999999999",
+    "Content-Length: ", "Transfer-Encoding: chunked", "Connection: keep-alive",
+    "HTTP/1.1 200 OK\r\n", std::string(1, '\0'),
+  };
+
+  std::mt19937 rng(12345);
+
+  for (int ii = 0; ii < 20000; ++ii)
+  {
+    std::string data = seeds[rng() % seeds.size()];
+    int num_mutations = 1 + (rng() % 4);
+
+    for (int jj = 0; jj < num_mutations; ++jj)
+    {
+      size_t pos = rng() % (data.size() + 1);
+
+      switch (rng() % 5)
+      {
+      case 0:
+        // Replace a byte with a random one.
+        if (pos < data.size())
+        {
+          data[pos] = (char)(rng() % 256);
+        }
+        break;
+
+      case 1:
+        // Delete some bytes.
+        data.erase(pos, rng() % 8);
+        break;
+
+      case 2:
+        // Insert a token.
+        data.insert(pos, tokens[rng() % tokens.size()]);
+        break;
+
+      case 3:
+        // Duplicate part of the data.
+        data.insert(pos, data.substr(rng() % (data.size() + 1), rng() % 32));
+        break;
+
+      default:
+        // Append another response.
+        data += seeds[rng() % seeds.size()];
+        break;
+      }
+    }
+
+    std::vector<std::string> whole = parse_stream(data, std::vector<size_t>());
+
+    std::vector<size_t> splits;
+    int num_splits = rng() % 8;
+
+    for (int jj = 0; jj < num_splits; ++jj)
+    {
+      splits.push_back(rng() % (data.size() + 1));
+    }
+
+    std::sort(splits.begin(), splits.end());
+    ASSERT_EQ(whole, parse_stream(data, splits)) << "Iteration " << ii;
+  }
+}
+
+// Test that the parser copes with random bytes.
+TEST(TestHttpResponseParser, FuzzRandomBytes)
+{
+  std::mt19937 rng(54321);
+
+  for (int ii = 0; ii < 2000; ++ii)
+  {
+    // Start most of the inputs with a valid status line, so that the rest of
+    // the parser is reached.
+    std::string data = (rng() % 4 != 0) ? "HTTP/1.1 200 OK\r\n" : "";
+    size_t length = rng() % 256;
+
+    for (size_t jj = 0; jj < length; ++jj)
+    {
+      // Favour the characters that mean something to the parser.
+      data.push_back((rng() % 4 == 0) ? "\r\n: 0a"[rng() % 7] : (char)(rng() % 256));
+    }
+
+    std::vector<std::string> whole = parse_stream(data, std::vector<size_t>());
+    std::vector<size_t> splits;
+
+    for (size_t jj = 1; jj < data.size(); jj += 1 + (rng() % 16))
+    {
+      splits.push_back(jj);
+    }
+
+    ASSERT_EQ(whole, parse_stream(data, splits)) << "Iteration " << ii;
+  }
+}
+
+/*****************************************************************************/
+/* AsyncHttpClient tests                                                     */
+/*****************************************************************************/
+
+// The results of the requests sent in a test.
+struct Results
+{
+  std::mutex lock;
+  std::map<std::string, std::pair<HTTPCode, std::string>> responses;
+  std::atomic<size_t> num_completed;
+
+  Results() : num_completed(0) {}
+
+  bool wait_for_completed(size_t count, int timeout_ms = 10000)
+  {
+    for (int ii = 0; (ii < timeout_ms) && (num_completed.load() < count); ++ii)
+    {
+      usleep(1000);
+    }
+
+    return (num_completed.load() >= count);
+  }
+};
+
+class TestRequest : public AsyncHttpRequest
+{
+public:
+  TestRequest(Results* results, const std::string& server, const std::string& path) :
+    _results(results)
+  {
+    this->server = server;
+    this->path = path;
+  }
+
+  void complete(HTTPCode rc, const std::string& rsp_body)
+  {
+    std::lock_guard<std::mutex> lock(_results->lock);
+    _results->responses[path] = std::make_pair(rc, rsp_body);
+    ++_results->num_completed;
+  }
+
+private:
+  Results* _results;
+};
+
+// Counts how many times it's incremented.
+class CountingCounterTable : public SNMP::CounterTable
+{
+public:
+  CountingCounterTable() : count(0) {}
+  void increment() { count++; }
+
+  std::atomic<int> count;
+};
+
+class TestAsyncHttpClient : public Base
+{
+protected:
+  void SetUp()
+  {
+    Base::SetUp();
+
+    _resolver = new FakeHttpResolver("127.0.0.1");
+    _server = new StubHttpServer();
+    _client = NULL;
+    create_client(100, 30000, 1);
+  }
+
+  // Replace the client with one that has the given connection pool settings.
+  void create_client(size_t max_connections,
+                     int idle_timeout_ms,
+                     size_t pipeline_depth)
+  {
+    delete _client;
+    _client = new AsyncHttpClient(_resolver,
+                                  "0.0.0.0",
+                                  1000,
+                                  100,
+                                  max_connections,
+                                  idle_timeout_ms,
+                                  pipeline_depth,
+                                  &_new_connections,
+                                  &_reused_connections);
+    _client->start();
+  }
+
+  // Send a request, and wait for it to complete.
+  HTTPCode send_and_wait(const std::string& path)
+  {
+    size_t num_completed = _results.num_completed.load();
+    _client->send(new TestRequest(&_results, server(), path));
+    EXPECT_TRUE(_results.wait_for_completed(num_completed + 1));
+    std::lock_guard<std::mutex> lock(_results.lock);
+    return _results.responses[path].first;
+  }
+
+  void TearDown()
+  {
+    delete _client;
+    delete _server;
+    delete _resolver;
+
+    Base::TearDown();
+  }
+
+  std::string server()
+  {
+    return "127.0.0.1:" + std::to_string(_server->port());
+  }
+
+  FakeHttpResolver* _resolver;
+  StubHttpServer* _server;
+  AsyncHttpClient* _client;
+  Results _results;
+  CountingCounterTable _new_connections;
+  CountingCounterTable _reused_connections;
+};
+
+TEST_F(TestAsyncHttpClient, SendRequest)
+{
+  TestRequest* request = new TestRequest(&_results, server(), "/callback1");
+  request->headers.push_back("X-Sequence-Number: 3");
+  request->body = "stuff stuff stuff";
+  _client->send(request);
+
+  ASSERT_TRUE(_results.wait_for_completed(1));
+  EXPECT_EQ(200, _results.responses["/callback1"].first);
+
+  std::vector<StubHttpServer::Request> requests = _server->requests();
+  ASSERT_EQ(1u, requests.size());
+  EXPECT_EQ("POST", requests[0].method);
+  EXPECT_EQ("/callback1", requests[0].path);
+  EXPECT_EQ("3", requests[0].headers["x-sequence-number"]);
+  EXPECT_EQ(server(), requests[0].headers["host"]);
+  EXPECT_EQ("stuff stuff stuff", requests[0].body);
+}
+
+TEST_F(TestAsyncHttpClient, ErrorResponse)
+{
+  _server->set_status(404);
+  _client->send(new TestRequest(&_results, server(), "/callback1"));
+
+  ASSERT_TRUE(_results.wait_for_completed(1));
+  EXPECT_EQ(404, _results.responses["/callback1"].first);
+}
+
+// Test that a body that's too big to send in one go is sent in full.
+TEST_F(TestAsyncHttpClient, LargeBody)
+{
+  TestRequest* request = new TestRequest(&_results, server(), "/callback1");
+  request->body = std::string(10 * 1024 * 1024, 'x');
+  _client->send(request);
+
+  ASSERT_TRUE(_results.wait_for_completed(1));
+  EXPECT_EQ(200, _results.responses["/callback1"].first);
+  ASSERT_EQ(1u, _server->num_requests());
+  EXPECT_EQ(10u * 1024 * 1024, _server->requests()[0].body.size());
+}
+
+// Test that many requests can be in flight at once, and that any more than
+// the maximum wait until there's space.
+TEST_F(TestAsyncHttpClient, ManyRequestsInFlight)
+{
+  _server->set_latency_ms(200);
+
+  for (int ii = 0; ii < 300; ++ii)
+  {
+    _client->send(new TestRequest(&_results, server(), "/callback" + std::to_string(ii)));
+  }
+
+  // The first 100 requests are all sent straight away.
+  EXPECT_TRUE(_server->wait_for_requests(100, 150));
+  EXPECT_EQ(100u, _server->num_requests());
+
+  ASSERT_TRUE(_results.wait_for_completed(300));
+  EXPECT_EQ(300u, _server->num_requests());
+  EXPECT_EQ(300u, _results.responses.size());
+}
+
+TEST_F(TestAsyncHttpClient, ConnectionRefused)
+{
+  // Find a port that nothing's listening on, by starting a server and then
+  // stopping it.
+  StubHttpServer* stopped_server = new StubHttpServer();
+  std::string stopped_server_name = "127.0.0.1:" + std::to_string(stopped_server->port());
+  delete stopped_server;
+
+  _client->send(new TestRequest(&_results, stopped_server_name, "/callback1"));
+
+  ASSERT_TRUE(_results.wait_for_completed(1));
+  EXPECT_EQ(0, _results.responses["/callback1"].first);
+}
+
+TEST_F(TestAsyncHttpClient, Timeout)
+{
+  _server->set_latency_ms(2000);
+  _client->send(new TestRequest(&_results, server(), "/callback1"));
+
+  ASSERT_TRUE(_results.wait_for_completed(1, 1500));
+  EXPECT_EQ(0, _results.responses["/callback1"].first);
+}
+
+TEST_F(TestAsyncHttpClient, InvalidServer)
+{
+  _client->send(new TestRequest(&_results, "127.0.0.1:http", "/callback1"));
+  _client->send(new TestRequest(&_results, "[::1", "/callback2"));
+
+  ASSERT_TRUE(_results.wait_for_completed(2));
+  EXPECT_EQ(0, _results.responses["/callback1"].first);
+  EXPECT_EQ(0, _results.responses["/callback2"].first);
+  EXPECT_EQ(0u, _server->num_requests());
+}
+
+// Test that requests that haven't been sent when the client stops are
+// dropped.
+TEST_F(TestAsyncHttpClient, StopWithRequestsInFlight)
+{
+  _server->set_latency_ms(2000);
+
+  for (int ii = 0; ii < 200; ++ii)
+  {
+    _client->send(new TestRequest(&_results, server(), "/callback" + std::to_string(ii)));
+  }
+
+  EXPECT_TRUE(_server->wait_for_requests(100));
+  delete _client; _client = NULL;
+  EXPECT_EQ(0u, _results.num_completed.load());
+}
+
+// Test that requests to the same server are sent on the same connection.
+TEST_F(TestAsyncHttpClient, ReuseConnection)
+{
+  EXPECT_EQ(200, send_and_wait("/callback1"));
+  EXPECT_EQ(200, send_and_wait("/callback2"));
+  EXPECT_EQ(200, send_and_wait("/callback3"));
+
+  EXPECT_EQ(3u, _server->num_requests());
+  EXPECT_EQ(1u, _server->num_connections());
+  EXPECT_EQ(1, _new_connections.count.load());
+  EXPECT_EQ(2, _reused_connections.count.load());
+}
+
+// Test that requests wait for a connection once a server has the maximum
+// number of connections.
+TEST_F(TestAsyncHttpClient, ConnectionLimit)
+{
+  create_client(4, 30000, 1);
+  _server->set_latency_ms(50);
+
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    _client->send(new TestRequest(&_results, server(), "/callback" + std::to_string(ii)));
+  }
+
+  ASSERT_TRUE(_results.wait_for_completed(20));
+  EXPECT_EQ(20u, _server->num_requests());
+  EXPECT_EQ(4u, _server->num_connections());
+  EXPECT_EQ(4, _new_connections.count.load());
+  EXPECT_EQ(16, _reused_connections.count.load());
+
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    EXPECT_EQ(200, _results.responses["/callback" + std::to_string(ii)].first);
+  }
+}
+
+// Test that connections that have been idle for too long are closed.
+TEST_F(TestAsyncHttpClient, IdleTimeout)
+{
+  create_client(100, 100, 1);
+
+  EXPECT_EQ(200, send_and_wait("/callback1"));
+  EXPECT_EQ(200, send_and_wait("/callback2"));
+  usleep(300000);
+  EXPECT_EQ(200, send_and_wait("/callback3"));
+
+  EXPECT_EQ(2u, _server->num_connections());
+  EXPECT_EQ(1, _reused_connections.count.load());
+}
+
+// Test that connections aren't kept if the idle timeout is 0.
+TEST_F(TestAsyncHttpClient, NoIdleConnections)
+{
+  create_client(100, 0, 1);
+
+  EXPECT_EQ(200, send_and_wait("/callback1"));
+  EXPECT_EQ(200, send_and_wait("/callback2"));
+
+  EXPECT_EQ(2u, _server->num_connections());
+  EXPECT_EQ(0, _reused_connections.count.load());
+}
+
+// Test that requests are pipelined on a connection once the server has shown
+// it keeps connections open.
+TEST_F(TestAsyncHttpClient, Pipelining)
+{
+  create_client(1, 30000, 4);
+  EXPECT_EQ(200, send_and_wait("/callback"));
+
+  _server->set_latency_ms(200);
+
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    _client->send(new TestRequest(&_results, server(), "/callback" + std::to_string(ii)));
+  }
+
+  // Four requests are sent at once, without waiting for responses.
+  EXPECT_TRUE(_server->wait_for_requests(5, 150));
+
+  ASSERT_TRUE(_results.wait_for_completed(9));
+  EXPECT_EQ(9u, _server->num_requests());
+  EXPECT_EQ(1u, _server->num_connections());
+
+  // The responses are matched up with the right requests.
+  std::vector<StubHttpServer::Request> requests = _server->requests();
+
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    EXPECT_EQ(200, _results.responses["/callback" + std::to_string(ii)].first);
+    EXPECT_EQ("/callback" + std::to_string(ii), requests[ii + 1].path);
+  }
+}
+
+// Test that a request isn't sent again if the server closes a reused
+// connection without responding, as the server may have acted on it.
+TEST_F(TestAsyncHttpClient, NoRetryOnReusedConnection)
+{
+  EXPECT_EQ(200, send_and_wait("/callback1"));
+
+  _server->drop_next_request();
+  EXPECT_EQ(0, send_and_wait("/callback2"));
+
+  EXPECT_EQ(1u, _server->num_requests());
+  EXPECT_EQ(1u, _server->num_connections());
+}
+
+// Test that idle connections that the server has closed aren't reused.
+TEST_F(TestAsyncHttpClient, IdleConnectionClosedByServer)
+{
+  _server->close_when_idle();
+
+  EXPECT_EQ(200, send_and_wait("/callback1"));
+  EXPECT_EQ(200, send_and_wait("/callback2"));
+  EXPECT_EQ(200, send_and_wait("/callback3"));
+
+  EXPECT_EQ(3u, _server->num_requests());
+  EXPECT_EQ(3u, _server->num_connections());
+}
+
+// Test that if a connection fails, the requests pipelined on it that had been
+// sent fail, while those that hadn't been sent are sent on another connection.
+TEST_F(TestAsyncHttpClient, PipelinedRequestsOnFailedConnection)
+{
+  create_client(1, 30000, 4);
+  EXPECT_EQ(200, send_and_wait("/callback"));
+
+  // The first four requests are all sent on the connection straight away,
+  // and the server closes it when it gets the last of them (before it's
+  // responded to the others). The rest are waiting for space on the
+  // connection, so are sent on a new one.
+  _server->set_latency_ms(200);
+  _server->drop_request(4);
+
+  for (int ii = 0; ii < 6; ++ii)
+  {
+    _client->send(new TestRequest(&_results, server(), "/callback" + std::to_string(ii)));
+  }
+
+  ASSERT_TRUE(_results.wait_for_completed(7));
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    EXPECT_EQ(0, _results.responses["/callback" + std::to_string(ii)].first);
+  }
+
+  for (int ii = 4; ii < 6; ++ii)
+  {
+    EXPECT_EQ(200, _results.responses["/callback" + std::to_string(ii)].first);
+  }
+
+  EXPECT_EQ(6u, _server->num_requests());
+  EXPECT_EQ(2u, _server->num_connections());
+}
+
+// Test that a request isn't sent again if a new connection closes without a
+// response, as the server may have acted on it.
+TEST_F(TestAsyncHttpClient, NoRetryOnNewConnection)
+{
+  _server->drop_next_request();
+  EXPECT_EQ(0, send_and_wait("/callback1"));
+
+  EXPECT_EQ(0u, _server->num_requests());
+  EXPECT_EQ(1u, _server->num_connections());
+}
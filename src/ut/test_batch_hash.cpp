@@ -0,0 +1,136 @@
+/**
+ * @file test_batch_hash.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "batch_hash.h"
+#include "murmur/MurmurHash3.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+#include <vector>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestBatchHash : public Base
+{
+protected:
+  // The implementations that this CPU supports.
+  std::vector<BatchHash::Implementation> supported_implementations()
+  {
+    std::vector<BatchHash::Implementation> implementations;
+
+    for (int impl = BatchHash::SCALAR;
+         impl <= BatchHash::best_implementation();
+         ++impl)
+    {
+      implementations.push_back((BatchHash::Implementation)impl);
+    }
+
+    return implementations;
+  }
+};
+
+/*****************************************************************************/
+/* Tests                                                                     */
+/*****************************************************************************/
+
+// Each implementation gives the same hashes as MurmurHash3, including for
+// numbers of keys that don't fill the SIMD lanes.
+TEST_F(TestBatchHash, MatchesMurmurHash)
+{
+  std::vector<uint32_t> seeds = {0, 1, 0xffffffff, 0x12345678, 0xcafebabe};
+
+  for (size_t num_keys : {0, 1, 3, 4, 7, 8, 13, 64, 101})
+  {
+    std::vector<uint64_t> keys;
+
+    for (size_t jj = 0; jj < num_keys; ++jj)
+    {
+      keys.push_back(((uint64_t)rand() << 40) ^ ((uint64_t)rand() << 20) ^ rand());
+    }
+
+    for (BatchHash::Implementation impl : supported_implementations())
+    {
+      std::vector<uint32_t> hashes(seeds.size() * num_keys);
+      BatchHash::murmur3_32(keys.data(),
+                            num_keys,
+                            seeds.data(),
+                            seeds.size(),
+                            hashes.data(),
+                            impl);
+
+      for (size_t ii = 0; ii < seeds.size(); ++ii)
+      {
+        for (size_t jj = 0; jj < num_keys; ++jj)
+        {
+          uint32_t expected;
+          MurmurHash3_x86_32(&keys[jj], sizeof(uint64_t), seeds[ii], &expected);
+          ASSERT_EQ(expected, hashes[(ii * num_keys) + jj])
+            << "Implementation " << impl << ", key " << jj << ", seed " << ii;
+        }
+      }
+    }
+  }
+}
+
+// Measure how many timer IDs a second each implementation can hash with the
+// seeds for an eleven node cluster.
+TEST_F(TestBatchHash, DISABLED_Benchmark)
+{
+  const size_t NUM_KEYS = 1024;
+  const int NUM_ROUNDS = 100;
+  std::vector<uint32_t> seeds;
+  std::vector<uint64_t> keys;
+
+  for (int ii = 0; ii < 11; ++ii)
+  {
+    seeds.push_back(rand());
+  }
+
+  for (size_t jj = 0; jj < NUM_KEYS; ++jj)
+  {
+    keys.push_back(((uint64_t)rand() << 32) ^ rand());
+  }
+
+  std::vector<uint32_t> hashes(seeds.size() * NUM_KEYS);
+
+  for (BatchHash::Implementation impl : supported_implementations())
+  {
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int round = 0; round < NUM_ROUNDS; ++round)
+    {
+      BatchHash::murmur3_32(keys.data(),
+                            NUM_KEYS,
+                            seeds.data(),
+                            seeds.size(),
+                            hashes.data(),
+                            impl);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t total_us = ((end.tv_sec - start.tv_sec) * 1000000) +
+                        ((end.tv_nsec - start.tv_nsec) / 1000);
+
+    printf("Implementation %d hashed %lu IDs in %lu us (%lu IDs/s)\n",
+           impl,
+           NUM_ROUNDS * NUM_KEYS,
+           total_us,
+           (NUM_ROUNDS * NUM_KEYS * 1000000UL) / std::max(total_us, 1UL));
+  }
+}
@@ -0,0 +1,108 @@
+/**
+ * @file test_batch_queue.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "batch_queue.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+#include <vector>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestBatchQueue : public Base
+{
+};
+
+/*****************************************************************************/
+/* Tests                                                                     */
+/*****************************************************************************/
+
+TEST_F(TestBatchQueue, PushAndPopInOrder)
+{
+  BatchQueue<int> q(1);
+  std::vector<int> items = {1, 2, 3};
+  q.push_batch(items);
+  q.push(4);
+
+  // Pushing a batch empties the vector.
+  EXPECT_TRUE(items.empty());
+  EXPECT_EQ(4u, q.size());
+
+  // Items come off in order, up to the requested number at a time.
+  ASSERT_TRUE(q.pop_batch(items, 3));
+  EXPECT_EQ(std::vector<int>({1, 2, 3}), items);
+
+  items.clear();
+  ASSERT_TRUE(q.pop_batch(items, 3));
+  EXPECT_EQ(std::vector<int>({4}), items);
+  EXPECT_EQ(0u, q.size());
+}
+
+TEST_F(TestBatchQueue, ConsumersTakeTheirShare)
+{
+  // With four consumers, each takes at most a quarter of the queue (rounded
+  // up), so that the items are spread between them.
+  BatchQueue<int> q(4);
+  std::vector<int> items = {1, 2, 3, 4, 5, 6};
+  q.push_batch(items);
+
+  ASSERT_TRUE(q.pop_batch(items, 16));
+  EXPECT_EQ(2u, items.size());
+
+  // As the queue shrinks, so does each consumer's share, but a consumer
+  // always takes at least one item.
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    items.clear();
+    ASSERT_TRUE(q.pop_batch(items, 16));
+    EXPECT_EQ(1u, items.size());
+  }
+
+  EXPECT_EQ(0u, q.size());
+}
+
+static void* pop_until_terminated(void* arg)
+{
+  BatchQueue<int>* q = static_cast<BatchQueue<int>*>(arg);
+  std::vector<int> items;
+
+  while (q->pop_batch(items, 16))
+  {
+  }
+
+  return NULL;
+}
+
+TEST_F(TestBatchQueue, TerminateWakesConsumers)
+{
+  BatchQueue<int> q(2);
+  pthread_t threads[2];
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    pthread_create(&threads[ii], NULL, &pop_until_terminated, &q);
+  }
+
+  q.terminate();
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  // Nothing more can be taken off the queue once it's terminated.
+  q.push(1);
+  std::vector<int> items;
+  EXPECT_FALSE(q.pop_batch(items, 16));
+  EXPECT_TRUE(items.empty());
+}
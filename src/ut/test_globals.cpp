@@ -10,6 +10,7 @@
  */
 
 #include "globals.h"
+#include "snmp_counter_table.h"
 #include "test_interposer.hpp"
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
@@ -24,6 +25,16 @@ class TestGlobals : public ::testing::Test
 {
 };
 
+// Counts how many times it's incremented.
+class CountingCounterTable : public SNMP::CounterTable
+{
+public:
+  CountingCounterTable() : count(0) {}
+  void increment() { count++; }
+
+  int count;
+};
+
 TEST_F(TestGlobals, ParseGlobalsDefaults)
 {
   // Initialize the global configuration. Use default configuration
@@ -51,6 +62,30 @@ TEST_F(TestGlobals, ParseGlobalsDefaults)
   test_global->get_gr_threads(gr_threads);
   EXPECT_EQ(gr_threads, 50);
 
+  bool binary_replication;
+  test_global->get_binary_replication(binary_replication);
+  EXPECT_FALSE(binary_replication);
+
+  int timer_shards;
+  test_global->get_timer_shards(timer_shards);
+  EXPECT_EQ(timer_shards, 1);
+
+  bool queue_timer_adds;
+  test_global->get_queue_timer_adds(queue_timer_adds);
+  EXPECT_FALSE(queue_timer_adds);
+
+  int callback_connections_per_host;
+  test_global->get_callback_connections_per_host(callback_connections_per_host);
+  EXPECT_EQ(callback_connections_per_host, 400);
+
+  int callback_idle_timeout;
+  test_global->get_callback_idle_timeout(callback_idle_timeout);
+  EXPECT_EQ(callback_idle_timeout, 30000);
+
+  int callback_pipeline_depth;
+  test_global->get_callback_pipeline_depth(callback_pipeline_depth);
+  EXPECT_EQ(callback_pipeline_depth, 1);
+
   int ttl;
   test_global->get_max_ttl(ttl);
   EXPECT_EQ(ttl, 600);
@@ -140,6 +175,30 @@ TEST_F(TestGlobals, ParseGlobalsNotDefaults)
   test_global->get_gr_threads(gr_threads);
   EXPECT_EQ(gr_threads, 30);
 
+  bool binary_replication;
+  test_global->get_binary_replication(binary_replication);
+  EXPECT_TRUE(binary_replication);
+
+  int timer_shards;
+  test_global->get_timer_shards(timer_shards);
+  EXPECT_EQ(timer_shards, 4);
+
+  bool queue_timer_adds;
+  test_global->get_queue_timer_adds(queue_timer_adds);
+  EXPECT_TRUE(queue_timer_adds);
+
+  int callback_connections_per_host;
+  test_global->get_callback_connections_per_host(callback_connections_per_host);
+  EXPECT_EQ(callback_connections_per_host, 8);
+
+  int callback_idle_timeout;
+  test_global->get_callback_idle_timeout(callback_idle_timeout);
+  EXPECT_EQ(callback_idle_timeout, 5000);
+
+  int callback_pipeline_depth;
+  test_global->get_callback_pipeline_depth(callback_pipeline_depth);
+  EXPECT_EQ(callback_pipeline_depth, 4);
+
   int ttl;
   test_global->get_max_ttl(ttl);
   EXPECT_EQ(ttl, 500);
@@ -286,3 +345,118 @@ TEST_F(TestGlobals, UnknownOptions)
 
   delete test_global; test_global = NULL;
 }
+
+TEST_F(TestGlobals, ConfigChangeHandler)
+{
+  Globals* test_global = new Globals("./no_local_config_file",
+                                     "./no_cluster_config_file",
+                                     "./no_shared_config_file");
+
+  // The handler is called each time the configuration is reloaded, once the
+  // new configuration is in place.
+  int calls = 0;
+  uint64_t generation = 0;
+  test_global->set_config_change_handler([&]()
+  {
+    calls++;
+    generation = test_global->get_config_generation();
+  });
+
+  test_global->update_config();
+  EXPECT_EQ(1, calls);
+  EXPECT_EQ(test_global->get_config_generation(), generation);
+
+  test_global->update_config();
+  EXPECT_EQ(2, calls);
+
+  // Clearing the handler stops it being called.
+  test_global->set_config_change_handler(std::function<void()>());
+  test_global->update_config();
+  EXPECT_EQ(2, calls);
+
+  delete test_global; test_global = NULL;
+}
+
+TEST_F(TestGlobals, ClusterConfigSnapshot)
+{
+  Globals* test_global = new Globals(std::string(UT_DIR).append("/chronos.conf"),
+                                     std::string(UT_DIR).append("/chronos_cluster.conf"),
+                                     std::string(UT_DIR).append("/chronos_shared.conf"));
+
+  // There's always a snapshot, even before the configuration is read.
+  ClusterConfigPtr initial_config = test_global->get_cluster_config();
+  ASSERT_TRUE(initial_config != NULL);
+  EXPECT_EQ(test_global->get_config_generation(), initial_config->generation);
+  EXPECT_TRUE(initial_config->new_cluster.empty());
+
+  test_global->update_config();
+
+  // Reading the configuration publishes a new snapshot of it, with the
+  // current cluster made of the staying then joining nodes, and the old
+  // cluster of the staying then leaving nodes.
+  ClusterConfigPtr config = test_global->get_cluster_config();
+  EXPECT_NE(initial_config, config);
+  EXPECT_EQ(test_global->get_config_generation(), config->generation);
+  EXPECT_EQ("1.2.3.4", config->cluster_local_ip.str());
+  EXPECT_EQ(std::vector<std::string>({"1.2.3.4", "1.2.3.5", "3.4.5.6", "3.4.5.7"}),
+            config->new_cluster);
+  EXPECT_EQ(std::vector<std::string>({"1.2.3.4", "1.2.3.5", "2.3.4.5", "2.3.4.6"}),
+            config->old_cluster);
+  EXPECT_EQ(config->new_cluster.size(), config->new_cluster_hashes.size());
+  EXPECT_EQ(config->old_cluster.size(), config->old_cluster_hashes.size());
+  EXPECT_EQ(7254, config->bind_port);
+  EXPECT_EQ("mysite", config->local_site_name.str());
+  EXPECT_EQ(2u, config->remote_site_names.size());
+
+  std::string cluster_view_id;
+  test_global->get_cluster_view_id(cluster_view_id);
+  EXPECT_EQ(cluster_view_id, config->cluster_view_id.str());
+
+  // Changing the configuration publishes another snapshot, and leaves the
+  // earlier one alone.
+  test_global->lock();
+  test_global->set_cluster_local_ip("5.6.7.8");
+  test_global->unlock();
+
+  EXPECT_EQ("5.6.7.8", test_global->get_cluster_config()->cluster_local_ip.str());
+  EXPECT_EQ("1.2.3.4", config->cluster_local_ip.str());
+  EXPECT_LT(config->generation, test_global->get_config_generation());
+
+  // Superseded snapshots are freed once nothing is using them, but the
+  // current one is kept.
+  std::weak_ptr<const ClusterConfig> weak_initial_config = initial_config;
+  std::weak_ptr<const ClusterConfig> weak_config = config;
+  std::weak_ptr<const ClusterConfig> weak_current_config =
+                                              test_global->get_cluster_config();
+  initial_config.reset();
+  config.reset();
+  EXPECT_TRUE(weak_initial_config.expired());
+  EXPECT_TRUE(weak_config.expired());
+  EXPECT_FALSE(weak_current_config.expired());
+
+  delete test_global; test_global = NULL;
+}
+
+TEST_F(TestGlobals, ConfigReadsCounted)
+{
+  Globals* test_global = new Globals("./no_local_config_file",
+                                     "./no_cluster_config_file",
+                                     "./no_shared_config_file");
+  test_global->update_config();
+
+  CountingCounterTable config_reads_table;
+  test_global->set_config_reads_table(&config_reads_table);
+
+  // Reads that take the lock are counted, but reads of the snapshot aren't.
+  std::string bind_address;
+  test_global->get_bind_address(bind_address);
+  test_global->get_cluster_config();
+  test_global->get_config_generation();
+  EXPECT_EQ(1, config_reads_table.count);
+
+  test_global->set_config_reads_table(NULL);
+  test_global->get_bind_address(bind_address);
+  EXPECT_EQ(1, config_reads_table.count);
+
+  delete test_global; test_global = NULL;
+}
@@ -548,3 +548,56 @@ TYPED_TEST(TestHandler, ReplicationFactorGreaterThanReplicasReplicated)
   EXPECT_EQ(added_timer->replicas.size(), 1);
   delete added_timer; added_timer = NULL;
 }
+
+// Tests that a timer in the binary format is accepted if the request says it's
+// binary, and that a binary timer with site and replica information isn't
+// replicated further
+TYPED_TEST(TestHandler, BinaryTimerWithSitesAndReplicas)
+{
+  Timer timer(1, 100000, 200000);
+  timer.callback_url = "localhost";
+  timer.callback_body = "stuff";
+  timer.replicas.push_back("10.0.0.1:9999");
+  timer.replicas.push_back("10.0.0.3:9999");
+  timer.sites.push_back("remote_site_1_name");
+  timer.sites.push_back("remote_site_2_name");
+
+  Timer* added_timer;
+  HttpStack::Request req(NULL, NULL);
+
+  TestFixture::controller_request("/timers/0000000000000001-2", htp_method_PUT, timer.to_binary(), "");
+  TestFixture::_req->add_header_to_incoming_req("Content-Type", "application/vnd.chronos.timer");
+  EXPECT_CALL(*TestFixture::_replicator, replicate(_)).Times(0);
+  if (TestFixture::_gr_replicator != NULL)
+  {
+    EXPECT_CALL(*TestFixture::_gr_replicator, replicate(_)).Times(0);
+  }
+  EXPECT_CALL(*TestFixture::_th, add_timer(_,_)).WillOnce(SaveArg<0>(&added_timer));
+  EXPECT_CALL(*TestFixture::_httpstack, send_reply(_, 200, _)).WillOnce(SaveArg<0>(&req));
+  TestFixture::_task->run();
+
+  // Check that the timer matches the one that was sent.
+  EXPECT_EQ(added_timer->callback_url, "localhost");
+  EXPECT_EQ(added_timer->callback_body, "stuff");
+  EXPECT_EQ(added_timer->repeat_for, (unsigned)200000);
+  EXPECT_EQ(added_timer->interval_ms, (unsigned)100000);
+  EXPECT_EQ(added_timer->_replication_factor, 2);
+  EXPECT_EQ(added_timer->replicas, timer.replicas);
+  EXPECT_EQ(added_timer->sites, timer.sites);
+  delete added_timer; added_timer = NULL;
+}
+
+// Tests that a badly formed binary timer is rejected
+TYPED_TEST(TestHandler, InvalidBinaryTimer)
+{
+  Timer timer(1, 100000, 200000);
+  timer.callback_url = "localhost";
+  timer.callback_body = "stuff";
+  std::string body = timer.to_binary();
+  body.resize(body.size() / 2);
+
+  TestFixture::controller_request("/timers/0000000000000001-2", htp_method_PUT, body, "");
+  TestFixture::_req->add_header_to_incoming_req("Content-Type", "application/vnd.chronos.timer");
+  EXPECT_CALL(*TestFixture::_httpstack, send_reply(_, 400, _));
+  TestFixture::_task->run();
+}
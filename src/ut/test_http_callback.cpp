@@ -16,8 +16,18 @@
 #include "fakehttpresolver.hpp"
 #include "mock_timer_handler.h"
 #include "timer_helper.h"
+#include "stub_http_server.h"
 
-/// Fixture for HTTPCallbackTest.
+#include <algorithm>
+#include <atomic>
+#include <sys/resource.h>
+
+using ::testing::_;
+using ::testing::Invoke;
+using ::testing::InvokeWithoutArgs;
+
+/// Fixture for HTTPCallbackTest. Callbacks are sent to a stub HTTP server,
+/// apart from those over TLS, which go through fakecurl.
 class TestHTTPCallback : public Base
 {
 protected:
@@ -25,7 +35,8 @@ protected:
   {
     Base::SetUp();
 
-    _resolver = new FakeHttpResolver("10.42.42.42");
+    _resolver = new FakeHttpResolver("127.0.0.1");
+    _server = new StubHttpServer();
     _th = new MockTimerHandler();
     _callback = new HTTPCallback(_resolver, NULL);
     _callback->start(_th);
@@ -38,69 +49,402 @@ protected:
   {
     delete _callback;
     delete _th;
+    delete _server;
     delete _resolver;
 
     Base::TearDown();
   }
 
+  // Create a timer whose callback goes to the stub server.
+  Timer* stub_server_timer(TimerID id)
+  {
+    Timer* timer = default_timer(id);
+    timer->callback_url = _server->url("/callback" + std::to_string(id));
+    return timer;
+  }
+
   FakeHttpResolver* _resolver;
+  StubHttpServer* _server;
   MockTimerHandler* _th;
   HTTPCallback* _callback;
 };
 
+// Waits until the expected number of callbacks have completed.
+class CallbackCounter
+{
+public:
+  CallbackCounter() : _count(0) {}
+
+  void increment() { ++_count; }
+
+  bool wait_for(uint64_t count)
+  {
+    // Don't wait for more than 10 seconds.
+    for (int ii = 0; (ii < 10000) && (_count.load() < count); ++ii)
+    {
+      usleep(1000);
+    }
+
+    return (_count.load() >= count);
+  }
+
+private:
+  std::atomic<uint64_t> _count;
+};
+
 // Test successful timer callback
 TEST_F(TestHTTPCallback, Success)
 {
-  fakecurl_responses["http://10.42.42.42:80/callback1"] = CURLE_OK;
+  CallbackCounter completed;
+  Timer* timer1 = stub_server_timer(1);
+  EXPECT_CALL(*_th, return_timer(timer1));
+  EXPECT_CALL(*_th, handle_successful_callback(1))
+    .WillOnce(InvokeWithoutArgs(&completed, &CallbackCounter::increment));
+  _callback->perform(timer1);
+
+  EXPECT_TRUE(completed.wait_for(1)) << "The callback didn't complete";
+
+  // Check the request is as expected.
+  std::vector<StubHttpServer::Request> requests = _server->requests();
+  ASSERT_EQ(1u, requests.size());
+  EXPECT_EQ("/callback1", requests[0].path);
+  EXPECT_EQ("stuff stuff stuff", requests[0].body);
+  EXPECT_EQ("0", requests[0].headers["x-sequence-number"]);
+  EXPECT_EQ("application/octet-stream", requests[0].headers["content-type"]);
+
+  delete timer1; timer1 = NULL;
+}
+
+// Test failed timer callback
+TEST_F(TestHTTPCallback, Failure)
+{
+  CallbackCounter completed;
+  _server->set_status(404);
+  Timer* timer1 = stub_server_timer(1);
+  EXPECT_CALL(*_th, return_timer(timer1));
+  EXPECT_CALL(*_th, handle_failed_callback(1))
+    .WillOnce(InvokeWithoutArgs(&completed, &CallbackCounter::increment));
+  _callback->perform(timer1);
+
+  EXPECT_TRUE(completed.wait_for(1)) << "The callback didn't complete";
+  EXPECT_EQ(1u, _server->num_requests());
+
+  delete timer1; timer1 = NULL;
+}
+
+// Test a batch of timer callbacks
+TEST_F(TestHTTPCallback, PerformBatch)
+{
+  CallbackCounter completed;
+  Timer* timer1 = stub_server_timer(1);
+  Timer* timer2 = stub_server_timer(2);
+  EXPECT_CALL(*_th, return_timer(timer1));
+  EXPECT_CALL(*_th, return_timer(timer2));
+  EXPECT_CALL(*_th, handle_successful_callback(1))
+    .WillOnce(InvokeWithoutArgs(&completed, &CallbackCounter::increment));
+  EXPECT_CALL(*_th, handle_successful_callback(2))
+    .WillOnce(InvokeWithoutArgs(&completed, &CallbackCounter::increment));
+
+  std::vector<Timer*> timers = {timer1, timer2};
+  _callback->perform_batch(timers);
+  EXPECT_TRUE(timers.empty());
+
+  EXPECT_TRUE(completed.wait_for(2)) << "The callbacks didn't both complete";
+  EXPECT_EQ(2u, _server->num_requests());
+
+  delete timer1; timer1 = NULL;
+  delete timer2; timer2 = NULL;
+}
+
+// Test that callbacks to the same URL are sent in one request if their
+// clients accept batches, with each timer getting its own result.
+TEST_F(TestHTTPCallback, BatchedCallbacks)
+{
+  CallbackCounter completed;
+  _server->set_response_body("{\"results\": [200, 503, 200]}");
+
+  std::vector<Timer*> timers;
+
+  for (TimerID id = 1; id <= 3; ++id)
+  {
+    Timer* timer = stub_server_timer(id);
+    timer->callback_url = _server->url("/batch");
+    timer->batch_callback = true;
+    timer->sequence_number = id;
+    timers.push_back(timer);
+    EXPECT_CALL(*_th, return_timer(timer));
+  }
+
+  std::vector<Timer*> to_pop = timers;
+  EXPECT_CALL(*_th, handle_successful_callback(1))
+    .WillOnce(InvokeWithoutArgs(&completed, &CallbackCounter::increment));
+  EXPECT_CALL(*_th, handle_failed_callback(2))
+    .WillOnce(InvokeWithoutArgs(&completed, &CallbackCounter::increment));
+  EXPECT_CALL(*_th, handle_successful_callback(3))
+    .WillOnce(InvokeWithoutArgs(&completed, &CallbackCounter::increment));
+  _callback->perform_batch(to_pop);
+
+  EXPECT_TRUE(completed.wait_for(3)) << "The callbacks didn't all complete";
+
+  std::vector<StubHttpServer::Request> requests = _server->requests();
+  ASSERT_EQ(1u, requests.size());
+  EXPECT_EQ("/batch", requests[0].path);
+  EXPECT_EQ("application/json", requests[0].headers["content-type"]);
+  EXPECT_EQ("{\"callbacks\":["
+            "{\"id\":\"" + timers[0]->url().substr(8) + "\",\"sequence-number\":1,\"opaque\":\"stuff stuff stuff\"},"
+            "{\"id\":\"" + timers[1]->url().substr(8) + "\",\"sequence-number\":2,\"opaque\":\"stuff stuff stuff\"},"
+            "{\"id\":\"" + timers[2]->url().substr(8) + "\",\"sequence-number\":3,\"opaque\":\"stuff stuff stuff\"}]}",
+            requests[0].body);
+
+  for (Timer* timer : timers)
+  {
+    delete timer;
+  }
+}
+
+// Test that batches only hold callbacks to the same URL, and only for clients
+// that accept them.
+TEST_F(TestHTTPCallback, BatchedCallbacksByURL)
+{
+  CallbackCounter completed;
+  _server->set_response_body("{\"results\": [200, 200]}");
+
+  std::vector<Timer*> timers;
+
+  for (TimerID id = 1; id <= 5; ++id)
+  {
+    Timer* timer = stub_server_timer(id);
+    timer->callback_url = _server->url((id <= 2) ? "/batch1" : "/batch2");
+    timer->batch_callback = (id != 5);
+    timers.push_back(timer);
+    EXPECT_CALL(*_th, return_timer(timer));
+    EXPECT_CALL(*_th, handle_successful_callback(id))
+      .WillOnce(InvokeWithoutArgs(&completed, &CallbackCounter::increment));
+  }
+
+  std::vector<Timer*> to_pop = timers;
+  _callback->perform_batch(to_pop);
+
+  EXPECT_TRUE(completed.wait_for(5)) << "The callbacks didn't all complete";
+
+  // The timer that doesn't accept batches gets its own callback.
+  std::vector<StubHttpServer::Request> requests = _server->requests();
+  ASSERT_EQ(3u, requests.size());
+  std::vector<std::string> paths;
+
+  for (StubHttpServer::Request& request : requests)
+  {
+    paths.push_back(request.path);
+  }
+
+  std::sort(paths.begin(), paths.end());
+  EXPECT_EQ(std::vector<std::string>({"/batch1", "/batch2", "/batch2"}), paths);
+
+  for (Timer* timer : timers)
+  {
+    delete timer;
+  }
+}
+
+// Test that all the callbacks in a batch fail if the response doesn't hold a
+// result for each of them.
+TEST_F(TestHTTPCallback, BatchedCallbacksInvalidResponse)
+{
+  CallbackCounter completed;
+  _server->set_response_body("{\"results\": [200]}");
+
+  std::vector<Timer*> timers;
+
+  for (TimerID id = 1; id <= 2; ++id)
+  {
+    Timer* timer = stub_server_timer(id);
+    timer->callback_url = _server->url("/batch");
+    timer->batch_callback = true;
+    timers.push_back(timer);
+    EXPECT_CALL(*_th, return_timer(timer));
+    EXPECT_CALL(*_th, handle_failed_callback(id))
+      .WillOnce(InvokeWithoutArgs(&completed, &CallbackCounter::increment));
+  }
+
+  std::vector<Timer*> to_pop = timers;
+  _callback->perform_batch(to_pop);
+
+  EXPECT_TRUE(completed.wait_for(2)) << "The callbacks didn't all complete";
+  EXPECT_EQ(1u, _server->num_requests());
+
+  for (Timer* timer : timers)
+  {
+    delete timer;
+  }
+}
+
+// Test that callbacks whose opaque data isn't valid UTF-8 (so can't be sent
+// as a JSON string) are sent on their own, even if their clients accept
+// batches.
+TEST_F(TestHTTPCallback, BatchedCallbacksNotUTF8)
+{
+  CallbackCounter completed;
+  _server->set_response_body("{\"results\": [200]}");
+
+  std::vector<std::string> bodies = {
+    "caf\xc3\xa9 \xf0\x9f\x98\x80",  // Valid two and four byte sequences.
+    "\xc0\xaf",                      // Overlong encoding of '/'.
+    "\xed\xa0\x80",                  // UTF-16 surrogate (U+D800).
+    "\xf4\x90\x80\x80",              // Above U+10FFFF.
+    "\xe2\x82",                      // Truncated sequence.
+    "abc\x80",                       // Unexpected continuation byte.
+    "\xef\xbf\xbf"                   // Valid three byte sequence (U+FFFF).
+  };
+
+  std::vector<Timer*> timers;
+
+  for (TimerID id = 1; id <= bodies.size(); ++id)
+  {
+    Timer* timer = stub_server_timer(id);
+    timer->callback_url = _server->url("/batch");
+    timer->batch_callback = true;
+    timer->callback_body = bodies[id - 1];
+    timers.push_back(timer);
+    EXPECT_CALL(*_th, return_timer(timer));
+    EXPECT_CALL(*_th, handle_successful_callback(id))
+      .WillOnce(InvokeWithoutArgs(&completed, &CallbackCounter::increment));
+  }
+
+  // Pop the last timer on its own, and the rest together.
+  std::vector<Timer*> to_pop(timers.begin(), timers.end() - 1);
+  _callback->perform_batch(to_pop);
+  _callback->perform(timers.back());
+
+  EXPECT_TRUE(completed.wait_for(bodies.size())) << "The callbacks didn't all complete";
+
+  // The valid opaque data is sent unchanged in batches, and the rest in
+  // callbacks of their own.
+  std::vector<StubHttpServer::Request> requests = _server->requests();
+  ASSERT_EQ(7u, requests.size());
+  std::vector<std::string> batches;
+  std::vector<std::string> single_bodies;
+
+  for (StubHttpServer::Request& request : requests)
+  {
+    if (request.headers["content-type"] == "application/json")
+    {
+      batches.push_back(request.body);
+    }
+    else
+    {
+      single_bodies.push_back(request.body);
+    }
+  }
+
+  ASSERT_EQ(2u, batches.size());
+  std::string batched = batches[0] + batches[1];
+  EXPECT_NE(std::string::npos, batched.find("\"opaque\":\"" + bodies[0] + "\""));
+  EXPECT_NE(std::string::npos, batched.find("\"opaque\":\"" + bodies[6] + "\""));
+
+  std::sort(single_bodies.begin(), single_bodies.end());
+  std::vector<std::string> expected_bodies(bodies.begin() + 1, bodies.end() - 1);
+  std::sort(expected_bodies.begin(), expected_bodies.end());
+  EXPECT_EQ(expected_bodies, single_bodies);
+
+  for (Timer* timer : timers)
+  {
+    delete timer;
+  }
+}
+
+// Test that callbacks over TLS are sent by the worker threads.
+TEST_F(TestHTTPCallback, TLSSuccess)
+{
+  fakecurl_responses["https://127.0.0.1:80/callback1"] = CURLE_OK;
   Timer* timer1 = default_timer(1);
+  timer1->callback_url = "https://localhost:80/callback1";
   EXPECT_CALL(*_th, return_timer(timer1));
   EXPECT_CALL(*_th, handle_successful_callback(1));
   _callback->perform(timer1);
 
   // The timer's been sent when fakecurl records the request. Sleep until then.
   std::map<std::string, Request>::iterator it =
-      fakecurl_requests.find("http://localhost:80/callback1");
+      fakecurl_requests.find("https://localhost:80/callback1");
   int count = 0;
   while (it == fakecurl_requests.end() && count < 10)
   {
     // Don't wait for more than 10 seconds
     count++;
     sleep(1);
-    it = fakecurl_requests.find("http://localhost:80/callback1");
+    it = fakecurl_requests.find("https://localhost:80/callback1");
   }
 
   EXPECT_LT(count, 10) << "No request was sent that matched the expected timer";
 
   // Check the body on the request is expected.
-  Request& request = fakecurl_requests["http://localhost:80/callback1"];
-  rapidjson::Document doc;
+  Request& request = fakecurl_requests["https://localhost:80/callback1"];
   EXPECT_EQ(request._body, "stuff stuff stuff");
 
   delete timer1; timer1 = NULL;
 }
 
-// Test failed timer callback
-TEST_F(TestHTTPCallback, Failure)
+// Measure how many callbacks a second can be sent when the client application
+// takes 1ms, 50ms and 500ms to respond to each one.
+TEST_F(TestHTTPCallback, DISABLED_Benchmark)
 {
-  fakecurl_responses["http://10.42.42.42:80/callback1"] = CURLE_REMOTE_FILE_NOT_FOUND;
-  Timer* timer1 = default_timer(1);
-  EXPECT_CALL(*_th, return_timer(timer1));
-  EXPECT_CALL(*_th, handle_failed_callback(1));
-  _callback->perform(timer1);
+  const int NUM_TIMERS = HTTPCALLBACK_LOOP_COUNT * HTTPCALLBACK_MAX_IN_FLIGHT;
 
-  // The timer's been sent when fakecurl records the request. Sleep until then.
-  std::map<std::string, Request>::iterator it =
-      fakecurl_requests.find("http://localhost:80/callback1");
-  int count = 0;
-  while (it == fakecurl_requests.end() && count < 10)
+  // Each callback in flight uses a socket at each end.
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+
+  if (limit.rlim_max < (rlim_t)(3 * NUM_TIMERS))
   {
-    // Don't wait for more than 10 seconds
-    count++;
-    sleep(1);
-    it = fakecurl_requests.find("http://localhost:80/callback1");
+    printf("Skipping benchmark as too few files can be opened\n");
+    return;
   }
 
-  EXPECT_LT(count, 10) << "No request was sent that matched the expected timer";
+  limit.rlim_cur = std::max(limit.rlim_cur, (rlim_t)(3 * NUM_TIMERS));
+  setrlimit(RLIMIT_NOFILE, &limit);
 
-  delete timer1; timer1 = NULL;
+  // Allow a connection for every callback in flight, so that the slower
+  // client applications don't leave callbacks waiting for a connection.
+  __globals->lock();
+  __globals->set_callback_connections_per_host(NUM_TIMERS);
+  __globals->unlock();
+  delete _callback;
+  _callback = new HTTPCallback(_resolver, NULL);
+  _callback->start(_th);
+
+  CallbackCounter completed;
+  EXPECT_CALL(*_th, return_timer(_)).WillRepeatedly(Invoke([](Timer* timer) { delete timer; }));
+  EXPECT_CALL(*_th, handle_successful_callback(_))
+    .WillRepeatedly(InvokeWithoutArgs(&completed, &CallbackCounter::increment));
+
+  uint64_t total_completed = 0;
+
+  for (int latency_ms : {1, 50, 500})
+  {
+    _server->set_latency_ms(latency_ms);
+
+    std::vector<Timer*> timers;
+
+    for (int ii = 0; ii < NUM_TIMERS; ++ii)
+    {
+      timers.push_back(stub_server_timer(total_completed + ii + 1));
+    }
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    _callback->perform_batch(timers);
+    total_completed += NUM_TIMERS;
+    ASSERT_TRUE(completed.wait_for(total_completed));
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t total_us = ((end.tv_sec - start.tv_sec) * 1000000) +
+                        ((end.tv_nsec - start.tv_nsec) / 1000);
+
+    printf("Sent %d callbacks with %d ms latency in %lu us (%lu pops/s)\n",
+           NUM_TIMERS,
+           latency_ms,
+           total_us,
+           (NUM_TIMERS * 1000000UL) / std::max(total_us, 1UL));
+  }
 }
@@ -0,0 +1,155 @@
+/**
+ * @file test_interned_string.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "interned_string.h"
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+
+/*****************************************************************************/
+/* Tests                                                                     */
+/*****************************************************************************/
+
+TEST(TestInternedString, EqualStringsShareStorage)
+{
+  std::string str = "10.0.0.1:9999";
+  InternedString a(str);
+  InternedString b("10.0.0.1:9999");
+  InternedString c("10.0.0.2:9999");
+
+  EXPECT_EQ(&a.str(), &b.str());
+  EXPECT_NE(&a.str(), &c.str());
+  EXPECT_TRUE(a == b);
+  EXPECT_TRUE(a != c);
+
+  // Interned strings can also be compared with ordinary strings.
+  EXPECT_TRUE(a == str);
+  EXPECT_TRUE(str == a);
+  EXPECT_TRUE(a == "10.0.0.1:9999");
+  EXPECT_TRUE(c != str);
+  EXPECT_TRUE(a < c);
+  EXPECT_FALSE(c < a);
+  EXPECT_FALSE(a < b);
+}
+
+TEST(TestInternedString, DefaultIsEmpty)
+{
+  InternedString a;
+  InternedString b("");
+
+  EXPECT_TRUE(a.empty());
+  EXPECT_TRUE(a == b);
+  EXPECT_STREQ("", a.c_str());
+}
+
+static void* intern_on_thread(void* arg)
+{
+  *static_cast<InternedString*>(arg) = InternedString("thread_interned_string");
+  return NULL;
+}
+
+TEST(TestInternedString, SharedAcrossThreads)
+{
+  // A string interned on another thread shares storage with the same string
+  // interned here.
+  InternedString other_thread_str;
+  pthread_t thread;
+  pthread_create(&thread, NULL, &intern_on_thread, &other_thread_str);
+  pthread_join(thread, NULL);
+
+  size_t table_size = InternedString::table_size();
+  InternedString here("thread_interned_string");
+  EXPECT_EQ(&other_thread_str.str(), &here.str());
+  EXPECT_EQ(table_size, InternedString::table_size());
+}
+
+// Test that strings are removed from the table once nothing refers to them.
+TEST(TestInternedString, FreedWhenUnused)
+{
+  size_t table_size = InternedString::table_size();
+
+  {
+    InternedString a("unused_string");
+    EXPECT_EQ(table_size + 1, InternedString::table_size());
+
+    // Copies share the string, and keep it alive after the original's gone.
+    InternedString* b = new InternedString(a);
+    InternedString c;
+    c = *b;
+    a = InternedString();
+    delete b;
+    EXPECT_EQ(table_size + 1, InternedString::table_size());
+    EXPECT_EQ("unused_string", c.str());
+  }
+
+  EXPECT_EQ(table_size, InternedString::table_size());
+
+  // Interning the string again adds it back.
+  InternedString d("unused_string");
+  EXPECT_EQ(table_size + 1, InternedString::table_size());
+}
+
+struct InternAndReleaseArgs
+{
+  std::vector<std::string> strings;
+  int iterations;
+};
+
+static void* intern_and_release(void* arg)
+{
+  InternAndReleaseArgs* args = static_cast<InternAndReleaseArgs*>(arg);
+
+  for (int ii = 0; ii < args->iterations; ++ii)
+  {
+    InternedString a(args->strings[ii % args->strings.size()]);
+    InternedString b = a;
+    EXPECT_EQ(args->strings[ii % args->strings.size()], b.str());
+  }
+
+  return NULL;
+}
+
+// Test that many threads can intern and release the same strings at once
+// without the table losing track of them.
+TEST(TestInternedString, ConcurrentInternAndRelease)
+{
+  size_t table_size = InternedString::table_size();
+  InternAndReleaseArgs args;
+  args.strings = {"concurrent_a", "concurrent_b", "concurrent_c"};
+  args.iterations = 20000;
+
+  std::vector<pthread_t> threads(4);
+
+  for (pthread_t& thread : threads)
+  {
+    pthread_create(&thread, NULL, &intern_and_release, &args);
+  }
+
+  for (pthread_t& thread : threads)
+  {
+    pthread_join(thread, NULL);
+  }
+
+  EXPECT_EQ(table_size, InternedString::table_size());
+}
+
+TEST(TestInternedString, ConvertLists)
+{
+  std::vector<std::string> strings = {"site_a", "site_b"};
+  InternedStringList list = strings;
+
+  EXPECT_EQ(2u, list.size());
+  EXPECT_TRUE(list == strings);
+  EXPECT_TRUE(list[0] == "site_a");
+
+  std::vector<std::string> converted = list;
+  EXPECT_EQ(strings, converted);
+}
@@ -0,0 +1,117 @@
+/**
+ * @file test_mpsc_queue.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "mpsc_queue.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <vector>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestMPSCQueue : public Base
+{
+};
+
+/*****************************************************************************/
+/* Tests                                                                     */
+/*****************************************************************************/
+
+TEST_F(TestMPSCQueue, PopAllInOrder)
+{
+  MPSCQueue<int> q;
+  EXPECT_TRUE(q.empty());
+
+  // Only the first push finds the queue empty.
+  EXPECT_TRUE(q.push(1));
+  EXPECT_FALSE(q.push(2));
+  EXPECT_FALSE(q.push(3));
+  EXPECT_FALSE(q.empty());
+
+  // Items are appended to the vector in the order they were pushed.
+  std::vector<int> items = {0};
+  q.pop_all(items);
+  EXPECT_EQ(std::vector<int>({0, 1, 2, 3}), items);
+  EXPECT_TRUE(q.empty());
+
+  // Popping an empty queue leaves the vector alone.
+  q.pop_all(items);
+  EXPECT_EQ(4u, items.size());
+  EXPECT_TRUE(q.push(4));
+}
+
+static const int ITEMS_PER_PRODUCER = 10000;
+
+struct Producer
+{
+  MPSCQueue<int>* q;
+  int id;
+  pthread_t thread;
+};
+
+static void* produce(void* arg)
+{
+  Producer* producer = static_cast<Producer*>(arg);
+
+  for (int ii = 0; ii < ITEMS_PER_PRODUCER; ++ii)
+  {
+    producer->q->push((producer->id * ITEMS_PER_PRODUCER) + ii);
+  }
+
+  return NULL;
+}
+
+TEST_F(TestMPSCQueue, ManyProducers)
+{
+  const int NUM_PRODUCERS = 4;
+  MPSCQueue<int> q;
+  Producer producers[NUM_PRODUCERS];
+
+  for (int ii = 0; ii < NUM_PRODUCERS; ++ii)
+  {
+    producers[ii].q = &q;
+    producers[ii].id = ii;
+    pthread_create(&producers[ii].thread, NULL, &produce, &producers[ii]);
+  }
+
+  // Consume while the producers are still running.
+  std::vector<int> items;
+
+  while (items.size() < (size_t)(NUM_PRODUCERS * ITEMS_PER_PRODUCER))
+  {
+    q.pop_all(items);
+  }
+
+  for (int ii = 0; ii < NUM_PRODUCERS; ++ii)
+  {
+    pthread_join(producers[ii].thread, NULL);
+  }
+
+  // Every item comes off exactly once, and each producer's items come off in
+  // the order it pushed them.
+  EXPECT_TRUE(q.empty());
+  std::vector<int> next_item(NUM_PRODUCERS);
+
+  for (int item : items)
+  {
+    int id = item / ITEMS_PER_PRODUCER;
+    EXPECT_EQ(next_item[id], item % ITEMS_PER_PRODUCER);
+    next_item[id] = (item % ITEMS_PER_PRODUCER) + 1;
+  }
+
+  for (int ii = 0; ii < NUM_PRODUCERS; ++ii)
+  {
+    EXPECT_EQ(ITEMS_PER_PRODUCER, next_item[ii]);
+  }
+}
@@ -0,0 +1,215 @@
+/**
+ * @file test_object_pool.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "object_pool.h"
+#include "timer.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+#include <set>
+#include <vector>
+
+// A type that's only used in these tests, so that each test can start from
+// an empty pool.
+template <int N>
+struct TestObject
+{
+  uint64_t data[4];
+};
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestObjectPool : public Base
+{
+};
+
+/*****************************************************************************/
+/* Tests                                                                     */
+/*****************************************************************************/
+
+TEST_F(TestObjectPool, AllocateAndRelease)
+{
+  typedef ObjectPool<TestObject<1>> Pool;
+  EXPECT_EQ(0u, Pool::heap_allocations());
+
+  // Allocate more than a slab's worth of objects. They should all be distinct.
+  std::set<void*> objects;
+
+  for (size_t ii = 0; ii < Pool::OBJECTS_PER_SLAB + 1; ++ii)
+  {
+    EXPECT_TRUE(objects.insert(Pool::allocate()).second);
+  }
+
+  EXPECT_EQ(2u, Pool::heap_allocations());
+
+  // Free them all, then allocate them again. The pool shouldn't need to grow.
+  for (void* obj : objects)
+  {
+    Pool::release(obj);
+  }
+
+  std::vector<void*> reallocated;
+
+  for (size_t ii = 0; ii < Pool::OBJECTS_PER_SLAB + 1; ++ii)
+  {
+    reallocated.push_back(Pool::allocate());
+  }
+
+  EXPECT_EQ(2u, Pool::heap_allocations());
+
+  for (void* obj : reallocated)
+  {
+    Pool::release(obj);
+  }
+}
+
+template <int N>
+static void* free_objects(void* arg)
+{
+  std::vector<void*>* objects = static_cast<std::vector<void*>*>(arg);
+
+  for (void* obj : *objects)
+  {
+    ObjectPool<TestObject<N>>::release(obj);
+  }
+
+  return NULL;
+}
+
+TEST_F(TestObjectPool, ReleaseOnAnotherThread)
+{
+  typedef ObjectPool<TestObject<2>> Pool;
+
+  // Allocate objects on this thread and free them on another. The freeing
+  // thread hands the objects back to the shared pool when it exits, so they
+  // can be reused here without the pool growing.
+  std::vector<void*> objects;
+
+  for (size_t ii = 0; ii < Pool::OBJECTS_PER_SLAB; ++ii)
+  {
+    objects.push_back(Pool::allocate());
+  }
+
+  EXPECT_EQ(1u, Pool::heap_allocations());
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, &free_objects<2>, &objects);
+  pthread_join(thread, NULL);
+
+  for (size_t ii = 0; ii < Pool::OBJECTS_PER_SLAB; ++ii)
+  {
+    objects[ii] = Pool::allocate();
+  }
+
+  EXPECT_EQ(1u, Pool::heap_allocations());
+
+  for (void* obj : objects)
+  {
+    Pool::release(obj);
+  }
+}
+
+static void* allocate_and_free_objects(void* arg)
+{
+  typedef ObjectPool<TestObject<3>> Pool;
+  size_t num_objects = *static_cast<size_t*>(arg);
+  std::vector<void*> objects;
+
+  for (size_t ii = 0; ii < num_objects; ++ii)
+  {
+    objects.push_back(Pool::allocate());
+  }
+
+  for (void* obj : objects)
+  {
+    Pool::release(obj);
+  }
+
+  return NULL;
+}
+
+// Test that slabs are freed once all their objects have been freed, apart
+// from one that's kept spare.
+TEST_F(TestObjectPool, EmptySlabsFreed)
+{
+  typedef ObjectPool<TestObject<3>> Pool;
+
+  // Use a thread for this, so that all the objects are handed back to the
+  // shared pool when it exits.
+  size_t num_objects = Pool::OBJECTS_PER_SLAB * 4;
+  pthread_t thread;
+  pthread_create(&thread, NULL, &allocate_and_free_objects, &num_objects);
+  pthread_join(thread, NULL);
+
+  EXPECT_EQ(4u, Pool::heap_allocations());
+  EXPECT_EQ(1u, Pool::slabs());
+  EXPECT_EQ((uint64_t)Pool::OBJECTS_PER_SLAB, Pool::capacity());
+
+  // The spare slab is used before any new ones are allocated.
+  num_objects = Pool::OBJECTS_PER_SLAB;
+  pthread_create(&thread, NULL, &allocate_and_free_objects, &num_objects);
+  pthread_join(thread, NULL);
+
+  EXPECT_EQ(4u, Pool::heap_allocations());
+  EXPECT_EQ(1u, Pool::slabs());
+
+  // A slab with any objects in use isn't freed.
+  std::vector<void*> objects;
+
+  for (size_t ii = 0; ii < Pool::OBJECTS_PER_SLAB * 2; ++ii)
+  {
+    objects.push_back(Pool::allocate());
+  }
+
+  EXPECT_EQ(2u, Pool::slabs());
+
+  void* kept = objects[0];
+  objects.erase(objects.begin());
+  pthread_create(&thread, NULL, &free_objects<3>, &objects);
+  pthread_join(thread, NULL);
+
+  EXPECT_EQ(2u, Pool::slabs());
+  Pool::release(kept);
+}
+
+TEST_F(TestObjectPool, TimersUsePool)
+{
+  // Creating and deleting timers in a steady state doesn't need any new memory
+  // for the timers.
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    delete new Timer(1, 100, 100);
+  }
+
+  uint64_t heap_allocations = ObjectPool<Timer>::heap_allocations();
+  EXPECT_LT(0u, heap_allocations);
+
+  std::vector<Timer*> timers;
+
+  for (int cycle = 0; cycle < 10; ++cycle)
+  {
+    for (int ii = 0; ii < 100; ++ii)
+    {
+      timers.push_back(new Timer(ii, 100, 100));
+    }
+
+    for (Timer* timer : timers)
+    {
+      delete timer;
+    }
+
+    timers.clear();
+  }
+
+  EXPECT_EQ(heap_allocations, ObjectPool<Timer>::heap_allocations());
+}
@@ -0,0 +1,185 @@
+/**
+ * @file test_pop_pipeline.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "timer_handler.h"
+#include "batch_queue.h"
+#include "base.h"
+#include "timer_helper.h"
+#include "mock_replicator.h"
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <unistd.h>
+
+// A callback that hands popped timers to a pool of worker threads in the same
+// way as the HTTP callback, but whose workers just delete the timers rather
+// than sending requests.
+class StubCallback : public Callback
+{
+public:
+  static const int NUM_WORKERS = 8;
+
+  StubCallback() : _q(NUM_WORKERS), _completed(0)
+  {
+    for (int ii = 0; ii < NUM_WORKERS; ++ii)
+    {
+      pthread_create(&_workers[ii], NULL, &worker_entry_point, this);
+    }
+  }
+
+  ~StubCallback()
+  {
+    _q.terminate();
+
+    for (int ii = 0; ii < NUM_WORKERS; ++ii)
+    {
+      pthread_join(_workers[ii], NULL);
+    }
+  }
+
+  std::string protocol() { return "stub"; }
+  void perform(Timer* timer) { _q.push(timer); }
+  void perform_batch(std::vector<Timer*>& timers) { _q.push_batch(timers); }
+
+  // Wait until the workers have finished with the given number of timers.
+  void wait_for_completed(uint64_t count)
+  {
+    while (_completed.load() < count)
+    {
+      sched_yield();
+    }
+  }
+
+private:
+  static void* worker_entry_point(void* arg)
+  {
+    StubCallback* callback = static_cast<StubCallback*>(arg);
+    std::vector<Timer*> timers;
+
+    while (callback->_q.pop_batch(timers, 16))
+    {
+      for (Timer* timer : timers)
+      {
+        delete timer;
+      }
+
+      callback->_completed += timers.size();
+      timers.clear();
+    }
+
+    return NULL;
+  }
+
+  BatchQueue<Timer*> _q;
+  std::atomic<uint64_t> _completed;
+  pthread_t _workers[NUM_WORKERS];
+};
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+// Runs a real timer store and timer handler (on the real clock, so that the
+// pops can be timed), with a stub callback.
+class TestPopPipeline : public Base
+{
+protected:
+  void SetUp()
+  {
+    Base::SetUp();
+
+    _health_checker = new HealthChecker();
+    _store = new TimerStore(_health_checker);
+    _callback = new StubCallback();
+    _replicator = new MockReplicator();
+
+    // Stats are not tested here, so pass in NULL for the stats tables.
+    _th = new TimerHandler(_store, _callback, _replicator, NULL, NULL, NULL, NULL);
+  }
+
+  void TearDown()
+  {
+    delete _th;
+    delete _store;
+    delete _health_checker;
+    delete _replicator;
+    // _callback is deleted by the timer handler.
+
+    Base::TearDown();
+  }
+
+  HealthChecker* _health_checker;
+  TimerStore* _store;
+  StubCallback* _callback;
+  MockReplicator* _replicator;
+  TimerHandler* _th;
+};
+
+/*****************************************************************************/
+/* Tests                                                                     */
+/*****************************************************************************/
+
+// Measure how many timers a second can be popped from the store and handed to
+// the callback's workers, when many timers pop on the same tick. This is
+// timing dependent, so is disabled by default - run it with
+// --gtest_also_run_disabled_tests.
+TEST_F(TestPopPipeline, DISABLED_Benchmark)
+{
+  const int NUM_ROUNDS = 5;
+  const int TIMERS_PER_ROUND = 20000;
+  pthread_mutex_t* mutex = &_th->_shards[0]->mutex;
+  std::vector<Timer*> timers;
+  uint64_t total_us = 0;
+
+  for (int round = 0; round < NUM_ROUNDS; ++round)
+  {
+    // Add a burst of timers that are all due to pop on the next tick. These
+    // go straight into the store, so the handler's thread isn't woken.
+    pthread_mutex_lock(mutex);
+
+    for (int ii = 0; ii < TIMERS_PER_ROUND; ++ii)
+    {
+      Timer* timer = default_timer((round * TIMERS_PER_ROUND) + ii + 1);
+      timer->interval_ms = 0;
+      timer->repeat_for = 0;
+      _store->insert(timer);
+    }
+
+    pthread_mutex_unlock(mutex);
+
+    // Wait until the timers are due, then time popping them all.
+    usleep(2 * TimerStore::SHORT_WHEEL_RESOLUTION_MS * 1000);
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_mutex_lock(mutex);
+    _store->fetch_next_timers(timers);
+    pthread_mutex_unlock(mutex);
+
+    // The handler's thread may have woken and popped some of the timers
+    // itself, but they still go to the callback, so are waited for below.
+    _th->pop(timers);
+    _callback->wait_for_completed((uint64_t)(round + 1) * TIMERS_PER_ROUND);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    total_us += ((end.tv_sec - start.tv_sec) * 1000000) +
+                ((end.tv_nsec - start.tv_nsec) / 1000);
+  }
+
+  printf("Popped %d timers in %lu us (%lu pops/s)\n",
+         NUM_ROUNDS * TIMERS_PER_ROUND,
+         total_us,
+         (NUM_ROUNDS * TIMERS_PER_ROUND * 1000000UL) / std::max(total_us, 1UL));
+}
@@ -17,6 +17,8 @@
 #include "mockcommunicationmonitor.h"
 #include "timer_helper.h"
 
+#include <algorithm>
+
 using ::testing::_;
 
 /// Fixture for ReplicatorTest.
@@ -117,6 +119,59 @@ TEST_F(TestReplicator, StandardReplica)
   delete timer2; timer2 = NULL;
 }
 
+// Test that a timer is replicated in the binary format if binary replication
+// is configured
+TEST_F(TestReplicator, BinaryReplica)
+{
+  __globals->set_binary_replication(true);
+  Replicator* binary_replicator = new Replicator(_resolver, NULL);
+
+  Timer* timer1 = default_timer(1);
+  timer1->_replication_factor = 2;
+  timer1->replicas.push_back("10.0.0.2:9999");
+  fakecurl_responses["http://10.0.0.2:9999/timers/0000000000000001-2"] = CURLE_OK;
+
+  binary_replicator->replicate(timer1);
+
+  // The timer's been sent when fakecurl records the request. Sleep until then.
+  std::map<std::string, Request>::iterator it =
+      fakecurl_requests.find("http://10.0.0.2:9999/timers/0000000000000001-2");
+  int count = 0;
+  while (it == fakecurl_requests.end() && count < 10)
+  {
+    // Don't wait for more than 10 seconds
+    count++;
+    sleep(1);
+    it = fakecurl_requests.find("http://10.0.0.2:9999/timers/0000000000000001-2");
+  }
+
+  ASSERT_TRUE(it != fakecurl_requests.end());
+
+  // Check that the request says the body is binary, and that the body makes
+  // the same timer.
+  Request& request = it->second;
+  EXPECT_TRUE(std::find(request._headers.begin(),
+                        request._headers.end(),
+                        "Content-Type: application/vnd.chronos.timer") !=
+              request._headers.end());
+
+  std::string error;
+  bool replicated;
+  bool gr_replicated;
+
+  Timer* timer2 = Timer::from_binary(1, 2, 0, request._body, error, replicated, gr_replicated);
+  ASSERT_TRUE(timer2);
+  EXPECT_TRUE(replicated);
+  EXPECT_EQ(timer2->replicas, timer1->replicas);
+  EXPECT_EQ(timer2->callback_url, timer1->callback_url);
+  EXPECT_EQ(timer2->callback_body, timer1->callback_body);
+
+  delete timer1; timer1 = NULL;
+  delete timer2; timer2 = NULL;
+  delete binary_replicator; binary_replicator = NULL;
+  __globals->set_binary_replication(false);
+}
+
 // Test that timer extra-replicas are replicated successfully
 TEST_F(TestReplicator, ExtraReplica)
 {
@@ -0,0 +1,94 @@
+/**
+ * @file test_shared_string.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "shared_string.h"
+
+#include <gtest/gtest.h>
+#include <sstream>
+
+/*****************************************************************************/
+/* Tests                                                                     */
+/*****************************************************************************/
+
+TEST(TestSharedString, CopiesShareStorage)
+{
+  std::string str = "{\"aor_id\": \"sip:6505550001@example.com\"}";
+  SharedString a(str);
+  SharedString b = a;
+  SharedString c(str);
+
+  // Copies share the string, but separately constructed strings don't.
+  EXPECT_EQ(a.data(), b.data());
+  EXPECT_NE(a.data(), c.data());
+  EXPECT_EQ(2, a.use_count());
+
+  EXPECT_TRUE(a == b);
+  EXPECT_TRUE(a == c);
+  EXPECT_EQ(str.size(), a.size());
+
+  // Shared strings can also be compared with ordinary strings.
+  EXPECT_TRUE(a == str);
+  EXPECT_TRUE(str == a);
+  EXPECT_TRUE(a != "stuff");
+  EXPECT_TRUE("stuff" != a);
+  EXPECT_TRUE(a != std::string("stuff"));
+  EXPECT_EQ(str, a.str());
+}
+
+TEST(TestSharedString, MovedStringsAreNotCopied)
+{
+  std::string str(10000, 'x');
+  const char* data = str.data();
+  SharedString a(std::move(str));
+
+  EXPECT_EQ(data, a.data());
+  EXPECT_EQ(10000u, a.size());
+}
+
+TEST(TestSharedString, StorageFreedWithLastCopy)
+{
+  SharedString a("stuff");
+
+  {
+    SharedString b = a;
+    EXPECT_EQ(2, a.use_count());
+  }
+
+  EXPECT_EQ(1, a.use_count());
+
+  // Assigning a new value doesn't change the other copies.
+  SharedString b = a;
+  b = "other stuff";
+  EXPECT_TRUE(a == "stuff");
+  EXPECT_TRUE(b == "other stuff");
+  EXPECT_EQ(1, a.use_count());
+}
+
+TEST(TestSharedString, EmptyStringsShareStorage)
+{
+  SharedString a;
+  SharedString b("");
+  SharedString c(std::string(""));
+
+  EXPECT_TRUE(a.empty());
+  EXPECT_EQ(0u, a.size());
+  EXPECT_STREQ("", a.c_str());
+  EXPECT_EQ(a.data(), b.data());
+  EXPECT_EQ(a.data(), c.data());
+  EXPECT_TRUE(a == "");
+}
+
+TEST(TestSharedString, Output)
+{
+  std::ostringstream os;
+  os << SharedString("stuff");
+  EXPECT_EQ("stuff", os.str());
+}
@@ -13,10 +13,12 @@
 #include "globals.h"
 #include "base.h"
 #include "test_interposer.hpp"
+#include "binary_codec.h"
 
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 #include <map>
+#include <algorithm>
 
 using ::testing::UnorderedElementsAreArray;
 
@@ -487,6 +489,522 @@ TEST_F(TestTimer, ToJSON)
   cwtest_reset_time();
 }
 
+// Test that from_json reports the same errors as it always has.
+TEST_F(TestTimer, FromJSONErrors)
+{
+  std::string err;
+  bool replicated;
+  bool gr_replicated;
+
+  EXPECT_EQ((void*)NULL, Timer::from_json(1, 0, 0, "{\"timing\"", err, replicated, gr_replicated));
+  EXPECT_EQ(0u, err.find("Failed to parse timer as JSON. Error: ")) << err;
+
+  err = "";
+  EXPECT_EQ((void*)NULL, Timer::from_json(1, 0, 0, "{\"timing\": {}}", err, replicated, gr_replicated));
+  EXPECT_EQ(0u, err.find("Badly formed Timer entry - hit error on line ")) << err;
+
+  err = "";
+  EXPECT_EQ((void*)NULL, Timer::from_json(1, 0, 0, "{\"timing\": { \"interval\": 0, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\" }}}", err, replicated, gr_replicated));
+  EXPECT_EQ("Can't have a zero interval time with a non-zero (200) repeat-for time", err);
+
+  err = "";
+  EXPECT_EQ((void*)NULL, Timer::from_json(1, 0, 0, "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\" }}, \"reliability\": { \"replicas\": [] }}", err, replicated, gr_replicated));
+  EXPECT_EQ("If replicas is specified it must be non-empty", err);
+
+  err = "";
+  EXPECT_EQ((void*)NULL, Timer::from_json(1, 2, 0, "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\" }}, \"reliability\": { \"replication-factor\": 3 }}", err, replicated, gr_replicated));
+  EXPECT_EQ("Replication factor on the timer ID (2) doesn't match the JSON body (3)", err);
+}
+
+// Test that a timer too large to parse on the stack is still parsed.
+TEST_F(TestTimer, FromJSONLargeTimer)
+{
+  t1->callback_body = std::string(100000, 'x');
+
+  for (int ii = 0; ii < 500; ++ii)
+  {
+    t1->tags["TAG" + std::to_string(ii)] = ii;
+  }
+
+  std::string err;
+  bool replicated;
+  bool gr_replicated;
+  Timer* t2 = Timer::from_json(2, 0, 0, t1->to_json(), err, replicated, gr_replicated);
+  ASSERT_NE((void*)NULL, t2);
+  EXPECT_EQ(t1->callback_body, t2->callback_body);
+  EXPECT_EQ(t1->tags, t2->tags);
+  EXPECT_EQ(t1->replicas, t2->replicas);
+  delete t2;
+}
+
+// Measure how quickly timers are parsed from JSON, for a set of timers like
+// those that clients and other Chronos nodes send. This compares from_json
+// (which parses the JSON in place) with parsing a copy of the JSON.
+TEST_F(TestTimer, DISABLED_FromJSONBenchmark)
+{
+  const int NUM_ROUNDS = 2000;
+  std::vector<std::string> corpus;
+
+  // A new timer from a client.
+  corpus.push_back("{\"timing\": { \"interval\": 300, \"repeat-for\": 300 }, "
+                   "\"callback\": { \"http\": { \"uri\": \"http://10.0.0.5:9888/timers\", "
+                   "\"opaque\": \"{\\\"aor_id\\\": \\\"sip:6505550001@example.com\\\", "
+                   "\\\"binding_id\\\": \\\"<urn:uuid:00000000-0000-0000-0000-000000000001>:1\\\"}\" }}, "
+                   "\"reliability\": { \"replication-factor\": 2 }, "
+                   "\"statistics\": { \"tag-info\": [ { \"type\": \"REG\", \"count\": 1 }, "
+                   "{ \"type\": \"BIND\", \"count\": 2 } ] }}");
+
+  // The same timer, replicated from another node.
+  Timer* t2 = new Timer(*t1);
+  t2->interval_ms = 300000;
+  t2->repeat_for = 300000;
+  t2->callback_body = "{\"aor_id\": \"sip:6505550001@example.com\", "
+                      "\"binding_id\": \"<urn:uuid:00000000-0000-0000-0000-000000000001>:1\"}";
+  corpus.push_back(t2->to_json());
+
+  // A timer carrying several KB of SIP state, replicated from another node.
+  std::string sip_state = "{\"bindings\": {";
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    sip_state += "\"<urn:uuid:00000000-0000-0000-0000-00000000000" + std::to_string(ii) + ">:1\": "
+                 "{\"uri\": \"sip:6505550001@10.0.0.1:5060;transport=tcp;ob\", "
+                 "\"cid\": \"0gQAAC8WAAACBAAALxYAAAL8zUGNJ9V9ANkvyljj+KRPJMdBcyH6pVVk1fpHA5k=\", "
+                 "\"cseq\": 12345, \"expires\": 1500000000, \"priority\": 0, "
+                 "\"path_headers\": [\"<sip:abcdefgh@sprout.example.com:5058;transport=TCP;lr;ob>\"], "
+                 "\"paths\": [\"sip:abcdefgh@sprout.example.com:5058;transport=TCP;lr;ob\"], "
+                 "\"params\": {\"+sip.instance\": \"\\\"<urn:uuid:00000000-0000-0000-0000-000000000001>\\\"\", "
+                 "\"reg-id\": \"1\", \"+sip.ice\": \"\"}, \"private_id\": \"6505550001@example.com\", "
+                 "\"emergency_reg\": false}, ";
+  }
+  sip_state += "\"end\": true}}";
+  t2->callback_body = sip_state;
+  corpus.push_back(t2->to_json());
+
+  // A tombstone.
+  t2->become_tombstone();
+  corpus.push_back(t2->to_json());
+  delete t2;
+
+  size_t corpus_bytes = 0;
+  for (const std::string& json : corpus)
+  {
+    corpus_bytes += json.size();
+  }
+
+  for (int in_place = 0; in_place < 2; ++in_place)
+  {
+    std::string err;
+    bool replicated;
+    bool gr_replicated;
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int round = 0; round < NUM_ROUNDS; ++round)
+    {
+      for (const std::string& json : corpus)
+      {
+        Timer* timer;
+
+        if (in_place)
+        {
+          timer = Timer::from_json(1, 0, 0, json, err, replicated, gr_replicated);
+        }
+        else
+        {
+          rapidjson::Document doc;
+          doc.Parse<0>(json.c_str());
+          timer = Timer::from_json_obj(1, 0, 0, err, replicated, gr_replicated, doc);
+        }
+
+        ASSERT_NE((void*)NULL, timer) << err;
+        delete timer;
+      }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t total_ns = ((end.tv_sec - start.tv_sec) * 1000000000) +
+                        ((end.tv_nsec - start.tv_nsec));
+    uint64_t num_timers = NUM_ROUNDS * corpus.size();
+
+    printf("%s: %lu ns per timer (%lu MB/s)\n",
+           (in_place ? "In place" : "Copied"),
+           total_ns / num_timers,
+           (corpus_bytes * NUM_ROUNDS * 1000) / total_ns);
+  }
+}
+
+TEST_F(TestTimer, ToBinary)
+{
+  // Test this by rendering in binary, then parsing back to a timer and
+  // comparing. As for ToJSON, time needs to be completely controlled so that
+  // the start time comes back the same.
+  cwtest_completely_control_time();
+
+  // Unlike JSON, the binary format holds the interval and repeat-for in
+  // milliseconds, so t1 can be used as is.
+  cwtest_advance_time_ms(1000);
+  std::string binary = t1->to_binary();
+
+  std::string err;
+  bool replicated;
+  bool gr_replicated;
+  Timer* t2 = Timer::from_binary(2, 0, 0, binary, err, replicated, gr_replicated);
+  EXPECT_EQ(err, "");
+  EXPECT_TRUE(replicated);
+  EXPECT_TRUE(gr_replicated);
+  ASSERT_NE((void*)NULL, t2);
+
+  EXPECT_EQ(2u, t2->id);
+  EXPECT_EQ(1000000u, t2->start_time_mono_ms);
+  EXPECT_EQ(t1->sequence_number, t2->sequence_number);
+  EXPECT_EQ(t1->interval_ms, t2->interval_ms);
+  EXPECT_EQ(t1->repeat_for, t2->repeat_for);
+  EXPECT_EQ(2, get_replication_factor(t2));
+  EXPECT_EQ(t1->replicas, t2->replicas);
+  EXPECT_EQ(t1->sites, t2->sites);
+  EXPECT_EQ(t1->tags, t2->tags);
+  EXPECT_EQ(t1->cluster_view_id, t2->cluster_view_id);
+  EXPECT_EQ(t1->callback_url, t2->callback_url);
+  EXPECT_EQ(t1->callback_body, t2->callback_body);
+  delete t2;
+
+  cwtest_reset_time();
+}
+
+// Test that a timer sent in binary is the same as the timer sent as JSON,
+// including for a timer without replicas or sites (as sent cross-site).
+TEST_F(TestTimer, FromBinaryMatchesFromJSON)
+{
+  cwtest_completely_control_time();
+
+  Timer* t2 = new Timer(*t1);
+  t2->interval_ms = 10000;
+  t2->repeat_for = 30000;
+  t2->sequence_number = 2;
+  t2->callback_body = std::string("binary\0body\xff", 12);
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    std::string err;
+    bool json_replicated;
+    bool json_gr_replicated;
+    bool binary_replicated;
+    bool binary_gr_replicated;
+    Timer* from_json = Timer::from_json(2, 3, 4, t2->to_json(), err, json_replicated, json_gr_replicated);
+    Timer* from_binary = Timer::from_binary(2, 3, 4, t2->to_binary(), err, binary_replicated, binary_gr_replicated);
+    ASSERT_NE((void*)NULL, from_json);
+    ASSERT_NE((void*)NULL, from_binary);
+
+    EXPECT_EQ(json_replicated, binary_replicated);
+    EXPECT_EQ(json_gr_replicated, binary_gr_replicated);
+    EXPECT_EQ(from_json->start_time_mono_ms, from_binary->start_time_mono_ms);
+    EXPECT_EQ(from_json->sequence_number, from_binary->sequence_number);
+    EXPECT_EQ(from_json->interval_ms, from_binary->interval_ms);
+    EXPECT_EQ(from_json->repeat_for, from_binary->repeat_for);
+    EXPECT_EQ(get_replication_factor(from_json), get_replication_factor(from_binary));
+    EXPECT_EQ(from_json->replicas, from_binary->replicas);
+    EXPECT_EQ(from_json->sites, from_binary->sites);
+    EXPECT_EQ(from_json->tags, from_binary->tags);
+    EXPECT_EQ(from_json->cluster_view_id, from_binary->cluster_view_id);
+    EXPECT_EQ(from_json->callback_url, from_binary->callback_url);
+    EXPECT_EQ(from_json->next_pop_time(), from_binary->next_pop_time());
+
+    // JSON can't hold the NULL in the opaque data, but binary can.
+    EXPECT_EQ(t2->callback_body, from_binary->callback_body);
+
+    delete from_json;
+    delete from_binary;
+
+    // Check again without the replicas and sites, which the receiving node
+    // works out itself.
+    t2->replicas.clear();
+    t2->sites.clear();
+  }
+
+  delete t2;
+  cwtest_reset_time();
+}
+
+// Test that a binary timer that's been cut short anywhere is rejected.
+TEST_F(TestTimer, FromBinaryTruncated)
+{
+  std::string binary = t1->to_binary();
+
+  for (size_t length = 0; length < binary.size(); ++length)
+  {
+    std::string err;
+    bool replicated;
+    bool gr_replicated;
+    Timer* timer = Timer::from_binary(1, 0, 0, binary.substr(0, length), err, replicated, gr_replicated);
+    EXPECT_EQ((void*)NULL, timer) << "Accepted timer truncated to " << length << " bytes";
+    EXPECT_NE("", err);
+    delete timer;
+  }
+}
+
+// Test that badly formed binary timers are rejected.
+TEST_F(TestTimer, FromBinaryInvalid)
+{
+  std::string err;
+  bool replicated;
+  bool gr_replicated;
+  std::string binary = t1->to_binary();
+
+  // Unknown version.
+  std::string bad_version = binary;
+  bad_version[0] = 3;
+  EXPECT_EQ((void*)NULL, Timer::from_binary(1, 0, 0, bad_version, err, replicated, gr_replicated));
+  EXPECT_EQ("Unsupported binary timer version (3)", err);
+
+  // Trailing data.
+  err = "";
+  EXPECT_EQ((void*)NULL, Timer::from_binary(1, 0, 0, binary + "x", err, replicated, gr_replicated));
+  EXPECT_NE("", err);
+
+  // A string that's longer than the rest of the body.
+  std::string bad_length;
+  BinaryWriter writer(bad_length);
+  writer.write_uint(1);
+  writer.write_int(0);
+  writer.write_uint(0);
+  writer.write_uint(1000);
+  writer.write_uint(1000);
+  writer.write_uint(UINT64_MAX);
+  err = "";
+  EXPECT_EQ((void*)NULL, Timer::from_binary(1, 0, 0, bad_length, err, replicated, gr_replicated));
+  EXPECT_NE("", err);
+
+  // A zero interval with a non-zero repeat-for.
+  Timer t2(1, 0, 1000);
+  err = "";
+  EXPECT_EQ((void*)NULL, Timer::from_binary(1, 0, 0, t2.to_binary(), err, replicated, gr_replicated));
+  EXPECT_EQ("Can't have a zero interval time with a non-zero (1) repeat-for time", err);
+}
+
+// Test that a binary timer cut short after its callback names the field that
+// is missing.
+TEST_F(TestTimer, FromBinaryTruncatedClusterInformation)
+{
+  std::string err;
+  bool replicated;
+  bool gr_replicated;
+  std::string binary;
+  BinaryWriter writer(binary);
+  writer.write_uint(1);
+  writer.write_int(0);
+  writer.write_uint(0);
+  writer.write_uint(1000);
+  writer.write_uint(1000);
+  writer.write_string("http://localhost:80/callback");
+  writer.write_string("stuff stuff stuff");
+
+  EXPECT_EQ((void*)NULL, Timer::from_binary(1, 0, 0, binary, err, replicated, gr_replicated));
+  EXPECT_EQ("Badly formed binary timer - truncated cluster view ID", err);
+
+  writer.write_string("cluster-view-id");
+  EXPECT_EQ((void*)NULL, Timer::from_binary(1, 0, 0, binary, err, replicated, gr_replicated));
+  EXPECT_EQ("Badly formed binary timer - truncated replicas", err);
+}
+
+// Test that integers are only read if they fit in 64 bits.
+TEST_F(TestTimer, BinaryIntegerTooLong)
+{
+  std::string binary;
+  BinaryWriter writer(binary);
+  writer.write_uint(UINT64_MAX);
+  ASSERT_EQ(std::string(9, '\xff') + '\x01', binary);
+
+  uint64_t value = 0;
+  BinaryReader reader(binary);
+  EXPECT_TRUE(reader.read_uint(value));
+  EXPECT_EQ(UINT64_MAX, value);
+  EXPECT_TRUE(reader.end());
+
+  // Any more bits in the tenth byte don't fit.
+  std::string too_long = std::string(9, '\xff') + '\x02';
+  BinaryReader too_long_reader(too_long);
+  value = 0;
+  EXPECT_FALSE(too_long_reader.read_uint(value));
+  EXPECT_EQ(0u, value);
+
+  // Nor does an eleventh byte.
+  std::string too_many_bytes = std::string(10, '\xff') + '\x00';
+  BinaryReader too_many_bytes_reader(too_many_bytes);
+  EXPECT_FALSE(too_many_bytes_reader.read_uint(value));
+  EXPECT_EQ(0u, value);
+}
+
+// Test that whether the client accepts batched callbacks is kept in both
+// formats, and that the binary format only changes for timers that do.
+TEST_F(TestTimer, BatchCallback)
+{
+  EXPECT_FALSE(t1->batch_callback);
+  EXPECT_EQ(std::string::npos, t1->to_json().find("batch"));
+  EXPECT_EQ(1, t1->to_binary()[0]);
+
+  Timer* t2 = new Timer(*t1);
+  t2->interval_ms = 10000;
+  t2->repeat_for = 30000;
+  t2->batch_callback = true;
+
+  std::string err;
+  bool replicated;
+  bool gr_replicated;
+  Timer* from_json = Timer::from_json(2, 0, 0, t2->to_json(), err, replicated, gr_replicated);
+  ASSERT_NE((void*)NULL, from_json) << err;
+  EXPECT_TRUE(from_json->batch_callback);
+  delete from_json;
+
+  std::string binary = t2->to_binary();
+  EXPECT_EQ(2, binary[0]);
+  Timer* from_binary = Timer::from_binary(2, 0, 0, binary, err, replicated, gr_replicated);
+  ASSERT_NE((void*)NULL, from_binary) << err;
+  EXPECT_TRUE(from_binary->batch_callback);
+  EXPECT_EQ(t2->callback_url, from_binary->callback_url);
+  EXPECT_EQ(t2->callback_body, from_binary->callback_body);
+  EXPECT_EQ(t2->cluster_view_id, from_binary->cluster_view_id);
+  EXPECT_EQ(t2->replicas, from_binary->replicas);
+  delete from_binary;
+
+  // The flags can't be left out of a version 2 timer.
+  for (size_t length = 0; length < binary.size(); ++length)
+  {
+    EXPECT_EQ((void*)NULL, Timer::from_binary(2, 0, 0, binary.substr(0, length), err, replicated, gr_replicated));
+  }
+
+  // A client can't give the batch flag a non-boolean value.
+  std::string bad_json = t2->to_json();
+  bad_json.replace(bad_json.find("\"batch\":true"), 12, "\"batch\":1");
+  EXPECT_EQ((void*)NULL, Timer::from_json(2, 0, 0, bad_json, err, replicated, gr_replicated));
+
+  delete t2;
+}
+
+// Compare the size of timers in the binary format and as JSON, and how long
+// it takes to build and parse them.
+TEST_F(TestTimer, DISABLED_BinaryBenchmark)
+{
+  const int NUM_TIMERS = 20000;
+  std::string err;
+  bool replicated;
+  bool gr_replicated;
+
+  // A typical timer from a client, with an opaque body carrying a few
+  // identifiers.
+  Timer* t2 = new Timer(*t1);
+  t2->interval_ms = 300000;
+  t2->repeat_for = 300000;
+  t2->callback_body = "{\"aor_id\": \"sip:6505550001@example.com\", "
+                      "\"binding_id\": \"<urn:uuid:00000000-0000-0000-0000-000000000001>:1\"}";
+
+  for (int format = 0; format < 2; ++format)
+  {
+    bool binary = (format == 1);
+    size_t total_bytes = 0;
+
+    struct timespec start;
+    struct timespec mid;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    std::vector<std::string> bodies;
+    bodies.reserve(NUM_TIMERS);
+    for (int ii = 0; ii < NUM_TIMERS; ++ii)
+    {
+      bodies.push_back(binary ? t2->to_binary() : t2->to_json());
+      total_bytes += bodies.back().size();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &mid);
+
+    for (int ii = 0; ii < NUM_TIMERS; ++ii)
+    {
+      Timer* timer = binary ?
+        Timer::from_binary(1, 2, 0, bodies[ii], err, replicated, gr_replicated) :
+        Timer::from_json(1, 2, 0, bodies[ii], err, replicated, gr_replicated);
+      ASSERT_NE((void*)NULL, timer);
+      delete timer;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t encode_ns = ((mid.tv_sec - start.tv_sec) * 1000000000) +
+                         (mid.tv_nsec - start.tv_nsec);
+    uint64_t decode_ns = ((end.tv_sec - mid.tv_sec) * 1000000000) +
+                         (end.tv_nsec - mid.tv_nsec);
+
+    printf("%s: %lu bytes, %lu ns to build and %lu ns to parse per timer\n",
+           (binary ? "Binary" : "JSON"),
+           total_bytes / NUM_TIMERS,
+           encode_ns / NUM_TIMERS,
+           decode_ns / NUM_TIMERS);
+  }
+
+  EXPECT_LT(t2->to_binary().size(), t2->to_json().size());
+  delete t2;
+}
+
+// Test that a timer's replication bodies are shared while a ReplicationBodies
+// is in scope for it, and only then.
+TEST_F(TestTimer, ReplicationBodiesShared)
+{
+  std::shared_ptr<const std::string> json = t1->replication_body(false, true);
+  EXPECT_NE(json, t1->replication_body(false, true));
+
+  {
+    ReplicationBodies bodies(t1);
+    json = t1->replication_body(false, true);
+    std::shared_ptr<const std::string> binary = t1->replication_body(true, true);
+    std::shared_ptr<const std::string> json_no_replicas = t1->replication_body(false, false);
+    std::shared_ptr<const std::string> binary_no_replicas = t1->replication_body(true, false);
+
+    EXPECT_EQ(json, t1->replication_body(false, true));
+    EXPECT_EQ(binary, t1->replication_body(true, true));
+    EXPECT_EQ(json_no_replicas, t1->replication_body(false, false));
+    EXPECT_EQ(binary_no_replicas, t1->replication_body(true, false));
+    EXPECT_EQ(t1->to_binary(), *binary);
+
+    // A copy of the timer doesn't share the bodies.
+    Timer t2(*t1);
+    EXPECT_NE(json, t2.replication_body(false, true));
+  }
+
+  EXPECT_NE(json, t1->replication_body(false, true));
+}
+
+// Test that copies of a timer share its callback URL and opaque data, rather
+// than copying them.
+TEST_F(TestTimer, CopiesShareCallback)
+{
+  t1->callback_body = std::string(100000, 'x');
+  Timer t2(*t1);
+
+  EXPECT_EQ(t1->callback_url.data(), t2.callback_url.data());
+  EXPECT_EQ(t1->callback_body.data(), t2.callback_body.data());
+
+  // Tombstoning the copy doesn't affect the original.
+  t2.become_tombstone();
+  EXPECT_TRUE(t2.is_tombstone());
+  EXPECT_FALSE(t1->is_tombstone());
+  EXPECT_EQ(100000u, t1->callback_body.size());
+}
+
+// Test that leaving the replicas out of a timer's body gives the same body as
+// a copy of the timer without any replicas.
+TEST_F(TestTimer, ReplicationBodyWithoutReplicas)
+{
+  cwtest_completely_control_time();
+
+  Timer t2(*t1);
+  t2.replicas.clear();
+
+  EXPECT_EQ(t2.to_json(), *t1->replication_body(false, false));
+  EXPECT_EQ(t2.to_binary(), *t1->replication_body(true, false));
+
+  cwtest_reset_time();
+}
+
 TEST_F(TestTimer, IsLocal)
 {
   EXPECT_TRUE(t1->is_local("10.0.0.1:9999"));
@@ -601,3 +1119,116 @@ TEST_F(TestTimer, NextPopTimeMidReplicaAndSite)
 
   delete t;
 }
+
+// Test that the next pop time picks up a change to the local site name, even
+// after the timer's position delay has been calculated.
+TEST_F(TestTimer, NextPopTimeAfterConfigChange)
+{
+  Timer* t = new Timer(100, 100, 200);
+  t->sequence_number = 0;
+  t->_replication_factor = 1;
+  std::vector<std::string> replicas;
+  replicas.push_back("10.0.0.1:9999");
+  t->replicas = replicas;
+  std::vector<std::string> sites;
+  sites.push_back("local_site_name");
+  sites.push_back("remote_site_1_name");
+  t->sites = sites;
+  t->start_time_mono_ms = 1000000;
+
+  EXPECT_EQ(t->next_pop_time(), 1000100);
+
+  // Move this node to the second site. Its replica is now behind the one
+  // replica in the first site, so is delayed by 2 seconds.
+  __globals->lock();
+  __globals->set_local_site_name("remote_site_1_name");
+  __globals->unlock();
+
+  EXPECT_EQ(t->next_pop_time(), 1002100);
+
+  __globals->lock();
+  __globals->set_local_site_name("local_site_name");
+  __globals->unlock();
+
+  delete t;
+}
+
+// Test that the next pop time picks up a change to the timer's replicas once
+// the cached pop time has been invalidated.
+TEST_F(TestTimer, NextPopTimeAfterReplicasChange)
+{
+  Timer* t = new Timer(100, 100, 200);
+  t->sequence_number = 0;
+  t->_replication_factor = 2;
+  std::vector<std::string> replicas;
+  replicas.push_back("10.0.0.1:9999");
+  replicas.push_back("10.0.0.2:9999");
+  t->replicas = replicas;
+  t->start_time_mono_ms = 1000000;
+
+  EXPECT_EQ(t->next_pop_time(), 1000100);
+
+  std::reverse(t->replicas.begin(), t->replicas.end());
+  t->invalidate_pop_time();
+
+  EXPECT_EQ(t->next_pop_time(), 1002100);
+
+  delete t;
+}
+
+// Test that updating a timer's cluster information uses the cluster
+// information worked out for it in advance, if it's for the current
+// configuration.
+TEST_F(TestTimer, UpdateClusterInformationUsesPrecomputedReplicas)
+{
+  PrecomputedReplicas* precomputed = new PrecomputedReplicas();
+  precomputed->config_generation = __globals->get_config_generation();
+  precomputed->cluster_view_id = "precomputed-cluster-view-id";
+  precomputed->replicas = std::vector<std::string>({"10.0.0.3", "10.0.0.2"});
+  precomputed->extra_replicas = std::vector<std::string>({"10.0.0.1:9999"});
+
+  t1->set_precomputed_replicas(PrecomputedReplicasPtr(precomputed));
+  t1->update_cluster_information();
+
+  EXPECT_EQ(std::vector<std::string>({"10.0.0.3", "10.0.0.2"}),
+            std::vector<std::string>(t1->replicas.begin(), t1->replicas.end()));
+  EXPECT_EQ(std::vector<std::string>({"10.0.0.1:9999"}),
+            std::vector<std::string>(t1->extra_replicas.begin(),
+                                     t1->extra_replicas.end()));
+  EXPECT_EQ("precomputed-cluster-view-id", (std::string)t1->cluster_view_id);
+
+  // The precomputed cluster information is only used once.
+  t1->extra_replicas.clear();
+  t1->update_cluster_information();
+  EXPECT_EQ("cluster-view-id", (std::string)t1->cluster_view_id);
+  EXPECT_TRUE(t1->extra_replicas.empty());
+}
+
+// Test that updating a timer's cluster information ignores cluster information
+// worked out for an earlier configuration.
+TEST_F(TestTimer, UpdateClusterInformationIgnoresStalePrecomputedReplicas)
+{
+  PrecomputedReplicas* precomputed = new PrecomputedReplicas();
+  precomputed->config_generation = __globals->get_config_generation();
+  precomputed->cluster_view_id = "precomputed-cluster-view-id";
+  precomputed->replicas = std::vector<std::string>({"10.0.0.3", "10.0.0.2"});
+
+  t1->set_precomputed_replicas(PrecomputedReplicasPtr(precomputed));
+
+  __globals->lock();
+  std::string cluster_view_id = "new-cluster-view-id";
+  __globals->set_cluster_view_id(cluster_view_id);
+  __globals->unlock();
+
+  t1->update_cluster_information();
+
+  // The timer's cluster information is the same as a timer that had nothing
+  // precomputed.
+  Timer t2(t1->id, 100, 200);
+  t2._replication_factor = 2;
+  t2.update_cluster_information();
+
+  EXPECT_EQ("new-cluster-view-id", (std::string)t1->cluster_view_id);
+  EXPECT_EQ(std::vector<std::string>(t2.replicas.begin(), t2.replicas.end()),
+            std::vector<std::string>(t1->replicas.begin(), t1->replicas.end()));
+}
@@ -22,11 +22,47 @@
 #include "mock_infinite_table.h"
 #include "mock_infinite_scalar_table.h"
 #include "mock_increment_table.h"
+#include "mock_event_accumulator_table.h"
 
 #include <gtest/gtest.h>
+#include <atomic>
+#include <set>
+#include <stdlib.h>
 
 using namespace ::testing;
 
+// Count every allocation the process makes from the heap, so that tests can
+// check how much a code path allocates.
+static std::atomic<uint64_t> heap_allocations(0);
+
+void* operator new(size_t size)
+{
+  ++heap_allocations;
+  void* ptr = malloc((size > 0) ? size : 1);
+
+  if (ptr == NULL)
+  {
+    throw std::bad_alloc(); // LCOV_EXCL_LINE - Can't run out of memory in UT
+  }
+
+  return ptr;
+}
+
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+  free(ptr);
+}
+
 
 class TestTimerHandlerFetchAndPop : public Base
 {
@@ -67,7 +103,7 @@ protected:
   }
 
   // Accessor functions into the timer handler's private variables
-  MockPThreadCondVar* _cond() { return (MockPThreadCondVar*)_th->_cond; }
+  MockPThreadCondVar* _cond() { return (MockPThreadCondVar*)_th->_shards[0]->cond; }
 
   MockInfiniteTable* _mock_tag_table;
   MockInfiniteScalarTable* _mock_scalar_table;
@@ -81,8 +117,8 @@ protected:
 TEST_F(TestTimerHandlerFetchAndPop, StartUpAndShutDown)
 {
   EXPECT_CALL(*_store, fetch_next_timers(_)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
   // NULL is passed in for the GRReplicator, as it is disabled by default.
   _th = new TimerHandler(_store, _callback, _replicator, NULL, _mock_increment_table, _mock_tag_table, _mock_scalar_table);
   _cond()->block_till_waiting();
@@ -90,14 +126,14 @@ TEST_F(TestTimerHandlerFetchAndPop, StartUpAndShutDown)
 
 TEST_F(TestTimerHandlerFetchAndPop, PopOneTimer)
 {
-  std::unordered_set<Timer*> timers;
+  std::vector<Timer*> timers;
   Timer* timer = default_timer(1);
-  timers.insert(timer);
+  timers.push_back(timer);
 
   EXPECT_CALL(*_store, fetch_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
 
   EXPECT_CALL(*_callback, perform(timer));
 
@@ -109,16 +145,16 @@ TEST_F(TestTimerHandlerFetchAndPop, PopOneTimer)
 
 TEST_F(TestTimerHandlerFetchAndPop, PopRepeatedTimer)
 {
-  std::unordered_set<Timer*> timers;
+  std::vector<Timer*> timers;
   Timer* timer = default_timer(1);
   timer->repeat_for = timer->interval_ms * 2;
-  timers.insert(timer);
+  timers.push_back(timer);
 
   EXPECT_CALL(*_store, fetch_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers)).
                        WillOnce(SetArgReferee<0>(timers)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
 
   EXPECT_CALL(*_callback, perform(timer)).Times(2);
 
@@ -130,16 +166,16 @@ TEST_F(TestTimerHandlerFetchAndPop, PopRepeatedTimer)
 
 TEST_F(TestTimerHandlerFetchAndPop, PopMultipleTimersSimultaneously)
 {
-  std::unordered_set<Timer*> timers;
+  std::vector<Timer*> timers;
   Timer* timer1 = default_timer(1);
   Timer* timer2 = default_timer(2);
-  timers.insert(timer1);
-  timers.insert(timer2);
+  timers.push_back(timer1);
+  timers.push_back(timer2);
 
   EXPECT_CALL(*_store, fetch_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
 
   EXPECT_CALL(*_callback, perform(timer1));
   EXPECT_CALL(*_callback, perform(timer2));
@@ -153,18 +189,18 @@ TEST_F(TestTimerHandlerFetchAndPop, PopMultipleTimersSimultaneously)
 
 TEST_F(TestTimerHandlerFetchAndPop, PopMultipleTimersSeries)
 {
-  std::unordered_set<Timer*> timers1;
-  std::unordered_set<Timer*> timers2;
+  std::vector<Timer*> timers1;
+  std::vector<Timer*> timers2;
   Timer* timer1 = default_timer(1);
   Timer* timer2 = default_timer(2);
-  timers1.insert(timer1);
-  timers2.insert(timer2);
+  timers1.push_back(timer1);
+  timers2.push_back(timer2);
 
   EXPECT_CALL(*_store, fetch_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers1)).
                        WillOnce(SetArgReferee<0>(timers2)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
 
   EXPECT_CALL(*_callback, perform(timer1));
   EXPECT_CALL(*_callback, perform(timer2));
@@ -178,22 +214,22 @@ TEST_F(TestTimerHandlerFetchAndPop, PopMultipleTimersSeries)
 
 TEST_F(TestTimerHandlerFetchAndPop, PopMultipleRepeatingTimers)
 {
-  std::unordered_set<Timer*> timers1;
-  std::unordered_set<Timer*> timers2;
+  std::vector<Timer*> timers1;
+  std::vector<Timer*> timers2;
   Timer* timer1 = default_timer(1);
   timer1->repeat_for = timer1->interval_ms * 2;
   Timer* timer2 = default_timer(2);
   timer2->repeat_for = timer2->interval_ms * 2;
-  timers1.insert(timer1);
-  timers2.insert(timer2);
+  timers1.push_back(timer1);
+  timers2.push_back(timer2);
 
   EXPECT_CALL(*_store, fetch_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers1)).
                        WillOnce(SetArgReferee<0>(timers2)).
                        WillOnce(SetArgReferee<0>(timers2)).
                        WillOnce(SetArgReferee<0>(timers1)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
 
   EXPECT_CALL(*_callback, perform(timer1)).Times(2);
   EXPECT_CALL(*_callback, perform(timer2)).Times(2);
@@ -207,19 +243,19 @@ TEST_F(TestTimerHandlerFetchAndPop, PopMultipleRepeatingTimers)
 
 TEST_F(TestTimerHandlerFetchAndPop, EmptyStore)
 {
-  std::unordered_set<Timer*> timers1;
-  std::unordered_set<Timer*> timers2;
+  std::vector<Timer*> timers1;
+  std::vector<Timer*> timers2;
   Timer* timer1 = default_timer(1);
   Timer* timer2 = default_timer(2);
-  timers1.insert(timer1);
-  timers2.insert(timer2);
+  timers1.push_back(timer1);
+  timers2.push_back(timer2);
 
   EXPECT_CALL(*_store, fetch_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers1)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
                        WillOnce(SetArgReferee<0>(timers2)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
 
   EXPECT_CALL(*_callback, perform(timer1));
   EXPECT_CALL(*_callback, perform(timer2));
@@ -236,16 +272,40 @@ TEST_F(TestTimerHandlerFetchAndPop, EmptyStore)
   delete timer2;
 }
 
+// Pop a batch of timers that includes a tombstone. Only the real timer is
+// passed to the callback.
+TEST_F(TestTimerHandlerFetchAndPop, PopBatchWithTombstone)
+{
+  std::vector<Timer*> timers;
+  Timer* timer1 = default_timer(1);
+  Timer* timer2 = default_timer(2);
+  timer2->become_tombstone();
+  timers.push_back(timer1);
+  timers.push_back(timer2);
+
+  EXPECT_CALL(*_store, fetch_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(timers)).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
+
+  EXPECT_CALL(*_callback, perform(timer1));
+
+  // NULL is passed in for the GRReplicator, as it is disabled by default.
+  _th = new TimerHandler(_store, _callback, _replicator, NULL, _mock_increment_table, _mock_tag_table, _mock_scalar_table);
+  _cond()->block_till_waiting();
+  delete timer1; timer1 = NULL;
+}
+
 TEST_F(TestTimerHandlerFetchAndPop, LeakTest)
 {
-  std::unordered_set<Timer*> timers;
+  std::vector<Timer*> timers;
   Timer* timer = default_timer(1);
-  timers.insert(timer);
+  timers.push_back(timer);
 
   // Make sure that the final call to fetch_next_timers actually returns some.  This
   // test should still pass valgrind's checking without leaking the timer.
   EXPECT_CALL(*_store, fetch_next_timers(_)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
                        WillOnce(SetArgReferee<0>(timers));
 
   // NULL is passed in for the GRReplicator, as it is disabled by default.
@@ -268,16 +328,16 @@ TEST_F(TestTimerHandlerFetchAndPop, FutureTimerPop)
   // time down to a millisecond.
   ts.tv_nsec = ts.tv_nsec - (ts.tv_nsec % (1000 * 1000));
 
-  std::unordered_set<Timer*> timers;
-  timers.insert(timer);
+  std::vector<Timer*> timers;
+  timers.push_back(timer);
 
   // After the timer pops, we'd expect to get a call back to get the next set of timers.
   // Then the standard one more check during termination.
   EXPECT_CALL(*_store, fetch_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
   EXPECT_CALL(*_callback, perform(_));
 
   // NULL is passed in for the GRReplicator, as it is disabled by default.
@@ -298,8 +358,8 @@ TEST_F(TestTimerHandlerFetchAndPop, PopTombstoneTimer)
   timer1->become_tombstone();
 
   EXPECT_CALL(*_store, fetch_next_timers(_)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
   // NULL is passed in for the GRReplicator, as it is disabled by default.
   _th = new TimerHandler(_store, _callback, _replicator, NULL, _mock_increment_table, _mock_tag_table, _mock_scalar_table);
   _cond()->block_till_waiting();
@@ -328,10 +388,10 @@ protected:
     _mock_scalar_table = new MockInfiniteScalarTable();
     _mock_increment_table = new MockIncrementTable();
 
-    // Set up the Timer Handler
+    // Set up the Timer Handler. Adding timers to the store wakes the timer
+    // handler's thread, so it can check the store any number of times.
     EXPECT_CALL(*_store, fetch_next_timers(_)).
-                         WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                         WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                         WillRepeatedly(SetArgReferee<0>(std::vector<Timer*>()));
     // NULL is passed in for the GRReplicator, as it is disabled by default.
     _th = new TimerHandler(_store, _callback, _replicator, NULL, _mock_increment_table, _mock_tag_table, _mock_scalar_table);
     _cond()->block_till_waiting();
@@ -356,7 +416,7 @@ protected:
   }
 
   // Accessor functions into the timer handler's private variables
-  MockPThreadCondVar* _cond() { return (MockPThreadCondVar*)_th->_cond; }
+  MockPThreadCondVar* _cond() { return (MockPThreadCondVar*)_th->_shards[0]->cond; }
 
   MockInfiniteTable* _mock_tag_table;
   MockInfiniteScalarTable* _mock_scalar_table;
@@ -390,6 +450,23 @@ TEST_F(TestTimerHandlerAddAndReturn, AddTimer)
   delete timer;
 }
 
+// Tests that queueing a timer adds it straight away if timer adds aren't
+// queued
+TEST_F(TestTimerHandlerAddAndReturn, QueueTimerNotQueued)
+{
+  Timer* timer = default_timer(1);
+  Timer* insert_timer;
+  EXPECT_CALL(*_store, fetch(timer->id, _)).Times(1);
+  EXPECT_CALL(*_mock_tag_table, increment("TAG1", 1)).Times(1);
+  EXPECT_CALL(*_mock_scalar_table, increment("TAG1", 1)).Times(1);
+  EXPECT_CALL(*_mock_increment_table, increment(1)).Times(1);
+  EXPECT_CALL(*_store, insert(_)).WillOnce(SaveArg<0>(&insert_timer));
+  _th->queue_timer(timer);
+
+  EXPECT_EQ(insert_timer, timer);
+  delete timer;
+}
+
 // Tests updating a timer
 TEST_F(TestTimerHandlerAddAndReturn, UpdateTimer)
 {
@@ -1029,7 +1106,7 @@ protected:
   }
 
   // Accessor functions into the timer handler's private variables
-  MockPThreadCondVar* _cond() { return (MockPThreadCondVar*)_th->_cond; }
+  MockPThreadCondVar* _cond() { return (MockPThreadCondVar*)_th->_shards[0]->cond; }
 
   MockInfiniteTable* _mock_tag_table;
   MockInfiniteScalarTable* _mock_scalar_table;
@@ -1381,6 +1458,138 @@ TEST_F(TestTimerHandlerRealStore, GetTimersForNodeFromAllStructures)
   EXPECT_EQ(rc, 200);
 }
 
+// Test that the timer handler's thread sleeps until the store next has work
+// to do, and is woken when a timer is added that needs to pop sooner.
+TEST_F(TestTimerHandlerRealStore, SleepUntilNextTimer)
+{
+  uint32_t tick_time;
+
+  // The store is empty, so the thread is waiting for a timer to be added.
+  EXPECT_FALSE(_th->_shards[0]->wake_time_set);
+
+  EXPECT_CALL(*_mock_increment_table, increment(1)).Times(2);
+  EXPECT_CALL(*_mock_tag_table, increment(_, _)).Times(2);
+  EXPECT_CALL(*_mock_scalar_table, increment(_, _)).Times(2);
+
+  // Adding a timer wakes the thread, which then sleeps until it's due.
+  Timer* timer1 = default_timer(1);
+  timer1->interval_ms = 10000;
+  timer1->repeat_for = 10000;
+  _th->add_timer(timer1);
+  _cond()->block_till_waiting();
+
+  ASSERT_TRUE(_store->next_tick_time(tick_time));
+  EXPECT_TRUE(_th->_shards[0]->wake_time_set);
+  EXPECT_EQ(tick_time, _th->_shards[0]->wake_time_ms);
+  uint32_t first_wake_time_ms = tick_time;
+
+  // Adding a timer that pops sooner wakes the thread again, and it now sleeps
+  // until the new timer is due.
+  Timer* timer2 = default_timer(2);
+  timer2->interval_ms = 100;
+  timer2->repeat_for = 100;
+  _th->add_timer(timer2);
+  _cond()->block_till_waiting();
+
+  ASSERT_TRUE(_store->next_tick_time(tick_time));
+  EXPECT_EQ(tick_time, _th->_shards[0]->wake_time_ms);
+  EXPECT_TRUE(Utils::overflow_less_than(tick_time, first_wake_time_ms));
+}
+
+// Test that getting timers for a node copes with more timers than the handler
+// gets from the store at a time, including many that pop at the same time.
+TEST_F(TestTimerHandlerRealStore, GetTimersForNodeAcrossBatches)
+{
+  const int NUM_TIMERS = 150;
+  EXPECT_CALL(*_mock_increment_table, increment(1)).Times(NUM_TIMERS);
+  EXPECT_CALL(*_mock_tag_table, increment(_, _)).Times(NUM_TIMERS);
+  EXPECT_CALL(*_mock_scalar_table, increment(_, _)).Times(NUM_TIMERS);
+
+  uint32_t current_time = Utils::get_time();
+
+  for (TimerID id = 1; id <= NUM_TIMERS; ++id)
+  {
+    Timer* timer = default_timer(id);
+
+    // Most of the timers pop at the same time.
+    timer->interval_ms = (id <= 100) ? 10000 : 10000 + id;
+    timer->repeat_for = timer->interval_ms;
+    _th->add_timer(timer);
+  }
+
+  std::vector<std::string> cluster_addresses;
+  cluster_addresses.push_back("10.0.0.1:9999");
+  __globals->lock();
+  __globals->set_cluster_staying_addresses(cluster_addresses);
+  __globals->unlock();
+
+  std::string get_response;
+  int rc = _th->get_timers_for_node("10.0.0.1:9999", 1000, "cluster-view-id", current_time, get_response);
+  EXPECT_EQ(rc, 200);
+
+  rapidjson::Document doc;
+  doc.Parse<0>(get_response.c_str());
+  ASSERT_FALSE(doc.HasParseError());
+  const rapidjson::Value& ids_arr = doc["Timers"];
+  std::set<uint64_t> timer_ids;
+  for (rapidjson::Value::ConstValueIterator ids_it = ids_arr.Begin();
+       ids_it != ids_arr.End();
+       ++ids_it)
+  {
+    timer_ids.insert((*ids_it)["TimerID"].GetInt64());
+  }
+
+  // Every timer is returned exactly once.
+  EXPECT_EQ((size_t)NUM_TIMERS, ids_arr.Size());
+  EXPECT_EQ((size_t)NUM_TIMERS, timer_ids.size());
+}
+
+// Test that timers that change after a resync has reached them (but before
+// they're copied) are skipped.
+TEST_F(TestTimerHandlerRealStore, ResyncSkipsChangedTimers)
+{
+  EXPECT_CALL(*_mock_increment_table, increment(1)).Times(3);
+  EXPECT_CALL(*_mock_tag_table, increment(_, _)).Times(3);
+  EXPECT_CALL(*_mock_scalar_table, increment(_, _)).Times(3);
+  EXPECT_CALL(*_mock_increment_table, decrement(1)).Times(1);
+  EXPECT_CALL(*_mock_tag_table, decrement(_, _)).Times(1);
+  EXPECT_CALL(*_mock_scalar_table, decrement(_, _)).Times(1);
+
+  for (TimerID id = 1; id <= 3; ++id)
+  {
+    Timer* timer = default_timer(id);
+    timer->interval_ms = id * 10000;
+    timer->repeat_for = timer->interval_ms;
+    _th->add_timer(timer);
+  }
+
+  ClusterReplicaView cluster;
+  std::string node = "10.0.0.1:9999";
+  TimerHandler::ResyncCursor cursor(_th,
+                                    _th->_shards[0],
+                                    Utils::get_time(),
+                                    &cluster,
+                                    &node);
+
+  // Delete timer 2 once the resync has its ID.
+  _th->handle_failed_callback(2);
+
+  std::vector<TimerID> copied_ids;
+
+  for (; !cursor.end(); ++cursor)
+  {
+    Timer* timer = cursor.copy_timer();
+
+    if (timer != NULL)
+    {
+      copied_ids.push_back(timer->id);
+      delete timer;
+    }
+  }
+
+  EXPECT_EQ(std::vector<TimerID>({1, 3}), copied_ids);
+}
+
 // Test that getting timers from the short wheel honours the time-from
 TEST_F(TestTimerHandlerRealStore, TimeFromShortWheelTimers)
 {
@@ -1493,6 +1702,154 @@ TEST_F(TestTimerHandlerRealStore, TimeFromHeapTimers)
   EXPECT_EQ(rc, 200);
 }
 
+// A callback that just holds on to the timer it's given (rather than sending
+// anything), and a replicator that doesn't replicate anything, so that tests
+// can drive timers round the pop cycle without using mocks (which allocate
+// memory whenever they're called).
+class HoldingCallback : public Callback
+{
+public:
+  HoldingCallback() : timer(NULL) {}
+
+  std::string protocol() { return "http"; }
+  void perform(Timer* popped_timer) { timer = popped_timer; }
+
+  Timer* timer;
+};
+
+class NullReplicator : public Replicator
+{
+public:
+  NullReplicator() : Replicator(NULL, NULL) {}
+
+  void replicate(Timer*) {}
+  void replicate_timer_to_node(Timer*, std::string) {}
+};
+
+class TestTimerHandlerPopCycle : public Base
+{
+protected:
+  void SetUp()
+  {
+    Base::SetUp();
+    cwtest_completely_control_time();
+
+    _health_checker = new HealthChecker();
+    _store = new TimerStore(_health_checker);
+    _callback = new HoldingCallback();
+    _replicator = new NullReplicator();
+
+    // NULL is passed in for the GRReplicator (as it is disabled by default),
+    // and for the statistics tables (as popping a timer doesn't update them).
+    _th = new TimerHandler(_store, _callback, _replicator, NULL, NULL, NULL, NULL);
+    _cond()->block_till_waiting();
+  }
+
+  void TearDown()
+  {
+    delete _th;
+    delete _store;
+    delete _health_checker;
+    delete _replicator;
+    // _callback is deleted by the timer handler.
+
+    cwtest_reset_time();
+    Base::TearDown();
+  }
+
+  // Move time on to each time the shard thread wakes up, until it pops a
+  // timer, and then take the timer from the callback.
+  Timer* pop_timer()
+  {
+    while (_callback->timer == NULL)
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      uint32_t now_ms = (ts.tv_sec * 1000) + (ts.tv_nsec / (1000 * 1000));
+
+      EXPECT_TRUE(_th->_shards[0]->wake_time_set);
+      cwtest_advance_time_ms(_th->_shards[0]->wake_time_ms - now_ms);
+      _cond()->signal_timeout();
+      _cond()->block_till_waiting();
+    }
+
+    Timer* timer = _callback->timer;
+    _callback->timer = NULL;
+    return timer;
+  }
+
+  // Accessor functions into the timer handler's private variables
+  MockPThreadCondVar* _cond() { return (MockPThreadCondVar*)_th->_shards[0]->cond; }
+
+  HealthChecker* _health_checker;
+  TimerStore* _store;
+  HoldingCallback* _callback;
+  NullReplicator* _replicator;
+  TimerHandler* _th;
+};
+
+// Test how many allocations it takes to pop a repeating timer, return it to
+// the handler once its callback has been sent, and re-arm it once the callback
+// has succeeded (which is what happens to every timer each time it pops).
+TEST_F(TestTimerHandlerPopCycle, PopCycleAllocations)
+{
+  const int NUM_WARM_UP_CYCLES = 3;
+  const int NUM_CYCLES = 10;
+
+  Timer* timer = default_timer(1);
+  timer->interval_ms = 1000;
+  timer->repeat_for = 1000000;
+  TimerID id = timer->id;
+  _th->add_timer(timer, false);
+  _cond()->block_till_waiting();
+
+  // Let the store and the timer settle (e.g. so that the timer has picked up
+  // the current cluster information) before counting.
+  uint64_t start_allocations = 0;
+
+  for (int ii = 0; ii < NUM_WARM_UP_CYCLES + NUM_CYCLES; ++ii)
+  {
+    if (ii == NUM_WARM_UP_CYCLES)
+    {
+      start_allocations = heap_allocations.load();
+    }
+
+    timer = pop_timer();
+    ASSERT_EQ(id, timer->id);
+
+    _th->return_timer(timer);
+    _cond()->block_till_waiting();
+
+    _th->handle_successful_callback(id);
+    _cond()->block_till_waiting();
+  }
+
+  // The timer itself comes from the pool, and is moved (rather than copied)
+  // between the store, the callback and the handler. The only allocations
+  // left are the two lists of addresses that the timer's replicas are worked
+  // out in when it pops, for the current and the previous cluster (see
+  // Timer::calculate_replicas).
+  uint64_t allocations = heap_allocations.load() - start_allocations;
+  EXPECT_EQ(2u * NUM_CYCLES, allocations);
+}
+
+// Test that the shard's thread reports how many slabs the timer pool has
+// allocated before it goes to sleep.
+TEST_F(TestTimerHandlerPopCycle, TimerPoolReported)
+{
+  SNMP::U32Scalar timer_pool_scalar("", "");
+  _th->_timer_pool_scalar = &timer_pool_scalar;
+
+  // Adding a timer wakes the thread, which then sleeps until it's due.
+  _th->add_timer(default_timer(1), false);
+  _cond()->block_till_waiting();
+
+  EXPECT_LT(0u, timer_pool_scalar.value);
+  EXPECT_EQ(ObjectPool<Timer>::heap_allocations(), timer_pool_scalar.value);
+
+  _th->_timer_pool_scalar = NULL;
+}
+
 
 class TestTimerHandlerWithGREnabled : public Base
 {
@@ -1510,10 +1867,10 @@ protected:
     _replicator = new MockReplicator();
     _gr_replicator = new MockGRReplicator();
 
-    // Set up the Timer Handler
+    // Set up the Timer Handler. Adding timers to the store wakes the timer
+    // handler's thread, so it can check the store any number of times.
     EXPECT_CALL(*_store, fetch_next_timers(_)).
-                         WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                         WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                         WillRepeatedly(SetArgReferee<0>(std::vector<Timer*>()));
     // Stats are not tested in this test base, so pass in NULL for the stats tables.
     _th = new TimerHandler(_store, new MockCallback(), _replicator, _gr_replicator, NULL, NULL, NULL);
     _cond()->block_till_waiting();
@@ -1536,7 +1893,7 @@ protected:
   }
 
   // Accessor functions into the timer handler's private variables
-  MockPThreadCondVar* _cond() { return (MockPThreadCondVar*)_th->_cond; }
+  MockPThreadCondVar* _cond() { return (MockPThreadCondVar*)_th->_shards[0]->cond; }
 
   MockTimerStore* _store;
   MockReplicator* _replicator;
@@ -1561,3 +1918,359 @@ TEST_F(TestTimerHandlerWithGREnabled, ReplicateCallbackSuccess)
 
   delete timer;
 }
+
+// Timer handler tests with several real timer stores, to check that timers
+// are spread across the shards correctly.
+class TestTimerHandlerSharded : public Base
+{
+protected:
+  static const int NUM_SHARDS = 4;
+
+  void SetUp()
+  {
+    Base::SetUp();
+    cwtest_completely_control_time();
+
+    _health_checker = new HealthChecker();
+
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      _stores.push_back(new TimerStore(_health_checker));
+    }
+
+    _replicator = new MockReplicator();
+
+    // Stats are not tested in this test base, so pass in NULL for the stats
+    // tables.
+    _th = new TimerHandler(_stores,
+                           new MockCallback(),
+                           _replicator,
+                           NULL,
+                           NULL,
+                           NULL,
+                           NULL);
+
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      _cond(ii)->block_till_waiting();
+    }
+  }
+
+  void TearDown()
+  {
+    delete _th;
+
+    for (TimerStore* store : _stores)
+    {
+      delete store;
+    }
+
+    delete _health_checker;
+    delete _replicator;
+    // MockCallback is deleted in the TimerHandler
+
+    cwtest_reset_time();
+    Base::TearDown();
+  }
+
+  // Accessor functions into the timer handler's private variables
+  MockPThreadCondVar* _cond(int shard) { return (MockPThreadCondVar*)_th->_shards[shard]->cond; }
+  TimerStore* _store_for(TimerID id) { return _th->shard_for(id)->store; }
+
+  HealthChecker* _health_checker;
+  std::vector<TimerStore*> _stores;
+  MockReplicator* _replicator;
+  TimerHandler* _th;
+};
+
+// Test that timers are partitioned across the shards' stores, and that the
+// handler finds them in the right store.
+TEST_F(TestTimerHandlerSharded, TimersSpreadAcrossShards)
+{
+  for (TimerID id = 1; id <= 20; ++id)
+  {
+    _th->add_timer(default_timer(id));
+  }
+
+  size_t total_timers = 0;
+
+  for (TimerStore* store : _stores)
+  {
+    EXPECT_LT(0u, store->_timer_lookup_id_table.size());
+    total_timers += store->_timer_lookup_id_table.size();
+  }
+
+  EXPECT_EQ(20u, total_timers);
+
+  for (TimerID id = 1; id <= 20; ++id)
+  {
+    EXPECT_TRUE(_store_for(id)->_timer_lookup_id_table.find(id) != NULL);
+  }
+
+  // A failed callback deletes the timer from its shard.
+  _th->handle_failed_callback(7);
+  EXPECT_TRUE(_store_for(7)->_timer_lookup_id_table.find(7) == NULL);
+}
+
+// Test that getting timers for a node merges the timers from all the shards
+// in pop time order.
+TEST_F(TestTimerHandlerSharded, GetTimersForNodeMergesShards)
+{
+  uint32_t current_time = Utils::get_time();
+
+  // Add timers that pop in the reverse order of their IDs.
+  for (TimerID id = 1; id <= 20; ++id)
+  {
+    Timer* timer = default_timer(id);
+    timer->interval_ms = (21 - id) * 1000;
+    timer->repeat_for = timer->interval_ms;
+    _th->add_timer(timer);
+  }
+
+  // Now update the current cluster view ID
+  std::string updated_cluster_view_id = "updated-cluster-view-id";
+  std::vector<std::string> cluster_addresses;
+  cluster_addresses.push_back("10.0.0.1:9999");
+  __globals->lock();
+  __globals->set_cluster_staying_addresses(cluster_addresses);
+  __globals->set_cluster_view_id(updated_cluster_view_id);
+  __globals->unlock();
+
+  // Ask for the first five timers.
+  std::string get_response;
+  int rc = _th->get_timers_for_node("10.0.0.1:9999", 5, updated_cluster_view_id, current_time, get_response);
+  EXPECT_EQ(rc, 206);
+
+  rapidjson::Document doc;
+  doc.Parse<0>(get_response.c_str());
+  EXPECT_FALSE(doc.HasParseError());
+  const rapidjson::Value& ids_arr = doc["Timers"];
+  std::vector<uint64_t> timer_ids;
+  for (rapidjson::Value::ConstValueIterator ids_it = ids_arr.Begin();
+       ids_it != ids_arr.End();
+       ++ids_it)
+  {
+    timer_ids.push_back((*ids_it)["TimerID"].GetInt64());
+  }
+
+  std::vector<uint64_t> expected_ids = {20, 19, 18, 17, 16};
+  EXPECT_EQ(expected_ids, timer_ids);
+}
+
+// Test that precomputing the timers' cluster information does it for the
+// timers in every shard, and reports its progress.
+TEST_F(TestTimerHandlerSharded, PrecomputeReplicas)
+{
+  for (TimerID id = 1; id <= 20; ++id)
+  {
+    _th->add_timer(default_timer(id));
+  }
+
+  std::string updated_cluster_view_id = "updated-cluster-view-id";
+  std::vector<std::string> cluster_addresses;
+  cluster_addresses.push_back("10.0.0.1:9999");
+  cluster_addresses.push_back("10.0.0.4:9999");
+  __globals->lock();
+  __globals->set_cluster_staying_addresses(cluster_addresses);
+  __globals->set_new_cluster_hashes(__globals->generate_hashes(cluster_addresses));
+  __globals->set_cluster_view_id(updated_cluster_view_id);
+  __globals->unlock();
+
+  SNMP::U32Scalar remaining_scalar("", "");
+  remaining_scalar.value = 1;
+  _th->_precompute_remaining_scalar = &remaining_scalar;
+  _th->precompute_replicas();
+
+  // Wait for the precomputing threads to finish.
+  while (remaining_scalar.value != 0)
+  {
+    sched_yield();
+  }
+
+  for (TimerID id = 1; id <= 20; ++id)
+  {
+    Timer* timer = _store_for(id)->_timer_lookup_id_table.find(id);
+    ASSERT_TRUE(timer->_precomputed_replicas != NULL);
+    EXPECT_EQ(__globals->get_config_generation(),
+              timer->_precomputed_replicas->config_generation);
+
+    // The precomputed cluster information is what the timer would work out
+    // for itself.
+    Timer expected(id, 100, 100);
+    expected._replication_factor = timer->_replication_factor;
+    expected.update_cluster_information();
+    timer->update_cluster_information();
+    EXPECT_EQ(updated_cluster_view_id, (std::string)timer->cluster_view_id);
+    EXPECT_EQ(std::vector<std::string>(expected.replicas.begin(),
+                                       expected.replicas.end()),
+              std::vector<std::string>(timer->replicas.begin(),
+                                       timer->replicas.end()));
+  }
+
+  _th->_precompute_remaining_scalar = NULL;
+}
+
+// Test that precomputing the timers' cluster information copes with timers
+// that don't pop until the end of the timer wheels, when the store's tick
+// isn't aligned with the wheels.
+TEST_F(TestTimerHandlerSharded, PrecomputeReplicasForLongTimers)
+{
+  cwtest_advance_time_ms(TimerStore::DAY_WHEEL_RESOLUTION_MS / 2);
+
+  for (TimerID id = 1; id <= 4; ++id)
+  {
+    Timer* timer = default_timer(id);
+    timer->interval_ms = TimerStore::WEEK_WHEEL_PERIOD_MS -
+                        TimerStore::SHORT_WHEEL_RESOLUTION_MS;
+    timer->repeat_for = timer->interval_ms;
+    _th->add_timer(timer);
+  }
+
+  __globals->lock();
+  std::string updated_cluster_view_id = "updated-cluster-view-id";
+  __globals->set_cluster_view_id(updated_cluster_view_id);
+  __globals->unlock();
+
+  SNMP::U32Scalar remaining_scalar("", "");
+  remaining_scalar.value = 1;
+  _th->_precompute_remaining_scalar = &remaining_scalar;
+  _th->precompute_replicas();
+
+  while (remaining_scalar.value != 0)
+  {
+    sched_yield();
+  }
+
+  for (TimerID id = 1; id <= 4; ++id)
+  {
+    Timer* timer = _store_for(id)->_timer_lookup_id_table.find(id);
+    ASSERT_TRUE(timer->_precomputed_replicas != NULL);
+    EXPECT_EQ(__globals->get_config_generation(),
+              timer->_precomputed_replicas->config_generation);
+  }
+
+  _th->_precompute_remaining_scalar = NULL;
+}
+
+// Timer handler tests with timer adds queued for the shard's thread, and with
+// the lock hold time and queue depth statistics enabled.
+class TestTimerHandlerQueuedAdds : public Base
+{
+protected:
+  void SetUp()
+  {
+    Base::SetUp();
+    cwtest_completely_control_time();
+
+    _health_checker = new HealthChecker();
+    _store = new TimerStore(_health_checker);
+    _replicator = new MockReplicator();
+    _mock_increment_table = new MockIncrementTable();
+    _lock_hold_time_table = new MockEventAccumulatorTable();
+    _add_queue_depth_table = new MockEventAccumulatorTable();
+
+    // The shard's lock is taken and released as the handler runs, so its hold
+    // time can be recorded any number of times.
+    EXPECT_CALL(*_lock_hold_time_table, accumulate(_)).Times(AnyNumber());
+
+    // Tags aren't tested here, so pass in NULL for the tag tables.
+    _th = new TimerHandler(std::vector<TimerStore*>(1, _store),
+                           new MockCallback(),
+                           _replicator,
+                           NULL,
+                           _mock_increment_table,
+                           NULL,
+                           NULL,
+                           true,
+                           _lock_hold_time_table,
+                           _add_queue_depth_table);
+    _cond()->block_till_waiting();
+  }
+
+  void TearDown()
+  {
+    delete _th;
+    delete _store;
+    delete _health_checker;
+    delete _replicator;
+    delete _mock_increment_table;
+    delete _lock_hold_time_table;
+    delete _add_queue_depth_table;
+    // MockCallback is deleted in the TimerHandler
+
+    cwtest_reset_time();
+    Base::TearDown();
+  }
+
+  // Accessor functions into the timer handler's private variables
+  MockPThreadCondVar* _cond() { return (MockPThreadCondVar*)_th->_shards[0]->cond; }
+  MPSCQueue<Timer*>& _queued_timers() { return _th->_shards[0]->queued_timers; }
+
+  HealthChecker* _health_checker;
+  TimerStore* _store;
+  MockReplicator* _replicator;
+  MockIncrementTable* _mock_increment_table;
+  MockEventAccumulatorTable* _lock_hold_time_table;
+  MockEventAccumulatorTable* _add_queue_depth_table;
+  TimerHandler* _th;
+};
+
+// Test that a queued timer wakes the shard's thread, which adds it to the
+// store.
+TEST_F(TestTimerHandlerQueuedAdds, QueuedTimerAdded)
+{
+  EXPECT_CALL(*_mock_increment_table, increment(1)).Times(1);
+  EXPECT_CALL(*_add_queue_depth_table, accumulate(1)).Times(1);
+
+  _th->queue_timer(default_timer(1));
+  _cond()->block_till_waiting();
+
+  EXPECT_TRUE(_queued_timers().empty());
+  EXPECT_TRUE(_store->_timer_lookup_id_table.find(1) != NULL);
+}
+
+// Test that timers queued while the shard's thread is busy are added
+// together.
+TEST_F(TestTimerHandlerQueuedAdds, QueuedTimersAddedTogether)
+{
+  EXPECT_CALL(*_mock_increment_table, increment(1)).Times(3);
+  EXPECT_CALL(*_add_queue_depth_table, accumulate(3)).Times(1);
+
+  // Queue two timers without waking the thread, as if they were queued while
+  // it was popping timers. Queueing the third wakes it.
+  _queued_timers().push(default_timer(1));
+  _queued_timers().push(default_timer(2));
+  _th->queue_timer(default_timer(3));
+  _cond()->block_till_waiting();
+
+  for (TimerID id = 1; id <= 3; ++id)
+  {
+    EXPECT_TRUE(_store->_timer_lookup_id_table.find(id) != NULL);
+  }
+}
+
+// Test that updating a queued timer replaces the timer in the store, in the
+// order the updates were queued.
+TEST_F(TestTimerHandlerQueuedAdds, QueuedTimerUpdated)
+{
+  EXPECT_CALL(*_mock_increment_table, increment(1)).Times(1);
+  EXPECT_CALL(*_add_queue_depth_table, accumulate(2)).Times(1);
+
+  Timer* timer1 = default_timer(1);
+  Timer* timer2 = default_timer(1);
+  timer2->interval_ms = 200;
+  timer2->repeat_for = 200;
+  timer2->start_time_mono_ms += 10;
+
+  _queued_timers().push(timer1);
+  _th->queue_timer(timer2);
+  _cond()->block_till_waiting();
+
+  Timer* timer = NULL;
+  pthread_mutex_lock(&_th->_shards[0]->mutex);
+  _store->fetch(1, &timer);
+  pthread_mutex_unlock(&_th->_shards[0]->mutex);
+  ASSERT_TRUE(timer != NULL);
+  EXPECT_EQ(200u, timer->interval_ms);
+  delete timer;
+}
@@ -0,0 +1,257 @@
+/**
+ * @file test_timer_id_table.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "timer_id_table.h"
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <random>
+#include <set>
+#include <time.h>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestTimerIDTable : public ::testing::Test
+{
+protected:
+  // The table never dereferences the timers it holds, so the tests use
+  // distinct fake pointers rather than building real timers.
+  static Timer* fake_timer(TimerID id)
+  {
+    return reinterpret_cast<Timer*>((id + 1) * 16);
+  }
+
+  // Find IDs that all hash to the same slot in the table's current
+  // (initial-sized) table, to force long probe sequences.
+  std::vector<TimerID> colliding_ids(int count)
+  {
+    std::vector<TimerID> ids;
+    size_t target = TimerIDTable::home_slot(_table._table, 0);
+
+    for (TimerID id = 0; (int)ids.size() < count; ++id)
+    {
+      if (TimerIDTable::home_slot(_table._table, id) == target)
+      {
+        ids.push_back(id);
+      }
+    }
+
+    return ids;
+  }
+
+  bool resizing() { return (_table._old_table.slots != NULL); }
+
+  TimerIDTable _table;
+};
+
+/*****************************************************************************/
+/* Tests                                                                     */
+/*****************************************************************************/
+
+TEST_F(TestTimerIDTable, InsertFindErase)
+{
+  EXPECT_TRUE(_table.empty());
+  EXPECT_TRUE(_table.find(1) == NULL);
+
+  _table.insert(1, fake_timer(1));
+  _table.insert(2, fake_timer(2));
+  EXPECT_EQ(2u, _table.size());
+  EXPECT_EQ(fake_timer(1), _table.find(1));
+  EXPECT_EQ(fake_timer(2), _table.find(2));
+  EXPECT_TRUE(_table.find(3) == NULL);
+
+  EXPECT_TRUE(_table.erase(1));
+  EXPECT_FALSE(_table.erase(1));
+  EXPECT_EQ(1u, _table.size());
+  EXPECT_TRUE(_table.find(1) == NULL);
+  EXPECT_EQ(fake_timer(2), _table.find(2));
+}
+
+TEST_F(TestTimerIDTable, EraseFromCollidingChain)
+{
+  // Build a chain of colliding IDs, then remove entries from the front,
+  // middle and end. The remaining entries must all still be found.
+  std::vector<TimerID> ids = colliding_ids(6);
+
+  for (TimerID id : ids)
+  {
+    _table.insert(id, fake_timer(id));
+  }
+
+  EXPECT_TRUE(_table.erase(ids[0]));
+  EXPECT_TRUE(_table.erase(ids[3]));
+  EXPECT_TRUE(_table.erase(ids[5]));
+
+  EXPECT_TRUE(_table.find(ids[0]) == NULL);
+  EXPECT_EQ(fake_timer(ids[1]), _table.find(ids[1]));
+  EXPECT_EQ(fake_timer(ids[2]), _table.find(ids[2]));
+  EXPECT_TRUE(_table.find(ids[3]) == NULL);
+  EXPECT_EQ(fake_timer(ids[4]), _table.find(ids[4]));
+  EXPECT_TRUE(_table.find(ids[5]) == NULL);
+  EXPECT_EQ(3u, _table.size());
+}
+
+TEST_F(TestTimerIDTable, IncrementalResize)
+{
+  // Add enough timers to force the table to resize, checking that every timer
+  // can be found (and removed) while the old table is being drained.
+  const TimerID num_timers = 1000;
+  bool seen_resize = false;
+
+  for (TimerID id = 0; id < num_timers; ++id)
+  {
+    _table.insert(id, fake_timer(id));
+    seen_resize |= resizing();
+
+    // Remove every third timer, so that some are removed from the old table
+    // mid-resize.
+    if ((id % 3) == 0)
+    {
+      EXPECT_TRUE(_table.erase(id / 3));
+    }
+  }
+
+  EXPECT_TRUE(seen_resize);
+
+  for (TimerID id = 0; id < num_timers; ++id)
+  {
+    bool erased = (id <= (num_timers - 1) / 3);
+    EXPECT_EQ(erased ? NULL : fake_timer(id), _table.find(id)) << id;
+  }
+}
+
+TEST_F(TestTimerIDTable, IterateDuringResize)
+{
+  std::set<Timer*> expected;
+
+  for (TimerID id = 0; !resizing(); ++id)
+  {
+    _table.insert(id, fake_timer(id));
+    expected.insert(fake_timer(id));
+  }
+
+  std::set<Timer*> found;
+
+  for (TimerIDTable::iterator it = _table.begin(); it != _table.end(); ++it)
+  {
+    EXPECT_TRUE(found.insert(*it).second);
+  }
+
+  EXPECT_EQ(expected, found);
+  EXPECT_EQ(expected.size(), _table.size());
+}
+
+TEST_F(TestTimerIDTable, Clear)
+{
+  for (TimerID id = 0; id < 100; ++id)
+  {
+    _table.insert(id, fake_timer(id));
+  }
+
+  _table.clear();
+  EXPECT_TRUE(_table.empty());
+  EXPECT_TRUE(_table.find(1) == NULL);
+  EXPECT_FALSE(_table.begin() != _table.end());
+
+  // The table is still usable.
+  _table.insert(1, fake_timer(1));
+  EXPECT_EQ(fake_timer(1), _table.find(1));
+}
+
+static uint64_t monotonic_time_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+// Measure how long it takes to insert timers with random IDs into the table,
+// and to look up IDs that are and aren't in it, at 1M, 10M and 50M timers.
+// The largest table needs around 4GB of memory.
+TEST_F(TestTimerIDTable, DISABLED_Benchmark)
+{
+  const size_t NUM_LOOKUPS = 1000000;
+  const size_t SIZES[] = {1000000, 10000000, 50000000};
+
+  for (size_t size : SIZES)
+  {
+    TimerIDTable* table = new TimerIDTable();
+    std::mt19937_64 rng(size);
+    std::vector<TimerID> ids(size);
+
+    for (TimerID& id : ids)
+    {
+      id = rng();
+    }
+
+    // Time each insert separately, to find the slowest (which would hold up
+    // the tick thread).
+    uint64_t insert_ns = 0;
+    uint64_t worst_insert_ns = 0;
+
+    for (TimerID id : ids)
+    {
+      uint64_t start_ns = monotonic_time_ns();
+      table->insert(id, fake_timer(id));
+      uint64_t elapsed_ns = monotonic_time_ns() - start_ns;
+      insert_ns += elapsed_ns;
+      worst_insert_ns = std::max(worst_insert_ns, elapsed_ns);
+    }
+
+    // Look up a random selection of the IDs in the table.
+    std::vector<TimerID> hits(NUM_LOOKUPS);
+
+    for (TimerID& id : hits)
+    {
+      id = ids[rng() % size];
+    }
+
+    uint64_t start_ns = monotonic_time_ns();
+    size_t found = 0;
+
+    for (TimerID id : hits)
+    {
+      found += (table->find(id) != NULL);
+    }
+
+    uint64_t hit_ns = monotonic_time_ns() - start_ns;
+    EXPECT_EQ(NUM_LOOKUPS, found);
+
+    // Look up random IDs, which almost certainly aren't in the table.
+    std::vector<TimerID> misses(NUM_LOOKUPS);
+
+    for (TimerID& id : misses)
+    {
+      id = rng();
+    }
+
+    start_ns = monotonic_time_ns();
+    found = 0;
+
+    for (TimerID id : misses)
+    {
+      found += (table->find(id) != NULL);
+    }
+
+    uint64_t miss_ns = monotonic_time_ns() - start_ns;
+
+    printf("%lu timers: insert %lu ns (worst %lu us), hit %lu ns, miss %lu ns\n",
+           size,
+           insert_ns / size,
+           worst_insert_ns / 1000,
+           hit_ns / NUM_LOOKUPS,
+           miss_ns / NUM_LOOKUPS);
+
+    delete table;
+  }
+}
@@ -16,6 +16,10 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 #include <map>
+#include <set>
+#include <memory>
+#include <cstdio>
+#include <time.h>
 
 using testing::Types;
 
@@ -178,6 +182,320 @@ TEST_F(TestTimerReplicaChoosing, NoPrimaryBackupSwap)
   }
 }
 
+// Working out whether a node is a replica for a timer from a snapshot of the
+// cluster should give the same answer as working out the timer's replicas.
+TEST_F(TestTimerReplicaChoosing, ClusterReplicaViewMatchesTimers)
+{
+  std::vector<std::string> joining_cluster = {"10.0.0.100:7253"};
+  __globals->lock();
+  __globals->set_cluster_staying_addresses(old_cluster);
+  __globals->set_cluster_joining_addresses(joining_cluster);
+  __globals->set_new_cluster_hashes(new_cluster_rendezvous_hashes);
+  __globals->set_old_cluster_hashes(old_cluster_rendezvous_hashes);
+  __globals->unlock();
+
+  ClusterReplicaView view;
+
+  for (TimerID id = (TimerID)0;
+       id < (TimerID)MAX_TIMERS;
+       id++)
+  {
+    Timer timer(id, 100, 100);
+    timer._replication_factor = REPLICATION_FACTOR;
+    timer.update_cluster_information();
+
+    for (const std::string& node : new_cluster)
+    {
+      ASSERT_EQ(timer.is_local(node),
+                view.is_replica(id, REPLICATION_FACTOR, node));
+    }
+  }
+}
+
+// Checking many timers at once gives the same answers as checking them one at
+// a time.
+TEST_F(TestTimerReplicaChoosing, ClusterReplicaViewBatchMatchesSingle)
+{
+  std::vector<std::string> joining_cluster = {"10.0.0.100:7253"};
+  __globals->lock();
+  __globals->set_cluster_staying_addresses(old_cluster);
+  __globals->set_cluster_joining_addresses(joining_cluster);
+  __globals->set_new_cluster_hashes(new_cluster_rendezvous_hashes);
+  __globals->unlock();
+
+  ClusterReplicaView view;
+  std::vector<TimerID> ids;
+  std::vector<uint32_t> replication_factors;
+
+  for (TimerID id = (TimerID)0;
+       id < (TimerID)MAX_TIMERS;
+       id++)
+  {
+    // Spread the IDs across all 64 bits, and vary the replication factor.
+    ids.push_back(id * 0x9E3779B97F4A7C15ULL);
+    replication_factors.push_back(1 + (id % 3));
+  }
+
+  for (const std::string& node : new_cluster)
+  {
+    std::vector<bool> replicas;
+    view.are_replicas(ids, replication_factors, node, replicas);
+    ASSERT_EQ(ids.size(), replicas.size());
+
+    for (size_t ii = 0; ii < ids.size(); ++ii)
+    {
+      ASSERT_EQ(view.is_replica(ids[ii], replication_factors[ii], node),
+                replicas[ii]);
+    }
+  }
+}
+
+// Precomputing the cluster information for many timers at once gives the same
+// replicas and extra replicas as the timers work out for themselves, while
+// nodes are both joining and leaving the cluster.
+TEST_F(TestTimerReplicaChoosing, ClusterReplicaViewPrecomputeMatchesTimers)
+{
+  std::vector<std::string> staying_cluster = {"10.0.0.1:7253", "10.0.0.2:7253", "10.0.0.3:7253"};
+  std::vector<std::string> joining_cluster = {"10.0.0.100:7253"};
+  std::vector<std::string> leaving_cluster = {"10.0.0.4:7253"};
+  std::string cluster_view_id = "precompute-cluster-view-id";
+  old_cluster = staying_cluster;
+  old_cluster.insert(old_cluster.end(), leaving_cluster.begin(), leaving_cluster.end());
+  new_cluster = staying_cluster;
+  new_cluster.insert(new_cluster.end(), joining_cluster.begin(), joining_cluster.end());
+
+  __globals->lock();
+  __globals->set_cluster_staying_addresses(staying_cluster);
+  __globals->set_cluster_joining_addresses(joining_cluster);
+  __globals->set_cluster_leaving_addresses(leaving_cluster);
+  __globals->set_new_cluster_hashes(__globals->generate_hashes(new_cluster));
+  __globals->set_old_cluster_hashes(__globals->generate_hashes(old_cluster));
+  __globals->set_cluster_view_id(cluster_view_id);
+  __globals->unlock();
+
+  ClusterReplicaView view;
+  std::vector<TimerID> ids;
+  std::vector<uint32_t> replication_factors;
+
+  for (TimerID id = (TimerID)0;
+       id < (TimerID)MAX_TIMERS;
+       id++)
+  {
+    ids.push_back(id * 0x9E3779B97F4A7C15ULL);
+    replication_factors.push_back(1 + (id % 3));
+  }
+
+  std::vector<PrecomputedReplicasPtr> precomputed;
+  view.precompute_replicas(ids, replication_factors, precomputed);
+  ASSERT_EQ(ids.size(), precomputed.size());
+  std::set<PrecomputedReplicasPtr> distinct;
+
+  for (size_t ii = 0; ii < ids.size(); ++ii)
+  {
+    Timer timer(ids[ii], 100, 100);
+    timer._replication_factor = replication_factors[ii];
+    timer.update_cluster_information();
+
+    Timer precomputed_timer(ids[ii], 100, 100);
+    precomputed_timer._replication_factor = replication_factors[ii];
+    precomputed_timer.set_precomputed_replicas(precomputed[ii]);
+    precomputed_timer.update_cluster_information();
+
+    EXPECT_EQ(cluster_view_id, (std::string)precomputed_timer.cluster_view_id);
+    ASSERT_EQ(std::vector<std::string>(timer.replicas.begin(),
+                                       timer.replicas.end()),
+              std::vector<std::string>(precomputed_timer.replicas.begin(),
+                                       precomputed_timer.replicas.end()));
+    ASSERT_EQ(std::vector<std::string>(timer.extra_replicas.begin(),
+                                       timer.extra_replicas.end()),
+              std::vector<std::string>(precomputed_timer.extra_replicas.begin(),
+                                       precomputed_timer.extra_replicas.end()));
+    distinct.insert(precomputed[ii]);
+  }
+
+  // Timers with the same cluster information share it.
+  EXPECT_GT(ids.size(), distinct.size() * 4);
+}
+
+// The cluster information precomputed for a configuration is freed once the
+// configuration has been superseded and nothing refers to it any more, but not
+// while a timer still does.
+TEST_F(TestTimerReplicaChoosing, ClusterReplicaViewFreesSupersededPrecomputes)
+{
+  std::vector<TimerID> ids;
+  std::vector<uint32_t> replication_factors;
+
+  for (TimerID id = (TimerID)0; id < (TimerID)100; id++)
+  {
+    ids.push_back(id * 0x9E3779B97F4A7C15ULL);
+    replication_factors.push_back(2);
+  }
+
+  std::vector<std::weak_ptr<const PrecomputedReplicas>> old_precomputed;
+  Timer timer(ids[0], 100, 100);
+  timer._replication_factor = 2;
+
+  {
+    ClusterReplicaView view;
+    std::vector<PrecomputedReplicasPtr> precomputed;
+    view.precompute_replicas(ids, replication_factors, precomputed);
+    old_precomputed.assign(precomputed.begin(), precomputed.end());
+    timer.set_precomputed_replicas(precomputed[0]);
+  }
+
+  // The cluster information is shared with later views for the same
+  // configuration.
+  {
+    ClusterReplicaView view;
+    std::vector<PrecomputedReplicasPtr> precomputed;
+    view.precompute_replicas(ids, replication_factors, precomputed);
+
+    for (size_t ii = 0; ii < ids.size(); ++ii)
+    {
+      EXPECT_EQ(old_precomputed[ii].lock(), precomputed[ii]);
+    }
+  }
+
+  // Change the configuration, and precompute the replicas for it.
+  new_cluster.push_back("10.0.0.100:7253");
+  __globals->lock();
+  __globals->set_cluster_joining_addresses({"10.0.0.100:7253"});
+  __globals->set_new_cluster_hashes(__globals->generate_hashes(new_cluster));
+  __globals->unlock();
+
+  {
+    ClusterReplicaView view;
+    std::vector<PrecomputedReplicasPtr> precomputed;
+    view.precompute_replicas(ids, replication_factors, precomputed);
+    EXPECT_EQ(__globals->get_config_generation(),
+              precomputed[0]->config_generation);
+  }
+
+  // Only the cluster information the timer still refers to is left from the
+  // old configuration.
+  for (size_t ii = 1; ii < ids.size(); ++ii)
+  {
+    if (old_precomputed[ii].lock() != old_precomputed[0].lock())
+    {
+      EXPECT_TRUE(old_precomputed[ii].expired());
+    }
+  }
+
+  EXPECT_FALSE(old_precomputed[0].expired());
+
+  // Once the timer has used (and discarded) it, it's freed too.
+  timer.update_cluster_information();
+  EXPECT_TRUE(old_precomputed[0].expired());
+}
+
+// Measure how many timers a second can have their replicas calculated, for
+// both the current and previous clusters.
+TEST_F(TestTimerReplicaChoosing, DISABLED_Benchmark)
+{
+  const int NUM_ROUNDS = 100;
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int round = 0; round < NUM_ROUNDS; ++round)
+  {
+    for (TimerID id = (TimerID)0;
+         id < (TimerID)MAX_TIMERS;
+         id++)
+    {
+      calculate_timers_for_id(id);
+      extra_replicas.clear();
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  uint64_t total_us = ((end.tv_sec - start.tv_sec) * 1000000) +
+                      ((end.tv_nsec - start.tv_nsec) / 1000);
+
+  // Each timer has its replicas calculated twice.
+  printf("Calculated replicas for %d timers in %lu us (%lu timers/s)\n",
+         2 * NUM_ROUNDS * MAX_TIMERS,
+         total_us,
+         (2UL * NUM_ROUNDS * MAX_TIMERS * 1000000UL) / std::max(total_us, 1UL));
+}
+
+// A hasher that hashes each timer to a fixed value per server, to force the
+// timer's hashes for different servers to collide.
+class FixedHasher : public Hasher
+{
+public:
+  FixedHasher(std::map<uint32_t, uint32_t> hashes) : _hashes(hashes) {}
+
+  virtual uint32_t do_hash(TimerID data, uint32_t seed)
+  {
+    return _hashes[seed];
+  }
+
+private:
+  std::map<uint32_t, uint32_t> _hashes;
+};
+
+// When a timer hashes to the same value for two servers, the first server in
+// the cluster ranks lower.
+TEST_F(TestTimerReplicaChoosing, TimerHashesCollide)
+{
+  std::vector<std::string> cluster = {"A", "B", "C", "D"};
+  std::vector<uint32_t> server_hashes = {1, 2, 3, 4};
+  std::vector<std::string> replicas;
+  std::vector<std::string> extra_replicas;
+
+  // The servers rank A (10), C (11), D (30), B (40), so the primary is A and
+  // the backups are B then D.
+  FixedHasher hasher({{1, 10}, {2, 40}, {3, 10}, {4, 30}});
+  Timer::calculate_replicas(1,
+                            cluster,
+                            server_hashes,
+                            cluster,
+                            server_hashes,
+                            3,
+                            replicas,
+                            extra_replicas,
+                            &hasher);
+  EXPECT_EQ(std::vector<std::string>({"A", "B", "D"}), replicas);
+  EXPECT_TRUE(extra_replicas.empty());
+
+  // Here C's hash collides with A's and then B's, and D's with B's and then
+  // C's, so the servers rank A (10), B (11), C (12), D (13).
+  FixedHasher chained_hasher({{1, 10}, {2, 11}, {3, 10}, {4, 11}});
+  Timer::calculate_replicas(1,
+                            cluster,
+                            server_hashes,
+                            cluster,
+                            server_hashes,
+                            4,
+                            replicas,
+                            extra_replicas,
+                            &chained_hasher);
+  EXPECT_EQ(std::vector<std::string>({"A", "D", "C", "B"}), replicas);
+  EXPECT_TRUE(extra_replicas.empty());
+}
+
+// The replication factor is capped at the size of the cluster.
+TEST_F(TestTimerReplicaChoosing, ReplicationFactorLargerThanCluster)
+{
+  std::vector<std::string> replicas;
+  std::vector<std::string> extra_replicas;
+
+  Timer::calculate_replicas(1,
+                            old_cluster,
+                            old_cluster_rendezvous_hashes,
+                            old_cluster,
+                            old_cluster_rendezvous_hashes,
+                            6,
+                            replicas,
+                            extra_replicas,
+                            &normal_hasher);
+
+  EXPECT_EQ(old_cluster.size(), replicas.size());
+  EXPECT_EQ(old_cluster.size(),
+            std::set<std::string>(replicas.begin(), replicas.end()).size());
+}
+
 // Test behaviour when the hashes of two servers collide, and the collision is resolved by removing one.
 class TestTimerReplicaChoosingWithCollision : public TestTimerReplicaChoosing
 {
@@ -18,6 +18,14 @@
 
 #include <gtest/gtest.h>
 #include "gmock/gmock.h"
+#include <algorithm>
+#include <linux/perf_event.h>
+#include <random>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 using ::testing::MatchesRegex;
 
@@ -155,7 +163,7 @@ TYPED_TEST(TestTimerStore, NearGetNextTimersTest)
 {
   TestFixture::ts->insert(TestFixture::timers[0]);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   TestFixture::ts->fetch_next_timers(next_timers);
 
   ASSERT_EQ(0u, next_timers.size());
@@ -174,7 +182,7 @@ TYPED_TEST(TestTimerStore, NearGetNextTimersOffsetTest)
 
   TestFixture::ts->insert(TestFixture::timers[0]);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   cwtest_advance_time_ms(1500);
   TestFixture::ts->fetch_next_timers(next_timers);
@@ -193,7 +201,7 @@ TYPED_TEST(TestTimerStore, NearGetNextTimersOffsetTest)
 TYPED_TEST(TestTimerStore, MidGetNextTimersTest)
 {
   TestFixture::ts->insert(TestFixture::timers[1]);
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   TestFixture::ts->fetch_next_timers(next_timers);
 
   ASSERT_EQ(0u, next_timers.size());
@@ -209,7 +217,7 @@ TYPED_TEST(TestTimerStore, MidGetNextTimersTest)
 TYPED_TEST(TestTimerStore, LongGetNextTimersTest)
 {
   TestFixture::ts->insert(TestFixture::timers[2]);
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   TestFixture::ts->fetch_next_timers(next_timers);
 
   ASSERT_EQ(0u, next_timers.size());
@@ -230,7 +238,7 @@ TYPED_TEST(TestTimerStore, MultiNearGetNextTimersTest)
   TestFixture::ts->insert(TestFixture::timers[0]);
   TestFixture::ts->insert(TestFixture::timers[1]);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   cwtest_advance_time_ms(1000 + TIMER_GRANULARITY_MS);
 
@@ -252,7 +260,7 @@ TYPED_TEST(TestTimerStore, ClashingMultiMidGetNextTimersTest)
   TestFixture::ts->insert(TestFixture::timers[0]);
   TestFixture::ts->insert(TestFixture::timers[1]);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   cwtest_advance_time_ms(TestFixture::timers[0]->interval_ms + TIMER_GRANULARITY_MS);
   TestFixture::ts->fetch_next_timers(next_timers);
@@ -280,7 +288,7 @@ TYPED_TEST(TestTimerStore, SeparateMultiMidGetNextTimersTest)
   TestFixture::ts->insert(TestFixture::timers[0]);
   TestFixture::ts->insert(TestFixture::timers[1]);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   cwtest_advance_time_ms(TestFixture::timers[0]->interval_ms + TIMER_GRANULARITY_MS);
   TestFixture::ts->fetch_next_timers(next_timers);
@@ -309,7 +317,7 @@ TYPED_TEST(TestTimerStore, MultiLongGetTimersTest)
   TestFixture::ts->insert(TestFixture::timers[1]);
   TestFixture::ts->insert(TestFixture::timers[2]);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   cwtest_advance_time_ms(TestFixture::timers[0]->interval_ms + TIMER_GRANULARITY_MS);
   TestFixture::ts->fetch_next_timers(next_timers);
@@ -338,7 +346,7 @@ TYPED_TEST(TestTimerStore, HeapPropertyTest)
 {
   // This test ensures that the heap is working properly - i.e. that the timer
   // which is next to pop is at the top of the heap.
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   // Set the timers (with IDs 1, 2 and 3) up so that:
   //  - the timer with ID 2 is the first one to pop
@@ -380,7 +388,7 @@ TYPED_TEST(TestTimerStore, ReallyLongTimer)
   TestFixture::timers[2]->interval_ms = (3600 * 1000) * 10;
   TestFixture::ts->insert(TestFixture::timers[2]);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   TestFixture::ts->fetch_next_timers(next_timers);
   ASSERT_EQ(0u, next_timers.size());
@@ -402,7 +410,7 @@ TYPED_TEST(TestTimerStore, MultipleReallyLongTimers)
   TestFixture::timers[2]->interval_ms = (3600 * 1000) * 10;
   TestFixture::ts->insert(TestFixture::timers[2]);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   TestFixture::ts->fetch_next_timers(next_timers);
   ASSERT_EQ(0u, next_timers.size());
@@ -421,7 +429,7 @@ TYPED_TEST(TestTimerStore, DeleteNearTimer)
   Timer* to_delete = NULL;
   TestFixture::ts->fetch(1, &to_delete);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   cwtest_advance_time_ms(interval_ms + TIMER_GRANULARITY_MS);
   TestFixture::ts->fetch_next_timers(next_timers);
 
@@ -436,7 +444,7 @@ TYPED_TEST(TestTimerStore, DeleteMidTimer)
   Timer* to_delete = NULL;
   TestFixture::ts->fetch(2, &to_delete);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   cwtest_advance_time_ms(interval_ms + TIMER_GRANULARITY_MS);
   TestFixture::ts->fetch_next_timers(next_timers);
 
@@ -453,7 +461,7 @@ TYPED_TEST(TestTimerStore, DeleteLongTimer)
   EXPECT_FALSE(to_delete == NULL);
 
   cwtest_advance_time_ms(interval_ms + TIMER_GRANULARITY_MS);
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   TestFixture::ts->fetch_next_timers(next_timers);
 
   EXPECT_TRUE(next_timers.empty());
@@ -470,7 +478,7 @@ TYPED_TEST(TestTimerStore, DeleteHeapTimer)
   EXPECT_FALSE(to_delete == NULL);
 
   cwtest_advance_time_ms(interval_ms + TIMER_GRANULARITY_MS);
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   TestFixture::ts->fetch_next_timers(next_timers);
 
   EXPECT_TRUE(next_timers.empty());
@@ -487,7 +495,7 @@ TYPED_TEST(TestTimerStore, AddTombstone)
 {
   TestFixture::ts->insert(TestFixture::tombstone);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   cwtest_advance_time_ms(1000000);
   TestFixture::ts->fetch_next_timers(next_timers);
   EXPECT_EQ(1u, next_timers.size());
@@ -498,7 +506,7 @@ TYPED_TEST(TestTimerStore, MixtureOfTimerLengths)
   // Add timers that all pop at the same time, but in such a way that one ends
   // up in the short wheel, one in the long wheel, and one in the heap.  Check
   // they pop at the same time.
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   // Timers all pop 1hr, 1s, 500ms from the start of the test.
   // Set timer 1.
@@ -536,7 +544,7 @@ TYPED_TEST(TestTimerStore, MixtureOfTimerLengths)
 
 TYPED_TEST(TestTimerStore, TimerPopsOnTheHour)
 {
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   uint32_t pop_time_ms;
 
   pop_time_ms = (TestFixture::timers[0]->start_time_mono_ms / (60 * 60 * 1000));
@@ -556,7 +564,7 @@ TYPED_TEST(TestTimerStore, TimerPopsOnTheHour)
 TYPED_TEST(TestTimerStore, PopOverdueTimer)
 {
   cwtest_advance_time_ms(500);
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   TestFixture::ts->fetch_next_timers(next_timers);
 
   TestFixture::ts->insert(TestFixture::timers[0]);
@@ -571,7 +579,7 @@ TYPED_TEST(TestTimerStore, PopOverdueTimer)
 TYPED_TEST(TestTimerStore, DeleteOverdueTimer)
 {
   cwtest_advance_time_ms(500);
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   TestFixture::ts->fetch_next_timers(next_timers);
 
   TestFixture::ts->insert(TestFixture::timers[0]);
@@ -583,6 +591,132 @@ TYPED_TEST(TestTimerStore, DeleteOverdueTimer)
 
 }
 
+// Test that a timer can be deleted even if its pop time has changed since it
+// was added to the store (as the store tracks where the timer is, rather than
+// working this out from the pop time).
+TYPED_TEST(TestTimerStore, DeleteTimerAfterPopTimeChanges)
+{
+  TestFixture::ts->insert(TestFixture::timers[0]);
+  TestFixture::ts->insert(TestFixture::timers[1]);
+
+  // Move timer one's pop time into the long wheel's range.
+  uint32_t interval_ms = TestFixture::timers[1]->interval_ms;
+  TestFixture::timers[0]->interval_ms = interval_ms;
+
+  Timer* to_delete = NULL;
+  TestFixture::ts->fetch(1, &to_delete);
+  EXPECT_EQ(TestFixture::timers[0], to_delete);
+
+  // Only timer two should pop.
+  std::vector<Timer*> next_timers;
+  cwtest_advance_time_ms(interval_ms + TIMER_GRANULARITY_MS);
+  TestFixture::ts->fetch_next_timers(next_timers);
+
+  ASSERT_EQ(1u, next_timers.size());
+  EXPECT_EQ(2u, (*next_timers.begin())->id);
+}
+
+// Test that a timer moves through the wheels according to the pop time it had
+// when it was added to the store.
+TYPED_TEST(TestTimerStore, TimerPopsAtPopTimeWhenAdded)
+{
+  TestFixture::ts->insert(TestFixture::timers[1]);
+
+  // Changing the interval after adding the timer doesn't affect when it pops.
+  uint32_t interval_ms = TestFixture::timers[1]->interval_ms;
+  TestFixture::timers[1]->interval_ms = TestFixture::timers[2]->interval_ms;
+
+  std::vector<Timer*> next_timers;
+  cwtest_advance_time_ms(interval_ms + TIMER_GRANULARITY_MS);
+  TestFixture::ts->fetch_next_timers(next_timers);
+
+  ASSERT_EQ(1u, next_timers.size());
+  EXPECT_EQ(TestFixture::timers[1], *next_timers.begin());
+}
+
+// Test that a timer pops later once this node moves further down the timer's
+// site list.
+TYPED_TEST(TestTimerStore, UpdatePopTimesWhenSiteChanges)
+{
+  TestFixture::ts->insert(TestFixture::timers[0]);
+
+  // Move this node to the second site. Its replica is now behind the one
+  // replica in the first site, so the timer is delayed by 2 seconds.
+  __globals->lock();
+  __globals->set_local_site_name("remote_site_1_name");
+  __globals->unlock();
+  TestFixture::ts->update_pop_times();
+
+  std::vector<Timer*> next_timers;
+  cwtest_advance_time_ms(100 + TIMER_GRANULARITY_MS);
+  TestFixture::ts->fetch_next_timers(next_timers);
+  ASSERT_EQ(0u, next_timers.size());
+
+  cwtest_advance_time_ms(2000);
+  TestFixture::ts->fetch_next_timers(next_timers);
+  ASSERT_EQ(1u, next_timers.size());
+  EXPECT_EQ(TestFixture::timers[0], *next_timers.begin());
+}
+
+// Test that timers (including those in the heap) pop earlier once this node
+// moves up their replica lists, and that timers that should already have
+// popped pop straight away.
+TYPED_TEST(TestTimerStore, UpdatePopTimesWhenAddressChanges)
+{
+  // Make this node the second replica for each of the timers. Timer one pops
+  // 2 seconds late, and timer three is long enough to be in the heap.
+  uint32_t heap_interval_ms = (3600 * 1000) * 24 * 4;
+  TestFixture::timers[2]->interval_ms = heap_interval_ms;
+
+  for (int ii = 0; ii < 3; ii += 2)
+  {
+    TestFixture::timers[ii]->replicas.push_back("10.0.0.2");
+    std::swap(TestFixture::timers[ii]->replicas[0],
+              TestFixture::timers[ii]->replicas[1]);
+    TestFixture::ts->insert(TestFixture::timers[ii]);
+  }
+
+  std::vector<Timer*> next_timers;
+  cwtest_advance_time_ms(1000);
+  TestFixture::ts->fetch_next_timers(next_timers);
+  ASSERT_EQ(0u, next_timers.size());
+
+  // Change this node's address to the first replica. Timer one should have
+  // popped by now.
+  __globals->lock();
+  __globals->set_cluster_local_ip("10.0.0.2");
+  __globals->unlock();
+  TestFixture::ts->update_pop_times();
+
+  TestFixture::ts->fetch_next_timers(next_timers);
+  ASSERT_EQ(1u, next_timers.size());
+  EXPECT_EQ(TestFixture::timers[0], *next_timers.begin());
+  next_timers.clear();
+
+  cwtest_advance_time_ms(heap_interval_ms - 1000 + TIMER_GRANULARITY_MS);
+  TestFixture::ts->fetch_next_timers(next_timers);
+  ASSERT_EQ(1u, next_timers.size());
+  EXPECT_EQ(TestFixture::timers[2], *next_timers.begin());
+}
+
+// Test that a copy of a timer in the store isn't treated as being in the store.
+TYPED_TEST(TestTimerStore, CopiedTimerIsNotInStore)
+{
+  TestFixture::ts->insert(TestFixture::timers[0]);
+  Timer* copy = new Timer(*TestFixture::timers[0]);
+
+  // Removing the copy leaves the original timer in place.
+  TestFixture::ts->remove_timer_from_timer_wheel(copy);
+  delete copy; copy = NULL;
+
+  std::vector<Timer*> next_timers;
+  cwtest_advance_time_ms(100 + TIMER_GRANULARITY_MS);
+  TestFixture::ts->fetch_next_timers(next_timers);
+
+  ASSERT_EQ(1u, next_timers.size());
+  EXPECT_EQ(TestFixture::timers[0], *next_timers.begin());
+}
+
 // Test that timers get picked up by the iterators.
 TYPED_TEST(TestTimerStore, IterateOverTimers)
 {
@@ -604,6 +738,101 @@ TYPED_TEST(TestTimerStore, IterateOverTimers)
 
 }
 
+// Test that the IDs and pop times of timers can be got a few at a time, one
+// timer wheel bucket after another.
+TYPED_TEST(TestTimerStore, GetResyncEntries)
+{
+  TestFixture::ts->insert(TestFixture::timers[0]);
+  TestFixture::ts->insert(TestFixture::timers[1]);
+  TestFixture::ts->insert(TestFixture::timers[2]);
+
+  // Add another timer that pops at the same time as timer 2, and a tombstone
+  // (which should be skipped).
+  Timer* timer4 = default_timer(4);
+  timer4->start_time_mono_ms = TestFixture::timers[1]->start_time_mono_ms;
+  timer4->interval_ms = TestFixture::timers[1]->interval_ms;
+  TestFixture::ts->insert(timer4);
+
+  Timer* tombstone = Timer::create_tombstone(5, 0, timer4->_replication_factor);
+  tombstone->start_time_mono_ms = get_time_ms();
+  TestFixture::ts->insert(tombstone);
+
+  // Timer 1 is on its own in its bucket.
+  std::vector<TimerStore::ResyncEntry> entries;
+  std::vector<TimerID> skip_ids;
+  EXPECT_TRUE(TestFixture::ts->get_resync_entries(get_time_ms(), skip_ids, 1, entries));
+  ASSERT_EQ(1u, entries.size());
+  EXPECT_EQ(1u, entries[0].id);
+  EXPECT_EQ(TestFixture::timers[0]->next_pop_time(), entries[0].pop_time);
+
+  // Carry on from timer 1. Timers 2 and 4 are in the same bucket, so are got
+  // together.
+  uint32_t time_from = entries[0].pop_time;
+  skip_ids.push_back(1);
+  entries.clear();
+  EXPECT_TRUE(TestFixture::ts->get_resync_entries(time_from, skip_ids, 1, entries));
+  ASSERT_EQ(2u, entries.size());
+  EXPECT_EQ(TestFixture::timers[1]->next_pop_time(), entries[0].pop_time);
+  EXPECT_EQ(TestFixture::timers[1]->next_pop_time(), entries[1].pop_time);
+  EXPECT_EQ(6u, entries[0].id + entries[1].id);
+
+  // Carry on from timers 2 and 4, then check there's nothing after timer 3.
+  time_from = entries[0].pop_time;
+  skip_ids = {2, 4};
+  entries.clear();
+  TestFixture::ts->get_resync_entries(time_from, skip_ids, 1, entries);
+  ASSERT_EQ(1u, entries.size());
+  EXPECT_EQ(3u, entries[0].id);
+
+  time_from = entries[0].pop_time;
+  skip_ids = {3};
+  entries.clear();
+  EXPECT_FALSE(TestFixture::ts->get_resync_entries(time_from, skip_ids, 1, entries));
+  EXPECT_EQ(0u, entries.size());
+
+  TestFixture::ts->clear();
+  delete timer4; timer4 = NULL;
+  delete tombstone; tombstone = NULL;
+}
+
+// Test that resync entries can be got for a timer that's due just before the
+// end of the week wheel (so is in the heap) when the current tick isn't at
+// the start of a week wheel bucket.
+TYPED_TEST(TestTimerStore, GetResyncEntriesForHeapTimer)
+{
+  std::vector<Timer*> next_timers;
+  cwtest_advance_time_ms(TimerStore::WEEK_WHEEL_RESOLUTION_MS -
+                         (get_time_ms() % TimerStore::WEEK_WHEEL_RESOLUTION_MS) +
+                         TimerStore::DAY_WHEEL_RESOLUTION_MS / 2);
+  TestFixture::ts->fetch_next_timers(next_timers);
+
+  TestFixture::timers[0]->start_time_mono_ms = get_time_ms();
+  TestFixture::ts->insert(TestFixture::timers[0]);
+  Timer* timer4 = default_timer(4);
+  timer4->start_time_mono_ms = get_time_ms();
+  timer4->interval_ms = TimerStore::WEEK_WHEEL_PERIOD_MS - TIMER_GRANULARITY_MS;
+  TestFixture::ts->insert(timer4);
+
+  std::vector<TimerStore::ResyncEntry> entries;
+  std::vector<TimerID> skip_ids;
+  EXPECT_FALSE(TestFixture::ts->get_resync_entries(get_time_ms(), skip_ids, 10, entries));
+  ASSERT_EQ(2u, entries.size());
+  EXPECT_EQ(1u, entries[0].id);
+  EXPECT_EQ(4u, entries[1].id);
+  EXPECT_EQ(timer4->next_pop_time(), entries[1].pop_time);
+
+  // Carry on from the first timer, as the next page of a resync would.
+  uint32_t time_from = entries[0].pop_time;
+  skip_ids.push_back(1);
+  entries.clear();
+  EXPECT_FALSE(TestFixture::ts->get_resync_entries(time_from, skip_ids, 10, entries));
+  ASSERT_EQ(1u, entries.size());
+  EXPECT_EQ(4u, entries[0].id);
+
+  TestFixture::ts->clear();
+  delete timer4; timer4 = NULL;
+}
+
 // Test that adding timers to the bucket "behind" where the current time
 // corresponds to still results in them being picked up by the iterators.
 TYPED_TEST(TestTimerStore, IterateOverTimersInPreviousBuckets)
@@ -624,8 +853,8 @@ TYPED_TEST(TestTimerStore, IterateOverTimersInPreviousBuckets)
 
   // We call fetch_next_timers to ensure the _tick_timestamp is up to date since
   // we've altered the time
-  std::unordered_set<Timer*> unused_set = std::unordered_set<Timer*>();
-  TestFixture::ts->fetch_next_timers(unused_set);
+  std::vector<Timer*> unused_timers = std::vector<Timer*>();
+  TestFixture::ts->fetch_next_timers(unused_timers);
 
   // Add a timer that falls into the first bucket of the short wheel, "behind"
   // the bucket we're currently pointed at.
@@ -684,8 +913,8 @@ TYPED_TEST(TestTimerStore, IterateOverTimersRefillingWheel)
 
   // We call fetch_next_timers to ensure the _tick_timestamp is up to date since
   // we've altered the time
-  std::unordered_set<Timer*> unused_set = std::unordered_set<Timer*>();
-  TestFixture::ts->fetch_next_timers(unused_set);
+  std::vector<Timer*> unused_timers = std::vector<Timer*>();
+  TestFixture::ts->fetch_next_timers(unused_timers);
 
   // Add a third timer due to pop after timer4, but still in the short wheel.
   // This once gets added directly to the short wheel.
@@ -713,3 +942,551 @@ TYPED_TEST(TestTimerStore, IterateOverTimersRefillingWheel)
   delete timer5; timer5 = NULL;
   delete timer6; timer6 = NULL;
 }
+
+// Test that timers far enough in the future to be in the day and week wheels,
+// or in the heap, pop on time.
+TYPED_TEST(TestTimerStore, VeryLongTimersPopOnTime)
+{
+  std::vector<Timer*> next_timers;
+
+  // Put a timer into each of the day wheel, the week wheel and the heap.
+  TestFixture::timers[0]->interval_ms = TimerStore::LONG_WHEEL_PERIOD_MS +
+                                        TimerStore::LONG_WHEEL_PERIOD_MS / 2;
+  TestFixture::timers[1]->interval_ms = TimerStore::DAY_WHEEL_PERIOD_MS +
+                                        TimerStore::DAY_WHEEL_PERIOD_MS / 2;
+  TestFixture::timers[2]->interval_ms = TimerStore::WEEK_WHEEL_PERIOD_MS +
+                                        TimerStore::WEEK_WHEEL_PERIOD_MS / 2;
+
+  TestFixture::ts->insert(TestFixture::timers[0]);
+  TestFixture::ts->insert(TestFixture::timers[1]);
+  TestFixture::ts->insert(TestFixture::timers[2]);
+  EXPECT_EQ(1u, TestFixture::ts->_extra_heap.size());
+
+  uint32_t elapsed_ms = 0;
+
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    // Nothing pops just before the timer is due, then the timer pops.
+    uint32_t interval_ms = TestFixture::timers[ii]->interval_ms;
+    cwtest_advance_time_ms(interval_ms - elapsed_ms - TIMER_GRANULARITY_MS);
+    TestFixture::ts->fetch_next_timers(next_timers);
+    EXPECT_EQ(0u, next_timers.size());
+
+    cwtest_advance_time_ms(TIMER_GRANULARITY_MS * 2);
+    TestFixture::ts->fetch_next_timers(next_timers);
+    ASSERT_EQ(1u, next_timers.size());
+    EXPECT_EQ(TestFixture::timers[ii], *next_timers.begin());
+    next_timers.clear();
+
+    elapsed_ms = interval_ms + TIMER_GRANULARITY_MS;
+  }
+}
+
+// Test that the iterators return timers from all the wheels and the heap in
+// order, including a timer that is due to pop within the range of the short
+// wheel but hasn't been moved out of the day wheel yet.
+TYPED_TEST(TestTimerStore, IterateOverTimersInAllWheels)
+{
+  // Start at a long wheel rotation.
+  std::vector<Timer*> next_timers;
+  cwtest_advance_time_ms(TimerStore::LONG_WHEEL_PERIOD_MS -
+                         (get_time_ms() % TimerStore::LONG_WHEEL_PERIOD_MS));
+  TestFixture::ts->fetch_next_timers(next_timers);
+
+  // Add a timer due to pop just after the next long wheel rotation. This goes
+  // into the day wheel.
+  Timer* timer4 = default_timer(4);
+  timer4->start_time_mono_ms = get_time_ms();
+  timer4->interval_ms = TimerStore::LONG_WHEEL_PERIOD_MS +
+                        TimerStore::SHORT_WHEEL_PERIOD_MS / 4;
+  TestFixture::ts->insert(timer4);
+
+  // Move on to just before the next rotation. Nothing pops.
+  cwtest_advance_time_ms(TimerStore::LONG_WHEEL_PERIOD_MS -
+                         TimerStore::SHORT_WHEEL_PERIOD_MS / 2);
+  TestFixture::ts->fetch_next_timers(next_timers);
+  EXPECT_EQ(0u, next_timers.size());
+
+  // Add timers that go into the short wheel (after timer 4), the long wheel,
+  // the day wheel, the week wheel and the heap.
+  uint32_t intervals_ms[] = {TimerStore::SHORT_WHEEL_PERIOD_MS * 7 / 8,
+                             TimerStore::SHORT_WHEEL_PERIOD_MS * 2,
+                             TimerStore::LONG_WHEEL_PERIOD_MS * 2,
+                             TimerStore::DAY_WHEEL_PERIOD_MS * 2,
+                             TimerStore::WEEK_WHEEL_PERIOD_MS * 2};
+  std::vector<Timer*> timers;
+  timers.push_back(timer4);
+
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    Timer* timer = default_timer(ii + 5);
+    timer->start_time_mono_ms = get_time_ms();
+    timer->interval_ms = intervals_ms[ii];
+    TestFixture::ts->insert(timer);
+    timers.push_back(timer);
+  }
+
+  // Check the iterator returns the timers in pop time order.
+  int ii = 0;
+
+  for (TimerStore::TSIterator it = TestFixture::ts->begin(get_time_ms());
+       !(it.end());
+       ++it)
+  {
+    ASSERT_LT(ii, 6);
+    EXPECT_EQ(timers[ii], *it);
+    ii++;
+  }
+
+  EXPECT_EQ(6, ii);
+
+  for (Timer* timer : timers)
+  {
+    delete timer;
+  }
+}
+
+// Test that timers due just before the end of a wheel's range can be iterated
+// over when the current tick isn't at the start of a bucket in any wheel.
+// These timers don't have a bucket in the wheel below yet, so must be left
+// where they are.
+TYPED_TEST(TestTimerStore, IterateOverTimersAtEndOfWheels)
+{
+  std::vector<Timer*> next_timers;
+  cwtest_advance_time_ms(TimerStore::WEEK_WHEEL_RESOLUTION_MS -
+                         (get_time_ms() % TimerStore::WEEK_WHEEL_RESOLUTION_MS) +
+                         TimerStore::DAY_WHEEL_RESOLUTION_MS / 2 +
+                         TimerStore::LONG_WHEEL_RESOLUTION_MS / 2 +
+                         TimerStore::SHORT_WHEEL_RESOLUTION_MS * 4);
+  TestFixture::ts->fetch_next_timers(next_timers);
+  EXPECT_EQ(0u, next_timers.size());
+
+  // Add timers due just before the end of the long, day and week wheels. The
+  // last of these goes into the heap.
+  uint32_t intervals_ms[] = {TimerStore::LONG_WHEEL_PERIOD_MS - TIMER_GRANULARITY_MS,
+                             TimerStore::DAY_WHEEL_PERIOD_MS - TIMER_GRANULARITY_MS,
+                             TimerStore::WEEK_WHEEL_PERIOD_MS - TIMER_GRANULARITY_MS};
+  std::vector<Timer*> timers;
+
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    Timer* timer = default_timer(ii + 4);
+    timer->start_time_mono_ms = get_time_ms();
+    timer->interval_ms = intervals_ms[ii];
+    TestFixture::ts->insert(timer);
+    timers.push_back(timer);
+  }
+
+  // Check the iterator returns the timers in pop time order, and can do so
+  // again.
+  for (int jj = 0; jj < 2; ++jj)
+  {
+    int ii = 0;
+
+    for (TimerStore::TSIterator it = TestFixture::ts->begin(get_time_ms());
+         !(it.end());
+         ++it)
+    {
+      ASSERT_LT(ii, 3);
+      EXPECT_EQ(timers[ii], *it);
+      ii++;
+    }
+
+    EXPECT_EQ(3, ii);
+  }
+
+  // The first timer still pops on time.
+  cwtest_advance_time_ms(intervals_ms[0] - TIMER_GRANULARITY_MS);
+  TestFixture::ts->fetch_next_timers(next_timers);
+  EXPECT_EQ(0u, next_timers.size());
+  cwtest_advance_time_ms(TIMER_GRANULARITY_MS * 2);
+  TestFixture::ts->fetch_next_timers(next_timers);
+  ASSERT_EQ(1u, next_timers.size());
+  EXPECT_EQ(timers[0], next_timers[0]);
+  next_timers.clear();
+
+  for (Timer* timer : timers)
+  {
+    delete timer;
+  }
+}
+
+// Test that the occupancy bitmap finds the next occupied bucket, wrapping round
+// the wheel.
+TEST(TestOccupancyBitmap, FindsNextOccupiedBucket)
+{
+  TimerStore::OccupancyBitmap occupancy(200);
+  EXPECT_EQ(-1, occupancy.next_occupied(0));
+
+  occupancy.set(5);
+  occupancy.set(130);
+  EXPECT_EQ(5, occupancy.next_occupied(0));
+  EXPECT_EQ(0, occupancy.next_occupied(5));
+  EXPECT_EQ(124, occupancy.next_occupied(6));
+  EXPECT_EQ(0, occupancy.next_occupied(130));
+  EXPECT_EQ(74, occupancy.next_occupied(131));
+
+  occupancy.clear(5);
+  EXPECT_EQ(199, occupancy.next_occupied(131));
+  EXPECT_EQ(130, occupancy.next_occupied(0));
+}
+
+// Test that timers pop correctly when catching up after a stall, when most of
+// the buckets passed over are empty.
+TYPED_TEST(TestTimerStore, CatchUpAfterStall)
+{
+  TestFixture::timers[0]->interval_ms = TimerStore::SHORT_WHEEL_PERIOD_MS * 3 / 4;
+  TestFixture::timers[1]->interval_ms = TimerStore::SHORT_WHEEL_PERIOD_MS * 5 / 2;
+  TestFixture::ts->insert(TestFixture::timers[0]);
+  TestFixture::ts->insert(TestFixture::timers[1]);
+  TestFixture::ts->insert(TestFixture::timers[2]);
+
+  // Stall until just before timer three is due. Timers one and two pop.
+  std::vector<Timer*> next_timers;
+  cwtest_advance_time_ms(TestFixture::timers[2]->interval_ms - TIMER_GRANULARITY_MS);
+  TestFixture::ts->fetch_next_timers(next_timers);
+  EXPECT_EQ(2u, next_timers.size());
+  next_timers.clear();
+
+  // Timer three pops on time.
+  cwtest_advance_time_ms(TIMER_GRANULARITY_MS * 2);
+  TestFixture::ts->fetch_next_timers(next_timers);
+  ASSERT_EQ(1u, next_timers.size());
+  EXPECT_EQ(TestFixture::timers[2], *next_timers.begin());
+}
+
+// Test that the store reports when it next has work to do, and that checking
+// it only at those times pops every timer on time.
+TYPED_TEST(TestTimerStore, NextTickTime)
+{
+  uint32_t tick_time;
+  EXPECT_FALSE(TestFixture::ts->next_tick_time(tick_time));
+
+  // Put timers in the short wheel, the long wheel and the heap. The heap timer
+  // is moved down through all of the wheels before it pops.
+  TestFixture::timers[2]->interval_ms = TimerStore::WEEK_WHEEL_PERIOD_MS +
+                                        TimerStore::WEEK_WHEEL_PERIOD_MS / 2;
+  TestFixture::ts->insert(TestFixture::timers[0]);
+  TestFixture::ts->insert(TestFixture::timers[1]);
+  TestFixture::ts->insert(TestFixture::timers[2]);
+
+  std::vector<Timer*> next_timers;
+  uint32_t now = get_time_ms();
+  int popped = 0;
+  int wakes = 0;
+
+  while (TestFixture::ts->next_tick_time(tick_time))
+  {
+    // Nothing pops before the next tick time.
+    ASSERT_TRUE(Utils::overflow_less_than(now, tick_time));
+    cwtest_advance_time_ms(tick_time - now - 1);
+    TestFixture::ts->fetch_next_timers(next_timers);
+    EXPECT_EQ(0u, next_timers.size());
+
+    cwtest_advance_time_ms(1);
+    now = tick_time;
+    TestFixture::ts->fetch_next_timers(next_timers);
+    ++wakes;
+
+    for (Timer* timer : next_timers)
+    {
+      EXPECT_FALSE(Utils::overflow_less_than(now, timer->next_pop_time()));
+      EXPECT_LE(now - timer->next_pop_time(), (uint32_t)TIMER_GRANULARITY_MS);
+      ++popped;
+    }
+
+    next_timers.clear();
+  }
+
+  // Each timer popped, without checking the store on every tick.
+  EXPECT_EQ(3, popped);
+  EXPECT_GT(20, wakes);
+}
+
+TYPED_TEST(TestTimerStore, NextTickTimeForOverdueTimer)
+{
+  TestFixture::timers[0]->start_time_mono_ms -= 1000;
+  TestFixture::ts->insert(TestFixture::timers[0]);
+
+  // The overdue timer pops straight away.
+  uint32_t tick_time;
+  ASSERT_TRUE(TestFixture::ts->next_tick_time(tick_time));
+  EXPECT_FALSE(Utils::overflow_less_than(get_time_ms(), tick_time));
+}
+
+/*****************************************************************************/
+/* Benchmarks                                                                */
+/*****************************************************************************/
+
+// Fixture for benchmarking the timer store. Time is controlled, so stalls
+// don't take real time, and the benchmarks time themselves with the CPU time
+// from clock() (which the time control doesn't affect).
+//
+// The UT build uses smaller timer wheels than production (see timer_store.h),
+// so for figures that apply to production, build the store and these tests
+// without UNIT_TEST.
+class TestTimerStoreBenchmark : public Base
+{
+protected:
+  virtual void SetUp()
+  {
+    Base::SetUp();
+    cwtest_completely_control_time();
+    hc = new HealthChecker();
+  }
+
+  virtual void TearDown()
+  {
+    delete hc; hc = NULL;
+    cwtest_reset_time();
+    Base::TearDown();
+  }
+
+  // Create timers that pop once, at random times up to max_interval_ms from
+  // now.
+  std::vector<Timer*> create_timers(int count, uint32_t max_interval_ms)
+  {
+    std::mt19937 rng(count);
+    std::vector<Timer*> timers;
+
+    for (int ii = 0; ii < count; ++ii)
+    {
+      uint32_t interval_ms = TimerStore::SHORT_WHEEL_RESOLUTION_MS +
+                             (rng() % max_interval_ms);
+      Timer* timer = new Timer(ii + 1, interval_ms, interval_ms);
+      timer->start_time_mono_ms = get_time_ms();
+      timer->replicas = std::vector<std::string>(1, "10.0.0.1:9999");
+      timer->callback_url = "http://localhost:80/callback";
+      timer->callback_body = std::string(200, 'x');
+      timers.push_back(timer);
+    }
+
+    return timers;
+  }
+
+  static uint64_t cpu_time_ns()
+  {
+    return ((uint64_t)clock() * 1000000000) / CLOCKS_PER_SEC;
+  }
+
+  // Counts this thread's cache misses using the CPU's performance counters,
+  // where they're available (they often aren't in virtual machines).
+  class CacheMissCounter
+  {
+  public:
+    CacheMissCounter()
+    {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      _fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~CacheMissCounter()
+    {
+      if (_fd >= 0)
+      {
+        close(_fd);
+      }
+    }
+
+    void start()
+    {
+      if (_fd >= 0)
+      {
+        ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+
+    // Returns the number of cache misses since start was called, or -1 if
+    // they can't be counted.
+    int64_t stop()
+    {
+      uint64_t count;
+
+      if ((_fd < 0) ||
+          (ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0) < 0) ||
+          (read(_fd, &count, sizeof(count)) != sizeof(count)))
+      {
+        return -1;
+      }
+
+      return count;
+    }
+
+  private:
+    int _fd;
+  };
+
+  // Push everything the store uses out of the CPU's caches.
+  static void evict_caches()
+  {
+    std::vector<char> junk(64 * 1024 * 1024, 1);
+    volatile char sum = 0;
+
+    for (size_t ii = 0; ii < junk.size(); ii += 64)
+    {
+      sum += junk[ii];
+    }
+  }
+
+  static void print_result(const char* name,
+                           uint64_t total_ns,
+                           int64_t cache_misses,
+                           size_t num_timers)
+  {
+    printf("%s: %lu ns per timer, ", name, total_ns / num_timers);
+
+    if (cache_misses >= 0)
+    {
+      printf("%.2f cache misses per timer\n", (double)cache_misses / num_timers);
+    }
+    else
+    {
+      printf("cache misses not available\n");
+    }
+  }
+
+  HealthChecker* hc;
+};
+
+// Measure how long fetch_next_timers takes to catch up after the tick thread
+// has stalled for 5 seconds, repeatedly over an hour, for stores holding no
+// timers, 1000 timers and 100000 timers due over that hour.
+TEST_F(TestTimerStoreBenchmark, DISABLED_CatchUpAfterStall)
+{
+  const uint32_t STALL_MS = 5000;
+  const uint32_t DURATION_MS = 3600 * 1000;
+  const int NUM_TIMERS[] = {0, 1000, 100000};
+
+  for (int num_timers : NUM_TIMERS)
+  {
+    TimerStore* ts = new TimerStore(hc);
+
+    for (Timer* timer : create_timers(num_timers, DURATION_MS))
+    {
+      ts->insert(timer);
+    }
+
+    std::vector<Timer*> next_timers;
+    uint64_t total_ns = 0;
+    int calls = 0;
+    int popped = 0;
+
+    for (uint32_t elapsed_ms = 0; elapsed_ms <= DURATION_MS; elapsed_ms += STALL_MS)
+    {
+      cwtest_advance_time_ms(STALL_MS);
+
+      uint64_t start_ns = cpu_time_ns();
+      ts->fetch_next_timers(next_timers);
+      total_ns += cpu_time_ns() - start_ns;
+      ++calls;
+
+      popped += next_timers.size();
+
+      for (Timer* timer : next_timers)
+      {
+        delete timer;
+      }
+
+      next_timers.clear();
+    }
+
+    EXPECT_EQ(num_timers, popped);
+    printf("%d timers, %d ms short wheel buckets: %lu ns per catch up\n",
+           num_timers,
+           TimerStore::SHORT_WHEEL_RESOLUTION_MS,
+           total_ns / calls);
+
+    delete ts;
+  }
+}
+
+// Measure the cost of moving timers through the timer wheels and popping
+// them, with 1M timers due over the next long wheel rotation. The timers are
+// added to the store in a random order, so that neighbouring timers in a
+// bucket are far apart in memory, and the caches are emptied before each
+// measurement. Where the CPU's counters are available, this also counts the
+// cache misses (otherwise, run it under `perf stat -e cache-misses`).
+TEST_F(TestTimerStoreBenchmark, DISABLED_WheelBenchmark)
+{
+  const int NUM_TIMERS = 1000000;
+  CacheMissCounter cache_misses;
+
+  // Move every bucket of the long wheel into the short wheel in turn, as
+  // happens once a second as the long wheel goes round.
+  {
+    TimerStore* ts = new TimerStore(hc);
+    std::vector<Timer*> timers = create_timers(NUM_TIMERS,
+                                               TimerStore::LONG_WHEEL_PERIOD_MS);
+    std::shuffle(timers.begin(), timers.end(), std::mt19937(1));
+
+    for (Timer* timer : timers)
+    {
+      ts->insert(timer);
+    }
+
+    evict_caches();
+    uint32_t start_tick = ts->_tick_timestamp;
+    cache_misses.start();
+    uint64_t start_ns = cpu_time_ns();
+
+    for (int ii = 0; ii < TimerStore::LONG_WHEEL_NUM_BUCKETS; ++ii)
+    {
+      ts->_tick_timestamp = start_tick + (ii * TimerStore::LONG_WHEEL_RESOLUTION_MS);
+      ts->refill_short_wheel();
+    }
+
+    uint64_t total_ns = cpu_time_ns() - start_ns;
+    print_result("refill_short_wheel", total_ns, cache_misses.stop(), NUM_TIMERS);
+
+    // The short wheel now holds timers that aren't due for a long time, so
+    // throw the store away rather than popping them.
+    ts->_tick_timestamp = start_tick;
+    delete ts;
+  }
+
+  // Pop all the timers, checking the store every short wheel tick.
+  {
+    TimerStore* ts = new TimerStore(hc);
+    std::vector<Timer*> timers = create_timers(NUM_TIMERS,
+                                               TimerStore::LONG_WHEEL_PERIOD_MS);
+    std::shuffle(timers.begin(), timers.end(), std::mt19937(1));
+
+    for (Timer* timer : timers)
+    {
+      ts->insert(timer);
+    }
+
+    // Collect all the popped timers, and delete them afterwards, so that only
+    // the store's work is measured.
+    std::vector<Timer*> popped;
+    popped.reserve(NUM_TIMERS);
+    evict_caches();
+    cache_misses.start();
+    uint64_t start_ns = cpu_time_ns();
+
+    while (popped.size() < (size_t)NUM_TIMERS)
+    {
+      cwtest_advance_time_ms(TimerStore::SHORT_WHEEL_RESOLUTION_MS);
+      ts->fetch_next_timers(popped);
+    }
+
+    uint64_t total_ns = cpu_time_ns() - start_ns;
+    int64_t total_cache_misses = cache_misses.stop();
+
+    for (Timer* timer : popped)
+    {
+      delete timer;
+    }
+
+    print_result("fetch_next_timers", total_ns, total_cache_misses, NUM_TIMERS);
+    delete ts;
+  }
+}